@@ -14,142 +14,2036 @@
  *   + - Zoom in
  *   - - Zoom out
  *   W - Cycle through weather modes
- *   Arrow keys - Rotate camera view
+ *   ] / [ - Spawn or despawn a tenth of the villagers
+ *   } / { - Plant or fell a tenth of the trees
+ *   > / < - Add or take away a tenth of the lanterns
+ *   ) / ( - Gather or clear away a tenth of the clouds
+ *   C - Toggle cached/immediate static geometry
+ *   H - Toggle the per-pass timing overlay
+ *   S - Toggle sun/moon shadows
+ *   V - Toggle stereo rendering (both eyes, side by side)
+ *   O - Toggle software occlusion culling
+ *   U - Toggle dynamic resolution scaling
+ *   R - End the --capture recording
+ *   Left/Right arrows - Rotate camera view
+ *   Up/Down arrows - Move the camera forward/back across the terrain
+ *   Left click - Identify the person, tree, cabin or ground under the cursor
+ *
+ * Options:
+ *   --trees N          Generate a procedural forest of N trees
+ *   --terrain-size N   Side length of the terrain in world units (default 2048)
+ *   --seed N           Seed for procedural content and the simulation (default 1)
+ *   --scene FILE       Load a binary scene file (cabin and hills, trees, tree meshes,
+ *                      seed, terrain size, people and clouds; overrides those options)
+ *   --convert-scene IN OUT  Convert a text scene description to a binary
+ *                      scene file and exit
+ *   --particles N      Rain/snow particle pool capacity
+ *   --clouds N         Clouds in the sky layer (default 300)
+ *   --lights N         Lanterns lit around the clearing at night (default 64)
+ *   --smoke N          Puffs in the chimney smoke plume (default 400)
+ *   --people N         Number of villagers
+ *   --crowd-stats      Print crowd update throughput every few seconds
+ *   --stereo LAYOUT    Render both eyes from one traversal of the scene:
+ *                      "sbs" side by side in one frame, or "layers" into a
+ *                      two-layer texture array (shown side by side)
+ *   --ipd N            Stereo eye separation in world units (default 0.064)
+ *   --convergence N    Stereo zero-parallax distance (default 30)
+ *   --dynamic-res MS   Frame-time budget for dynamic resolution scaling; 0
+ *                      turns it off (default 16 in a window, off headless so
+ *                      frames are reproducible)
+ *   --threads N        Simulation threads (0 = simulate on the GLUT thread)
+ *   --record FILE      Record the scene and simulation options and every input
+ *                      to FILE
+ *   --replay FILE      Replay a --record file; its options override the command
+ *                      line (live keys are ignored)
+ *   --profile FILE     Time every pass and write min/avg/p99 as CSV on exit
+ *   --benchmark FILE   Run the scripted benchmark scenarios headless and write
+ *                      a JSON report (- for stdout); uses --size and --fps
+ *   --bench-only NAME  Only run scenarios whose name contains NAME
+ *   --bench-frames N   Measured frames per scenario (default 300)
+ *   --bench-warmup N   Unmeasured warmup frames per scenario (default 60)
+ *   --headless N       Render N frames offscreen (EGL) without opening a window
+ *   --size WxH         Headless frame size (default 640x480)
+ *   --fps N            Headless frames per simulated second, also the frame
+ *                      rate written to Y4M captures (default 30)
+ *   --output PATTERN   Headless output: per-frame files if PATTERN contains a
+ *                      printf-style %d (PPM if it ends in .ppm, else raw RGB),
+ *                      otherwise one stream of frames (Y4M video if it ends in
+ *                      .y4m, else raw RGB); "-" streams raw RGB to stdout and
+ *                      "|COMMAND" pipes Y4M to an encoder (default frame%05d.ppm)
+ *   --capture TARGET   Capture the window's frames to TARGET, as for --output
+ *                      (at the window size when the capture starts)
+ *
+ * Build:
+ *   cc -O2 PES1PG24CS004_Assignment_OpenGL.c -lglut -lGLU -lGL -lEGL -lm -lpthread
  */
 
 // Platform-specific includes
 #ifdef __APPLE__
 #include <GLUT/glut.h>  // macOS GLUT implementation
+#include <OpenGL/glext.h>
+#define glVertexAttribDivisor glVertexAttribDivisorARB     // Legacy contexts only
+#define glDrawElementsInstanced glDrawElementsInstancedARB // expose the ARB names
+#define glGetQueryObjectui64v glGetQueryObjectui64vEXT   // EXT_timer_query
+#define GL_TIME_ELAPSED GL_TIME_ELAPSED_EXT
 #else
+#define GL_GLEXT_PROTOTYPES // Expose buffer object entry points from glext.h
 #include <GL/glut.h>    // Standard GLUT for other platforms
+#include <EGL/egl.h>    // Offscreen contexts for --headless
+#include <EGL/eglext.h>
+#define HAVE_EGL 1
+#ifdef GL_MAP_PERSISTENT_BIT
+#define HAVE_BUFFER_STORAGE 1 // Persistently mapped buffers (GL 4.4 headers)
+#endif
 #endif
 #include <math.h>       // Math functions for trigonometry
+#include <pthread.h>    // Simulation thread and worker pool
+#include <stdatomic.h>  // Lock-free snapshot hand-off
+#include <stddef.h>     // offsetof for interleaved vertex layouts
+#include <stdio.h>      // Console output for status messages
 #include <stdlib.h>     // Standard library for random numbers
+#include <string.h>     // Memory helpers for geometry buffers
 #include <time.h>       // Time functions for random seeding
+#include <unistd.h>     // CPU count for the default thread count
+#include <fcntl.h>      // Opening scene files
+#include <sys/mman.h>   // Mapping scene files into memory
+#include <sys/stat.h>   // Scene file size
+#if defined(__AVX__)
+#include <immintrin.h>  // AVX particle update and skinning kernels
+#elif defined(__SSE__)
+#include <xmmintrin.h>  // SSE particle update and skinning kernels
+#endif
 
 /* GLOBAL VARIABLES */
-float sunAngle = 0.0;       // Current solar position in radians
-int isDay = 1;              // Day/night toggle (1=day, 0=night)
 float cameraAngle = 0.0;     // Camera rotation around Y-axis
 float zoom = -30.0;          // Camera distance from scene
-int weatherMode = 0;         // Current weather (0-3: clear,rain,snow,fog)
-float lightFlicker = 0.8;    // Flicker intensity for night lights
-float smokeY = 0.0;          // Vertical position for smoke animation
+int useSceneCache = 1;       // Draw static scene from cache (1) or immediate mode (0)
+
+#define DEFAULT_PEOPLE 5    // Characters in scene unless --people is given
+
+/* RANDOM NUMBERS */
+// Each subsystem (and each person) draws from its own xoshiro128** stream
+// derived from the scene seed, so runs are reproducible and streams can
+// be advanced on different threads without sharing state.
+typedef struct {
+    unsigned int s[4];      // xoshiro128** state (never all zero)
+} Rng;
+
+typedef enum {
+    RNG_STREAM_FOREST,      // Tree placement
+    RNG_STREAM_PEOPLE,      // Initial crowd layout
+    RNG_STREAM_PERSON,      // Behavior of one person (indexed by person)
+    RNG_STREAM_PARTICLES,   // Precipitation spawns
+    RNG_STREAM_FLICKER,     // Night light flicker
+    RNG_STREAM_CLOUDS,      // Cloud sprites and layout
+    RNG_STREAM_LIGHTS       // Lantern placement and color
+} RngStream;
 
-#define MAX_PEOPLE 5        // Maximum number of characters in scene
+unsigned int sceneSeed = 1; // Seed for all procedural content and simulation (--seed)
+
+/* ENVIRONMENT */
+// Sky and weather state shared by the simulation systems. It is one
+// resource rather than loose globals so systems can declare their access.
+typedef struct {
+    float sunAngle;         // Current solar position in radians
+    int isDay;              // Day/night toggle (1=day, 0=night)
+    int weatherMode;        // Current weather (0-3: clear,rain,snow,fog)
+    float lightFlicker;     // Flicker intensity for night lights
+    Rng flickerRng;         // Light flicker stream
+} Environment;
+
+Environment environment = {0.0f, 1, 0, 0.8f};
 
 /* PERSON STRUCTURE */
+// Villagers are simulated as entities (see ENTITIES); this is the pose a
+// snapshot carries to draw one
 typedef struct {
     float x, z;             // 2D position coordinates
+    float y;                // Ground height under the person
     float angle;            // Facing direction in degrees
-    float speed;            // Movement speed
-    int state;              // 0=standing, 1=walking
-    int timer;              // State duration counter
     float legAngle;         // Current leg swing angle
-    int legDirection;       // Leg swing direction (1 or -1)
+    float prevX, prevY, prevZ; // Values at the previous tick, for interpolation
+    float prevAngle, prevLegAngle;
+    int gait;               // Walking: leg swing direction (1 or -1); standing: 0
+    int id;                 // Entity slot: stable while the crowd is reordered by cell every tick
 } Person;
 
-Person people[MAX_PEOPLE];  // Array of character instances
+int numPeople = DEFAULT_PEOPLE; // Number of villagers (--people, then ] and [)
+
+/* ENTITIES */
+// Simulated objects are entities: a handle naming a slot, with the
+// components of the archetype it was spawned as. An archetype stores its
+// entities in chunks of ENTITY_CHUNK_ROWS rows with one array per column,
+// so a system reading one component streams through contiguous memory.
+// Despawning moves the last row into the hole; freed slots are reused
+// with a new generation, so stale handles can be told apart.
+#define ENTITY_SLOT_BITS 22      // Slot part of a handle (the generation is above it)
+#define MAX_ENTITIES (1 << ENTITY_SLOT_BITS)
+#define ENTITY_SLOT_MASK (MAX_ENTITIES - 1)
+#define ENTITY_GENERATION_MASK ((1u << (32 - ENTITY_SLOT_BITS)) - 1)
+#define ENTITY_CHUNK_SHIFT 12    // log2 of the rows per chunk
+#define ENTITY_CHUNK_ROWS (1 << ENTITY_CHUNK_SHIFT)
+#define ENTITY_ROW_MASK (ENTITY_CHUNK_ROWS - 1)
+
+typedef unsigned int Entity;    // Slot, then generation
+
+typedef enum {
+    COMPONENT_POSITION = 1 << 0, // Position on the ground
+    COMPONENT_HEADING = 1 << 1, // Facing and walking speed
+    COMPONENT_GAIT = 1 << 2,    // Leg swing
+    COMPONENT_BEHAVIOR = 1 << 3, // Standing/walking state machine
+    COMPONENT_HISTORY = 1 << 4, // Pose at the previous tick
+    COMPONENT_RANDOM = 1 << 5,  // Own random stream
+    COMPONENT_SIZE = 1 << 6,    // Uniform size (a tree's scale, a cloud's half-width)
+    COMPONENT_EMITTER = 1 << 7, // Light reach and color
+    COMPONENT_CLOUD = 1 << 8,   // Sky impostor: cover, drift phase and sprite
+    // Data outside the entity tables, for the scheduler's conflict checks
+    RESOURCE_SKY = 1 << 16,     // Sun, day/night and light flicker
+    RESOURCE_WEATHER = 1 << 17, // Weather mode
+    RESOURCE_PRECIPITATION = 1 << 18, // Rain/snow particle pool
+    RESOURCE_CROWD_GRID = 1 << 19 // Villager neighbor grid
+} Component;
+
+typedef enum {
+    COLUMN_ENTITY,          // Handle of the entity in each row
+    COLUMN_X,               // Position
+    COLUMN_Y,
+    COLUMN_Z,
+    COLUMN_ANGLE,           // Heading: facing in degrees
+    COLUMN_SPEED,           // ... and units per second when walking
+    COLUMN_LEG_ANGLE,       // Gait: leg swing angle
+    COLUMN_LEG_DIRECTION,   // ... and swing direction (1 or -1)
+    COLUMN_STATE,           // Behavior: 0=standing, 1=walking
+    COLUMN_TIMER,           // ... and seconds spent in that state
+    COLUMN_ROUND,           // ... and the crowd round it was last updated in
+    COLUMN_PREV_X,          // History
+    COLUMN_PREV_Y,
+    COLUMN_PREV_Z,
+    COLUMN_PREV_ANGLE,
+    COLUMN_PREV_LEG_ANGLE,
+    COLUMN_RNG,             // Random
+    COLUMN_SCALE,           // Size
+    COLUMN_RADIUS,          // Emitter: distance at which the light has faded out
+    COLUMN_RED,             // ... and color times intensity
+    COLUMN_GREEN,
+    COLUMN_BLUE,
+    COLUMN_COVER,           // Cloud: weather cover at which it appears
+    COLUMN_PHASE,           // ... offset of its sun-driven drift
+    COLUMN_SPRITE,          // ... and atlas cell
+    ENTITY_COLUMNS
+} EntityColumn;
+
+typedef struct {
+    unsigned int component; // Component the column belongs to (0: every archetype)
+    size_t size;            // Bytes per row
+} ColumnInfo;
+
+const ColumnInfo entityColumns[ENTITY_COLUMNS] = {
+    {0, sizeof(Entity)},
+    {COMPONENT_POSITION, sizeof(float)}, {COMPONENT_POSITION, sizeof(float)}, {COMPONENT_POSITION, sizeof(float)},
+    {COMPONENT_HEADING, sizeof(float)}, {COMPONENT_HEADING, sizeof(float)},
+    {COMPONENT_GAIT, sizeof(float)}, {COMPONENT_GAIT, sizeof(int)},
+    {COMPONENT_BEHAVIOR, sizeof(int)}, {COMPONENT_BEHAVIOR, sizeof(float)}, {COMPONENT_BEHAVIOR, sizeof(int)},
+    {COMPONENT_HISTORY, sizeof(float)}, {COMPONENT_HISTORY, sizeof(float)}, {COMPONENT_HISTORY, sizeof(float)},
+    {COMPONENT_HISTORY, sizeof(float)}, {COMPONENT_HISTORY, sizeof(float)},
+    {COMPONENT_RANDOM, sizeof(Rng)},
+    {COMPONENT_SIZE, sizeof(float)},
+    {COMPONENT_EMITTER, sizeof(float)}, {COMPONENT_EMITTER, sizeof(float)}, {COMPONENT_EMITTER, sizeof(float)},
+    {COMPONENT_EMITTER, sizeof(float)},
+    {COMPONENT_CLOUD, sizeof(float)}, {COMPONENT_CLOUD, sizeof(float)}, {COMPONENT_CLOUD, sizeof(int)}
+};
+
+typedef struct {
+    char* memory;           // One 32-byte aligned block holding every column
+    void* columns[ENTITY_COLUMNS]; // Start of each column (NULL if absent)
+} EntityChunk;
+
+typedef struct {
+    const char* name;       // For messages
+    unsigned int components; // Component mask
+    int columns[ENTITY_COLUMNS]; // Columns present
+    int numColumns;
+    EntityChunk* chunks;    // Row r lives in chunk r >> ENTITY_CHUNK_SHIFT
+    EntityChunk* spare;     // Receives reordered rows, then swaps with chunks
+    int numChunks, numSpare; // Chunks allocated in each (kept when rows go)
+    int maxChunks;          // Capacity of both chunk arrays
+    int count;              // Rows in use
+    int version;            // Bumped whenever rows are added or removed
+} Archetype;
+
+typedef enum {
+    ARCHETYPE_VILLAGER,     // People walking around the clearing
+    ARCHETYPE_TREE,         // Forest trees (the forest's instances are built from them)
+    ARCHETYPE_LIGHT,        // Point lights, cabin lights first (so are the light field's)
+    ARCHETYPE_CLOUD,        // Sky impostors (the cloud layer is built from them)
+    ARCHETYPES
+} ArchetypeId;
+
+typedef struct {
+    Archetype archetypes[ARCHETYPES];
+    unsigned int* generation; // Per slot: bumped when the slot is freed
+    unsigned char* slotArchetype; // Per slot: archetype of its entity
+    int* slotRow;           // Per slot: row of its entity
+    int* freeSlots;         // Slots to reuse, last freed on top
+    int numFree;
+    int numSlots;           // Slots handed out so far
+    int maxSlots;           // Capacity of the per-slot arrays
+} World;
+
+World world;                // Every entity
+
+/* STATIC TREE PLACEMENT */
+#define NUM_TREES 8
+float treePositions[NUM_TREES][2] = { // (x, z) of each tree
+    {5, 3}, {-6, -4}, {8, -5}, {6, 4},
+    {-5, -6}, {7, -7}, {-9, 5}, {10, 2}
+};
+
+/* GEOMETRY CACHE STRUCTURES */
+typedef struct {
+    GLfloat pos[3];         // Position after modelling transform
+    GLfloat normal[3];      // Unit surface normal
+    GLubyte color[4];       // RGBA vertex color
+} MeshVertex;
+
+#define MESH_STACK_DEPTH 8  // Maximum nested geomPushMatrix() calls
+
+typedef struct {
+    MeshVertex* verts;      // Recorded vertices
+    int numVerts, maxVerts;
+    GLuint* indices;        // Triangle list indices into verts
+    int numIndices, maxIndices;
+    GLubyte color[4];       // Color applied to new vertices
+    GLfloat matrix[MESH_STACK_DEPTH][16]; // Transform stack (column-major)
+    int depth;              // Top of the transform stack
+    GLenum mode;            // Primitive being recorded (GL_QUADS/GL_TRIANGLES)
+    int primCount;          // Vertices recorded for the current primitive
+} MeshBuilder;
+
+typedef struct {
+    GLuint vbo, ibo;        // Buffer objects (GL 1.5+ path)
+    GLuint list;            // Display list (GL 1.x fallback)
+    int numIndices;         // Triangle indices in the cache
+    int useBuffers;         // 1 when buffer objects are supported
+    int dirty;              // Rebuild before the next draw
+} GeometryCache;
+
+MeshBuilder* geomTarget = NULL; // When set, geom* calls record instead of draw
+GLenum geomMode;            // Primitive open in immediate mode
+GLfloat geomPoly[4][3];     // Its current polygon, held until the face normal is known
+int geomPolyCount;          // Vertices held in geomPoly
+GeometryCache sceneCache = {0, 0, 0, 0, 0, 1}; // Cabin
+
+/* PRIMITIVE MESH LIBRARY */
+// Solid cubes and spheres are tessellated once per distinct shape at
+// several levels of detail and kept in buffer objects; each draw picks the
+// coarsest level whose silhouette stays within PRIMITIVE_MAX_ERROR pixels.
+#define PRIMITIVE_LODS 4        // Levels: 2x, 1x, 1/2 and 1/4 of the requested slices
+#define PRIMITIVE_MIN_SLICES 4  // Coarsest tessellation around the axis
+#define PRIMITIVE_MAX_ERROR 0.5f // Allowed silhouette error (pixels)
+
+typedef enum { PRIMITIVE_CUBE, PRIMITIVE_SPHERE } PrimitiveKind;
+
+typedef struct {
+    PrimitiveKind kind;
+    float a;                // Cube size or sphere radius
+    int slices, stacks;     // Tessellation requested by the caller
+    int levels;             // Detail levels built (1 for cubes)
+    int levelSlices[PRIMITIVE_LODS]; // Slices around the axis at each level
+    int first[PRIMITIVE_LODS], count[PRIMITIVE_LODS]; // Index range of each level
+    MeshBuilder mesh;       // Every level, one after another
+    GLuint vbo, ibo;        // Uploaded mesh (0 without buffer objects)
+} CachedPrimitive;
+
+CachedPrimitive* primitiveCache = NULL; // One entry per distinct sphere/cube shape (grows)
+int numCachedPrimitives = 0, maxCachedPrimitives = 0;
+float primitivePixelScale = 845.0; // Pixels per unit at unit distance (set by reshape)
+long long primitiveTriangles = 0;  // Triangles drawn through the library this frame
+
+/* RADIX SORT */
+// Blended geometry is ordered back to front by turning view depths into
+// 32-bit keys that sort like the floats, then moving keys and payload
+// between two buffers in three counting passes of RADIX_BITS each. The
+// cost is linear in the count and the buffers are kept between frames.
+#define RADIX_BITS 11               // Key bits per counting pass
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+#define RADIX_PASSES 3              // Passes covering a 32-bit key
+
+typedef struct {
+    unsigned int* keys[2];  // Keys to sort and the scatter buffer
+    int* values[2];         // Payload moved with the keys
+    int capacity;
+} RadixSorter;
+
+/* RENDER QUEUE */
+// Between renderQueueBegin() and renderQueueFlush() the geom* solids are
+// queued instead of drawn: each becomes an instance of a library mesh level
+// with its own model matrix and color. The flush groups opaque instances by
+// mesh with a counting sort, draws translucent ones back to front after
+// them, and streams the per-instance data through a persistently mapped
+// ring buffer so every group costs one instanced draw call.
+#define RENDER_QUEUE_FRAMES 3   // Ring regions in flight, each guarded by a fence
+#define RENDER_RING_MIN_BYTES 65536 // Initial size of one ring region
+
+typedef struct {
+    GLfloat rows[3][4];     // First three rows of the model matrix
+    GLubyte color[4];       // RGBA
+} RenderInstance;
+
+typedef struct {
+    RenderInstance instance;
+    int bucket;             // Library shape * PRIMITIVE_LODS + detail level (opaque sort key)
+    float depth;            // Distance in front of the camera
+} RenderItem;
+
+typedef struct {
+    RenderItem* items;      // Submitted since renderQueueBegin()
+    int numItems, maxItems;
+    RadixSorter sorter;     // Orders the translucent items by depth
+    int* order;             // Translucent items, back to front (in sorter)
+    GLfloat view[16];       // Camera transform at renderQueueBegin()
+    GLfloat matrix[MESH_STACK_DEPTH][16]; // Model transform stack (world space)
+    int depth;              // Top of the transform stack
+    GLubyte color[4];       // Current color
+    GLuint program;         // Instancing shader (0: replay items one by one)
+    GLint rowAttrib[3], colorAttrib, fogUniform;
+    GLuint ring;            // Instance ring buffer
+    char* mapped;           // Persistent mapping of the ring (NULL: upload each frame)
+    RenderInstance* staging; // Sorted instances when the ring is not mapped
+    size_t regionBytes;     // Bytes in each ring region
+    int region;             // Region written by the current frame
+    int persistent;         // glBufferStorage is available
+    RenderInstance* packed; // Last flush's instances in draw order
+    int* start;             // Opaque groups within packed (numBuckets + 1 entries)
+    int* next;              // Fill position per group while packing
+    int numBuckets;         // Library mesh levels when packed
+    int maxBuckets;         // Capacity of start and next
+    int numOpaque, numTranslucent;
+    int drawn;              // packed holds a flushed frame
+#ifdef HAVE_BUFFER_STORAGE
+    GLsync fences[RENDER_QUEUE_FRAMES]; // Last GPU use of each region
+#endif
+    int drawCalls;          // Issued by the last flush
+    int instances;          // Drawn by the last flush
+} RenderQueue;
+
+RenderQueue renderQueue;
+RenderQueue* geomQueue = NULL; // When set, geom* solids are queued instead of drawn
+
+/* SKELETAL ANIMATION */
+// Villagers are skinned on the CPU into one shared vertex buffer. Each has
+// a five-bone skeleton posed from a sampled walk or idle clip; the limbs are
+// separate solids, so every vertex follows a single bone and each bone's
+// vertices are transformed as one batch. Poses have levels of detail by
+// distance: near villagers are posed every frame, farther ones every
+// ANIM_MID_INTERVAL frames into a per-person cache, and the most distant
+// share a pool of poses skinned once in model space. At most
+// ANIM_POSE_BUDGET poses are evaluated per frame, nearest first; the rest
+// keep their cached pose or take one from the pool.
+#define ANIM_CHANNELS 8         // Values per pose (one AVX register)
+#define ANIM_KEYS 32            // Keys sampled over one clip cycle
+#define ANIM_IDLE_PERIOD 4.0f   // Seconds per idle cycle
+#define ANIM_NEAR 20.0f         // Posed every frame within this depth
+#define ANIM_FAR 45.0f          // Pooled poses beyond this depth
+#define ANIM_MID_INTERVAL 4     // Frames between poses in between
+#define ANIM_POOL_POSES 16      // Pooled poses per clip cycle
+#define ANIM_POSE_BUDGET 4096   // Poses evaluated per frame
+#define SKIN_COARSE_DEPTH 30.0f // Coarser villager mesh beyond this depth
+
+typedef enum { BONE_ROOT, BONE_TORSO, BONE_HEAD, BONE_LEFT_LEG, BONE_RIGHT_LEG, BONES } Bone;
+
+typedef enum {
+    CHANNEL_BOB,            // Root height offset
+    CHANNEL_TORSO_PITCH,    // Degrees about the waist: lean forward
+    CHANNEL_TORSO_ROLL,     // ... and sway
+    CHANNEL_HEAD_PITCH,     // Degrees about the neck: nod
+    CHANNEL_HEAD_YAW,       // ... and look around
+    CHANNEL_LEFT_LEG,       // Degrees about the hips
+    CHANNEL_RIGHT_LEG
+} AnimChannel;
+
+typedef enum { CLIP_IDLE, CLIP_WALK, CLIPS } AnimClip;
+typedef enum { SKIN_FINE, SKIN_COARSE, SKIN_LEVELS } SkinLevel;
+
+typedef struct {
+    MeshBuilder mesh;       // Bind pose, vertices grouped by bone
+    int boneFirst[BONES + 1]; // First vertex of each bone
+    MeshVertex* pool;       // Pooled poses skinned in model space, CLIPS x ANIM_POOL_POSES meshes
+    GLuint* indices;        // Mesh indices repeated for maxAgents villagers
+    int maxAgents;
+    GLuint ibo;             // Uploaded indices (0 without buffer objects)
+} SkinMesh;
+
+typedef struct {
+    int id;                 // Person id
+    int clip;               // CLIP_IDLE or CLIP_WALK
+    float phase;            // Position in the clip cycle [0, 1)
+    float depth;            // Distance in front of the camera
+    GLfloat place[16];      // Model transform: position and facing
+} SkinAgent;
+
+typedef struct {
+    float clips[CLIPS][ANIM_KEYS + 1][ANIM_CHANNELS]; // Sampled cycles; the last key repeats the first
+    SkinMesh meshes[SKIN_LEVELS];
+    SkinAgent* agents;      // Visible this frame
+    int numAgents, maxAgents;
+    float (*poses)[ANIM_CHANNELS]; // Last pose evaluated for each person id
+    long long* posedFrame;  // Frame it was evaluated in (-1: none)
+    int maxPoses;
+    int crowdVersion;       // Crowd the cache was filled for
+    MeshVertex* verts;      // Skinned villagers: the fine level, then the coarse one
+    int maxVerts;
+    int first[SKIN_LEVELS]; // First vertex of each level in verts
+    int count[SKIN_LEVELS]; // Villagers skinned at each level
+    GLuint vbo;             // Uploaded verts (0 without buffer objects)
+    GLfloat view[16];       // Camera transform at beginCrowdSkinning()
+    long long frame;        // Frames animated
+    int evaluated, cached, pooled; // This frame's poses by source
+    int ready;              // Clips, meshes and pools are built
+} CrowdSkin;
+
+CrowdSkin crowdSkin = {.crowdVersion = -1};
+
+// Bone joints in the bind pose (the root stands on the ground)
+const float boneJoints[BONES][3] = {
+    {0.0, 0.0, 0.0}, {0.0, 0.7, 0.0}, {0.0, 1.3, 0.0}, {-0.1, 0.4, 0.0}, {0.1, 0.4, 0.0}
+};
+
+/* FOREST STRUCTURES */
+typedef struct {
+    float x, y, z;          // Base of the trunk
+    float scale;            // Uniform size multiplier
+} TreeInstance;
+
+#define FOREST_CHUNK_SIZE 16.0   // World units along each side of a chunk
+#define FOREST_LODS 3            // Tessellation levels for tree meshes
+#define FOREST_LOD_NEAR 30.0     // Chunks closer than this use full detail
+#define FOREST_LOD_FAR 60.0      // Chunks beyond this use the coarsest mesh
+#define FOREST_TREE_DENSITY 0.08 // Trees per square unit when generating
+
+typedef struct {
+    int first, count;       // Range of trees in the forest array
+    float min[3], max[3];   // Bounding box of the chunk's trees
+    MeshVertex* verts;      // Merged mesh for the fallback path
+    GLuint* indices;
+    int numIndices;         // 0 until the merged mesh is built
+    GLuint vbo, ibo;        // Merged mesh buffer objects
+} ForestChunk;
+
+typedef struct {
+    TreeInstance* trees;    // Packed instances, sorted by chunk
+    int numTrees;
+    ForestChunk* chunks;    // Row-major grid of chunks
+    signed char* chunkLod;  // Per-frame LOD of each chunk (-1 = culled)
+    int chunksX, chunksZ;
+    float originX, originZ; // World position of the grid corner
+    MeshBuilder lodMesh[FOREST_LODS]; // Tree mesh at each detail level
+    GLuint lodVbo[FOREST_LODS], lodIbo[FOREST_LODS];
+    GLuint instanceVbo;     // Per-tree attributes for instanced drawing
+    GLuint program;         // Instancing shader (0 = merged-mesh fallback)
+    GLint instanceAttrib;   // Location of the per-instance attribute
+    GLint fogUniform;       // Location of the fog toggle uniform
+    int visibleTrees;       // Trees drawn last frame
+    int drawCalls;          // Draw calls issued last frame
+    int mapped;             // trees points into the scene file (not freed)
+    int version;            // Tree archetype version the instances were built from
+} Forest;
+
+typedef struct {
+    float planes[6][4];     // Clip planes (a, b, c, d), pointing inward
+    float eye[3];           // Camera position in world space
+    int occlusion;          // Also test boxes against the occlusion buffer (camera views only)
+} ViewFrustum;
+
+Forest forest;              // All trees in the scene
+int forestTreeCount = 0;    // Trees to generate (0 = hand-placed layout)
+Rng forestRng;              // Where trees are planted, and which ones are felled (simulation thread)
+
+/* SCENE FILES */
+// A scene file is a versioned binary image of the scene content: an
+// object table (the cabin, the hills and the forest), tree instances
+// already sorted into forest chunks and the prebuilt tree meshes. It is mapped read-only and the arrays are used in
+// place, so loading costs the same for ten trees or a million.
+#define SCENE_MAGIC "CABNSCN"   // First 8 bytes, terminator included
+#define SCENE_VERSION 2         // Bumped whenever the layout changes
+#define SCENE_BYTE_ORDER 0x01020304u // Reads differently on a machine of the other endianness
+#define SCENE_ALIGN 16          // Sections start at multiples of this
+
+typedef enum {
+    SCENE_SECTION_OBJECTS,      // SceneObject table
+    SCENE_SECTION_INSTANCES,    // TreeInstance transforms, grouped by chunk
+    SCENE_SECTION_CHUNKS,       // SceneChunk for each forest grid cell
+    SCENE_SECTION_MESHES,       // SceneMesh ranges into the next two sections
+    SCENE_SECTION_VERTICES,     // MeshVertex data of every mesh
+    SCENE_SECTION_INDICES,      // Triangle indices, relative to each mesh's first vertex
+    SCENE_SECTION_COUNT
+} SceneSectionType;
+
+typedef enum {
+    SCENE_OBJECT_TREE,          // Forest tree: FOREST_LODS meshes, instances by chunk
+    SCENE_OBJECT_CABIN,         // The cabin: place holds its x and z
+    SCENE_OBJECT_HILL           // A hill: place holds x, z, base radius and height
+} SceneObjectKind;
+
+typedef struct {
+    unsigned int count;         // Records in the section
+    unsigned int pad;
+    unsigned long long offset;  // From the start of the file
+    unsigned long long bytes;   // count * record size
+} SceneSection;
+
+typedef struct {
+    char magic[8];              // SCENE_MAGIC
+    unsigned int version;       // SCENE_VERSION
+    unsigned int byteOrder;     // SCENE_BYTE_ORDER as written
+    unsigned int seed;          // Terrain and simulation seed
+    float terrainSize;          // Side length of the world
+    int people, clouds;         // Crowd and cloud layer sizes
+    int chunksX, chunksZ;       // Forest chunk grid
+    float originX, originZ;     // World position of the grid corner
+    SceneSection sections[SCENE_SECTION_COUNT];
+} SceneHeader;
+
+typedef struct {
+    int kind;                   // SceneObjectKind
+    int firstInstance, numInstances;
+    int firstMesh, numMeshes;
+    float place[4];             // Position and size, by kind
+} SceneObject;
+
+typedef struct {
+    int first, count;           // Range of instances
+    float min[3], max[3];       // Bounding box
+} SceneChunk;
+
+typedef struct {
+    int firstVertex, numVertices;
+    int firstIndex, numIndices;
+} SceneMesh;
+
+typedef struct {
+    const char* data;           // Mapped file (NULL when no scene is loaded)
+    size_t size;
+    const SceneHeader* header;
+    const void* sections[SCENE_SECTION_COUNT];
+} SceneFile;
+
+SceneFile scene;
+const char* scenePath = NULL; // Binary scene to load (--scene)
+const size_t sceneRecordSize[SCENE_SECTION_COUNT] = {
+    sizeof(SceneObject), sizeof(TreeInstance), sizeof(SceneChunk),
+    sizeof(SceneMesh), sizeof(MeshVertex), sizeof(GLuint)
+};
+
+/* SCENE LAYOUT */
+// Where the cabin stands and the hills around it. The defaults are the
+// original scene; a scene file can move them, and the clearing is then
+// worked out from them when it loads (see layoutClearing()).
+#define MAX_HILLS 16             // Hills a scene may hold
+#define TERRAIN_CLEARING 12.0f   // Flat ground around the cabin, at most
+#define CLEARING_MIN 4.0f        // Hills must leave at least this much
+
+typedef struct {
+    float x, z;                 // Center of the base
+    float radius, height;       // Base radius and peak height
+} Hill;
+
+typedef struct {
+    float cabinX, cabinZ;       // Cabin position (it stands on the clearing floor)
+    Hill hills[MAX_HILLS];
+    int numHills;
+    float clearingX, clearingZ; // Flat ground, centered on the cabin
+    float clearingRadius;       // Stops short of the nearest hill
+} SceneLayout;
+
+SceneLayout layout = {0.0f, 0.0f, {{-15.0f, -30.0f, 15.0f, 10.0f}, {15.0f, -30.0f, 15.0f, 10.0f}}, 2,
+                      0.0f, 0.0f, TERRAIN_CLEARING};
+
+/* TERRAIN STRUCTURES */
+// The ground is a noise heightmap sampled every TERRAIN_SPACING units and
+// split into square chunks. Chunks around the camera live in a ring of
+// slots addressed by chunk coordinate modulo TERRAIN_RING; background
+// threads generate them nearest first and display() uploads the results.
+// Each chunk is drawn at a detail level picked from its distance, with
+// shared index lists that stitch its edges to coarser neighbors.
+#define TERRAIN_SPACING 1.0f     // World units between height samples
+#define TERRAIN_CHUNK_QUADS 32   // Cells along a chunk side at full detail
+#define TERRAIN_CHUNK_VERTS (TERRAIN_CHUNK_QUADS + 1)
+#define TERRAIN_CHUNK_SIZE (TERRAIN_CHUNK_QUADS * TERRAIN_SPACING)
+#define TERRAIN_LODS 4           // Detail levels, each with half the cells per side
+#define TERRAIN_LOD_DISTANCE 64.0f // Full detail within this distance, doubling per level
+#define TERRAIN_VIEW_DISTANCE 256.0f // Chunks are drawn up to here (also the far plane)
+#define TERRAIN_RING 32          // Chunk slots per side (power of two, spans the view)
+#define TERRAIN_UPLOADS 4        // Finished chunks uploaded per frame
+#define TERRAIN_MAX_THREADS 4    // Upper bound on generator threads
+#define TERRAIN_TABLE_HALF 256   // Height table covers +/- this many samples
+#define TERRAIN_PAN_STEP 4.0f    // Camera movement per Up/Down key press
+
+typedef enum {
+    CHUNK_EMPTY,            // Slot holds nothing
+    CHUNK_QUEUED,           // Waiting for a generator thread
+    CHUNK_BUILDING,         // Being generated
+    CHUNK_READY,            // Generated, waiting for upload
+    CHUNK_RESIDENT          // Drawable
+} TerrainChunkState;
+
+typedef struct {
+    int cx, cz;             // Chunk coordinates held by the slot
+    TerrainChunkState state;
+    unsigned int ticket;    // Bumped whenever the slot is given a new chunk
+    float priority;         // Distance from the camera when queued
+    MeshVertex* verts;      // TERRAIN_CHUNK_VERTS^2 vertices, row-major
+    GLuint vbo;             // Uploaded vertices (0 without buffer objects)
+    float min[3], max[3];   // Bounding box
+} TerrainChunk;
+
+typedef struct {
+    TerrainChunk* chunk;
+    int lod, mask;          // Detail level and coarser-edge mask
+} TerrainDraw;
+
+typedef struct {
+    TerrainChunk slots[TERRAIN_RING * TERRAIN_RING];
+    GLushort* indices;      // Index lists for every (level, coarser-edge mask)
+    int indexFirst[TERRAIN_LODS][16];
+    int indexCount[TERRAIN_LODS][16];
+    GLuint ibo;             // Uploaded index lists
+    float* heights;         // Height table around the origin for fast lookups
+    int tableSize;          // Samples per side of the table
+    int limit;              // Chunks exist for -limit <= cx, cz < limit
+    unsigned int seed;      // Noise seed
+    pthread_t threads[TERRAIN_MAX_THREADS]; // Chunk generators
+    int numThreads;
+    pthread_mutex_t lock;   // Guards slot states and the counters below
+    pthread_cond_t work;    // Signalled when chunks are queued
+    pthread_cond_t built;   // Signalled when a chunk finishes
+    int pending;            // Chunks queued or being built
+    int primed;             // The first view has been generated
+    int quit;
+    MeshVertex* scratch;    // Generator buffer when no threads started
+    int resident[TERRAIN_RING * TERRAIN_RING]; // Drawable slots (GLUT thread)
+    int numResident;
+    int visibleChunks;      // Chunks drawn last frame (one call each)
+    TerrainDraw cameraDraws[TERRAIN_RING * TERRAIN_RING]; // Chunks in the camera's view this frame
+    int numCameraDraws;
+    int generation;         // Bumped whenever chunks become drawable
+} Terrain;
+
+Terrain terrain;            // Streaming terrain
+float terrainSize = 2048.0; // Side length of the world (--terrain-size)
+float cameraX = 0.0, cameraZ = 0.0; // Ground point the camera orbits
+
+/* SHADOWS */
+// The sun (or moon) casts shadows through SHADOW_CASCADES depth maps, each
+// covering one slice of the view. Static casters (terrain, cabin, trees)
+// are drawn into a cached map per cascade, which is only redrawn when the
+// view slice leaves the cached area, new terrain streams in, or the light
+// has turned SHADOW_SUN_STEP radians (at most one such refresh per frame).
+// The queued dynamic solids (people, smoke, clouds) are drawn each frame
+// into a separate map with the nearest cascade's light transform, so the
+// cached maps are never copied. Terrain and cabin are then darkened by the
+// share of the light that the maps block.
+#define SHADOW_CASCADES 3         // View slices (the apply shader has three samplers)
+#define SHADOW_MAP_SIZE 1024      // Texels per side of each depth map
+#define SHADOW_SUN_STEP 0.05f     // Light movement (radians) before a cached map is stale
+#define SHADOW_COVER 1.25f        // Cached area relative to the slice it covers
+#define SHADOW_CASTER_RANGE 96.0f // Room toward the light for casters outside the slice
+#define SHADOW_MIN_ELEVATION 0.1f // No shadows with the light this close to the horizon
+
+typedef struct {
+    GLuint fbo, depth;               // Cached static casters
+    GLfloat view[16], proj[16];      // Light transform the cached map was drawn with
+    GLfloat lightMatrix[16];         // World to shadow map coordinates
+    float center[3], radius;         // Area covered by the cached map
+    float sunAngle;                  // Light direction it was drawn for
+    int generation;                  // Terrain generation it was drawn for
+    int valid;
+} ShadowCascade;
+
+typedef struct {
+    ShadowCascade cascades[SHADOW_CASCADES];
+    GLuint dynamicFbo, dynamicDepth; // Per-frame casters, first cascade's transform
+    GLuint program;         // Receiver pass shader (0: shadows unsupported)
+    GLint matrixUniform, splitUniform, twoSidedUniform, fogUniform;
+    int enabled;            // Toggled with S
+    int refreshes;          // Static cascade redraws so far
+} Shadows;
+
+Shadows shadows;
+const float shadowSplits[SHADOW_CASCADES + 1] = {1.0f, 40.0f, 100.0f, TERRAIN_VIEW_DISTANCE}; // Eye distances
+
+/* POINT LIGHTS */
+// At night the cabin windows, the chimney and lanterns around the clearing
+// light their surroundings. Each frame the lights are binned on the CPU
+// into clusters, CLUSTER_X by CLUSTER_Y screen tiles cut into CLUSTER_Z
+// depth slices that grow exponentially with distance. The light data and
+// the per-cluster lists are uploaded once, and a receiver pass like the
+// shadow one adds to each fragment of the terrain and cabin only the
+// lights listed for its cluster, so hundreds of lights cost little more
+// than the few that actually reach each pixel.
+#define DEFAULT_LIGHTS 64        // Lanterns unless --lights is given
+#define MAX_LIGHTS 4096          // Lanterns plus cabin lights (light texture width)
+#define CABIN_LIGHTS 3           // Two windows and the chimney, ahead of the lanterns
+#define LIGHT_LANES 8            // Light arrays are padded to the AVX width
+#define LIGHT_ARRAYS 10          // Float arrays per light (see LightField)
+#define CLUSTER_X 16             // Screen tiles across
+#define CLUSTER_Y 9              // Screen tiles up
+#define CLUSTER_Z 24             // Depth slices from the near plane to the view distance
+#define CLUSTER_COUNT (CLUSTER_X * CLUSTER_Y * CLUSTER_Z)
+#define CLUSTER_INDEX_WIDTH 1024 // Light indices per row of the index texture
+#define LANTERN_RADIUS 6.0f      // Distance at which a lantern's light has faded out
+#define LANTERN_HEIGHT 1.6f      // Lantern height above the ground
+#define LANTERN_SPACING 6.0f     // Typical distance between neighboring lanterns
+#define LIGHT_FLICKER_TICKS 4.0f // Simulation ticks between flicker noise samples
+
+typedef struct {
+    float x, y, z;          // World position
+    float radius;           // Distance at which the light has faded out
+    float red, green, blue; // Color times intensity, before flicker
+} PointLight;               // One light entity, as handed to display()
+
+typedef struct {
+    float *x, *y, *z;       // World positions (SoA, capacity entries each)
+    float* radius;          // Distance at which the light has faded out
+    float *red, *green, *blue; // Color times intensity, before flicker
+    float *viewX, *viewY, *viewZ; // Eye-space positions from the last binning
+    int* bounds[6];         // Cluster ranges per light: x0, x1, y0, y1, z0, z1 (x0 > x1: not in view)
+    int count;              // Lights in use (cabin lights first)
+    int capacity;           // count rounded up to LIGHT_LANES
+    int version;            // Light archetype version the arrays were built from
+    float slices[CLUSTER_Z + 1]; // Eye distance where each slice starts
+    unsigned int clusters[CLUSTER_COUNT * 2]; // First index and count per cluster
+    unsigned int cursor[CLUSTER_COUNT];       // Fill position per cluster while binning
+    unsigned short* indices; // Light indices grouped by cluster
+    int maxIndices;         // Capacity of indices and of the index texture
+    float texels[MAX_LIGHTS * 8]; // Light texture rows: eye position and radius, flickered color
+    int binned;             // Lights that reached a cluster last frame
+    int numIndices;         // Cluster entries written last frame
+    GLuint program;         // Receiver pass shader (0: point lights unsupported)
+    GLuint lightTexture, clusterTexture, indexTexture;
+    GLint viewportUniform, depthUniform, gridUniform, twoSidedUniform, fogUniform;
+} LightField;
+
+LightField lightField;
+int lanternCount = DEFAULT_LIGHTS; // Lanterns around the clearing (--lights)
+Rng lanternRng;             // Where lanterns are added, and which ones are taken away (simulation thread)
+
+/* CROWD STRUCTURES */
+#define CROWD_CELL_SIZE 1.0      // Spatial hash cell size (>= neighbor radius)
+#define CROWD_NEIGHBOR_RADIUS 0.8 // Agents closer than this push apart
+#define CROWD_TREE_RADIUS 0.3    // Trunk footprint radius at scale 1
+#define CROWD_OBSTACLE_WEIGHT 3.0 // Obstacle push relative to separation
+#define CROWD_MAX_TURN 600.0     // Steering turn limit (degrees per second)
+#define CROWD_BUDGET_MS 4.0      // Time allowed for the crowd systems per tick
+#define CROWD_DENSITY 0.5        // Agents per square unit when sizing the area
+#define CROWD_STATS_INTERVAL 5.0 // Seconds between throughput reports
+#define CROWD_BATCH 256          // Agents per work item (the budget is checked before each; divides ENTITY_CHUNK_ROWS)
+#define CABIN_HALF_WIDTH 2.0     // Cabin footprint, matching drawCabin()
+#define CABIN_HALF_DEPTH 1.5
+
+typedef struct {
+    float cellSize;         // World units per grid cell
+    int numBuckets;         // Hash table size (power of two)
+    int rowShift;           // log2 of the table's row length
+    int* cellStart;         // Start of each bucket in entries (numBuckets + 1)
+    int* entries;           // Item indices sorted by bucket
+    float* sortedX;         // Item positions in entry order, so neighbor
+    float* sortedZ;         // scans read contiguous memory
+    int* keys;              // Bucket of each item (scratch)
+    int capacity;           // Allocated entries
+} SpatialHash;
+
+typedef struct {
+    float *x, *y, *z;       // Position
+    float *angle, *speed;   // Heading
+    float* legAngle;        // Gait
+    int* legDirection;
+    int* state;             // Behavior
+    float* timer;
+    int* round;
+    Rng* rng;               // Random
+} VillagerColumns;          // One chunk's villager columns
+
+typedef struct {
+    SpatialHash agents;     // Villagers, rebuilt every tick
+    SpatialHash trees;      // Tree trunks, rebuilt when trees are planted or felled
+    TreeInstance* treeRows; // Tree entities gathered for the trunk hash
+    int maxTreeRows;        // Capacity of treeRows
+    float* gatherX;         // Villager positions gathered for the grid
+    float* gatherZ;
+    int maxGather;
+    Rng spawnRng;           // Where villagers spawn, and which ones leave
+    long long spawned;      // Villagers spawned so far (indexes their streams)
+    float bound;            // Agents turn back beyond +/- bound
+    int round;              // Update round in progress: each villager is updated once per round
+    float stepDt;           // Time step of the update in progress
+    double tickStart;       // Time the crowd systems started this tick
+    double deadline;        // No batches are started after this
+    atomic_int updated;     // Agents updated this tick
+    atomic_int skipFrom;    // First batch skipped for lack of time
+    double windowStart;     // Start of the current statistics window
+    double windowSeconds;   // Time spent in the crowd systems this window
+    double windowCoverage;  // Sum of per-tick updated fractions
+    long long windowAgents; // Agents updated this window
+    int windowTicks;        // Ticks this window
+    double agentsPerSecond; // Throughput over the last window
+    double coverage;        // Average fraction of agents updated per tick
+    double tickMs;          // Average crowd system time per tick
+} Crowd;
+
+Crowd crowd;                // Crowd simulation state
+int crowdStats = 0;         // Print throughput reports (--crowd-stats)
+
+
+/* SPATIAL INDEX */
+// Forest chunks, the cabin and the people are indexed by bounding volume
+// hierarchies with four children per node. Child boxes are stored as
+// structure-of-arrays so one SSE pass tests all four against a plane.
+// The static hierarchy is built with the forest; the crowd's is refit
+// every frame from the interpolated positions and rebuilt once refitting
+// has let its boxes grow loose.
+#define BVH_WIDTH 4              // Children per node (one SSE register)
+#define BVH_STACK 64             // Traversal stack (trees are balanced, depth ~log4 n)
+#define BVH_LOOSENESS 1.5f       // Rebuild once refit boxes cover this much more ground
+#define PERSON_HALF_WIDTH 0.5f   // Person bounding box, matching the villager mesh
+#define PERSON_HEIGHT 1.8f
+#define CABIN_HEIGHT 3.5f        // Roof ridge, matching drawCabin()
+
+typedef struct {
+    float minX[BVH_WIDTH], minY[BVH_WIDTH], minZ[BVH_WIDTH]; // Child boxes
+    float maxX[BVH_WIDTH], maxY[BVH_WIDTH], maxZ[BVH_WIDTH];
+    int child[BVH_WIDTH];   // Node index, or ~item for a leaf
+    int count;              // Children in use (packed first)
+    int pad[3];
+} BvhNode;
+
+typedef void (*BvhBoxFn)(void* ctx, int item, float* min, float* max);
+typedef void (*BvhVisitFn)(void* ctx, int item);
+typedef float (*BvhRayFn)(void* ctx, int item, const float* origin, const float* dir, float maxT);
+
+typedef struct {
+    BvhNode* nodes;         // Node 0 is the root; children come after their parents
+    int numNodes, maxNodes;
+    int numItems;
+    unsigned int* keys;     // Build scratch: Morton codes and item order, two of each
+    int* order;
+    int maxItems;
+    float builtArea;        // Ground covered by all child boxes when built
+    float area;             // ... after the last refit
+    int builds;             // Builds so far
+} Bvh;
+
+typedef struct {
+    Bvh statics;            // Cabin (item 0) and forest chunks (item 1 + chunk)
+    Bvh people;             // Crowd, item k being person personIds[k]
+    int* slotOf;            // Snapshot slot of each person id this frame (-1: none)
+    int maxSlots;
+    int* personIds;         // Live person ids, ascending, when the crowd was built
+    int maxPersonIds;
+    int crowdVersion;       // Crowd membership the hierarchy was built for
+    int cabinVisible;       // Cabin passed the last static cull
+    int visiblePeople;      // People drawn last frame
+} SceneIndex;
+
+typedef struct {
+    GLdouble modelview[16]; // Camera of the last frame
+    GLdouble projection[16];
+    GLint viewport[4];
+    int tree;               // Tree hit inside the chunk being tested
+    char text[96];          // What the last click found
+} PickState;
+
+SceneIndex sceneIndex;
+
+/* OCCLUSION CULLING */
+// From most angles the cabin and the hills around the clearing hide part
+// of the forest and crowd. Simplified occluders that fit inside them are
+// rasterized on the CPU into a small depth buffer, 8 (AVX) or 4 (SSE)
+// pixels per instruction, and the boxes of forest chunks and people are
+// tested against it before they are drawn. The occluders are the cabin's
+// wall box and a coarse grid over the terrain around the camera whose
+// corners sit at the lowest ground of the cells they touch, so the grid
+// never rises above the terrain at any detail level. The buffer is
+// rasterized on its own thread, started as soon as the frame's camera is
+// loaded and joined when the forest is culled, so it overlaps the terrain
+// pass; a camera that has not moved keeps the previous frame's buffer.
+// Only mono views are tested: one buffer cannot stand in for both eyes.
+#define OCCLUSION_WIDTH 256      // Depth buffer size (width a multiple of 8)
+#define OCCLUSION_HEIGHT 144
+#define OCCLUSION_NEAR 1.0f      // Triangles and boxes closer than the near plane are not used
+#define OCCLUDER_CELL_SAMPLES (1 << (TERRAIN_LODS - 1)) // Samples per grid cell: the coarsest terrain cell
+#define OCCLUDER_CELL (OCCLUDER_CELL_SAMPLES * TERRAIN_SPACING)
+#define OCCLUDER_CELLS (2 * TERRAIN_TABLE_HALF / OCCLUDER_CELL_SAMPLES) // Cells across the height table
+#define OCCLUDER_GRID 48         // Cells per side of the terrain grid around the camera
+#define OCCLUDER_MAX_VERTICES (8 + (OCCLUDER_GRID + 1) * (OCCLUDER_GRID + 1))
+#define OCCLUDER_MAX_TRIANGLES (10 + 2 * OCCLUDER_GRID * OCCLUDER_GRID)
+
+typedef struct {
+    float* depth;           // 1/w per pixel (larger is nearer, 0 = no occluder)
+    float vertices[OCCLUDER_MAX_VERTICES][3]; // Occluders in world space (the cabin first)
+    float screen[OCCLUDER_MAX_VERTICES][3];   // Buffer x, y and 1/w (0: in front of the near plane)
+    unsigned short triangles[OCCLUDER_MAX_TRIANGLES][3];
+    int numVertices, numTriangles;
+    float* cellMin;         // Lowest height sample of each cell of the height table
+    int gridX, gridZ, gridW, gridH; // Cells covered by the terrain grid in the mesh
+    GLfloat matrix[16];     // Clip matrix the buffer is (being) drawn with
+    float eye[3];           // Camera position for that matrix
+    int valid;              // matrix has been drawn or queued
+    pthread_t thread;       // Rasterizer
+    int threaded;           // The thread started (else the caller rasterizes)
+    pthread_mutex_t lock;
+    pthread_cond_t start;   // Signalled when a buffer is queued
+    pthread_cond_t done;    // Signalled when it is finished
+    int pending;            // A queued buffer is not finished yet
+    int enabled;            // Toggled with O
+    int active;             // Tests apply to the current view
+    int rejected;           // Objects hidden this frame (trees count one each)
+    int redraws;            // Buffers rasterized so far
+    float rasterMs;         // Time of the last rasterization
+} Occlusion;
+
+Occlusion occlusion = {.enabled = 1};
+PickState pick = {.text = "nothing"};
+
+/* PARTICLE STRUCTURES */
+#if defined(__AVX__)
+#define PARTICLE_LANES 8    // Particles per SIMD instruction
+#else
+#define PARTICLE_LANES 4
+#endif
+#define PARTICLE_ARRAYS 7   // Float arrays per particle (x, y, z, vx, vy, vz, life)
+#define PARTICLE_AREA 50.0  // Particles cover -AREA..AREA in X and Z
+#define PARTICLE_CEILING 25.0 // Height at which particles respawn
+#define PARTICLE_CHUNK 16384 // Particles integrated per worker job
+
+typedef struct {
+    float gravity;          // Downward acceleration (units/s^2)
+    float terminal;         // Fall speed limit (negative, units/s)
+    float drag;             // Rate horizontal velocity relaxes to the wind (1/s)
+    float jitter;           // Random horizontal speed at spawn (units/s)
+    float lifetime;         // Maximum seconds before respawn
+    float streak;           // Seconds of motion shown by each streak
+    float color[3];         // Streak color
+} PrecipitationParams;
+
+typedef struct {
+    float *x, *y, *z;       // Positions (structure of arrays, 32-byte aligned)
+    float *vx, *vy, *vz;    // Velocities
+    float *life;            // Seconds until forced respawn
+    int count;              // Live particles, packed at the front
+    int capacity;           // Allocated slots (multiple of PARTICLE_LANES)
+    int mode;               // Weather mode the particles belong to (1 or 2)
+    Rng rng;                // Spawn stream
+    int* flagged;           // Landed/expired particles, listed per chunk
+    int* chunkFlagged;      // Number of flagged particles in each chunk
+    float stepDt;           // Time step of the update in progress
+    int stepChunks;         // Chunks integrated by the update in progress
+} ParticlePool;
+
+PrecipitationParams precipitationModes[3] = {
+    {0},
+    {-40.0, -20.0, 2.0, 0.5, 10.0, 0.075, {0.5, 0.5, 1.0}}, // Rain
+    {-4.0, -1.5, 1.0, 1.5, 30.0, 0.15, {1.0, 1.0, 1.0}}     // Snow
+};
+ParticlePool precipitation; // Rain and snow particles
+GLuint precipitationVbo = 0; // Streaming vertex buffer for streaks
+int particleCapacity = 4000; // Pool size (--particles)
+float windX = 1.5, windZ = 0.5; // Horizontal wind velocity (units/s)
+
+/* CLOUD STRUCTURES */
+// Clouds are camera-facing billboards textured from an atlas of impostor
+// sprites baked once at startup. The layer tiles around the camera at a
+// fixed density, so only the clouds within view distance are ever drawn
+// no matter how many there are, and all of them go out in one draw call.
+#define DEFAULT_CLOUDS 300       // Clouds in the layer unless --clouds is given
+#define CLOUD_DENSITY 0.002f     // Clouds per square unit of sky
+#define CLOUD_MIN_FIELD 64.0f    // Smallest half-size of the tiled layer
+#define CLOUD_SPRITE_SIZE 128    // Texels per side of one impostor
+#define CLOUD_ATLAS_GRID 4       // Impostors per atlas row (16 variants)
+#define CLOUD_FADE 0.1f          // Cover band over which clouds fade in
+
+typedef struct {
+    float x, y, z;          // Position at time zero
+    float size;             // Billboard half-width
+    float cover;            // Weather cover at which the cloud appears
+    float phase;            // Offset of its sun-driven drift
+    int sprite;             // Atlas cell
+} Cloud;
+
+typedef struct {
+    Cloud* clouds;
+    int count;
+    float half;             // Half-size of the tile the layer repeats over
+    GLuint atlas;           // Baked impostor sprites
+    int drawn;              // Clouds drawn last frame
+    int version;            // Cloud archetype version the layer was built from
+} CloudLayer;
+
+CloudLayer cloudLayer;
+int cloudCount = DEFAULT_CLOUDS; // Clouds in the layer (--clouds)
+Rng cloudRng;               // Where clouds gather, and which ones clear away (simulation thread)
+const float cloudCover[4] = {0.35f, 1.0f, 0.85f, 0.6f}; // Share shown per weather mode
+
+/* CHIMNEY SMOKE */
+// The plume is a fixed pool of puffs, each leaving the chimney again every
+// SMOKE_LIFETIME seconds, staggered by its index. Where a puff is, how big
+// and how faded follow from its age and how often it has been reborn, so
+// the plume keeps no state and any frame can be drawn from the clock.
+#define DEFAULT_SMOKE_PUFFS 400  // Puffs in the plume unless --smoke is given
+#define SMOKE_LIFETIME 10.0f     // Seconds from the chimney top to gone
+#define SMOKE_RISE 0.6f          // Rise speed leaving the chimney (units per second)
+#define SMOKE_DRIFT 0.4f         // Share of the wind speed the plume drifts at
+#define SMOKE_SPREAD 0.35f       // Sideways wander after one second (units)
+#define SMOKE_OPACITY 0.5f       // Peak alpha of a puff at the default count
+#define SMOKE_SPRITE_SIZE 64     // Texels per side of the puff sprite
+
+int smokePuffs = DEFAULT_SMOKE_PUFFS; // Puffs in the plume (--smoke)
+const float chimneyTop[3] = {-1.2f, 3.5f, -0.8f}; // Where puffs are born, relative to the cabin
+
+/* TRANSPARENT PASS */
+// Blended sprites (cloud billboards and smoke puffs) are collected after
+// the solids, radix-sorted back to front on their view depth and drawn
+// with depth writes off, one draw call per run sharing a texture. The
+// lists are reserved for the frame's worst case and only ever grow.
+typedef enum {
+    SPRITE_CLOUD,           // Cloud impostor atlas
+    SPRITE_SMOKE,           // Smoke puff
+    SPRITE_TEXTURES
+} SpriteTexture;
+
+typedef struct {
+    GLfloat pos[3];
+    GLfloat uv[2];
+    GLubyte color[4];
+} SpriteVertex;
+
+typedef struct {
+    float *x, *y, *z;       // Sprite centers (32-byte aligned)
+    float* halfWidth;
+    float* halfHeight;
+    float* uv;              // Texture rectangle per sprite (u0, v0, u1, v1)
+    GLubyte* color;         // RGBA per sprite
+    unsigned char* texture; // SpriteTexture per sprite
+    int count, capacity;
+    RadixSorter sorter;     // View depth keys of the sprites
+    int* order;             // Sprites back to front (in sorter)
+    SpriteVertex* verts;    // Quads in draw order
+    GLuint vbo;             // Streaming copy of verts
+    int* runs;              // First sprite of each run sharing a texture, then count
+    int numRuns;
+    GLuint textures[SPRITE_TEXTURES];
+} TransparentPass;
+
+TransparentPass transparent;
+
+/* STEREO */
+// Both eyes share one traversal: terrain streaming, culling, the crowd
+// index, queue sorting, shadow maps and cloud billboards are done once
+// against a frustum that encloses both eyes, then the prepared draws are
+// issued once per eye with that eye's off-axis projection.
+#define DEFAULT_IPD 0.064f       // Eye separation (a world unit is about a meter)
+#define DEFAULT_CONVERGENCE 30.0f // Zero-parallax distance (the cabin at the default zoom)
+#define STEREO_FOV 45.0f         // Vertical field of view of each eye (as in mono)
+
+typedef enum {
+    STEREO_SIDE_BY_SIDE,    // Left eye in the left half of the frame
+    STEREO_LAYERS           // One texture array layer per eye, shown side by side
+} StereoLayout;
+
+typedef struct {
+    int enabled;            // Render both eyes (--stereo, V key)
+    StereoLayout layout;
+    int naive;              // Run the whole frame once per eye (benchmark baseline)
+    float ipd;              // Eye separation in world units
+    float convergence;      // Distance at which the eyes' images coincide
+    int width, height;      // Size of one eye's image
+    GLuint layers;          // Two-layer color texture array (layers layout)
+    GLuint depth;           // Depth buffer the eyes take turns with
+    GLuint fbos[2];         // Framebuffer per layer
+    int layerWidth, layerHeight; // Size the layers were created at
+} Stereo;
+
+Stereo stereo = {0, STEREO_SIDE_BY_SIDE, 0, DEFAULT_IPD, DEFAULT_CONVERGENCE};
+
+/* DYNAMIC RESOLUTION */
+// The scene is drawn into an offscreen framebuffer at a fraction of the
+// window's size, then stretched over the window before the HUD goes on
+// top. After each frame a controller compares the frame time against the
+// budget: the slower of the CPU time and, where timestamp queries exist,
+// the GPU time, which arrives a few frames late. It only shrinks the scene
+// when over budget and only grows it when comfortably under, and waits a
+// few frames after each change for the effect to show in the timings.
+#define DYNRES_TARGET_MS 16.0f  // Default frame-time budget (--dynamic-res)
+#define DYNRES_MIN_SCALE 0.5f   // Smallest fraction of the window's width and height
+#define DYNRES_HEADROOM 0.85f   // Grow only below this fraction of the budget
+#define DYNRES_MAX_STEP 1.1f    // Largest change of scale per decision, either way
+#define DYNRES_SMOOTHING 0.25f  // Weight of the newest frame in the smoothed time
+#define DYNRES_SETTLE_FRAMES 4  // Frames to wait after a change
+#define DYNRES_QUERY_FRAMES 4   // GPU timestamp pairs in flight
+
+typedef struct {
+    int enabled;            // 1 on, 0 off, -1 until init() decides (on in a window, off headless)
+    int supported;          // Framebuffer blits are available
+    float targetMs;         // Frame-time budget
+    GLuint fbo, color, depth; // Offscreen target, sized to the window
+    int targetWidth, targetHeight; // Size it was created at
+    GLuint sceneFbo;        // Framebuffer the scene goes to this frame (0: the window)
+    int width, height;      // Scene resolution this frame (the window's when off)
+    float scale;            // Fraction of the window's width and height
+    int timestamps;         // Timestamp queries are supported
+    GLuint queries[DYNRES_QUERY_FRAMES][2]; // Start and end of each frame's scene
+    int issued[DYNRES_QUERY_FRAMES];
+    int slot;               // Query pair of the current frame
+    double frameStart;      // CPU clock when the scene was started
+    float cpuMs, gpuMs;     // Last measurements (the GPU's lag a few frames)
+    float filteredMs;       // Smoothed frame time the controller acts on
+    int settle;             // Frames left before the next decision
+    int drops, raises;      // Decisions that shrank or grew the scene
+    long long frames;       // Frames drawn with scaling on
+    double scaleSum;        // For the average scale
+    float minScale;         // Smallest scale drawn at
+} DynamicResolution;
+
+DynamicResolution dynamicRes = {-1, 0, DYNRES_TARGET_MS, .scale = 1.0f, .minScale = 1.0f};
+
+/* SIMULATION TIMING */
+// The simulation advances in fixed steps of SIM_DT regardless of the
+// frame rate; display() interpolates between the last two steps.
+#define SIM_HZ 60           // Simulation steps per second
+#define SIM_DT (1.0f / SIM_HZ) // Seconds per step
+#define SIM_MAX_CATCHUP 8   // Steps run back to back before dropping time
+#define SUN_SPEED 0.3       // Sun/moon travel (radians per second)
+#define PERSON_IDLE_TIME 1.67 // Minimum seconds standing before walking off
+#define PERSON_WALK_TIME 3.33 // Minimum seconds walking before stopping
+#define PERSON_LEG_SWING 120.0 // Leg swing speed (degrees per second)
+#define PERSON_WANDER_RATE 1.2 // Random direction changes per second
+
+/* SIMULATION THREADING */
+// The simulation runs on its own thread and publishes a snapshot of
+// everything display() needs after each tick. Three snapshot slots rotate
+// between the simulation (back), the hand-off slot and display() (front),
+// so neither side ever waits for the other.
+#define SNAPSHOT_FRESH 4    // Set on the hand-off slot when it holds a new tick
+#define SIM_COMMAND_QUEUE 64 // Pending input commands (power of two)
+#define MAX_WORKERS 64      // Upper bound for --threads
+
+typedef struct {
+    long long tick;         // Simulation tick this snapshot was taken at
+    double tickTime;        // Wall-clock time (nowSeconds) the tick represents
+    float prevSunAngle;     // Values at the previous tick, for interpolation
+    float sunAngle;         // Copies of the environment
+    int isDay;
+    int weatherMode;
+    float lightFlicker;
+    Person* people;         // Villager poses, in entity row order
+    int numPeople;
+    int maxPeople;          // Capacity of people
+    int personSlots;        // Person ids are below this
+    int crowdVersion;       // Changes whenever villagers spawn or despawn
+    TreeInstance* trees;    // Tree entities in row order, copied only when they change
+    int numTrees;
+    int maxTrees;           // Capacity of trees
+    int forestVersion;      // Tree archetype version of trees
+    PointLight* lights;     // Light entities in row order, copied only when they change
+    int numLights;
+    int maxLights;          // Capacity of lights
+    int lightVersion;       // Light archetype version of lights
+    Cloud* clouds;          // Cloud entities in row order, copied only when they change
+    int numClouds;
+    int maxClouds;          // Capacity of clouds
+    int cloudVersion;       // Cloud archetype version of clouds
+    float* particleLines;   // Precipitation streaks, two vertices each
+    int numParticles;
+    int particleMode;       // Precipitation parameters to draw with
+    float stepMs[3];        // Simulation pass times when profiling (step, particles, people), summed over threads
+} SimSnapshot;
+
+typedef enum {
+    SIM_SET_DAY,            // Argument: 1 = day, 0 = night
+    SIM_CYCLE_WEATHER,      // Advance to the next weather mode
+    SIM_RESIZE_CROWD,       // Argument: 1 = spawn, -1 = despawn a tenth of the villagers
+    SIM_RESIZE_FOREST,      // Argument: 1 = plant, -1 = fell a tenth of the trees
+    SIM_RESIZE_LANTERNS,    // Argument: 1 = add, -1 = take away a tenth of the lanterns
+    SIM_RESIZE_CLOUDS       // Argument: 1 = gather, -1 = clear away a tenth of the clouds
+} SimCommandType;
+
+typedef struct {
+    SimCommandType type;
+    int arg;
+} SimCommand;
+
+typedef void (*ParallelFn)(void* ctx, int begin, int end);
+
+typedef struct {
+    pthread_t threads[MAX_WORKERS]; // Helper threads (the caller also works)
+    int numThreads;
+    pthread_mutex_t lock;
+    pthread_cond_t start;   // Signalled when a job is posted
+    pthread_cond_t done;    // Signalled when the last helper finishes
+    ParallelFn fn;          // Current job
+    void* ctx;
+    int count, grain;       // Job range and items claimed per step
+    atomic_int next;        // Next unclaimed item
+    int generation;         // Incremented for each job
+    int active;             // Helpers still working on the current job
+    int quit;
+} WorkerPool;
+
+SimSnapshot snapshots[3];   // Back, hand-off and front slots
+int snapshotBack = 0;       // Slot the simulation writes (simulation thread)
+atomic_int snapshotReady = 1; // Hand-off slot, with SNAPSHOT_FRESH if unread
+int snapshotFront = 2;      // Slot display() reads (GLUT thread)
+const SimSnapshot* frame = &snapshots[2]; // Snapshot being rendered
+float frameAlpha = 1.0;     // Interpolation from the previous tick (0) to frame (1)
+double viewTime = 0.0;      // Simulated seconds at the frame being rendered
+float viewSunAngle = 0.0;   // Interpolated value for the frame being rendered
+long long simTick = 0;      // Ticks simulated so far
+double simClockStart = 0.0; // Wall-clock time of tick 0 (moves forward after stalls)
+
+SimCommand simCommands[SIM_COMMAND_QUEUE]; // Input waiting for the simulation
+atomic_int simCommandHead = 0; // Next slot to write (GLUT thread)
+atomic_int simCommandTail = 0; // Next slot to read (simulation thread)
+
+WorkerPool workers;         // Helpers for parallelFor()
+int simThreads = -1;        // Simulation threads (--threads, -1 = automatic)
+pthread_t simThread;        // Thread running simulationLoop()
+int simThreadRunning = 0;   // simThread was started
+atomic_int simQuit = 0;     // Ask the simulation thread to stop
+
+/* SYSTEM SCHEDULER */
+// A simulation step runs a fixed list of systems. Each declares the
+// components and resources it reads and writes, and is placed in the
+// first stage after every earlier system it shares data with. Systems in
+// one stage never conflict, so the work items of all of them run as one
+// job on the worker pool, between each system's serial begin and end.
+#define MAX_SYSTEMS 16
+
+typedef int (*SystemBeginFn)(void* ctx, float dt);
+typedef void (*SystemEndFn)(void* ctx);
+
+typedef struct {
+    const char* name;
+    unsigned int reads;     // Components and resources read
+    unsigned int writes;    // Components and resources written
+    SystemBeginFn begin;    // Serial setup; returns the work items (NULL: none)
+    ParallelFn run;         // Runs work items [begin, end) on any thread
+    SystemEndFn end;        // Serial wrap-up once every item ran (may be NULL)
+    void* ctx;              // Passed to all three
+    int report;             // stepMs entry the system's time adds to (0: total only)
+    int stage;              // Assigned by addSystem()
+    int items;              // Work items this step
+    int firstItem;          // Its first item in the stage's job
+    double ms;              // Time this step when profiling, summed over threads
+    atomic_llong workNs;    // Time spent in run() this step
+} System;
+
+typedef struct {
+    System systems[MAX_SYSTEMS]; // In the order they were added
+    int numSystems;
+    int numStages;
+    System* stage[MAX_SYSTEMS]; // Systems of the stage being run
+    int stageSize;
+    int timed;              // Measure the systems this step
+} Scheduler;
+
+Scheduler scheduler;        // Systems of a simulation step
+
+/* HEADLESS RENDERING */
+int headless = 0;           // Render offscreen instead of opening a window
+int headlessFrames = 0;     // Frames to render (--headless)
+int headlessWidth = 640, headlessHeight = 480; // Frame size (--size)
+float headlessFps = 30.0;   // Frames per simulated second (--fps)
+const char* headlessOutput = "frame%05d.ppm"; // Output pattern (--output)
+double headlessTime = 0.0;  // Simulated clock driving headless frames
+
+/* FRAME CAPTURE */
+// Finished frames are read back into a ring of pixel buffer objects and
+// mapped CAPTURE_PBOS - 1 frames later, when the copy has long finished,
+// so the render thread never waits on the GPU. Mapped pixels are copied
+// into a queue that a writer thread converts and writes; when the queue
+// is full the render thread waits for it rather than dropping a frame.
+#define CAPTURE_PBOS 3          // Readbacks in flight
+#define CAPTURE_QUEUE 8         // Frames waiting for the writer
+
+typedef enum {
+    CAPTURE_RAW,            // Packed RGB rows, top-down
+    CAPTURE_PPM,            // Binary PPM (one per frame)
+    CAPTURE_Y4M             // YUV4MPEG2, 4:4:4 BT.601
+} CaptureFormat;
+
+typedef struct {
+    const char* target;     // Output, as given to startCapture()
+    CaptureFormat format;
+    int running;            // Writer started, frames are being captured
+    int width, height;      // Captured area (from the bottom-left corner)
+    size_t frameBytes;      // RGBA pixels of one frame
+    GLuint pbos[CAPTURE_PBOS]; // Readback ring (none: read straight into the queue)
+    long long pboFrame[CAPTURE_PBOS]; // Frame read into each buffer (-1 = free)
+    long long issued;       // Frames read back so far
+    unsigned char* slots[CAPTURE_QUEUE]; // Frames for the writer (bottom-up RGBA)
+    long long slotFrame[CAPTURE_QUEUE];
+    long long head, tail;   // Frames queued and written (guarded by lock)
+    pthread_mutex_t lock;
+    pthread_cond_t ready;   // Signalled when a frame is queued or on quit
+    pthread_cond_t space;   // Signalled when the writer frees a slot
+    pthread_t writer;
+    int quit;
+    FILE* stream;           // Output for every frame (NULL: one file per frame)
+    int piped;              // stream came from popen()
+    int failed;             // A write failed (reported once)
+    unsigned char* convert; // Writer's row or plane buffer
+    long long stalls;       // Frames that waited for a free slot
+    double readMs, copyMs, waitMs; // Render thread totals
+    double writeMs;         // Writer thread total
+} Capture;
+
+Capture capture;
+const char* captureTarget = NULL; // Pattern, file, "-" or "|command" (--capture, --output)
+
+/* PROFILING */
+#define PROFILE_HISTORY 256     // Samples in each rolling HUD window
+#define PROFILE_QUERY_FRAMES 4  // Frames of GPU timer queries in flight
+#define PROFILE_BUCKETS 160     // Log-scale histogram buckets (whole-run p99)
+#define PROFILE_BUCKETS_PER_DECADE 20 // Histogram resolution (about 12%)
+#define PROFILE_MIN_MS 0.0001   // Lower edge of the first histogram bucket
+#define PROFILE_HUD_REFRESH 0.25 // Seconds between HUD statistics updates
+
+typedef enum {
+    PASS_FRAME,             // Whole display() call
+    PASS_TERRAIN,           // Streaming heightmap terrain
+    PASS_STATIC,            // Cached cabin
+    PASS_CABIN,             // Immediate-mode cabin (cache off)
+    PASS_FOREST,
+    PASS_CLOUDS,
+    PASS_SMOKE,
+    PASS_INDEX,             // Refitting the crowd's hierarchy
+    PASS_OCCLUSION,         // Waiting for the occlusion buffer
+    PASS_PEOPLE,
+    PASS_ANIMATION,         // Posing, skinning and drawing the villagers
+    PASS_QUEUE,             // Sorted, instanced draw of the queued solids
+    PASS_SHADOW_STATIC,     // Cached shadow map redraws
+    PASS_SHADOW_DYNAMIC,    // Per-frame casters
+    PASS_SHADOW_APPLY,      // Darkening the receivers
+    PASS_LIGHT_BIN,         // Sorting the point lights into clusters
+    PASS_LIGHTS,            // Adding the point lights to the receivers
+    PASS_PRECIPITATION,
+    PASS_SORT,              // Keying and radix-sorting the blended sprites
+    PASS_TRANSPARENT,       // Drawing them back to front
+    PASS_COMPOSE,           // Copying the stereo layers into the frame
+    PASS_UPSCALE,           // Stretching the scaled scene over the window
+    PASS_CAPTURE,           // Frame readback for --capture/--output
+    PASS_SIM_STEP,          // Simulation passes (CPU only, simulation thread)
+    PASS_SIM_PARTICLES,
+    PASS_SIM_PEOPLE,
+    PROFILE_PASSES
+} ProfilePass;
+
+#define PROFILE_FIRST_SIM_PASS PASS_SIM_STEP
+
+const char* profilePassNames[PROFILE_PASSES] = {
+    "frame", "terrain", "static", "cabin", "forest", "clouds",
+    "smoke", "index", "occlusion", "people", "animation", "queue flush", "shadow static", "shadow dynamic", "shadow apply",
+    "light bin", "lights", "precipitation", "sort", "transparent", "compose", "upscale", "capture", "sim step", "sim particles", "sim people"
+};
+
+typedef struct {
+    float history[PROFILE_HISTORY]; // Rolling window of recent samples (ms)
+    int next;               // Oldest entry of the window
+    int count;              // Entries filled in the window
+    long long samples;      // Whole-run sample count
+    double sum, min, max;   // Whole-run totals (ms)
+    unsigned int buckets[PROFILE_BUCKETS]; // Whole-run log-scale histogram
+    float stats[3];         // Window min/avg/p99 shown on the HUD
+} ProfileSeries;
+
+typedef struct {
+    ProfileSeries cpu[PROFILE_PASSES]; // CPU time per pass
+    ProfileSeries gpu[PROFILE_PASSES]; // GPU time per pass (GL_TIME_ELAPSED)
+    double cpuStart[PROFILE_PASSES]; // Open CPU timers
+    double frameCpu[PROFILE_PASSES]; // CPU time per pass this frame (passes may repeat)
+    GLuint queries[PROFILE_QUERY_FRAMES][PROFILE_PASSES]; // Timer query ring
+    char issued[PROFILE_QUERY_FRAMES][PROFILE_PASSES]; // Query holds an unread result
+    int queryFrame;         // Ring slot used by the current frame
+    int gpuTimers;          // Timer queries are supported
+    int activeQuery;        // Pass with an open query, or -1
+    long long lastSimTick;  // Newest simulation tick already recorded
+    double lastRefresh;     // Time the HUD statistics were last computed
+    int ready;              // Queries have been created
+} Profiler;
+
+Profiler profiler;          // Per-pass timing state
+int profiling = 0;          // Collect timings (HUD shown or --profile given)
+atomic_int simProfiling = 0; // Copy of profiling read by the simulation thread
+int showProfileHud = 0;     // Draw the timing overlay
+const char* profileCsvPath = NULL; // Whole-run statistics file (--profile)
+int windowWidth = 900, windowHeight = 700; // Current viewport size for the HUD
+
+/* BENCHMARK SUITE */
+typedef struct {
+    const char* name;
+    int weatherMode;        // 0-3: clear, rain, snow, fog
+    int isDay;              // 1 = day, 0 = night
+    int trees;              // Forest size (0 = the eight default trees)
+    int people;             // Crowd size
+    int particles;          // Precipitation pool capacity
+    int clouds;             // Cloud layer size
+    int lights;             // Lanterns (lit at night)
+    int smoke;              // Puffs in the chimney plume
+    float zoom;             // Camera distance
+    float orbit;            // Degrees the camera turns over the measured frames
+    float travel;           // Units the camera moves forward over the measured frames
+    int stereo;             // 0 = mono, 1 = both eyes from one traversal, 2 = whole frame per eye
+} BenchmarkScenario;
+
+BenchmarkScenario benchmarkScenarios[] = {
+    {"clear-day",         0, 1,     0,    5,   4000,   300,    64,    400, -30.0,   0.0,    0.0, 0},
+    {"clear-night",       0, 0,     0,    5,   4000,   300,    64,    400, -30.0,   0.0,    0.0, 0},
+    {"rain-day",          1, 1,     0,    5,   4000,   300,    64,    400, -30.0,   0.0,    0.0, 0},
+    {"snow-night",        2, 0,     0,    5,   4000,   300,    64,    400, -30.0,   0.0,    0.0, 0},
+    {"fog-day",           3, 1,     0,    5,   4000,   300,    64,    400, -30.0,   0.0,    0.0, 0},
+    {"orbit-default",     0, 1,     0,    5,   4000,   300,    64,    400, -30.0, 360.0,    0.0, 0},
+    {"orbit-forest-10k",  0, 1, 10000,    5,   4000,   300,    64,    400, -45.0, 360.0,    0.0, 0},
+    {"forest-100k",       0, 1, 100000,   5,   4000,   300,    64,    400, -45.0, 360.0,    0.0, 0},
+    {"crowd-2k",          0, 1,     0, 2000,   4000,   300,    64,    400, -40.0, 360.0,    0.0, 0},
+    {"crowd-50k",         0, 1,     0, 50000,  4000,   300,    64,    400, -40.0, 360.0,    0.0, 0},
+    {"rain-100k",         1, 1,     0,    5, 100000,   300,    64,    400, -30.0, 360.0,    0.0, 0},
+    {"stress-night-snow", 2, 0, 20000, 2000, 100000,   300,    64,    400, -45.0, 360.0,    0.0, 0},
+    {"terrain-flyover",   0, 1,     0,    5,   4000,   300,    64,    400, -30.0,   0.0, 1500.0, 0},
+    {"sky-2",             1, 1,     0,    5,   4000,     2,    64,    400, -30.0, 360.0,    0.0, 0},
+    {"sky-10k",           1, 1,     0,    5,   4000, 10000,    64,    400, -30.0, 360.0,    0.0, 0},
+    {"occlusion-hills",   0, 1, 10000, 2000,   4000,   300,    64,    400, -20.0,  60.0,    0.0, 0},
+    {"stereo-naive",      0, 1, 10000, 2000,   4000,   300,    64,    400, -45.0, 360.0,    0.0, 2},
+    {"stereo-shared",     0, 1, 10000, 2000,   4000,   300,    64,    400, -45.0, 360.0,    0.0, 1},
+    {"lights-16",         0, 0,     0,    5,   4000,   300,    16,    400, -45.0, 360.0,    0.0, 0},
+    {"lights-256",        0, 0,     0,    5,   4000,   300,   256,    400, -45.0, 360.0,    0.0, 0},
+    {"lights-4k",         0, 0,     0,    5,   4000,   300,  4000,    400, -45.0, 360.0,    0.0, 0},
+    {"smoke-20k",         0, 1,     0,    5,   4000,   300,    64,  20000, -20.0, 360.0,    0.0, 0},
+    {"smoke-250k",        0, 1,     0,    5,   4000,   300,    64, 250000, -20.0, 360.0,    0.0, 0},
+};
+#define NUM_BENCHMARK_SCENARIOS (int)(sizeof(benchmarkScenarios) / sizeof(benchmarkScenarios[0]))
+
+const char* benchmarkReportPath = NULL; // Run the suite and write JSON here (--benchmark)
+const char* benchmarkFilter = NULL; // Only scenarios whose name contains this (--bench-only)
+int benchmarkSuiteFrames = 300; // Measured frames per scenario (--bench-frames)
+int benchmarkSuiteWarmup = 60;  // Unmeasured frames per scenario (--bench-warmup)
+
+/* INPUT RECORDING */
+// Recordings are text: a header with the seed and scene counts, then one
+// line per input event stamped with the simulation tick (1/SIM_HZ s).
+// "sim" events change simulation state and replay on exactly the same
+// tick; "view" events (camera, overlays) replay when that tick is shown.
+#define INPUT_RECORDING_MAGIC "cabin-input 1"
+
+typedef struct {
+    long long tick;         // Simulation tick the event applies to
+    int view;               // 1 = view key, 0 = simulation command
+    int code;               // Key code, or SimCommandType
+    int arg;                // 1 for GLUT special keys, or command argument
+} InputEvent;
+
+const char* recordPath = NULL; // Write input events here (--record)
+const char* replayPath = NULL; // Replay input events from here (--replay)
+FILE* recordFile = NULL;    // Open recording
+InputEvent* replayEvents = NULL; // Loaded recording
+int numReplayEvents = 0;
+int replaySimCursor = 0;    // Next event to check on the simulation thread
+int replayViewCursor = 0;   // Next event to check on the GLUT thread
+int exactRuns = 0;          // Recording or replaying: keep runs bit-identical
 
 /* FUNCTION PROTOTYPES */
 void drawCabin();           // Render the cabin structure
-void drawTree(float x, float z); // Draw a tree at position
-void drawGround();          // Draw the terrain plane
-void drawHills();           // Render background hills
-void drawCloud(float x, float y, float z); // Draw cloud cluster
-void drawPerson(Person* p); // Render a character
-void drawSmoke();           // Draw chimney smoke
-void drawRainOrSnow();      // Render precipitation
+void drawCabinImmediate();  // Draw the cabin uncached, lit like the cache
+void drawTerrain();         // Stream and draw the terrain around the camera
+void cullCameraTerrain();   // Stream the terrain and collect the chunks in view
+int cullTerrain(const ViewFrustum* view, TerrainDraw* out); // Chunks inside a view volume
+float terrainHeight(float x, float z); // Ground height at a world position
+void collectClouds();       // Add the clouds in view to the transparent pass
+void initClouds(int count, unsigned int seed); // Bake impostors and place clouds
+void gatherClouds(Cloud* out); // Copy the cloud entities out
+void updateCloudView();     // Rebuild the cloud layer after clouds gather or clear
+void resizeClouds(int direction); // Gather or clear away a tenth of the clouds
+void initSmoke();           // Bake the smoke puff sprite
+void collectSmoke();        // Add the chimney plume to the transparent pass
+void beginTransparent(int count); // Empty the transparent pass for a frame
+void addSprite(float x, float y, float z, float halfWidth, float halfHeight, const float* uv, const GLubyte* color,
+               SpriteTexture texture); // Add a camera-facing sprite to the transparent pass
+void sortTransparent();     // Order the blended sprites back to front
+void drawTransparent();     // Draw the sorted sprites
+void drawRainOrSnow(int upload); // Render precipitation
 void drawFog();             // Configure fog effects
 void initPeople();          // Initialize characters
+void initWorld();           // Register the entity archetypes
+Entity spawnEntity(ArchetypeId id); // Add an entity (its components are left uninitialized)
+void despawnEntity(Entity e); // Remove an entity, if it is still alive
+void spawnVillagers(int count); // Add villagers around the clearing
+void despawnVillagers(int count); // Remove villagers at random
+void resizeCrowd(int direction); // Spawn or despawn a tenth of the villagers
+int liveEntities();         // Entities of every archetype alive now
+void initSystems();         // Add the simulation systems to the scheduler
+void runSystems(float dt, int timed); // Run every system once, stage by stage
 void updateLighting();      // Update scene lighting
-void updatePeople();        // Update character positions
 void display();             // Main render function
+void drawView(int eye);     // Every pass for the mono camera or one eye
+void drawStereo();          // Both eyes from one shared traversal
+void initDynamicResolution(); // Offscreen target support and the starting state
+void beginDynamicResolution(); // Direct the scene at the offscreen target
+void endDynamicResolution(); // Stretch the scene over the window and adjust the scale
+void resetDynamicResolutionStats(); // Forget the decisions made so far
 void keyboard(unsigned char key, int x, int y); // Key press handler
+int applyViewKey(int key, int special); // Camera and overlay keys
+void recordViewInput(int key, int special); // Append a view key to --record
 void specialKeys(int key, int x, int y); // Special key handler
 void init();                // Initialize OpenGL
 void reshape(int w, int h); // Window resize handler
-void timer(int value);      // Animation timer
+void idle();                // Advance time and request a redraw
+void buildSceneCache();     // Record static geometry into the cache
+void drawSceneCache();      // Draw the cached static geometry
+void invalidateSceneCache(); // Force a cache rebuild on next draw
+void drawStaticScene();     // Draw terrain, cabin and trees
+void initForest();          // Build tree meshes and pick a render path
+void initTerrain();         // Index lists, height table and generator threads
+void initTerrainHeights();  // Height table around the origin
+void buildTreeMeshes(MeshBuilder* lods); // Record the tree at each detail level
+void generateForest(Forest* f, int count, unsigned int seed); // Place trees
+void loadForestScene(Forest* f); // Take the trees from the scene file
+void updateForestView(Forest* f); // Rebuild the forest after trees are planted or felled
+void resizeForest(int direction); // Plant or fell a tenth of the trees
+const SceneObject* sceneObject(SceneObjectKind kind); // Object of a kind in the scene file
+void drawForest();          // Draw all visible trees
+void indexStaticObjects();  // Rebuild the cabin and forest hierarchy
+void mouse(int button, int state, int x, int y); // Mouse click handler
+void pickAt(int x, int y);  // Identify the object under a window position
+void updatePeopleIndex();   // Refit or rebuild the crowd's hierarchy
+void drawVisiblePerson(void* ctx, int item); // Add a person that survived culling to the crowd
+void beginCrowdSkinning();  // Start collecting the villagers in view
+void addSkinnedPerson(const Person* p); // Add a villager to the crowd skinned this frame
+void skinCrowd();           // Pose and skin the collected villagers
+void drawSkinnedCrowd();    // Draw the villagers skinned by the last skinCrowd()
+void initOcclusion();       // Occluder meshes and the rasterizer thread
+void rasterizeOccluders(Occlusion* o); // Redraw the occlusion buffer
+void updateOccluderGrid(Occlusion* o); // Follow the camera with the terrain occluders
+void beginOcclusion();      // Queue the occlusion buffer for the loaded camera
+int waitOcclusion();        // Finish the buffer; 1 if views should be tested
+int boxOccluded(const float* min, const float* max); // Box hidden behind the occluders
+void drawForestView(const ViewFrustum* view); // Draw the trees inside a view volume
+void drawForestChunks(Forest* f); // Draw the trees of the classified chunks
+void drawTerrainView(const ViewFrustum* view); // Draw the terrain inside a view volume
+void drawTerrainChunks(const TerrainDraw* draws, int count); // Draw culled terrain chunks
+void initShadows();         // Shadow maps and the receiver shader
+void drawShadows();         // Update the shadow maps and darken the receivers
+int updateShadows(const GLfloat* camera, const GLfloat* projection); // Update the shadow maps only
+void initLights(int count, unsigned int seed); // Place the cabin lights and lanterns
+void gatherLights(PointLight* out); // Copy the light entities out
+void updateLightView();     // Rebuild the light arrays after lanterns come or go
+void resizeLanterns(int direction); // Add or take away a tenth of the lanterns
+void queueLanterns();       // Queue the lantern posts and lamps
+void initLightPass();       // Light textures and the clustered receiver shader
+void drawPointLights();     // Bin the point lights and add them to the receivers
+int beginParticleStep(void* ctx, float dt); // Start advancing rain/snow
+void particleJob(void* ctx, int begin, int end); // Integrate chunks of particles
+void finishParticleStep(void* ctx); // Respawn the particles that landed
+void initCrowdObstacles();  // Index tree trunks for crowd avoidance
+void parallelFor(int count, int grain, ParallelFn fn, void* ctx); // Run jobs on the worker pool
+void drawPrimitive(PrimitiveKind kind, float a, int slices, int stacks); // Solids from the mesh library
+void queuePrimitive(PrimitiveKind kind, float a, int slices, int stacks); // Add a solid to the render queue
+void initRenderQueue();     // Pick the render queue's draw path
+void renderQueueBegin();    // Start queueing geom* solids
+void renderQueueFlush();    // Sort and draw the queued solids
+void renderQueuePack();     // Sort the queued solids without drawing them
+int renderQueueDraw(RenderQueue* q); // Draw the last flush again
+void captureFrame();        // Queue the rendered frame for the capture writer
+void finishCapture();       // Write the frames in flight and close the capture
+void stopCaptureWriter();   // Drain the capture queue and close the output
+void* captureWriterMain(void* arg); // Capture writer thread
+void geomSolidCube(float size); // Solid shapes that can also be recorded
+void geomSolidSphere(float radius, int slices, int stacks);
+void geomPushMatrix();       // Transforms and colors that can also be recorded or queued
+void geomPopMatrix();
+void geomTranslatef(float x, float y, float z);
+void geomColor4f(float r, float g, float b, float a);
+void acquireSnapshot();     // Switch display() to the newest snapshot
+void postSimCommand(SimCommandType type, int arg); // Queue input for the simulation
+void profileBegin(ProfilePass pass); // Start timing a render pass
+void profileEnd(ProfilePass pass);   // Stop timing a render pass
+void allocSnapshots();      // Size the snapshots for the current counts
+void freeParticles(ParticlePool* p); // Release a particle pool
+void rngSeed(Rng* r, unsigned int seed, RngStream stream, unsigned long long index); // Start a stream
+float rngFloat(Rng* r);     // Uniform float in [0, 1)
+int rngRange(Rng* r, int n); // Uniform integer in [0, n)
+float latticeNoise(int x, int z, unsigned int seed); // Hash of a lattice point
+void replayViewInput(long long tick); // Apply recorded view keys up to a tick
 
 /**
- * Initialize character positions and states with random values
+ * Describe an archetype and the columns its components need
+ * @param id Archetype
+ * @param name Name for messages
+ * @param components Component mask
  */
-void initPeople() {
-    for (int i = 0; i < MAX_PEOPLE; i++) {
-        // Random position within scene bounds
-        people[i].x = (rand() % 30) - 15;  // X position (-15 to 15)
-        people[i].z = (rand() % 30) - 15;  // Z position (-15 to 15)
-        people[i].angle = rand() % 360;    // Random initial facing (0-360°)
-        people[i].speed = 0.02 + (rand() % 10) * 0.005; // Movement speed
-        people[i].state = rand() % 2;      // Random initial state
-        people[i].timer = rand() % 100;    // Random state timer
-        people[i].legAngle = 0;            // Start with legs straight
-        people[i].legDirection = 1;        // Initial leg swing direction
+void registerArchetype(ArchetypeId id, const char* name, unsigned int components) {
+    Archetype* a = &world.archetypes[id];
+    a->name = name;
+    a->components = components;
+    a->numColumns = 0;
+    for (int c = 0; c < ENTITY_COLUMNS; c++) {
+        if (!entityColumns[c].component || (entityColumns[c].component & components)) a->columns[a->numColumns++] = c;
     }
 }
 
 /**
- * Configure lighting based on time of day
- * Handles both day and night lighting scenarios
+ * Register the entity archetypes (once, before anything is spawned)
  */
-void updateLighting() {
-    // Lighting parameters
-    GLfloat ambientDay[] = {0.4, 0.4, 0.4, 1.0};    // Full daylight ambient
-    GLfloat diffuseDay[] = {1.0, 1.0, 0.8, 1.0};    // Daylight diffuse
-    GLfloat ambientNight[] = {lightFlicker, lightFlicker, 0.5, 1.0}; // Flickering night
-    GLfloat diffuseNight[] = {0.2, 0.2, 0.4, 1.0};  // Moonlight
-    
-    // Light source position (follows sun/moon)
-    GLfloat position[] = {cos(sunAngle) * 30, sin(sunAngle) * 30, 0.0, 0.0};
-    glLightfv(GL_LIGHT0, GL_POSITION, position);
-    
-    if (isDay) {
-        // Daytime configuration
-        glClearColor(
-            0.5 + 0.3 * cos(sunAngle),  // Dynamic sky color based on sun position
-            0.7 + 0.2 * sin(sunAngle), 
-            1.0,  // Blue component
-            1.0   // Alpha
-        );
-        glLightfv(GL_LIGHT0, GL_AMBIENT, ambientDay);
-        glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuseDay);
-    } else {
-        // Nighttime configuration
-        glClearColor(0.1, 0.1, 0.2, 1.0);  // Dark blue night sky
-        glLightfv(GL_LIGHT0, GL_AMBIENT, ambientNight);
-        glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuseNight);
+void initWorld() {
+    registerArchetype(ARCHETYPE_VILLAGER, "villager", COMPONENT_POSITION | COMPONENT_HEADING | COMPONENT_GAIT |
+                      COMPONENT_BEHAVIOR | COMPONENT_HISTORY | COMPONENT_RANDOM);
+    registerArchetype(ARCHETYPE_TREE, "tree", COMPONENT_POSITION | COMPONENT_SIZE);
+    registerArchetype(ARCHETYPE_LIGHT, "light", COMPONENT_POSITION | COMPONENT_EMITTER);
+    registerArchetype(ARCHETYPE_CLOUD, "cloud", COMPONENT_POSITION | COMPONENT_SIZE | COMPONENT_CLOUD);
+}
+
+/**
+ * Allocate a chunk's columns as one block, each column 32-byte aligned
+ * @param a Archetype the chunk belongs to
+ * @param c Chunk to fill in
+ */
+void allocEntityChunk(const Archetype* a, EntityChunk* c) {
+    size_t bytes = 0;
+    for (int k = 0; k < a->numColumns; k++) bytes += ENTITY_CHUNK_ROWS * entityColumns[a->columns[k]].size;
+    void* mem;
+    if (posix_memalign(&mem, 32, bytes) != 0) {
+        fprintf(stderr, "Out of memory allocating %s entities\n", a->name);
+        exit(1);
+    }
+    c->memory = mem;
+    memset(c->columns, 0, sizeof(c->columns));
+    for (int k = 0, offset = 0; k < a->numColumns; k++) {
+        c->columns[a->columns[k]] = c->memory + offset;
+        offset += ENTITY_CHUNK_ROWS * entityColumns[a->columns[k]].size;
     }
 }
 
 /**
- * Render precipitation based on current weather mode
- * Draws either rain (blue lines) or snow (white lines)
+ * Make sure one of an archetype's chunk arrays has enough chunks
+ * @param a Archetype
+ * @param spare 0 for its rows, 1 for the reorder target
+ * @param needed Chunks required
  */
-void drawRainOrSnow() {
-    glBegin(GL_LINES);  // Draw precipitation as vertical lines
-    
-    for (int i = 0; i < 300; i++) {  // 300 particles
-        // Random particle position
-        float x = (rand() % 100 - 50);  // X position (-50 to 50)
-        float y = rand() % 20 + 5;      // Y position (5 to 25)
-        float z = (rand() % 100 - 50);  // Z position (-50 to 50)
-        
-        // Set color based on weather mode
-        if (weatherMode == 1) 
-            glColor3f(0.5, 0.5, 1.0);  // Blue for rain
-        else 
-            glColor3f(1.0, 1.0, 1.0);  // White for snow
-        
-        // Draw particle as vertical line
-        glVertex3f(x, y, z);         // Top point
-        glVertex3f(x, y - 1.5, z);   // Bottom point
+void reserveEntityChunks(Archetype* a, int spare, int needed) {
+    if (needed > a->maxChunks) {
+        int capacity = a->maxChunks ? a->maxChunks : 16;
+        while (capacity < needed) capacity *= 2;
+        EntityChunk* chunks = realloc(a->chunks, capacity * sizeof(EntityChunk));
+        if (chunks) a->chunks = chunks;
+        EntityChunk* spares = chunks ? realloc(a->spare, capacity * sizeof(EntityChunk)) : NULL;
+        if (!spares) {
+            fprintf(stderr, "Out of memory allocating %s entities\n", a->name);
+            exit(1);
+        }
+        a->spare = spares;
+        a->maxChunks = capacity;
     }
-    glEnd();
+    EntityChunk* chunks = spare ? a->spare : a->chunks;
+    int* allocated = spare ? &a->numSpare : &a->numChunks;
+    for (; *allocated < needed; (*allocated)++) allocEntityChunk(a, &chunks[*allocated]);
+}
+
+/* Chunks holding an archetype's rows */
+int usedChunks(const Archetype* a) {
+    return (a->count + ENTITY_CHUNK_ROWS - 1) >> ENTITY_CHUNK_SHIFT;
+}
+
+/* Rows in use in one of an archetype's chunks */
+int chunkRows(const Archetype* a, int chunk) {
+    int rows = a->count - (chunk << ENTITY_CHUNK_SHIFT);
+    return rows < ENTITY_CHUNK_ROWS ? rows : ENTITY_CHUNK_ROWS;
+}
+
+/* Address of one row's value in a column */
+void* entityField(const Archetype* a, int row, EntityColumn column) {
+    return (char*)a->chunks[row >> ENTITY_CHUNK_SHIFT].columns[column] + (row & ENTITY_ROW_MASK) * entityColumns[column].size;
 }
 
 /**
- * Configure and enable fog effects
- * Uses linear fog density for realistic atmospheric perspective
+ * Add an entity at the end of its archetype's rows, reusing the most
+ * recently freed slot if there is one
+ * @param id Archetype
+ * @return Handle of the new entity
+ */
+Entity spawnEntity(ArchetypeId id) {
+    World* w = &world;
+    int slot;
+    if (w->numFree) {
+        slot = w->freeSlots[--w->numFree];
+    } else {
+        if (w->numSlots == MAX_ENTITIES) {
+            fprintf(stderr, "Too many entities (at most %d)\n", MAX_ENTITIES);
+            exit(1);
+        }
+        if (w->numSlots == w->maxSlots) {
+            int capacity = w->maxSlots ? w->maxSlots * 2 : 1024;
+            unsigned int* generation = realloc(w->generation, capacity * sizeof(unsigned int));
+            if (generation) w->generation = generation;
+            unsigned char* archetypes = realloc(w->slotArchetype, capacity);
+            if (archetypes) w->slotArchetype = archetypes;
+            int* rows = realloc(w->slotRow, capacity * sizeof(int));
+            if (rows) w->slotRow = rows;
+            int* freeSlots = realloc(w->freeSlots, capacity * sizeof(int));
+            if (freeSlots) w->freeSlots = freeSlots;
+            if (!generation || !archetypes || !rows || !freeSlots) {
+                fprintf(stderr, "Out of memory allocating %d entities\n", capacity);
+                exit(1);
+            }
+            w->maxSlots = capacity;
+        }
+        slot = w->numSlots++;
+        w->generation[slot] = 0;
+    }
+
+    Archetype* a = &w->archetypes[id];
+    int row = a->count++;
+    reserveEntityChunks(a, 0, (row >> ENTITY_CHUNK_SHIFT) + 1);
+    Entity e = slot | w->generation[slot] << ENTITY_SLOT_BITS;
+    *(Entity*)entityField(a, row, COLUMN_ENTITY) = e;
+    w->slotArchetype[slot] = id;
+    w->slotRow[slot] = row;
+    a->version++;
+    return e;
+}
+
+/* Entities of every archetype alive now */
+int liveEntities() {
+    return world.numSlots - world.numFree;
+}
+
+/* Whether a handle still names a live entity */
+int entityAlive(Entity e) {
+    int slot = e & ENTITY_SLOT_MASK;
+    return slot < world.numSlots && world.generation[slot] == e >> ENTITY_SLOT_BITS;
+}
+
+/**
+ * Remove an entity: the last row of its archetype moves into its place
+ * and its slot is freed for reuse
+ * @param e Entity (ignored if already despawned)
+ */
+void despawnEntity(Entity e) {
+    if (!entityAlive(e)) return;
+    World* w = &world;
+    int slot = e & ENTITY_SLOT_MASK;
+    Archetype* a = &w->archetypes[w->slotArchetype[slot]];
+    int row = w->slotRow[slot], last = --a->count;
+    if (row != last) {
+        for (int k = 0; k < a->numColumns; k++) {
+            int c = a->columns[k];
+            memcpy(entityField(a, row, c), entityField(a, last, c), entityColumns[c].size);
+        }
+        w->slotRow[*(Entity*)entityField(a, row, COLUMN_ENTITY) & ENTITY_SLOT_MASK] = row;
+    }
+    w->generation[slot] = (w->generation[slot] + 1) & ENTITY_GENERATION_MASK;
+    w->freeSlots[w->numFree++] = slot;
+    a->version++;
+}
+
+/**
+ * Despawn every entity of an archetype (its chunks are kept)
+ * @param id Archetype
+ */
+void clearArchetype(ArchetypeId id) {
+    Archetype* a = &world.archetypes[id];
+    while (a->count) despawnEntity(*(Entity*)entityField(a, a->count - 1, COLUMN_ENTITY));
+}
+
+/**
+ * Get an archetype ready to have its rows reordered by permuteColumns()
+ * @param id Archetype
+ * @return Columns to reorder (work items for permuteColumns())
+ */
+int beginPermute(ArchetypeId id) {
+    Archetype* a = &world.archetypes[id];
+    reserveEntityChunks(a, 1, usedChunks(a));
+    return a->count ? a->numColumns : 0;
+}
+
+/**
+ * Gather some of an archetype's columns into the reorder target
+ * Columns are independent, so they can be reordered in parallel.
+ * @param id Archetype
+ * @param order Row that moves to each position
+ * @param begin,end Range of the archetype's columns
+ */
+void permuteColumns(ArchetypeId id, const int* order, int begin, int end) {
+    Archetype* a = &world.archetypes[id];
+    for (int k = begin; k < end; k++) {
+        int column = a->columns[k];
+        size_t size = entityColumns[column].size;
+        for (int chunk = 0, row = 0; row < a->count; chunk++) {
+            char* out = a->spare[chunk].columns[column];
+            int rows = chunkRows(a, chunk);
+            for (int r = 0; r < rows; r++, row++) {
+                const char* in = entityField(a, order[row], column);
+                if (size == 4) ((unsigned int*)out)[r] = *(const unsigned int*)in;
+                else memcpy(out + r * size, in, size);
+            }
+        }
+    }
+}
+
+/**
+ * Swap in the reordered rows and update where each slot lives
+ * @param id Archetype
+ */
+void endPermute(ArchetypeId id) {
+    Archetype* a = &world.archetypes[id];
+    EntityChunk* chunks = a->chunks;
+    int numChunks = a->numChunks;
+    a->chunks = a->spare;
+    a->numChunks = a->numSpare;
+    a->spare = chunks;
+    a->numSpare = numChunks;
+    for (int chunk = 0, row = 0; row < a->count; chunk++) {
+        const Entity* entities = a->chunks[chunk].columns[COLUMN_ENTITY];
+        int rows = chunkRows(a, chunk);
+        for (int r = 0; r < rows; r++, row++) world.slotRow[entities[r] & ENTITY_SLOT_MASK] = row;
+    }
+}
+
+/**
+ * Find a chunk's villager columns
+ * @param c Chunk of the villager archetype
+ * @param v Receives the column pointers
+ */
+void villagerColumns(const EntityChunk* c, VillagerColumns* v) {
+    v->x = c->columns[COLUMN_X];
+    v->y = c->columns[COLUMN_Y];
+    v->z = c->columns[COLUMN_Z];
+    v->angle = c->columns[COLUMN_ANGLE];
+    v->speed = c->columns[COLUMN_SPEED];
+    v->legAngle = c->columns[COLUMN_LEG_ANGLE];
+    v->legDirection = c->columns[COLUMN_LEG_DIRECTION];
+    v->state = c->columns[COLUMN_STATE];
+    v->timer = c->columns[COLUMN_TIMER];
+    v->round = c->columns[COLUMN_ROUND];
+    v->rng = c->columns[COLUMN_RNG];
+}
+
+/**
+ * Initialize character positions and states with random values
+ */
+void initPeople() {
+    // Walking area grows with the crowd to keep density reasonable
+    crowd.bound = fmaxf(20.0f, sqrtf(numPeople / CROWD_DENSITY) / 2.0f);
+    rngSeed(&crowd.spawnRng, sceneSeed, RNG_STREAM_PEOPLE, 0);
+    crowd.spawned = 0;
+    crowd.round = 0;
+
+    clearArchetype(ARCHETYPE_VILLAGER);
+    spawnVillagers(numPeople);
+}
+
+/**
+ * Spawn villagers at random spots in the walking area, outside the cabin
+ * Layout comes from the crowd's spawn stream; each villager also gets a
+ * behavior stream of its own.
+ * @param count Villagers to add
+ */
+void spawnVillagers(int count) {
+    const Archetype* a = &world.archetypes[ARCHETYPE_VILLAGER];
+    float spawn = crowd.bound * 0.75f;
+    Rng* rng = &crowd.spawnRng;
+
+    for (int i = 0; i < count; i++) {
+        spawnEntity(ARCHETYPE_VILLAGER);
+        int row = a->count - 1, r = row & ENTITY_ROW_MASK;
+        VillagerColumns v;
+        villagerColumns(&a->chunks[row >> ENTITY_CHUNK_SHIFT], &v);
+        float* prevX = a->chunks[row >> ENTITY_CHUNK_SHIFT].columns[COLUMN_PREV_X];
+        float* prevY = a->chunks[row >> ENTITY_CHUNK_SHIFT].columns[COLUMN_PREV_Y];
+        float* prevZ = a->chunks[row >> ENTITY_CHUNK_SHIFT].columns[COLUMN_PREV_Z];
+        float* prevAngle = a->chunks[row >> ENTITY_CHUNK_SHIFT].columns[COLUMN_PREV_ANGLE];
+        float* prevLegAngle = a->chunks[row >> ENTITY_CHUNK_SHIFT].columns[COLUMN_PREV_LEG_ANGLE];
+
+        // Random position within scene bounds, outside the cabin
+        do {
+            v.x[r] = layout.clearingX + (rngFloat(rng) * 2.0f - 1.0f) * spawn; // -15 to 15 around the clearing by default
+            v.z[r] = layout.clearingZ + (rngFloat(rng) * 2.0f - 1.0f) * spawn;
+        } while (fabsf(v.x[r] - layout.cabinX) < CABIN_HALF_WIDTH + 0.5f &&
+                 fabsf(v.z[r] - layout.cabinZ) < CABIN_HALF_DEPTH + 0.5f);
+        v.angle[r] = rngRange(rng, 360); // Random initial facing (0-360°)
+        v.speed[r] = 1.2 + rngRange(rng, 10) * 0.3; // Movement speed
+        v.state[r] = rngRange(rng, 2); // Random initial state
+        v.timer[r] = rngFloat(rng) * PERSON_IDLE_TIME; // Random state timer
+        v.round[r] = crowd.round - 1;   // Due in the current round
+        v.legAngle[r] = 0;              // Start with legs straight
+        v.legDirection[r] = 1;          // Initial leg swing direction
+        v.y[r] = terrainHeight(v.x[r], v.z[r]);
+        prevX[r] = v.x[r];
+        prevY[r] = v.y[r];
+        prevZ[r] = v.z[r];
+        prevAngle[r] = v.angle[r];
+        prevLegAngle[r] = 0;
+        rngSeed(&v.rng[r], sceneSeed, RNG_STREAM_PERSON, crowd.spawned++);
+    }
+    numPeople = a->count;
+}
+
+/**
+ * Despawn villagers picked at random from the crowd's spawn stream
+ * @param count Villagers to remove
+ */
+void despawnVillagers(int count) {
+    const Archetype* a = &world.archetypes[ARCHETYPE_VILLAGER];
+    for (int i = 0; i < count && a->count; i++) {
+        despawnEntity(*(Entity*)entityField(a, rngRange(&crowd.spawnRng, a->count), COLUMN_ENTITY));
+    }
+    numPeople = a->count;
+}
+
+/**
+ * Grow or shrink the crowd by a tenth (at least one villager, and never
+ * below one)
+ * @param direction 1 to spawn, -1 to despawn
+ */
+void resizeCrowd(int direction) {
+    int step = numPeople / 10 > 1 ? numPeople / 10 : 1;
+    if (direction > 0 && liveEntities() + step <= MAX_ENTITIES) spawnVillagers(step);
+    if (direction < 0) despawnVillagers(step < numPeople ? step : numPeople - 1);
+}
+
+/**
+ * Configure lighting based on time of day
+ * Handles both day and night lighting scenarios
+ */
+void updateLighting() {
+    // Lighting parameters
+    GLfloat ambientDay[] = {0.4, 0.4, 0.4, 1.0};    // Full daylight ambient
+    GLfloat diffuseDay[] = {1.0, 1.0, 0.8, 1.0};    // Daylight diffuse
+    GLfloat ambientNight[] = {frame->lightFlicker, frame->lightFlicker, 0.5, 1.0}; // Flickering night
+    GLfloat diffuseNight[] = {0.2, 0.2, 0.4, 1.0};  // Moonlight
+    
+    // Light source position (follows sun/moon)
+    GLfloat position[] = {cos(viewSunAngle) * 30, sin(viewSunAngle) * 30, 0.0, 0.0};
+    glLightfv(GL_LIGHT0, GL_POSITION, position);
+    
+    if (frame->isDay) {
+        // Daytime configuration
+        glClearColor(
+            0.5 + 0.3 * cos(viewSunAngle),  // Dynamic sky color based on sun position
+            0.7 + 0.2 * sin(viewSunAngle), 
+            1.0,  // Blue component
+            1.0   // Alpha
+        );
+        glLightfv(GL_LIGHT0, GL_AMBIENT, ambientDay);
+        glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuseDay);
+    } else {
+        // Nighttime configuration
+        glClearColor(0.1, 0.1, 0.2, 1.0);  // Dark blue night sky
+        glLightfv(GL_LIGHT0, GL_AMBIENT, ambientNight);
+        glLightfv(GL_LIGHT0, GL_DIFFUSE, diffuseNight);
+    }
+}
+
+/**
+ * Configure and enable fog effects
+ * Uses linear fog density for realistic atmospheric perspective
  */
 void drawFog() {
     GLfloat fogColor[] = {0.8, 0.8, 0.8, 1.0}; // Gray fog color
@@ -162,487 +2056,8502 @@ void drawFog() {
 }
 
 /**
- * Render smoke effect from cabin chimney
- * Uses animated sphere with transparency
+ * Check the OpenGL version of the current context
+ * @param major Required major version
+ * @param minor Required minor version
+ * @return 1 if the context is at least major.minor
+ */
+int glVersionAtLeast(int major, int minor) {
+    const char* version = (const char*)glGetString(GL_VERSION);
+    int maj = 0, min = 0;
+    if (!version || sscanf(version, "%d.%d", &maj, &min) != 2) return 0;
+    return maj > major || (maj == major && min >= minor);
+}
+
+/**
+ * Reset a mesh builder to an empty mesh with identity transform
+ * @param m Builder to reset (storage is kept for reuse)
+ */
+void meshReset(MeshBuilder* m) {
+    m->numVerts = 0;
+    m->numIndices = 0;
+    m->depth = 0;
+    m->primCount = 0;
+    memset(m->matrix[0], 0, sizeof(m->matrix[0]));
+    m->matrix[0][0] = m->matrix[0][5] = m->matrix[0][10] = m->matrix[0][15] = 1.0;
+    m->color[0] = m->color[1] = m->color[2] = m->color[3] = 255;
+}
+
+/**
+ * Release the storage owned by a mesh builder
+ * @param m Builder to free
+ */
+void meshFree(MeshBuilder* m) {
+    free(m->verts);
+    free(m->indices);
+    m->verts = NULL;
+    m->indices = NULL;
+    m->maxVerts = m->maxIndices = 0;
+    meshReset(m);
+}
+
+/**
+ * Grow a dynamic array so it can hold at least one more element
+ * @param data Pointer to the array pointer
+ * @param count Elements currently stored
+ * @param capacity Pointer to the element capacity
+ * @param size Size of one element in bytes
+ */
+void growArray(void** data, int count, int* capacity, size_t size) {
+    if (count < *capacity) return;
+    int newCapacity = *capacity ? *capacity * 2 : 256;
+    void* grown = realloc(*data, newCapacity * size);
+    if (!grown) {
+        fprintf(stderr, "Out of memory growing geometry buffer\n");
+        exit(1);
+    }
+    *data = grown;
+    *capacity = newCapacity;
+}
+
+/**
+ * Make room in a radix sorter for a number of keys
+ * @param s Sorter
+ * @param count Keys that will be sorted
+ */
+void reserveRadixSort(RadixSorter* s, int count) {
+    if (count <= s->capacity) return;
+    int capacity = s->capacity ? s->capacity : 256;
+    while (capacity < count) capacity *= 2;
+    for (int i = 0; i < 2; i++) {
+        unsigned int* keys = realloc(s->keys[i], capacity * sizeof(unsigned int));
+        if (keys) s->keys[i] = keys;
+        int* values = realloc(s->values[i], capacity * sizeof(int));
+        if (values) s->values[i] = values;
+        if (!keys || !values) {
+            fprintf(stderr, "Out of memory sorting %d items\n", count);
+            exit(1);
+        }
+    }
+    s->capacity = capacity;
+}
+
+/**
+ * Sort key of a view-space depth
+ * Keys in ascending order put the most negative z, the farthest in front
+ * of the camera, first.
+ * @param z View-space z
+ * @return Key whose unsigned order matches the order of the floats
+ */
+unsigned int depthSortKey(float z) {
+    unsigned int bits;
+    memcpy(&bits, &z, sizeof(bits));
+    return bits ^ (bits >> 31 ? 0xffffffffu : 0x80000000u);
+}
+
+/**
+ * Sort a sorter's keys ascending, moving its values with them
+ * Least significant digit first, so equal keys keep their order; passes
+ * whose digit is the same for every key are skipped.
+ * @param s Sorter holding count keys and values in its first buffers
+ * @param count Number of keys
+ * @return Sorted values (one of the sorter's two value buffers)
+ */
+int* radixSort(RadixSorter* s, int count) {
+    unsigned int *keys = s->keys[0], *keysOut = s->keys[1];
+    int *values = s->values[0], *valuesOut = s->values[1];
+    if (count == 0) return values;
+
+    // One read of the keys counts the digits of all three passes
+    unsigned int counts[RADIX_PASSES][RADIX_BUCKETS];
+    memset(counts, 0, sizeof(counts));
+    for (int i = 0; i < count; i++) {
+        unsigned int k = keys[i];
+        counts[0][k & (RADIX_BUCKETS - 1)]++;
+        counts[1][(k >> RADIX_BITS) & (RADIX_BUCKETS - 1)]++;
+        counts[2][k >> (2 * RADIX_BITS)]++;
+    }
+    for (int pass = 0; pass < RADIX_PASSES; pass++) {
+        int shift = pass * RADIX_BITS;
+        unsigned int* c = counts[pass];
+        if (c[(keys[0] >> shift) & (RADIX_BUCKETS - 1)] == (unsigned int)count) continue;
+        unsigned int sum = 0;
+        for (int b = 0; b < RADIX_BUCKETS; b++) {
+            unsigned int n = c[b];
+            c[b] = sum;
+            sum += n;
+        }
+        for (int i = 0; i < count; i++) {
+            unsigned int k = keys[i], slot = c[(k >> shift) & (RADIX_BUCKETS - 1)]++;
+            keysOut[slot] = k;
+            valuesOut[slot] = values[i];
+        }
+        unsigned int* swapKeys = keys;
+        keys = keysOut;
+        keysOut = swapKeys;
+        int* swapValues = values;
+        values = valuesOut;
+        valuesOut = swapValues;
+    }
+    return values;
+}
+
+/**
+ * Post-multiply a transform in place, like glMultMatrixf
+ * @param c Column-major 4x4 matrix to update
+ * @param r Column-major 4x4 matrix
+ */
+void multMatrix(GLfloat* c, const GLfloat* r) {
+    GLfloat out[16];
+    for (int col = 0; col < 4; col++) {
+        for (int row = 0; row < 4; row++) {
+            out[col * 4 + row] = c[row] * r[col * 4] + c[4 + row] * r[col * 4 + 1] +
+                                 c[8 + row] * r[col * 4 + 2] + c[12 + row] * r[col * 4 + 3];
+        }
+    }
+    memcpy(c, out, sizeof(out));
+}
+
+/**
+ * Rotation about an axis through the origin, like glRotatef
+ * @param r Receives the column-major 4x4 matrix
+ * @param angle Degrees
+ * @param x,y,z Axis (not normalized; zero gives the identity)
+ */
+void rotationMatrix(GLfloat* r, float angle, float x, float y, float z) {
+    float len = sqrtf(x * x + y * y + z * z);
+    if (len > 0.0f) { x /= len; y /= len; z /= len; }
+    else angle = 0.0f;
+    float c = cosf(angle * M_PI / 180.0), s = sinf(angle * M_PI / 180.0), k = 1.0f - c;
+    GLfloat m[16] = {
+        x * x * k + c,     y * x * k + z * s, x * z * k - y * s, 0,
+        x * y * k - z * s, y * y * k + c,     y * z * k + x * s, 0,
+        x * z * k + y * s, y * z * k - x * s, z * z * k + c,     0,
+        0, 0, 0, 1
+    };
+    memcpy(r, m, sizeof(m));
+}
+
+/**
+ * Append a vertex transformed by the builder's current matrix
+ * @param m Builder being recorded into
+ * @param x,y,z Object-space position
+ * @param nx,ny,nz Object-space normal
+ * @return Index of the new vertex
+ */
+int meshAddVertex(MeshBuilder* m, float x, float y, float z, float nx, float ny, float nz) {
+    const GLfloat* t = m->matrix[m->depth];
+    growArray((void**)&m->verts, m->numVerts, &m->maxVerts, sizeof(MeshVertex));
+    MeshVertex* v = &m->verts[m->numVerts];
+
+    v->pos[0] = t[0] * x + t[4] * y + t[8] * z + t[12];
+    v->pos[1] = t[1] * x + t[5] * y + t[9] * z + t[13];
+    v->pos[2] = t[2] * x + t[6] * y + t[10] * z + t[14];
+
+    // Cofactor matrix keeps normals perpendicular under non-uniform scale
+    float cx = (t[5] * t[10] - t[6] * t[9]) * nx + (t[2] * t[9] - t[1] * t[10]) * ny + (t[1] * t[6] - t[2] * t[5]) * nz;
+    float cy = (t[6] * t[8] - t[4] * t[10]) * nx + (t[0] * t[10] - t[2] * t[8]) * ny + (t[2] * t[4] - t[0] * t[6]) * nz;
+    float cz = (t[4] * t[9] - t[5] * t[8]) * nx + (t[1] * t[8] - t[0] * t[9]) * ny + (t[0] * t[5] - t[1] * t[4]) * nz;
+    float len = sqrtf(cx * cx + cy * cy + cz * cz);
+    if (len > 0.0f) { cx /= len; cy /= len; cz /= len; }
+    v->normal[0] = cx;
+    v->normal[1] = cy;
+    v->normal[2] = cz;
+
+    memcpy(v->color, m->color, sizeof(v->color));
+    return m->numVerts++;
+}
+
+/**
+ * Append one triangle to the index list
+ * @param m Builder being recorded into
+ * @param a,b,c Vertex indices in counter-clockwise order
+ */
+void meshAddTriangle(MeshBuilder* m, int a, int b, int c) {
+    for (int i = 0; i < 3; i++) {
+        growArray((void**)&m->indices, m->numIndices, &m->maxIndices, sizeof(GLuint));
+        m->indices[m->numIndices++] = (i == 0) ? a : (i == 1) ? b : c;
+    }
+}
+
+/**
+ * Unit normal of a counter-clockwise triangle
+ * @param p0,p1,p2 Corners
+ * @param n Receives the normal (zero for a degenerate triangle)
+ */
+void faceNormal(const GLfloat* p0, const GLfloat* p1, const GLfloat* p2, GLfloat* n) {
+    float e1[3] = {p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]};
+    float e2[3] = {p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]};
+    n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+    float len = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    if (len > 0.0f) { n[0] /= len; n[1] /= len; n[2] /= len; }
+}
+
+/**
+ * Replace the normals of a just-recorded polygon with its face normal
+ * @param m Builder being recorded into
+ * @param first Index of the polygon's first vertex
+ * @param count Number of vertices in the polygon (3 or 4)
+ */
+void meshFlatNormal(MeshBuilder* m, int first, int count) {
+    GLfloat n[3];
+    faceNormal(m->verts[first].pos, m->verts[first + 1].pos, m->verts[first + 2].pos, n);
+    for (int i = 0; i < count; i++) memcpy(m->verts[first + i].normal, n, sizeof(n));
+}
+
+/**
+ * Append a cube centered at the origin, matching glutSolidCube
+ * @param m Builder being recorded into
+ * @param size Edge length
+ */
+void meshCube(MeshBuilder* m, float size) {
+    // Face normal and tangent; bitangent is normal x tangent
+    static const float faces[6][2][3] = {
+        {{1, 0, 0}, {0, 1, 0}}, {{-1, 0, 0}, {0, 0, 1}},
+        {{0, 1, 0}, {0, 0, 1}}, {{0, -1, 0}, {1, 0, 0}},
+        {{0, 0, 1}, {1, 0, 0}}, {{0, 0, -1}, {0, 1, 0}}
+    };
+    static const float corners[4][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, 1}};
+    float h = size / 2.0f;
+
+    for (int f = 0; f < 6; f++) {
+        const float* n = faces[f][0];
+        const float* u = faces[f][1];
+        float v[3] = {n[1] * u[2] - n[2] * u[1], n[2] * u[0] - n[0] * u[2], n[0] * u[1] - n[1] * u[0]};
+        int first = m->numVerts;
+        for (int c = 0; c < 4; c++) {
+            float a = corners[c][0], b = corners[c][1];
+            meshAddVertex(m, (n[0] + a * u[0] + b * v[0]) * h, (n[1] + a * u[1] + b * v[1]) * h,
+                          (n[2] + a * u[2] + b * v[2]) * h, n[0], n[1], n[2]);
+        }
+        meshAddTriangle(m, first, first + 1, first + 2);
+        meshAddTriangle(m, first, first + 2, first + 3);
+    }
+}
+
+/**
+ * Append a sphere centered at the origin, matching glutSolidSphere
+ * @param m Builder being recorded into
+ * @param radius Sphere radius
+ * @param slices Subdivisions around the Z axis
+ * @param stacks Subdivisions along the Z axis
+ */
+void meshSphere(MeshBuilder* m, float radius, int slices, int stacks) {
+    int first = m->numVerts;
+    for (int i = 0; i <= stacks; i++) {
+        float phi = M_PI * i / stacks;
+        for (int j = 0; j <= slices; j++) {
+            float theta = 2.0 * M_PI * j / slices;
+            float nx = sinf(phi) * cosf(theta), ny = sinf(phi) * sinf(theta), nz = cosf(phi);
+            meshAddVertex(m, nx * radius, ny * radius, nz * radius, nx, ny, nz);
+        }
+    }
+    for (int i = 0; i < stacks; i++) {
+        for (int j = 0; j < slices; j++) {
+            int v00 = first + i * (slices + 1) + j, v01 = v00 + 1;
+            int v10 = v00 + slices + 1, v11 = v10 + 1;
+            meshAddTriangle(m, v00, v10, v11);
+            meshAddTriangle(m, v00, v11, v01);
+        }
+    }
+}
+
+/* PRIMITIVE MESH LIBRARY */
+
+/**
+ * Find or build the cached meshes for a shape
+ * Each level is appended to one mesh and uploaded once.
+ * @param kind Shape
+ * @param a Cube size or sphere radius
+ * @param slices,stacks Tessellation requested (unused for cubes)
+ * @return Cache entry (moves when a new shape is added; keep its index)
+ */
+CachedPrimitive* findPrimitive(PrimitiveKind kind, float a, int slices, int stacks) {
+    for (int i = 0; i < numCachedPrimitives; i++) {
+        CachedPrimitive* e = &primitiveCache[i];
+        if (e->kind == kind && e->a == a && e->slices == slices && e->stacks == stacks) return e;
+    }
+
+    // New shape: grow the cache rather than evict one that queued items still name
+    growArray((void**)&primitiveCache, numCachedPrimitives, &maxCachedPrimitives, sizeof(CachedPrimitive));
+    CachedPrimitive* c = &primitiveCache[numCachedPrimitives++];
+    memset(c, 0, sizeof(*c));
+    c->kind = kind;
+    c->a = a;
+    c->slices = slices;
+    c->stacks = stacks;
+    c->levels = kind == PRIMITIVE_CUBE ? 1 : PRIMITIVE_LODS;
+    meshReset(&c->mesh);
+    for (int lod = 0; lod < c->levels; lod++) {
+        // Level 1 is what the caller asked for; level 0 doubles it for close-ups
+        int levelSlices = lod ? slices >> (lod - 1) : slices * 2;
+        int levelStacks = lod ? stacks >> (lod - 1) : stacks * 2;
+        if (levelSlices < PRIMITIVE_MIN_SLICES) levelSlices = PRIMITIVE_MIN_SLICES;
+        if (levelStacks < 2) levelStacks = 2;
+        c->levelSlices[lod] = levelSlices;
+        c->first[lod] = c->mesh.numIndices;
+        if (kind == PRIMITIVE_CUBE) meshCube(&c->mesh, a);
+        else meshSphere(&c->mesh, a, levelSlices, levelStacks);
+        c->count[lod] = c->mesh.numIndices - c->first[lod];
+    }
+
+    if (sceneCache.useBuffers) {
+        if (!c->vbo) glGenBuffers(1, &c->vbo);
+        if (!c->ibo) glGenBuffers(1, &c->ibo);
+        glBindBuffer(GL_ARRAY_BUFFER, c->vbo);
+        glBufferData(GL_ARRAY_BUFFER, c->mesh.numVerts * sizeof(MeshVertex), c->mesh.verts, GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, c->ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, c->mesh.numIndices * sizeof(GLuint), c->mesh.indices, GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+    return c;
+}
+
+/**
+ * Pick the coarsest level whose silhouette error stays under
+ * PRIMITIVE_MAX_ERROR pixels at the shape's current projected size
+ * A circle of radius r drawn with n segments is off by r(1 - cos(pi/n)).
+ * @param c Shape about to be drawn
+ * @param m Modelview matrix it will be drawn with
+ * @return Level
+ */
+int primitiveLevel(const CachedPrimitive* c, const GLfloat* m) {
+    if (c->levels == 1) return 0;
+
+    float scale = 0.0f; // Largest axis scale of the transform
+    for (int col = 0; col < 3; col++) {
+        scale = fmaxf(scale, m[col * 4] * m[col * 4] + m[col * 4 + 1] * m[col * 4 + 1] + m[col * 4 + 2] * m[col * 4 + 2]);
+    }
+    float dist = sqrtf(m[12] * m[12] + m[13] * m[13] + m[14] * m[14]);
+    float pixels = c->a * sqrtf(scale) * primitivePixelScale / fmaxf(dist, 0.1f);
+    if (pixels <= PRIMITIVE_MAX_ERROR) return c->levels - 1;
+
+    float needed = M_PI / acosf(1.0f - PRIMITIVE_MAX_ERROR / pixels);
+    for (int lod = c->levels - 1; lod > 0; lod--) {
+        if (c->levelSlices[lod] >= needed) return lod;
+    }
+    return 0;
+}
+
+/**
+ * Point the vertex and normal arrays at a library mesh
+ * @param c Shape to draw
+ * @return Base for glDrawElements index offsets (NULL with buffer objects)
+ */
+const char* bindPrimitive(const CachedPrimitive* c) {
+    const char* base = (const char*)c->mesh.verts;
+    const char* indices = (const char*)c->mesh.indices;
+    if (c->vbo) {
+        glBindBuffer(GL_ARRAY_BUFFER, c->vbo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, c->ibo);
+        base = indices = NULL;
+    }
+    glVertexPointer(3, GL_FLOAT, sizeof(MeshVertex), base + offsetof(MeshVertex, pos));
+    glNormalPointer(GL_FLOAT, sizeof(MeshVertex), base + offsetof(MeshVertex, normal));
+    return indices;
+}
+
+/**
+ * Draw a solid cube or sphere from the mesh library
+ * Matches glutSolid* output at the requested detail, uses the current
+ * color, and needs no window (so it also works headless)
+ * @param kind Shape
+ * @param a Cube size or sphere radius
+ * @param slices,stacks Tessellation (unused for cubes)
+ */
+void drawPrimitive(PrimitiveKind kind, float a, int slices, int stacks) {
+    CachedPrimitive* c = findPrimitive(kind, a, slices, stacks);
+    GLfloat m[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, m);
+    int lod = primitiveLevel(c, m);
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    const char* indices = bindPrimitive(c);
+    glDrawElements(GL_TRIANGLES, c->count[lod], GL_UNSIGNED_INT, indices + c->first[lod] * sizeof(GLuint));
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    if (c->vbo) {
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+    primitiveTriangles += c->count[lod] / 3;
+}
+
+/* GEOMETRY RECORDING
+ * The geom* functions mirror their OpenGL/GLUT counterparts. With geomTarget
+ * unset they draw in immediate mode; with it set they record into the builder
+ * so the same drawing code can populate the geometry cache. With geomQueue
+ * set instead, transforms and colors are tracked on the CPU and solids are
+ * queued for renderQueueFlush().
+ */
+
+/* CPU transform stack in use, or NULL when drawing through GL */
+GLfloat* geomMatrix() {
+    if (geomTarget) return geomTarget->matrix[geomTarget->depth];
+    if (geomQueue) return geomQueue->matrix[geomQueue->depth];
+    return NULL;
+}
+
+void geomBegin(GLenum mode) {
+    if (geomTarget) { geomTarget->mode = mode; geomTarget->primCount = 0; }
+    else { geomMode = mode; geomPolyCount = 0; glBegin(mode); }
+}
+
+void geomEnd() {
+    if (!geomTarget) glEnd();
+}
+
+void geomVertex3f(float x, float y, float z) {
+    if (!geomTarget) {
+        // Send each polygon with the same flat normal the recorder gives it
+        int polySize = (geomMode == GL_QUADS) ? 4 : 3;
+        GLfloat* p = geomPoly[geomPolyCount];
+        p[0] = x; p[1] = y; p[2] = z;
+        if (++geomPolyCount < polySize) return;
+        GLfloat n[3];
+        faceNormal(geomPoly[0], geomPoly[1], geomPoly[2], n);
+        glNormal3fv(n);
+        for (int i = 0; i < polySize; i++) glVertex3fv(geomPoly[i]);
+        geomPolyCount = 0;
+        return;
+    }
+
+    MeshBuilder* m = geomTarget;
+    int polySize = (m->mode == GL_QUADS) ? 4 : 3;
+    meshAddVertex(m, x, y, z, 0, 0, 1);
+    if (++m->primCount == polySize) {
+        int first = m->numVerts - polySize;
+        meshFlatNormal(m, first, polySize);
+        meshAddTriangle(m, first, first + 1, first + 2);
+        if (polySize == 4) meshAddTriangle(m, first, first + 2, first + 3);
+        m->primCount = 0;
+    }
+}
+
+void geomColor4f(float r, float g, float b, float a) {
+    GLubyte* c = geomTarget ? geomTarget->color : geomQueue ? geomQueue->color : NULL;
+    if (!c) { glColor4f(r, g, b, a); return; }
+    c[0] = (GLubyte)(r * 255.0f + 0.5f);
+    c[1] = (GLubyte)(g * 255.0f + 0.5f);
+    c[2] = (GLubyte)(b * 255.0f + 0.5f);
+    c[3] = (GLubyte)(a * 255.0f + 0.5f);
+}
+
+void geomColor3f(float r, float g, float b) {
+    geomColor4f(r, g, b, 1.0f);
+}
+
+void geomPushMatrix() {
+    GLfloat (*stack)[16];
+    int* depth;
+    if (geomTarget) { stack = geomTarget->matrix; depth = &geomTarget->depth; }
+    else if (geomQueue) { stack = geomQueue->matrix; depth = &geomQueue->depth; }
+    else { glPushMatrix(); return; }
+    if (*depth + 1 >= MESH_STACK_DEPTH) return;
+    memcpy(stack[*depth + 1], stack[*depth], sizeof(stack[0]));
+    (*depth)++;
+}
+
+void geomPopMatrix() {
+    int* depth = geomTarget ? &geomTarget->depth : geomQueue ? &geomQueue->depth : NULL;
+    if (!depth) { glPopMatrix(); return; }
+    if (*depth > 0) (*depth)--;
+}
+
+void geomTranslatef(float x, float y, float z) {
+    GLfloat* c = geomMatrix();
+    if (!c) { glTranslatef(x, y, z); return; }
+    GLfloat t[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, x, y, z, 1};
+    multMatrix(c, t);
+}
+
+void geomScalef(float x, float y, float z) {
+    GLfloat* c = geomMatrix();
+    if (!c) { glScalef(x, y, z); return; }
+    GLfloat s[16] = {x, 0, 0, 0, 0, y, 0, 0, 0, 0, z, 0, 0, 0, 0, 1};
+    multMatrix(c, s);
+}
+
+void geomSolidCube(float size) {
+    if (geomTarget) meshCube(geomTarget, size);
+    else if (geomQueue) queuePrimitive(PRIMITIVE_CUBE, size, 0, 0);
+    else drawPrimitive(PRIMITIVE_CUBE, size, 0, 0);
+}
+
+void geomSolidSphere(float radius, int slices, int stacks) {
+    if (geomTarget) meshSphere(geomTarget, radius, slices, stacks);
+    else if (geomQueue) queuePrimitive(PRIMITIVE_SPHERE, radius, slices, stacks);
+    else drawPrimitive(PRIMITIVE_SPHERE, radius, slices, stacks);
+}
+
+/**
+ * Render a cabin with detailed construction
+ * Includes walls, roof, chimney, door, and windows
+ */
+void drawCabin() {
+    geomPushMatrix();
+    geomTranslatef(layout.cabinX, 0.0, layout.cabinZ); // Stands on the clearing floor
+
+    // Cabin dimensions
+    float width = 4.0, height = 2.0, depth = 3.0, roofHeight = 1.5;
+    float halfW = width / 2.0, halfD = depth / 2.0;
+
+    /* WALLS - Wooden plank construction */
+    geomBegin(GL_QUADS);
+    for (float y = 0.0; y < height; y += 0.2) {
+        // Varying wood color for planks
+        geomColor3f(0.5 + fmod(y * 2, 0.4), 0.25, 0.1);
+
+        // Front wall
+        geomVertex3f(-halfW, y, halfD);
+        geomVertex3f(halfW, y, halfD);
+        geomVertex3f(halfW, y + 0.2, halfD);
+        geomVertex3f(-halfW, y + 0.2, halfD);
+
+        // Back wall
+        geomVertex3f(-halfW, y, -halfD);
+        geomVertex3f(halfW, y, -halfD);
+        geomVertex3f(halfW, y + 0.2, -halfD);
+        geomVertex3f(-halfW, y + 0.2, -halfD);
+
+        // Left wall
+        geomVertex3f(-halfW, y, -halfD);
+        geomVertex3f(-halfW, y, halfD);
+        geomVertex3f(-halfW, y + 0.2, halfD);
+        geomVertex3f(-halfW, y + 0.2, -halfD);
+
+        // Right wall
+        geomVertex3f(halfW, y, -halfD);
+        geomVertex3f(halfW, y, halfD);
+        geomVertex3f(halfW, y + 0.2, halfD);
+        geomVertex3f(halfW, y + 0.2, -halfD);
+    }
+    geomEnd();
+
+    /* FLOOR - Wooden planks */
+    geomColor3f(0.4, 0.2, 0.1); // Darker wood color
+    geomBegin(GL_QUADS);
+    geomVertex3f(-halfW, 0.0, -halfD);
+    geomVertex3f(halfW, 0.0, -halfD);
+    geomVertex3f(halfW, 0.0, halfD);
+    geomVertex3f(-halfW, 0.0, halfD);
+    geomEnd();
+
+    /* DOOR - Centered on front wall */
+    geomColor3f(0.3, 0.15, 0.05); // Brown door
+    geomBegin(GL_QUADS);
+    geomVertex3f(-0.5, 0.0, halfD + 0.01);  // Slightly in front of wall
+    geomVertex3f(0.5, 0.0, halfD + 0.01);
+    geomVertex3f(0.5, 1.2, halfD + 0.01);
+    geomVertex3f(-0.5, 1.2, halfD + 0.01);
+    geomEnd();
+
+    /* WINDOWS - On front wall */
+    geomColor3f(0.5, 0.8, 1.0); // Glass blue
+    geomBegin(GL_QUADS);
+    // Left window
+    geomVertex3f(-1.5, 1.0, halfD + 0.01);
+    geomVertex3f(-0.9, 1.0, halfD + 0.01);
+    geomVertex3f(-0.9, 1.5, halfD + 0.01);
+    geomVertex3f(-1.5, 1.5, halfD + 0.01);
+    // Right window
+    geomVertex3f(1.5, 1.0, halfD + 0.01);
+    geomVertex3f(0.9, 1.0, halfD + 0.01);
+    geomVertex3f(0.9, 1.5, halfD + 0.01);
+    geomVertex3f(1.5, 1.5, halfD + 0.01);
+    geomEnd();
+
+    /* ROOF - Gabled construction */
+    geomColor3f(0.4, 0.0, 0.0); // Dark red roof
+    // Front triangle
+    geomBegin(GL_TRIANGLES);
+    geomVertex3f(-halfW, height, halfD);
+    geomVertex3f(halfW, height, halfD);
+    geomVertex3f(0.0, height + roofHeight, halfD);
+    // Back triangle
+    geomVertex3f(-halfW, height, -halfD);
+    geomVertex3f(halfW, height, -halfD);
+    geomVertex3f(0.0, height + roofHeight, -halfD);
+    geomEnd();
+
+    // Roof sides
+    geomBegin(GL_QUADS);
+    // Left side
+    geomVertex3f(-halfW, height, -halfD);
+    geomVertex3f(-halfW, height, halfD);
+    geomVertex3f(0.0, height + roofHeight, halfD);
+    geomVertex3f(0.0, height + roofHeight, -halfD);
+    // Right side
+    geomVertex3f(halfW, height, -halfD);
+    geomVertex3f(halfW, height, halfD);
+    geomVertex3f(0.0, height + roofHeight, halfD);
+    geomVertex3f(0.0, height + roofHeight, -halfD);
+    geomEnd();
+
+    /* CHIMNEY - Brick structure */
+    geomPushMatrix();
+    geomTranslatef(-1.2, height + 0.5, -0.8); // Position on roof
+    geomColor3f(0.2, 0.2, 0.2); // Dark gray
+    geomScalef(0.3, 1.0, 0.3);  // Scale to chimney proportions
+    geomSolidCube(1.0);        // Simple cube chimney
+    geomPopMatrix();
+
+    geomPopMatrix();
+}
+
+/**
+ * Draw the cabin uncached under the same lighting state as drawSceneCache(),
+ * so toggling the cache only changes how the geometry is submitted
+ */
+void drawCabinImmediate() {
+    glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
+    drawCabin();
+    glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_FALSE);
+}
+
+/**
+ * Render a tree standing on the origin
+ * @param slices Foliage subdivisions around the vertical axis
+ * @param stacks Foliage subdivisions along the vertical axis
+ */
+void drawTreeShape(int slices, int stacks) {
+    /* TRUNK - Brown cylinder */
+    geomColor3f(0.4, 0.2, 0.1); // Brown wood
+    geomPushMatrix();
+    geomTranslatef(0, 1, 0);    // Raise trunk
+    geomScalef(0.2, 2, 0.2);    // Scale to trunk shape
+    geomSolidCube(1.0);        // Simple cube trunk
+    geomPopMatrix();
+
+    /* FOLIAGE - Green sphere */
+    geomColor3f(0.0, 0.6, 0.0); // Green leaves
+    geomPushMatrix();
+    geomTranslatef(0, 2.5, 0);  // Position foliage above trunk
+    geomSolidSphere(0.7, slices, stacks); // Spherical foliage
+    geomPopMatrix();
+}
+
+/**
+ * Draw indexed triangles from interleaved MeshVertex data
+ * @param base Start of the vertex data (NULL offset when a VBO is bound)
+ * @param indices Index data (offset when an index buffer is bound)
+ * @param count Number of indices to draw
+ */
+void drawMeshArrays(const char* base, const GLuint* indices, int count) {
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(MeshVertex), base + offsetof(MeshVertex, pos));
+    glNormalPointer(GL_FLOAT, sizeof(MeshVertex), base + offsetof(MeshVertex, normal));
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(MeshVertex), base + offsetof(MeshVertex, color));
+    glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, indices);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+/**
+ * Record the static scene (the cabin) and upload it
+ * into buffer objects, or a display list on GL 1.x drivers
+ */
+void buildSceneCache() {
+    MeshBuilder m = {0};
+    meshReset(&m);
+
+    // Run the regular drawing code in recording mode
+    geomTarget = &m;
+    drawCabin();
+    geomTarget = NULL;
+
+    if (sceneCache.useBuffers) {
+        if (!sceneCache.vbo) glGenBuffers(1, &sceneCache.vbo);
+        if (!sceneCache.ibo) glGenBuffers(1, &sceneCache.ibo);
+        glBindBuffer(GL_ARRAY_BUFFER, sceneCache.vbo);
+        glBufferData(GL_ARRAY_BUFFER, m.numVerts * sizeof(MeshVertex), m.verts, GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sceneCache.ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, m.numIndices * sizeof(GLuint), m.indices, GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    } else {
+        // Display list captures the client arrays at compile time
+        if (!sceneCache.list) sceneCache.list = glGenLists(1);
+        glNewList(sceneCache.list, GL_COMPILE);
+        drawMeshArrays((const char*)m.verts, m.indices, m.numIndices);
+        glEndList();
+    }
+
+    sceneCache.numIndices = m.numIndices;
+    sceneCache.dirty = 0;
+    meshFree(&m);
+}
+
+/**
+ * Draw the cached static scene in a single call
+ * Rebuilds the cache first if the scene has changed
+ */
+void drawSceneCache() {
+    if (sceneCache.dirty) buildSceneCache();
+
+    // Recorded walls use face winding as written, so light both sides
+    glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_TRUE);
+    if (sceneCache.useBuffers) {
+        glBindBuffer(GL_ARRAY_BUFFER, sceneCache.vbo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, sceneCache.ibo);
+        drawMeshArrays(NULL, NULL, sceneCache.numIndices);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    } else {
+        glCallList(sceneCache.list);
+    }
+    glLightModeli(GL_LIGHT_MODEL_TWO_SIDE, GL_FALSE);
+}
+
+/**
+ * Mark the static scene as changed so the cache is rebuilt on next draw
+ */
+void invalidateSceneCache() {
+    sceneCache.dirty = 1;
+}
+
+/**
+ * Draw every tree in immediate mode (cache off)
+ * Normals are renormalized as the cached meshes' are, since the trunk
+ * is a cube scaled unevenly
+ */
+void drawForestImmediate() {
+    glEnable(GL_NORMALIZE);
+    for (int i = 0; i < forest.numTrees; i++) {
+        TreeInstance* t = &forest.trees[i];
+        geomPushMatrix();
+        geomTranslatef(t->x, t->y, t->z);
+        geomScalef(t->scale, t->scale, t->scale);
+        drawTreeShape(10, 10);
+        geomPopMatrix();
+    }
+    glDisable(GL_NORMALIZE);
+}
+
+/**
+ * Draw terrain, cabin and trees
+ * The cabin uses the geometry cache or immediate mode depending on useSceneCache
+ */
+void drawStaticScene() {
+    profileBegin(PASS_TERRAIN);
+    drawTerrain();
+    profileEnd(PASS_TERRAIN);
+    if (useSceneCache) {
+        profileBegin(PASS_FOREST);
+        drawForest();       // Also culls the cabin
+        profileEnd(PASS_FOREST);
+        profileBegin(PASS_STATIC);
+        if (sceneIndex.cabinVisible) drawSceneCache();
+        profileEnd(PASS_STATIC);
+        return;
+    }
+    profileBegin(PASS_CABIN);
+    drawCabinImmediate(); // Main cabin structure
+    profileEnd(PASS_CABIN);
+    profileBegin(PASS_FOREST);
+    drawForestImmediate();
+    profileEnd(PASS_FOREST);
+}
+
+/**
+ * Read a monotonic clock
+ * @return Seconds since an arbitrary fixed point
+ */
+double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Time the simulation follows: the wall clock, or the frame clock when
+ * rendering headless so output does not depend on rendering speed
+ * @return Seconds
+ */
+double simClock() {
+    return headless ? headlessTime : nowSeconds();
+}
+
+/**
+ * Check whether the current context advertises an extension
+ * @param name Extension name, e.g. "GL_ARB_instanced_arrays"
+ * @return 1 if the extension is listed
+ */
+int hasExtension(const char* name) {
+    const char* list = (const char*)glGetString(GL_EXTENSIONS);
+    size_t len = strlen(name);
+    while (list && (list = strstr(list, name)) != NULL) {
+        if (list[len] == ' ' || list[len] == '\0') return 1;
+        list += len;
+    }
+    return 0;
+}
+
+/**
+ * Add one timing sample to a series
+ * @param s Series to update
+ * @param ms Sample in milliseconds
+ */
+void profileRecord(ProfileSeries* s, double ms) {
+    s->history[s->next] = ms;
+    s->next = (s->next + 1) % PROFILE_HISTORY;
+    if (s->count < PROFILE_HISTORY) s->count++;
+
+    if (s->samples == 0 || ms < s->min) s->min = ms;
+    if (s->samples == 0 || ms > s->max) s->max = ms;
+    s->samples++;
+    s->sum += ms;
+    int b = ms > PROFILE_MIN_MS ? (int)(log10(ms / PROFILE_MIN_MS) * PROFILE_BUCKETS_PER_DECADE) : 0;
+    s->buckets[b < PROFILE_BUCKETS ? b : PROFILE_BUCKETS - 1]++;
+}
+
+/* qsort comparator for floats */
+int compareFloats(const void* a, const void* b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Compute min/avg/p99 over a series' rolling window into s->stats
+ * @param s Series to summarize
+ */
+void profileSummarize(ProfileSeries* s) {
+    float sorted[PROFILE_HISTORY];
+    double sum = 0.0;
+    if (s->count == 0) return;
+    memcpy(sorted, s->history, s->count * sizeof(float)); // Window starts at 0 until it wraps
+    qsort(sorted, s->count, sizeof(float), compareFloats);
+    for (int i = 0; i < s->count; i++) sum += sorted[i];
+    s->stats[0] = sorted[0];
+    s->stats[1] = sum / s->count;
+    s->stats[2] = sorted[(s->count * 99) / 100];
+}
+
+/**
+ * Whole-run 99th percentile from a series' histogram
+ * @param s Series
+ * @return Upper edge of the bucket holding the 99th percentile (ms)
+ */
+double profilePercentile99(const ProfileSeries* s) {
+    long long target = (s->samples * 99 + 99) / 100, seen = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        seen += s->buckets[b];
+        if (seen >= target) return fmin(PROFILE_MIN_MS * pow(10.0, (b + 1.0) / PROFILE_BUCKETS_PER_DECADE), s->max);
+    }
+    return s->max;
+}
+
+/**
+ * Turn timing collection on or off
+ * Timer queries are created the first time profiling is enabled.
+ * @param on 1 to collect timings
+ */
+void setProfiling(int on) {
+    if (on && !profiler.ready) {
+        profiler.gpuTimers = glVersionAtLeast(3, 3) || hasExtension("GL_ARB_timer_query") ||
+                             hasExtension("GL_EXT_timer_query");
+        if (profiler.gpuTimers) glGenQueries(PROFILE_QUERY_FRAMES * PROFILE_PASSES, &profiler.queries[0][0]);
+        profiler.activeQuery = -1;
+        profiler.lastRefresh = nowSeconds();
+        profiler.ready = 1;
+    }
+    profiling = on;
+    atomic_store(&simProfiling, on);
+}
+
+/**
+ * Start a frame: collect GPU results that have arrived from earlier
+ * frames and the simulation timings from the snapshot
+ * Queries whose results are not ready yet are skipped, never waited on.
+ */
+void profileFrameBegin() {
+    if (!profiling) return;
+    profiler.queryFrame = (profiler.queryFrame + 1) % PROFILE_QUERY_FRAMES;
+
+    if (profiler.gpuTimers) {
+        // This slot was last used PROFILE_QUERY_FRAMES frames ago
+        double frameGpu = 0.0;
+        int any = 0;
+        for (int pass = 0; pass < PROFILE_FIRST_SIM_PASS; pass++) {
+            if (!profiler.issued[profiler.queryFrame][pass]) continue;
+            GLuint query = profiler.queries[profiler.queryFrame][pass];
+            GLint ready = 0;
+            glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &ready);
+            if (ready) {
+                GLuint64 ns = 0;
+                glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+                profileRecord(&profiler.gpu[pass], ns / 1e6);
+                frameGpu += ns / 1e6;
+                any = 1;
+            }
+            profiler.issued[profiler.queryFrame][pass] = 0;
+        }
+        if (any) profileRecord(&profiler.gpu[PASS_FRAME], frameGpu);
+    }
+
+    if (frame->tick != profiler.lastSimTick) {
+        profiler.lastSimTick = frame->tick;
+        for (int k = 0; k < 3; k++) profileRecord(&profiler.cpu[PROFILE_FIRST_SIM_PASS + k], frame->stepMs[k]);
+    }
+    for (int pass = 0; pass < PROFILE_PASSES; pass++) profiler.frameCpu[pass] = -1.0;
+    profiler.cpuStart[PASS_FRAME] = nowSeconds();
+}
+
+/**
+ * Open the CPU timer and GPU query for a render pass
+ * Only one query can be open at a time, so passes must not nest.
+ * @param pass Pass being drawn
+ */
+void profileBegin(ProfilePass pass) {
+    if (!profiling) return;
+    profiler.cpuStart[pass] = nowSeconds();
+    if (profiler.gpuTimers && profiler.activeQuery < 0) {
+        glBeginQuery(GL_TIME_ELAPSED, profiler.queries[profiler.queryFrame][pass]);
+        profiler.activeQuery = pass;
+    }
+}
+
+/**
+ * Close the timers opened by profileBegin()
+ * @param pass Pass that finished
+ */
+void profileEnd(ProfilePass pass) {
+    if (!profiling) return;
+    double ms = (nowSeconds() - profiler.cpuStart[pass]) * 1000.0;
+    profiler.frameCpu[pass] = fmax(profiler.frameCpu[pass], 0.0) + ms;
+    if (profiler.activeQuery == (int)pass) {
+        glEndQuery(GL_TIME_ELAPSED);
+        profiler.issued[profiler.queryFrame][pass] = 1;
+        profiler.activeQuery = -1;
+    }
+}
+
+/**
+ * Finish a frame: record CPU times and refresh the HUD statistics
+ */
+void profileFrameEnd() {
+    if (!profiling) return;
+    profiler.frameCpu[PASS_FRAME] = (nowSeconds() - profiler.cpuStart[PASS_FRAME]) * 1000.0;
+    for (int pass = 0; pass < PROFILE_FIRST_SIM_PASS; pass++) {
+        if (profiler.frameCpu[pass] >= 0.0) profileRecord(&profiler.cpu[pass], profiler.frameCpu[pass]);
+    }
+
+    double now = nowSeconds();
+    if (now - profiler.lastRefresh >= PROFILE_HUD_REFRESH) {
+        profiler.lastRefresh = now;
+        for (int pass = 0; pass < PROFILE_PASSES; pass++) {
+            profileSummarize(&profiler.cpu[pass]);
+            profileSummarize(&profiler.gpu[pass]);
+        }
+    }
+}
+
+/**
+ * Draw a line of HUD text with GLUT's bitmap font
+ * @param x,y Window position of the baseline (pixels from bottom-left)
+ * @param text String to draw
+ */
+void drawHudText(int x, int y, const char* text) {
+    glRasterPos2i(x, y);
+    for (; *text; text++) glutBitmapCharacter(GLUT_BITMAP_8_BY_13, *text);
+}
+
+/**
+ * Draw the timing overlay: rolling min/avg/p99 per pass, CPU and GPU
+ */
+void drawProfileHud() {
+    if (!showProfileHud || headless) return;
+    char line[128];
+    int rows = 12, lineHeight = 15, top = windowHeight - 10;
+    for (int pass = 0; pass < PROFILE_PASSES; pass++) rows += profiler.cpu[pass].count > 0;
+
+    glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT);
+    glDisable(GL_LIGHTING);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_FOG);
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glLoadIdentity();
+    gluOrtho2D(0, windowWidth, 0, windowHeight);
+    glMatrixMode(GL_MODELVIEW);
+    glPushMatrix();
+    glLoadIdentity();
+
+    // Translucent panel behind the text
+    glColor4f(0.0, 0.0, 0.0, 0.6);
+    glRectf(5, top + 5, 5 + 62 * 8, top - rows * lineHeight - 5);
+
+    glColor3f(1.0, 1.0, 0.6);
+    snprintf(line, sizeof(line), "%-14s %-20s %s", "pass (ms)", "cpu min/avg/p99",
+             profiler.gpuTimers ? "gpu min/avg/p99" : "gpu n/a");
+    drawHudText(10, top - lineHeight, line);
+    int row = 2;
+    for (int pass = 0; pass < PROFILE_PASSES; pass++) {
+        const ProfileSeries *c = &profiler.cpu[pass], *g = &profiler.gpu[pass];
+        if (c->count == 0) continue;
+        int n = snprintf(line, sizeof(line), "%-14s %5.2f %5.2f %6.2f  ", profilePassNames[pass],
+                         c->stats[0], c->stats[1], c->stats[2]);
+        if (g->count > 0) snprintf(line + n, sizeof(line) - n, "%5.2f %5.2f %6.2f", g->stats[0], g->stats[1], g->stats[2]);
+        glColor3f(1.0, 1.0, 1.0);
+        drawHudText(10, top - row++ * lineHeight, line);
+    }
+    snprintf(line, sizeof(line), "terrain %d chunks, trees %d, primitives %lld tris",
+             terrain.visibleChunks, forest.visibleTrees, primitiveTriangles);
+    glColor3f(1.0, 1.0, 0.6);
+    drawHudText(10, top - row++ * lineHeight, line);
+    snprintf(line, sizeof(line), "queue %d instances in %d draw calls (%s)", renderQueue.instances,
+             renderQueue.drawCalls, !renderQueue.program ? "replayed" : renderQueue.mapped ? "mapped ring" : "uploaded");
+    drawHudText(10, top - row++ * lineHeight, line);
+    snprintf(line, sizeof(line), "animation %d villagers: %d posed, %d cached, %d pooled", crowdSkin.numAgents,
+             crowdSkin.evaluated, crowdSkin.cached, crowdSkin.pooled);
+    drawHudText(10, top - row++ * lineHeight, line);
+    if (dynamicRes.enabled) {
+        snprintf(line, sizeof(line), "resolution %.0f%% (%dx%d), %.1f/%.1f ms, %d drops, %d raises",
+                 dynamicRes.scale * 100.0f, dynamicRes.width, dynamicRes.height, dynamicRes.filteredMs,
+                 dynamicRes.targetMs, dynamicRes.drops, dynamicRes.raises);
+    } else {
+        snprintf(line, sizeof(line), "resolution 100%% (%dx%d), scaling %s", windowWidth, windowHeight,
+                 dynamicRes.supported ? "off" : "unsupported");
+    }
+    drawHudText(10, top - row++ * lineHeight, line);
+    snprintf(line, sizeof(line), "shadows %s, %d cached map redraws", !shadows.program ? "unsupported" :
+             shadows.enabled ? "on" : "off", shadows.refreshes);
+    drawHudText(10, top - row++ * lineHeight, line);
+    snprintf(line, sizeof(line), "point lights %d/%d in view, %d cluster entries%s", lightField.binned,
+             lightField.count, lightField.numIndices, !lightField.program ? " (unsupported)" : "");
+    drawHudText(10, top - row++ * lineHeight, line);
+    snprintf(line, sizeof(line), "transparent %d sprites (%d clouds) in %d draw calls", transparent.count,
+             cloudLayer.drawn, transparent.numRuns);
+    drawHudText(10, top - row++ * lineHeight, line);
+    snprintf(line, sizeof(line), "cull %d/%d objects visible, crowd index built %d times",
+             forest.visibleTrees + sceneIndex.visiblePeople + sceneIndex.cabinVisible,
+             forest.numTrees + frame->numPeople + 1, sceneIndex.people.builds);
+    drawHudText(10, top - row++ * lineHeight, line);
+    snprintf(line, sizeof(line), "occlusion %s, %d objects hidden, %d buffers (%.2f ms each)",
+             !occlusion.enabled ? "off" : occlusion.active ? "on" : "idle", occlusion.rejected,
+             occlusion.redraws, occlusion.rasterMs);
+    drawHudText(10, top - row++ * lineHeight, line);
+    snprintf(line, sizeof(line), "picked %s", pick.text);
+    drawHudText(10, top - row * lineHeight, line);
+
+    glPopMatrix();
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopAttrib();
+}
+
+/**
+ * Write whole-run statistics for every pass to --profile (atexit)
+ */
+void writeProfileCsv() {
+    FILE* f = fopen(profileCsvPath, "w");
+    if (!f) {
+        fprintf(stderr, "Cannot write %s\n", profileCsvPath);
+        return;
+    }
+    fprintf(f, "pass,timer,samples,min_ms,avg_ms,p99_ms,max_ms\n");
+    for (int pass = 0; pass < PROFILE_PASSES; pass++) {
+        for (int gpu = 0; gpu < 2; gpu++) {
+            const ProfileSeries* s = gpu ? &profiler.gpu[pass] : &profiler.cpu[pass];
+            if (s->samples == 0) continue;
+            fprintf(f, "%s,%s,%lld,%.4f,%.4f,%.4f,%.4f\n", profilePassNames[pass], gpu ? "gpu" : "cpu",
+                    s->samples, s->min, s->sum / s->samples, profilePercentile99(s), s->max);
+        }
+    }
+    fclose(f);
+    printf("Profile written to %s\n", profileCsvPath);
+}
+
+/**
+ * Compile and link a GLSL program, printing the log on failure
+ * @param vertexSource Vertex shader source
+ * @param fragmentSource Fragment shader source
+ * @return Program object, or 0 if compilation or linking failed
+ */
+GLuint compileProgram(const char* vertexSource, const char* fragmentSource) {
+    const char* sources[2] = {vertexSource, fragmentSource};
+    GLenum types[2] = {GL_VERTEX_SHADER, GL_FRAGMENT_SHADER};
+    GLuint program = glCreateProgram();
+    char log[1024];
+    GLint ok;
+
+    for (int i = 0; i < 2; i++) {
+        GLuint shader = glCreateShader(types[i]);
+        glShaderSource(shader, 1, &sources[i], NULL);
+        glCompileShader(shader);
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+        if (!ok) {
+            glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+            fprintf(stderr, "Shader compile failed:\n%s\n", log);
+            glDeleteShader(shader);
+            glDeleteProgram(program);
+            return 0;
+        }
+        glAttachShader(program, shader);
+        glDeleteShader(shader); // Freed once the program is deleted
+    }
+
+    glLinkProgram(program);
+    glGetProgramiv(program, GL_LINK_STATUS, &ok);
+    if (!ok) {
+        glGetProgramInfoLog(program, sizeof(log), NULL, log);
+        fprintf(stderr, "Shader link failed:\n%s\n", log);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+/**
+ * Combine the current projection and modelview matrices
+ * @param c Receives projection * modelview (column-major)
+ */
+void getClipMatrix(GLfloat* c) {
+    GLfloat mv[16], pr[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+    glGetFloatv(GL_PROJECTION_MATRIX, pr);
+    for (int col = 0; col < 4; col++) {
+        for (int row = 0; row < 4; row++) {
+            c[col * 4 + row] = pr[row] * mv[col * 4] + pr[4 + row] * mv[col * 4 + 1] +
+                               pr[8 + row] * mv[col * 4 + 2] + pr[12 + row] * mv[col * 4 + 3];
+        }
+    }
+}
+
+/**
+ * Extract the view frustum from the current GL matrices
+ * @param f Frustum to fill (planes in world space when the modelview
+ *          holds only the camera transform)
+ */
+void extractFrustum(ViewFrustum* f) {
+    GLfloat mv[16], c[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+    getClipMatrix(c);
+
+    // Each plane is the fourth row of the clip matrix plus/minus another row
+    for (int i = 0; i < 3; i++) {
+        for (int k = 0; k < 4; k++) {
+            f->planes[i * 2][k] = c[k * 4 + 3] + c[k * 4 + i];
+            f->planes[i * 2 + 1][k] = c[k * 4 + 3] - c[k * 4 + i];
+        }
+    }
+
+    // Camera position is -R^T * t for a rigid modelview
+    for (int i = 0; i < 3; i++) {
+        f->eye[i] = -(mv[i * 4] * mv[12] + mv[i * 4 + 1] * mv[13] + mv[i * 4 + 2] * mv[14]);
+    }
+    f->occlusion = 0;
+}
+
+/**
+ * Test an axis-aligned box against the view frustum
+ * @param f Frustum to test against
+ * @param min Box minimum corner
+ * @param max Box maximum corner
+ * @return 0 if the box is completely outside, 1 otherwise
+ */
+int boxInFrustum(const ViewFrustum* f, const float* min, const float* max) {
+    for (int i = 0; i < 6; i++) {
+        const float* p = f->planes[i];
+        // Corner furthest along the plane normal
+        float x = p[0] >= 0 ? max[0] : min[0];
+        float y = p[1] >= 0 ? max[1] : min[1];
+        float z = p[2] >= 0 ? max[2] : min[2];
+        if (p[0] * x + p[1] * y + p[2] * z + p[3] < 0) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Spread the low 16 bits of a value to the even bit positions
+ * @param v Value to spread
+ * @return Bits 0..15 of v at positions 0, 2, ..., 30
+ */
+unsigned int mortonSpread(unsigned int v) {
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ffu;
+    v = (v | (v << 4)) & 0x0f0f0f0fu;
+    v = (v | (v << 2)) & 0x33333333u;
+    v = (v | (v << 1)) & 0x55555555u;
+    return v;
+}
+
+/**
+ * Union of a node's child boxes
+ * @param n Node
+ * @param min,max Receive the bounds
+ */
+void bvhNodeBounds(const BvhNode* n, float* min, float* max) {
+    // Plain comparisons rather than fminf/fmaxf: these stay inline (and
+    // in VEX encoding in AVX builds) instead of calling into libm
+    min[0] = min[1] = min[2] = 1e30f;
+    max[0] = max[1] = max[2] = -1e30f;
+    for (int k = 0; k < n->count; k++) {
+        if (n->minX[k] < min[0]) min[0] = n->minX[k];
+        if (n->minY[k] < min[1]) min[1] = n->minY[k];
+        if (n->minZ[k] < min[2]) min[2] = n->minZ[k];
+        if (n->maxX[k] > max[0]) max[0] = n->maxX[k];
+        if (n->maxY[k] > max[1]) max[1] = n->maxY[k];
+        if (n->maxZ[k] > max[2]) max[2] = n->maxZ[k];
+    }
+}
+
+/**
+ * Recompute every child box bottom-up, keeping the topology
+ * @param b Hierarchy to refit
+ * @param box Callback giving an item's current bounds
+ * @param ctx Callback context
+ */
+void bvhRefit(Bvh* b, BvhBoxFn box, void* ctx) {
+    float area = 0.0f;
+    for (int i = b->numNodes - 1; i >= 0; i--) {
+        BvhNode* n = &b->nodes[i];
+        for (int k = 0; k < n->count; k++) {
+            float min[3], max[3];
+            if (n->child[k] < 0) box(ctx, ~n->child[k], min, max);
+            else bvhNodeBounds(&b->nodes[n->child[k]], min, max);
+            n->minX[k] = min[0]; n->minY[k] = min[1]; n->minZ[k] = min[2];
+            n->maxX[k] = max[0]; n->maxY[k] = max[1]; n->maxZ[k] = max[2];
+            area += (max[0] - min[0]) * (max[2] - min[2]);
+        }
+    }
+    b->area = area;
+}
+
+/**
+ * Create the node for a run of Morton-ordered items, splitting it into
+ * up to BVH_WIDTH equal parts
+ * @param b Hierarchy being built
+ * @param first,count Run within b->order
+ * @return Node index
+ */
+int bvhBuildNode(Bvh* b, int first, int count) {
+    growArray((void**)&b->nodes, b->numNodes, &b->maxNodes, sizeof(BvhNode));
+    int index = b->numNodes++;
+    int parts = count < BVH_WIDTH ? count : BVH_WIDTH;
+    for (int k = 0; k < parts; k++) {
+        int begin = first + (int)((long long)count * k / parts);
+        int end = first + (int)((long long)count * (k + 1) / parts);
+        int child = end - begin == 1 ? ~b->order[begin] : bvhBuildNode(b, begin, end - begin);
+        b->nodes[index].child[k] = child; // Not through a pointer: the recursion may move nodes
+    }
+    b->nodes[index].count = parts;
+    return index;
+}
+
+/**
+ * Build a hierarchy over items 0..count-1: sort their centers along a
+ * Z-order curve, split the sorted list evenly at every level, then fit
+ * the boxes
+ * @param b Hierarchy to (re)build
+ * @param count Number of items
+ * @param box Callback giving an item's bounds
+ * @param ctx Callback context
+ */
+void bvhBuild(Bvh* b, int count, BvhBoxFn box, void* ctx) {
+    if (count > b->maxItems) {
+        free(b->keys);
+        free(b->order);
+        b->keys = malloc(2 * (size_t)count * sizeof(unsigned int));
+        b->order = malloc(2 * (size_t)count * sizeof(int));
+        if (!b->keys || !b->order) {
+            fprintf(stderr, "Out of memory indexing %d objects\n", count);
+            exit(1);
+        }
+        b->maxItems = count;
+    }
+
+    // Quantize centers to 16 bits per axis across the items' extent
+    float lo[2] = {1e30f, 1e30f}, hi[2] = {-1e30f, -1e30f};
+    float* centers = malloc(2 * (size_t)(count ? count : 1) * sizeof(float));
+    if (!centers) {
+        fprintf(stderr, "Out of memory indexing %d objects\n", count);
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        float min[3], max[3];
+        box(ctx, i, min, max);
+        centers[i * 2] = (min[0] + max[0]) * 0.5f;
+        centers[i * 2 + 1] = (min[2] + max[2]) * 0.5f;
+        for (int a = 0; a < 2; a++) {
+            if (centers[i * 2 + a] < lo[a]) lo[a] = centers[i * 2 + a];
+            if (centers[i * 2 + a] > hi[a]) hi[a] = centers[i * 2 + a];
+        }
+    }
+    float sx = 65535.0f / fmaxf(hi[0] - lo[0], 1e-6f), sz = 65535.0f / fmaxf(hi[1] - lo[1], 1e-6f);
+    for (int i = 0; i < count; i++) {
+        b->keys[i] = mortonSpread((unsigned int)((centers[i * 2] - lo[0]) * sx)) |
+                     mortonSpread((unsigned int)((centers[i * 2 + 1] - lo[1]) * sz)) << 1;
+        b->order[i] = i;
+    }
+    free(centers);
+
+    // Radix sort by key, eight bits per pass
+    unsigned int *keys = b->keys, *keysOut = b->keys + count;
+    int *order = b->order, *orderOut = b->order + count;
+    for (int shift = 0; shift < 32; shift += 8) {
+        int start[257] = {0};
+        for (int i = 0; i < count; i++) start[((keys[i] >> shift) & 255) + 1]++;
+        for (int d = 0; d < 256; d++) start[d + 1] += start[d];
+        for (int i = 0; i < count; i++) {
+            int slot = start[(keys[i] >> shift) & 255]++;
+            keysOut[slot] = keys[i];
+            orderOut[slot] = order[i];
+        }
+        unsigned int* tk = keys; keys = keysOut; keysOut = tk;
+        int* to = order; order = orderOut; orderOut = to;
+    }
+    // Four passes leave the result back in the first halves
+
+    b->numNodes = 0;
+    b->numItems = count;
+    bvhBuildNode(b, 0, count);
+    bvhRefit(b, box, ctx);
+    b->builtArea = b->area;
+    b->builds++;
+}
+
+/**
+ * Test a node's child boxes against a frustum, all four at once with SSE
+ * @param n Node
+ * @param f Frustum
+ * @param inside Receives a bit mask of children entirely inside
+ * @return Bit mask of children at least partly inside
+ */
+int bvhFrustumMask(const BvhNode* n, const ViewFrustum* f, int* inside) {
+#if defined(__SSE__)
+    int used = (1 << n->count) - 1; // Lanes holding children
+    const __m128 minX = _mm_loadu_ps(n->minX), minY = _mm_loadu_ps(n->minY), minZ = _mm_loadu_ps(n->minZ);
+    const __m128 maxX = _mm_loadu_ps(n->maxX), maxY = _mm_loadu_ps(n->maxY), maxZ = _mm_loadu_ps(n->maxZ);
+    const __m128 zero = _mm_setzero_ps();
+    __m128 outside = zero, crossing = zero;
+    for (int i = 0; i < 6; i++) {
+        const float* p = f->planes[i];
+        // Corners furthest along and against the plane normal
+        __m128 farX = p[0] >= 0 ? maxX : minX, nearX = p[0] >= 0 ? minX : maxX;
+        __m128 farY = p[1] >= 0 ? maxY : minY, nearY = p[1] >= 0 ? minY : maxY;
+        __m128 farZ = p[2] >= 0 ? maxZ : minZ, nearZ = p[2] >= 0 ? minZ : maxZ;
+        __m128 a = _mm_set1_ps(p[0]), b = _mm_set1_ps(p[1]), c = _mm_set1_ps(p[2]), d = _mm_set1_ps(p[3]);
+        __m128 far = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, farX), _mm_mul_ps(b, farY)), _mm_add_ps(_mm_mul_ps(c, farZ), d));
+        __m128 near = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a, nearX), _mm_mul_ps(b, nearY)), _mm_add_ps(_mm_mul_ps(c, nearZ), d));
+        outside = _mm_or_ps(outside, _mm_cmplt_ps(far, zero));
+        crossing = _mm_or_ps(crossing, _mm_cmplt_ps(near, zero));
+    }
+    int visible = ~_mm_movemask_ps(outside) & used;
+    *inside = visible & ~_mm_movemask_ps(crossing);
+    return visible;
+#else
+    int visible = 0;
+    *inside = 0;
+    for (int k = 0; k < n->count; k++) {
+        float min[3] = {n->minX[k], n->minY[k], n->minZ[k]}, max[3] = {n->maxX[k], n->maxY[k], n->maxZ[k]};
+        if (!boxInFrustum(f, min, max)) continue;
+        visible |= 1 << k;
+        if (boxInFrustum(f, max, min)) *inside |= 1 << k; // Swapped corners: the nearest corner is inside too
+    }
+    return visible;
+#endif
+}
+
+/**
+ * Visit every item below a node without further tests
+ * @param b Hierarchy
+ * @param node Subtree root
+ * @param visit Callback for each item
+ * @param ctx Callback context
+ */
+void bvhVisitAll(const Bvh* b, int node, BvhVisitFn visit, void* ctx) {
+    const BvhNode* n = &b->nodes[node];
+    for (int k = 0; k < n->count; k++) {
+        if (n->child[k] < 0) visit(ctx, ~n->child[k]);
+        else bvhVisitAll(b, n->child[k], visit, ctx);
+    }
+}
+
+/**
+ * Visit the items whose boxes are at least partly inside a frustum
+ * Subtrees entirely inside are visited without testing their boxes.
+ * @param b Hierarchy
+ * @param f Frustum
+ * @param visit Callback for each item
+ * @param ctx Callback context
+ */
+void bvhCull(const Bvh* b, const ViewFrustum* f, BvhVisitFn visit, void* ctx) {
+    int stack[BVH_STACK], top = 0;
+    if (b->numNodes) stack[top++] = 0;
+    while (top) {
+        const BvhNode* n = &b->nodes[stack[--top]];
+        int inside, mask = bvhFrustumMask(n, f, &inside);
+        while (mask) {
+            int k = __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (n->child[k] < 0) visit(ctx, ~n->child[k]);
+            else if (inside & (1 << k)) bvhVisitAll(b, n->child[k], visit, ctx);
+            else stack[top++] = n->child[k];
+        }
+    }
+}
+
+/**
+ * Intersect a ray with an axis-aligned box
+ * @param origin,dir Ray
+ * @param min,max Box corners
+ * @param maxT Ignore hits beyond this distance along the ray
+ * @return Entry distance (0 when starting inside), or -1 for a miss
+ */
+float rayBox(const float* origin, const float* dir, const float* min, const float* max, float maxT) {
+    float t0 = 0.0f, t1 = maxT;
+    for (int a = 0; a < 3; a++) {
+        float inv = 1.0f / dir[a]; // +/-inf for axis-parallel rays, which the comparisons handle
+        float ta = (min[a] - origin[a]) * inv, tb = (max[a] - origin[a]) * inv;
+        t0 = fmaxf(t0, fminf(ta, tb));
+        t1 = fminf(t1, fmaxf(ta, tb));
+    }
+    return t0 <= t1 ? t0 : -1.0f;
+}
+
+/**
+ * Find the nearest item hit by a ray
+ * @param b Hierarchy
+ * @param origin,dir Ray (dir normalized)
+ * @param hit Callback testing the ray against an item's actual shape
+ * @param ctx Callback context
+ * @param t In: maximum distance; out: distance to the nearest hit
+ * @return Item hit, or -1
+ */
+int bvhRaycast(const Bvh* b, const float* origin, const float* dir, BvhRayFn hit, void* ctx, float* t) {
+    int stack[BVH_STACK], top = 0, nearest = -1;
+    if (b->numNodes) stack[top++] = 0;
+    while (top) {
+        const BvhNode* n = &b->nodes[stack[--top]];
+        for (int k = 0; k < n->count; k++) {
+            float min[3] = {n->minX[k], n->minY[k], n->minZ[k]}, max[3] = {n->maxX[k], n->maxY[k], n->maxZ[k]};
+            if (rayBox(origin, dir, min, max, *t) < 0.0f) continue;
+            if (n->child[k] >= 0) {
+                stack[top++] = n->child[k];
+                continue;
+            }
+            float d = hit(ctx, ~n->child[k], origin, dir, *t);
+            if (d >= 0.0f && d < *t) {
+                *t = d;
+                nearest = ~n->child[k];
+            }
+        }
+    }
+    return nearest;
+}
+
+/* Add an occluder vertex */
+int addOccluderVertex(Occlusion* o, float x, float y, float z) {
+    o->vertices[o->numVertices][0] = x;
+    o->vertices[o->numVertices][1] = y;
+    o->vertices[o->numVertices][2] = z;
+    return o->numVertices++;
+}
+
+/* Add an occluder triangle */
+void addOccluderTriangle(Occlusion* o, int a, int b, int c) {
+    o->triangles[o->numTriangles][0] = a;
+    o->triangles[o->numTriangles][1] = b;
+    o->triangles[o->numTriangles][2] = c;
+    o->numTriangles++;
+}
+
+/**
+ * Rasterizer thread: draws each queued buffer
+ * @param arg Occlusion state
+ */
+void* occlusionMain(void* arg) {
+    Occlusion* o = arg;
+    pthread_mutex_lock(&o->lock);
+    for (;;) {
+        while (!o->pending) pthread_cond_wait(&o->start, &o->lock);
+        pthread_mutex_unlock(&o->lock);
+        rasterizeOccluders(o);
+        pthread_mutex_lock(&o->lock);
+        o->pending = 0;
+        pthread_cond_broadcast(&o->done);
+    }
+    return NULL;
+}
+
+/**
+ * Build the cabin occluder and the terrain cell table, and start the
+ * rasterizer thread
+ * Needs the terrain height table.
+ */
+void initOcclusion() {
+    Occlusion* o = &occlusion;
+    void* mem = NULL;
+    if (posix_memalign(&mem, 32, OCCLUSION_WIDTH * OCCLUSION_HEIGHT * sizeof(float)) != 0) {
+        fprintf(stderr, "Out of memory allocating the occlusion buffer\n");
+        exit(1);
+    }
+    o->depth = mem;
+    memset(o->depth, 0, OCCLUSION_WIDTH * OCCLUSION_HEIGHT * sizeof(float));
+
+    // Cabin walls: four sides and a lid under the roof
+    static const unsigned char box[10][3] = {{0, 1, 5}, {0, 5, 4}, {1, 3, 7}, {1, 7, 5}, {3, 2, 6},
+                                             {3, 6, 7}, {2, 0, 4}, {2, 4, 6}, {4, 5, 7}, {4, 7, 6}};
+    for (int k = 0; k < 8; k++) {
+        addOccluderVertex(o, layout.cabinX + (k & 1 ? CABIN_HALF_WIDTH : -CABIN_HALF_WIDTH), k & 4 ? 2.0f : 0.0f,
+                          layout.cabinZ + (k & 2 ? -CABIN_HALF_DEPTH : CABIN_HALF_DEPTH));
+    }
+    for (int t = 0; t < 10; t++) addOccluderTriangle(o, box[t][0], box[t][1], box[t][2]);
+    o->gridW = o->gridH = 0;
+
+    // Every detail level draws a cell inside the hull of its samples
+    o->cellMin = malloc(OCCLUDER_CELLS * OCCLUDER_CELLS * sizeof(float));
+    if (!o->cellMin) {
+        fprintf(stderr, "Out of memory allocating the occlusion buffer\n");
+        exit(1);
+    }
+    for (int cz = 0; cz < OCCLUDER_CELLS; cz++) {
+        for (int cx = 0; cx < OCCLUDER_CELLS; cx++) {
+            float low = 1e30f;
+            for (int j = 0; j <= OCCLUDER_CELL_SAMPLES; j++) {
+                const float* row = terrain.heights + (cz * OCCLUDER_CELL_SAMPLES + j) * terrain.tableSize +
+                                   cx * OCCLUDER_CELL_SAMPLES;
+                for (int i = 0; i <= OCCLUDER_CELL_SAMPLES; i++) low = row[i] < low ? row[i] : low;
+            }
+            o->cellMin[cz * OCCLUDER_CELLS + cx] = low;
+        }
+    }
+
+    pthread_mutex_init(&o->lock, NULL);
+    pthread_cond_init(&o->start, NULL);
+    pthread_cond_init(&o->done, NULL);
+    o->threaded = pthread_create(&o->thread, NULL, occlusionMain, o) == 0;
+}
+
+/**
+ * Rebuild the terrain grid when the camera has moved to another cell
+ * Each corner takes the lowest cell height around it, so the grid's
+ * triangles stay under the ground.
+ * @param o Occlusion state (eye set)
+ */
+void updateOccluderGrid(Occlusion* o) {
+    int half = OCCLUDER_CELLS / 2;
+    int limit = terrain.limit * TERRAIN_CHUNK_QUADS / OCCLUDER_CELL_SAMPLES; // Cells to the terrain's edge
+    int lo = half - limit > 0 ? half - limit : 0, hi = half + limit < OCCLUDER_CELLS ? half + limit : OCCLUDER_CELLS;
+    int window[2][2]; // First and last + 1 cell along x and z
+    for (int a = 0; a < 2; a++) {
+        int first = (int)floorf(o->eye[a * 2] / OCCLUDER_CELL) + half - OCCLUDER_GRID / 2;
+        window[a][0] = first < lo ? lo : first;
+        window[a][1] = first + OCCLUDER_GRID > hi ? hi : first + OCCLUDER_GRID;
+        if (window[a][1] < window[a][0]) window[a][1] = window[a][0];
+    }
+    int w = window[0][1] - window[0][0], h = window[1][1] - window[1][0];
+    if (window[0][0] == o->gridX && window[1][0] == o->gridZ && w == o->gridW && h == o->gridH) return;
+    o->gridX = window[0][0];
+    o->gridZ = window[1][0];
+    o->gridW = w;
+    o->gridH = h;
+    o->numVertices = 8; // Keep the cabin
+    o->numTriangles = 10;
+    if (w == 0 || h == 0) return;
+
+    int first = o->numVertices;
+    for (int j = 0; j <= h; j++) {
+        for (int i = 0; i <= w; i++) {
+            int cx = o->gridX + i, cz = o->gridZ + j;
+            float low = 1e30f;
+            for (int dz = -1; dz <= 0; dz++) {
+                for (int dx = -1; dx <= 0; dx++) {
+                    int x = cx + dx, z = cz + dz;
+                    if (x < 0 || z < 0 || x >= OCCLUDER_CELLS || z >= OCCLUDER_CELLS) continue;
+                    float cell = o->cellMin[z * OCCLUDER_CELLS + x];
+                    low = cell < low ? cell : low;
+                }
+            }
+            addOccluderVertex(o, (cx - half) * OCCLUDER_CELL, low, (cz - half) * OCCLUDER_CELL);
+        }
+    }
+    for (int j = 0; j < h; j++) {
+        for (int i = 0; i < w; i++) {
+            int v = first + j * (w + 1) + i;
+            addOccluderTriangle(o, v, v + 1, v + w + 2);
+            addOccluderTriangle(o, v, v + w + 2, v + w + 1);
+        }
+    }
+}
+
+/**
+ * Rasterize one triangle into the occlusion buffer, keeping the nearest
+ * depth; pixels count as covered when their center is inside
+ * @param o Occlusion state
+ * @param v Screen x, y and 1/w of the three corners
+ */
+void rasterizeOccluderTriangle(Occlusion* o, float v[3][3]) {
+    float area = (v[1][0] - v[0][0]) * (v[2][1] - v[0][1]) - (v[2][0] - v[0][0]) * (v[1][1] - v[0][1]);
+    if (fabsf(area) < 1e-6f) return;
+    if (area < 0.0f) {
+        // Either winding: swap to counter-clockwise
+        for (int k = 0; k < 3; k++) {
+            float t = v[1][k];
+            v[1][k] = v[2][k];
+            v[2][k] = t;
+        }
+        area = -area;
+    }
+
+    // Edge functions A*x + B*y + C, each opposite one corner, and depth
+    float a[3], b[3], c[3];
+    for (int e = 0; e < 3; e++) {
+        const float *p = v[(e + 1) % 3], *q = v[(e + 2) % 3];
+        a[e] = p[1] - q[1];
+        b[e] = q[0] - p[0];
+        c[e] = p[0] * q[1] - p[1] * q[0];
+    }
+    float za = (a[0] * v[0][2] + a[1] * v[1][2] + a[2] * v[2][2]) / area;
+    float zb = (b[0] * v[0][2] + b[1] * v[1][2] + b[2] * v[2][2]) / area;
+    float zc = (c[0] * v[0][2] + c[1] * v[1][2] + c[2] * v[2][2]) / area;
+
+    float minX = fminf(v[0][0], fminf(v[1][0], v[2][0])), maxX = fmaxf(v[0][0], fmaxf(v[1][0], v[2][0]));
+    float minY = fminf(v[0][1], fminf(v[1][1], v[2][1])), maxY = fmaxf(v[0][1], fmaxf(v[1][1], v[2][1]));
+    if (maxX < 0.0f || maxY < 0.0f || minX >= OCCLUSION_WIDTH || minY >= OCCLUSION_HEIGHT) return;
+    int x0 = minX < 0.0f ? 0 : (int)minX, x1 = maxX >= OCCLUSION_WIDTH ? OCCLUSION_WIDTH - 1 : (int)maxX;
+    int y0 = minY < 0.0f ? 0 : (int)minY, y1 = maxY >= OCCLUSION_HEIGHT ? OCCLUSION_HEIGHT - 1 : (int)maxY;
+
+    for (int y = y0; y <= y1; y++) {
+        float py = y + 0.5f;
+        float* row = o->depth + y * OCCLUSION_WIDTH;
+        int x = x0;
+#if defined(__AVX__)
+        const __m256 lanes = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 a0 = _mm256_set1_ps(a[0]), a1 = _mm256_set1_ps(a[1]), a2 = _mm256_set1_ps(a[2]);
+        const __m256 zA = _mm256_set1_ps(za);
+        const __m256 r0 = _mm256_set1_ps(b[0] * py + c[0]), r1 = _mm256_set1_ps(b[1] * py + c[1]);
+        const __m256 r2 = _mm256_set1_ps(b[2] * py + c[2]), rz = _mm256_set1_ps(zb * py + zc);
+        for (x = x0 & ~7; x <= x1; x += 8) {
+            __m256 px = _mm256_add_ps(_mm256_set1_ps((float)x), lanes);
+            __m256 inside = _mm256_and_ps(_mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(a0, px), r0), zero, _CMP_GE_OQ),
+                                          _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(a1, px), r1), zero, _CMP_GE_OQ));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(_mm256_mul_ps(a2, px), r2), zero, _CMP_GE_OQ));
+            if (_mm256_movemask_ps(inside) == 0) continue;
+            __m256 depth = _mm256_load_ps(row + x);
+            __m256 z = _mm256_max_ps(depth, _mm256_add_ps(_mm256_mul_ps(zA, px), rz));
+            _mm256_store_ps(row + x, _mm256_blendv_ps(depth, z, inside));
+        }
+#elif defined(__SSE__)
+        const __m128 lanes = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 a0 = _mm_set1_ps(a[0]), a1 = _mm_set1_ps(a[1]), a2 = _mm_set1_ps(a[2]);
+        const __m128 zA = _mm_set1_ps(za);
+        const __m128 r0 = _mm_set1_ps(b[0] * py + c[0]), r1 = _mm_set1_ps(b[1] * py + c[1]);
+        const __m128 r2 = _mm_set1_ps(b[2] * py + c[2]), rz = _mm_set1_ps(zb * py + zc);
+        for (x = x0 & ~3; x <= x1; x += 4) {
+            __m128 px = _mm_add_ps(_mm_set1_ps((float)x), lanes);
+            __m128 inside = _mm_and_ps(_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a0, px), r0), zero),
+                                       _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a1, px), r1), zero));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a2, px), r2), zero));
+            if (_mm_movemask_ps(inside) == 0) continue;
+            __m128 depth = _mm_load_ps(row + x);
+            __m128 z = _mm_max_ps(depth, _mm_add_ps(_mm_mul_ps(zA, px), rz));
+            _mm_store_ps(row + x, _mm_or_ps(_mm_and_ps(inside, z), _mm_andnot_ps(inside, depth)));
+        }
+#endif
+        for (; x <= x1; x++) {
+            float px = x + 0.5f;
+            if (a[0] * px + b[0] * py + c[0] < 0.0f || a[1] * px + b[1] * py + c[1] < 0.0f ||
+                a[2] * px + b[2] * py + c[2] < 0.0f) continue;
+            float z = za * px + zb * py + zc;
+            if (z > row[x]) row[x] = z;
+        }
+    }
+}
+
+/**
+ * Redraw the occlusion buffer from the occluders with o->matrix
+ * Triangles reaching in front of the near plane are left out, which only
+ * hides less.
+ * @param o Occlusion state
+ */
+void rasterizeOccluders(Occlusion* o) {
+    double start = nowSeconds();
+    const GLfloat* m = o->matrix;
+    updateOccluderGrid(o);
+    for (int k = 0; k < o->numVertices; k++) {
+        const float* p = o->vertices[k];
+        float w = m[3] * p[0] + m[7] * p[1] + m[11] * p[2] + m[15];
+        float iw = w < OCCLUSION_NEAR ? 0.0f : 1.0f / w;
+        o->screen[k][0] = ((m[0] * p[0] + m[4] * p[1] + m[8] * p[2] + m[12]) * iw * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+        o->screen[k][1] = ((m[1] * p[0] + m[5] * p[1] + m[9] * p[2] + m[13]) * iw * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+        o->screen[k][2] = iw;
+    }
+
+    memset(o->depth, 0, OCCLUSION_WIDTH * OCCLUSION_HEIGHT * sizeof(float));
+    for (int t = 0; t < o->numTriangles; t++) {
+        float v[3][3];
+        int k;
+        for (k = 0; k < 3; k++) {
+            memcpy(v[k], o->screen[o->triangles[t][k]], sizeof(v[k]));
+            if (v[k][2] == 0.0f) break;
+        }
+        if (k == 3) rasterizeOccluderTriangle(o, v);
+    }
+    o->rasterMs = (nowSeconds() - start) * 1000.0;
+    o->redraws++;
+}
+
+/**
+ * Start the occlusion buffer for the loaded camera on the rasterizer
+ * thread; a camera that has not moved keeps the last buffer
+ * Call with only the camera transform on the modelview stack
+ */
+void beginOcclusion() {
+    Occlusion* o = &occlusion;
+    o->active = 0;
+    o->rejected = 0;
+    if (!o->enabled || stereo.enabled || !o->depth) return;
+    o->active = 1;
+
+    GLfloat matrix[16];
+    getClipMatrix(matrix);
+    if (o->valid && !memcmp(matrix, o->matrix, sizeof(matrix))) return;
+    waitOcclusion(); // The thread may still be reading the old matrix
+    ViewFrustum view;
+    extractFrustum(&view);
+    memcpy(o->matrix, matrix, sizeof(matrix));
+    memcpy(o->eye, view.eye, sizeof(o->eye));
+    o->valid = 1;
+    if (!o->threaded) {
+        rasterizeOccluders(o);
+        return;
+    }
+    pthread_mutex_lock(&o->lock);
+    o->pending = 1;
+    pthread_cond_signal(&o->start);
+    pthread_mutex_unlock(&o->lock);
+}
+
+/**
+ * Wait for the occlusion buffer started by beginOcclusion()
+ * @return 1 if the current view should be tested against it
+ */
+int waitOcclusion() {
+    Occlusion* o = &occlusion;
+    if (!o->threaded) return o->active;
+    pthread_mutex_lock(&o->lock);
+    while (o->pending) pthread_cond_wait(&o->done, &o->lock);
+    pthread_mutex_unlock(&o->lock);
+    return o->active;
+}
+
+/**
+ * Test whether a box is hidden behind the occluders
+ * The box's screen rectangle, grown by a pixel to cover partly covered
+ * edge pixels, must be covered everywhere by an occluder nearer than
+ * the box's nearest corner.
+ * @param min,max Box corners in world space
+ * @return 1 if the box cannot be seen
+ */
+int boxOccluded(const float* min, const float* max) {
+    const Occlusion* o = &occlusion;
+    const GLfloat* m = o->matrix;
+    float x0 = OCCLUSION_WIDTH, x1 = -1.0f, y0 = OCCLUSION_HEIGHT, y1 = -1.0f, nearest = 0.0f;
+    for (int k = 0; k < 8; k++) {
+        float p[3] = {k & 1 ? max[0] : min[0], k & 2 ? max[1] : min[1], k & 4 ? max[2] : min[2]};
+        float w = m[3] * p[0] + m[7] * p[1] + m[11] * p[2] + m[15];
+        if (w < OCCLUSION_NEAR) return 0; // Reaches the camera
+        float iw = 1.0f / w;
+        float x = ((m[0] * p[0] + m[4] * p[1] + m[8] * p[2] + m[12]) * iw * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+        float y = ((m[1] * p[0] + m[5] * p[1] + m[9] * p[2] + m[13]) * iw * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+        if (x < x0) x0 = x;
+        if (x > x1) x1 = x;
+        if (y < y0) y0 = y;
+        if (y > y1) y1 = y;
+        if (iw > nearest) nearest = iw;
+    }
+    int px0 = x0 < 1.0f ? 0 : (int)x0 - 1, px1 = x1 >= OCCLUSION_WIDTH - 1 ? OCCLUSION_WIDTH - 1 : (int)x1 + 1;
+    int py0 = y0 < 1.0f ? 0 : (int)y0 - 1, py1 = y1 >= OCCLUSION_HEIGHT - 1 ? OCCLUSION_HEIGHT - 1 : (int)y1 + 1;
+    if (px0 > px1 || py0 > py1) return 0;
+    for (int y = py0; y <= py1; y++) {
+        const float* row = o->depth + y * OCCLUSION_WIDTH;
+        for (int x = px0; x <= px1; x++) {
+            if (row[x] <= nearest) return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Hash a lattice point to a pseudo-random value
+ * @param x,z Lattice coordinates
+ * @param seed Noise seed
+ * @return Value in [0, 1]
+ */
+float latticeNoise(int x, int z, unsigned int seed) {
+    unsigned int h = (unsigned int)x * 374761393u + (unsigned int)z * 668265263u + seed * 2246822519u;
+    h = (h ^ (h >> 13)) * 1274126177u;
+    h ^= h >> 16;
+    return (h & 0xffffff) / 16777215.0f;
+}
+
+/**
+ * Smoothly interpolated 2D value noise
+ * @param x,z Sample position in lattice units
+ * @param seed Noise seed
+ * @return Value in [0, 1]
+ */
+float valueNoise(float x, float z, unsigned int seed) {
+    int ix = (int)floorf(x), iz = (int)floorf(z);
+    float fx = x - ix, fz = z - iz;
+    fx = fx * fx * (3.0f - 2.0f * fx);
+    fz = fz * fz * (3.0f - 2.0f * fz);
+    float a = latticeNoise(ix, iz, seed), b = latticeNoise(ix + 1, iz, seed);
+    float c = latticeNoise(ix, iz + 1, seed), d = latticeNoise(ix + 1, iz + 1, seed);
+    return (a + (b - a) * fx) + ((c + (d - c) * fx) - (a + (b - a) * fx)) * fz;
+}
+
+/**
+ * Advance a splitmix64 sequence (used to expand seeds)
+ * @param state Sequence state
+ * @return Next 64-bit value
+ */
+unsigned long long splitmix64(unsigned long long* state) {
+    unsigned long long z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+/**
+ * Seed a random stream
+ * Streams with different (stream, index) pairs are independent.
+ * @param r Stream to seed
+ * @param seed Scene seed
+ * @param stream Subsystem the stream belongs to
+ * @param index Entity within the subsystem (0 if there is only one)
+ */
+void rngSeed(Rng* r, unsigned int seed, RngStream stream, unsigned long long index) {
+    unsigned long long key = ((unsigned long long)seed << 32 | (unsigned int)stream) ^ index * 0xd1342543de82ef95ull;
+    unsigned long long a = splitmix64(&key), b = splitmix64(&key);
+    r->s[0] = (unsigned int)a;
+    r->s[1] = (unsigned int)(a >> 32);
+    r->s[2] = (unsigned int)b;
+    r->s[3] = (unsigned int)(b >> 32);
+    if (!(r->s[0] | r->s[1] | r->s[2] | r->s[3])) r->s[0] = 1;
+}
+
+/**
+ * Next value of a xoshiro128** stream
+ * @param r Stream
+ * @return Uniform 32-bit value
+ */
+unsigned int rngNext(Rng* r) {
+    unsigned int* s = r->s;
+    unsigned int x = s[1] * 5;
+    unsigned int result = ((x << 7) | (x >> 25)) * 9;
+    unsigned int t = s[1] << 9;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 11) | (s[3] >> 21);
+    return result;
+}
+
+/**
+ * Uniform float from a stream
+ * @param r Stream
+ * @return Value in [0, 1)
+ */
+float rngFloat(Rng* r) {
+    return (rngNext(r) >> 8) / 16777216.0f;
+}
+
+/**
+ * Uniform integer from a stream
+ * @param r Stream
+ * @param n Number of possible values
+ * @return Value in [0, n)
+ */
+int rngRange(Rng* r, int n) {
+    return (int)(((unsigned long long)rngNext(r) * n) >> 32);
+}
+
+/**
+ * Probability of a tree growing at a position
+ * Two octaves of value noise form groves, with a clearing around the cabin
+ * @param x,z World position
+ * @param seed Noise seed
+ * @return Density in [0, 1]
+ */
+float forestDensity(float x, float z, unsigned int seed) {
+    float n = 0.65f * valueNoise(x / 24.0f, z / 24.0f, seed) + 0.35f * valueNoise(x / 7.0f, z / 7.0f, seed + 1);
+    float d = (n - 0.35f) * 2.5f;
+    if (d < 0.0f) d = 0.0f;
+    if (d > 1.0f) d = 1.0f;
+
+    float cx = x - layout.clearingX, cz = z - layout.clearingZ;
+    float r = sqrtf(cx * cx + cz * cz);
+    if (r < 8.0f) d *= fmaxf(0.0f, (r - 4.0f) / 4.0f);
+    return d;
+}
+
+/**
+ * Release trees, chunks and merged meshes (prototype meshes are kept)
+ * @param f Forest to clear
+ */
+void freeForestTrees(Forest* f) {
+    for (int i = 0; i < f->chunksX * f->chunksZ; i++) {
+        ForestChunk* c = &f->chunks[i];
+        free(c->verts);
+        free(c->indices);
+        if (c->vbo) glDeleteBuffers(1, &c->vbo);
+        if (c->ibo) glDeleteBuffers(1, &c->ibo);
+    }
+    if (!f->mapped) free(f->trees);
+    free(f->chunks);
+    free(f->chunkLod);
+    f->mapped = 0;
+    f->trees = NULL;
+    f->chunks = NULL;
+    f->chunkLod = NULL;
+    f->numTrees = f->chunksX = f->chunksZ = 0;
+}
+
+/**
+ * Sort trees into grid chunks and compute chunk bounds
+ * @param f Forest whose trees have been placed
+ */
+void buildForestChunks(Forest* f) {
+    float minX = 0, minZ = 0, maxX = 0, maxZ = 0;
+    for (int i = 0; i < f->numTrees; i++) {
+        TreeInstance* t = &f->trees[i];
+        if (i == 0 || t->x < minX) minX = t->x;
+        if (i == 0 || t->x > maxX) maxX = t->x;
+        if (i == 0 || t->z < minZ) minZ = t->z;
+        if (i == 0 || t->z > maxZ) maxZ = t->z;
+    }
+    f->originX = floorf(minX / FOREST_CHUNK_SIZE) * FOREST_CHUNK_SIZE;
+    f->originZ = floorf(minZ / FOREST_CHUNK_SIZE) * FOREST_CHUNK_SIZE;
+    f->chunksX = (int)((maxX - f->originX) / FOREST_CHUNK_SIZE) + 1;
+    f->chunksZ = (int)((maxZ - f->originZ) / FOREST_CHUNK_SIZE) + 1;
+
+    int numChunks = f->chunksX * f->chunksZ;
+    f->chunks = calloc(numChunks, sizeof(ForestChunk));
+    f->chunkLod = calloc(numChunks, 1);
+    int* chunkOf = malloc(f->numTrees * sizeof(int));
+    TreeInstance* sorted = malloc(f->numTrees * sizeof(TreeInstance));
+    if (!f->chunks || !f->chunkLod || (f->numTrees && (!chunkOf || !sorted))) {
+        fprintf(stderr, "Out of memory building forest chunks\n");
+        exit(1);
+    }
+
+    // Counting sort by chunk keeps each chunk's trees contiguous
+    for (int i = 0; i < f->numTrees; i++) {
+        int cx = (int)((f->trees[i].x - f->originX) / FOREST_CHUNK_SIZE);
+        int cz = (int)((f->trees[i].z - f->originZ) / FOREST_CHUNK_SIZE);
+        chunkOf[i] = cz * f->chunksX + cx;
+        f->chunks[chunkOf[i]].count++;
+    }
+    for (int i = 0, first = 0; i < numChunks; i++) {
+        f->chunks[i].first = first;
+        first += f->chunks[i].count;
+        f->chunks[i].count = 0;
+    }
+    for (int i = 0; i < f->numTrees; i++) {
+        ForestChunk* c = &f->chunks[chunkOf[i]];
+        TreeInstance* t = &f->trees[i];
+        float r = 0.7f * t->scale; // Foliage radius
+
+        if (c->count == 0) {
+            c->min[0] = t->x - r; c->max[0] = t->x + r;
+            c->min[1] = t->y;     c->max[1] = t->y + 3.2f * t->scale;
+            c->min[2] = t->z - r; c->max[2] = t->z + r;
+        } else {
+            c->min[0] = fminf(c->min[0], t->x - r); c->max[0] = fmaxf(c->max[0], t->x + r);
+            c->min[1] = fminf(c->min[1], t->y);     c->max[1] = fmaxf(c->max[1], t->y + 3.2f * t->scale);
+            c->min[2] = fminf(c->min[2], t->z - r); c->max[2] = fmaxf(c->max[2], t->z + r);
+        }
+        sorted[c->first + c->count++] = *t;
+    }
+
+    free(f->trees);
+    free(chunkOf);
+    f->trees = sorted;
+}
+
+/**
+ * Place trees by rejection sampling against the density map
+ * @param out Receives up to count trees
+ * @param count Trees wanted
+ * @param half Trees fall within +/- half of the origin on both axes
+ * @param rng Placement stream
+ * @param seed Density map seed
+ * @return Trees placed (fewer when too many samples are rejected)
+ */
+int placeTrees(TreeInstance* out, int count, float half, Rng* rng, unsigned int seed) {
+    long long attempts = 0, maxAttempts = (long long)count * 100;
+    int placed = 0;
+
+    while (placed < count && attempts++ < maxAttempts) {
+        float x = (rngFloat(rng) * 2.0f - 1.0f) * half;
+        float z = (rngFloat(rng) * 2.0f - 1.0f) * half;
+        if (rngFloat(rng) >= forestDensity(x, z, seed)) continue;
+        TreeInstance t = {x, terrainHeight(x, z) - 0.1f, z, 0.8f + 0.4f * rngFloat(rng)};
+        out[placed++] = t;
+    }
+    return placed;
+}
+
+/**
+ * Scatter a forest's trees over an area that grows with their number
+ * @param out Receives up to count trees
+ * @param count Trees wanted
+ * @param seed Placement seed; equal seeds give identical forests
+ * @return Trees placed (fewer when too many samples are rejected)
+ */
+int scatterTrees(TreeInstance* out, int count, unsigned int seed) {
+    Rng rng;
+    rngSeed(&rng, seed, RNG_STREAM_FOREST, 0);
+    return placeTrees(out, count, fmaxf(50.0f, sqrtf(count / FOREST_TREE_DENSITY) / 2.0f), &rng, seed);
+}
+
+/**
+ * Spawn a tree entity for each instance, in order
+ * @param trees Instances to copy
+ * @param count Number of instances
+ */
+void spawnTrees(const TreeInstance* trees, int count) {
+    const Archetype* a = &world.archetypes[ARCHETYPE_TREE];
+    for (int i = 0; i < count; i++) {
+        spawnEntity(ARCHETYPE_TREE);
+        int row = a->count - 1;
+        *(float*)entityField(a, row, COLUMN_X) = trees[i].x;
+        *(float*)entityField(a, row, COLUMN_Y) = trees[i].y;
+        *(float*)entityField(a, row, COLUMN_Z) = trees[i].z;
+        *(float*)entityField(a, row, COLUMN_SCALE) = trees[i].scale;
+    }
+}
+
+/**
+ * Copy the tree entities into instances, in row order
+ * @param out Receives one instance per tree entity
+ */
+void gatherTrees(TreeInstance* out) {
+    const Archetype* a = &world.archetypes[ARCHETYPE_TREE];
+    for (int chunk = 0; chunk < usedChunks(a); chunk++) {
+        void* const* c = a->chunks[chunk].columns;
+        const float *x = c[COLUMN_X], *y = c[COLUMN_Y], *z = c[COLUMN_Z], *scale = c[COLUMN_SCALE];
+        TreeInstance* t = out + (chunk << ENTITY_CHUNK_SHIFT);
+        for (int r = 0; r < chunkRows(a, chunk); r++) t[r] = (TreeInstance){x[r], y[r], z[r], scale[r]};
+    }
+}
+
+/**
+ * Make a freshly placed forest's trees the tree entities, row for row
+ * The snapshots are marked as matching, so display() keeps these
+ * instances until trees are planted or felled. Only call while the
+ * simulation thread is not running.
+ * @param f Forest whose trees were just placed or loaded
+ */
+void spawnForest(Forest* f) {
+    clearArchetype(ARCHETYPE_TREE);
+    spawnTrees(f->trees, f->numTrees);
+    f->version = world.archetypes[ARCHETYPE_TREE].version;
+    for (int i = 0; i < 3; i++) snapshots[i].forestVersion = f->version;
+    rngSeed(&forestRng, sceneSeed, RNG_STREAM_FOREST, 1);
+}
+
+/**
+ * Plant or fell a tenth of the trees (at least one, and never the last)
+ * New trees are scattered over the area a forest of the new size would
+ * cover; felled ones are picked from the same stream.
+ * @param direction 1 to plant, -1 to fell
+ */
+void resizeForest(int direction) {
+    const Archetype* a = &world.archetypes[ARCHETYPE_TREE];
+    int step = a->count / 10 > 1 ? a->count / 10 : 1;
+    if (direction > 0 && liveEntities() + step <= MAX_ENTITIES) {
+        TreeInstance* planted = malloc(step * sizeof(TreeInstance));
+        if (!planted) {
+            fprintf(stderr, "Out of memory planting %d trees\n", step);
+            exit(1);
+        }
+        float half = fmaxf(50.0f, sqrtf((a->count + step) / FOREST_TREE_DENSITY) / 2.0f);
+        spawnTrees(planted, placeTrees(planted, step, half, &forestRng, sceneSeed));
+        free(planted);
+    }
+    for (int i = 0; direction < 0 && i < step && a->count > 1; i++) {
+        despawnEntity(*(Entity*)entityField(a, rngRange(&forestRng, a->count), COLUMN_ENTITY));
+    }
+    initCrowdObstacles();
+}
+
+/**
+ * Upload the instance data of a placed forest and report its size
+ * @param f Forest with trees and chunks
+ */
+void uploadForest(Forest* f) {
+    if (f->program) {
+        if (!f->instanceVbo) glGenBuffers(1, &f->instanceVbo);
+        glBindBuffer(GL_ARRAY_BUFFER, f->instanceVbo);
+        glBufferData(GL_ARRAY_BUFFER, f->numTrees * sizeof(TreeInstance), f->trees, GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    printf("Forest: %d trees in %d chunks (%s)\n", f->numTrees, f->chunksX * f->chunksZ,
+           f->program ? "instanced" : "merged meshes");
+}
+
+/**
+ * Populate the forest with trees, spawn them as entities and upload
+ * instance data
+ * @param f Forest to fill (existing trees are discarded)
+ * @param count Number of trees to generate, or 0 for the hand-placed layout
+ * @param seed Seed for placement; equal seeds give identical forests
+ */
+void generateForest(Forest* f, int count, unsigned int seed) {
+    freeForestTrees(f);
+
+    if (count <= 0) {
+        f->numTrees = NUM_TREES;
+        f->trees = malloc(NUM_TREES * sizeof(TreeInstance));
+        for (int i = 0; i < NUM_TREES; i++) {
+            float x = treePositions[i][0], z = treePositions[i][1];
+            TreeInstance t = {x, terrainHeight(x, z), z, 1.0f};
+            f->trees[i] = t;
+        }
+    } else {
+        f->trees = malloc(count * sizeof(TreeInstance));
+        if (!f->trees) {
+            fprintf(stderr, "Out of memory generating %d trees\n", count);
+            exit(1);
+        }
+        f->numTrees = scatterTrees(f->trees, count, seed);
+    }
+
+    buildForestChunks(f);
+    spawnForest(f);
+    uploadForest(f);
+    indexStaticObjects();
+}
+
+/**
+ * Use the scene file's trees in place: the instances are already sorted
+ * by chunk, so only the chunk table is copied out (the tree entities are
+ * spawned from them)
+ * @param f Forest to fill (existing trees are discarded)
+ */
+void loadForestScene(Forest* f) {
+    const SceneHeader* h = scene.header;
+    const SceneObject* o = sceneObject(SCENE_OBJECT_TREE);
+    const SceneChunk* chunks = scene.sections[SCENE_SECTION_CHUNKS];
+    int numChunks = h->chunksX * h->chunksZ;
+    freeForestTrees(f);
+
+    f->trees = o ? (TreeInstance*)scene.sections[SCENE_SECTION_INSTANCES] + o->firstInstance : NULL;
+    f->numTrees = o ? o->numInstances : 0;
+    f->mapped = 1;
+    f->chunksX = h->chunksX;
+    f->chunksZ = h->chunksZ;
+    f->originX = h->originX;
+    f->originZ = h->originZ;
+    f->chunks = calloc(numChunks, sizeof(ForestChunk));
+    f->chunkLod = calloc(numChunks, 1);
+    if (!f->chunks || !f->chunkLod) {
+        fprintf(stderr, "Out of memory loading forest chunks\n");
+        exit(1);
+    }
+    for (int i = 0; i < numChunks; i++) {
+        f->chunks[i].first = chunks[i].first;
+        f->chunks[i].count = chunks[i].count;
+        memcpy(f->chunks[i].min, chunks[i].min, sizeof(chunks[i].min));
+        memcpy(f->chunks[i].max, chunks[i].max, sizeof(chunks[i].max));
+    }
+    spawnForest(f);
+    uploadForest(f);
+    indexStaticObjects();
+}
+
+/**
+ * Rebuild the forest from the tree entities of the frame being drawn
+ * Trees are planted and felled on the simulation thread; the snapshot
+ * carries their rows over, which are sorted into chunks again here.
+ * @param f Forest to rebuild
+ */
+void updateForestView(Forest* f) {
+    if (frame->forestVersion <= f->version) return;
+    freeForestTrees(f);
+    f->numTrees = frame->numTrees;
+    f->trees = malloc((f->numTrees ? f->numTrees : 1) * sizeof(TreeInstance));
+    if (!f->trees) {
+        fprintf(stderr, "Out of memory copying %d trees\n", f->numTrees);
+        exit(1);
+    }
+    memcpy(f->trees, frame->trees, f->numTrees * sizeof(TreeInstance));
+    buildForestChunks(f);
+    uploadForest(f);
+    indexStaticObjects();
+    f->version = frame->forestVersion;
+    for (int i = 0; i < SHADOW_CASCADES; i++) shadows.cascades[i].valid = 0; // Cached casters moved
+}
+
+/* Instanced tree shader: fixed-function style lighting and fog for one light */
+const char* forestVertexShader =
+    "#version 120\n"
+    "attribute vec4 instance; // x, y, z, scale\n"
+    "varying vec4 color;\n"
+    "void main() {\n"
+    "    vec4 eye = gl_ModelViewMatrix * vec4(gl_Vertex.xyz * instance.w + instance.xyz, 1.0);\n"
+    "    vec3 n = normalize(gl_NormalMatrix * gl_Normal);\n"
+    "    vec3 l = normalize(gl_LightSource[0].position.xyz);\n"
+    "    vec3 light = gl_LightModel.ambient.rgb + gl_LightSource[0].ambient.rgb +\n"
+    "                 gl_LightSource[0].diffuse.rgb * max(dot(n, l), 0.0);\n"
+    "    color = vec4(min(gl_Color.rgb * light, 1.0), gl_Color.a);\n"
+    "    gl_FogFragCoord = abs(eye.z);\n"
+    "    gl_Position = gl_ProjectionMatrix * eye;\n"
+    "}\n";
+
+const char* forestFragmentShader =
+    "#version 120\n"
+    "uniform int fogEnabled;\n"
+    "varying vec4 color;\n"
+    "void main() {\n"
+    "    vec4 c = color;\n"
+    "    if (fogEnabled != 0) {\n"
+    "        float f = clamp((gl_Fog.end - gl_FogFragCoord) * gl_Fog.scale, 0.0, 1.0);\n"
+    "        c.rgb = mix(gl_Fog.color.rgb, c.rgb, f);\n"
+    "    }\n"
+    "    gl_FragColor = c;\n"
+    "}\n";
+
+/**
+ * Check for instanced rendering: GLSL plus instanced arrays (core in GL 3.3)
+ * @return 1 if glDrawElementsInstanced and attribute divisors can be used
+ */
+int hasInstancing() {
+    return glVersionAtLeast(3, 3) ||
+        (glVersionAtLeast(2, 0) && hasExtension("GL_ARB_instanced_arrays") && hasExtension("GL_ARB_draw_instanced"));
+}
+
+/**
+ * Record the tree shape at each forest detail level
+ * @param lods Builders to fill, one per level
+ */
+void buildTreeMeshes(MeshBuilder* lods) {
+    static const int slices[FOREST_LODS] = {10, 6, 4};
+    static const int stacks[FOREST_LODS] = {10, 5, 3};
+
+    for (int lod = 0; lod < FOREST_LODS; lod++) {
+        meshReset(&lods[lod]);
+        geomTarget = &lods[lod];
+        drawTreeShape(slices[lod], stacks[lod]);
+        geomTarget = NULL;
+    }
+}
+
+/**
+ * Build the tree meshes and choose between instanced and merged rendering
+ * Call once a GL context exists, before generateForest()
+ */
+void initForest() {
+    const SceneObject* trees = sceneObject(SCENE_OBJECT_TREE);
+    if (trees) {
+        // Prebuilt meshes are used straight from the mapped file
+        const SceneMesh* meshes = scene.sections[SCENE_SECTION_MESHES];
+        for (int lod = 0; lod < FOREST_LODS; lod++) {
+            const SceneMesh* sm = &meshes[trees->firstMesh + lod];
+            MeshBuilder* m = &forest.lodMesh[lod];
+            m->verts = (MeshVertex*)scene.sections[SCENE_SECTION_VERTICES] + sm->firstVertex;
+            m->numVerts = sm->numVertices;
+            m->indices = (GLuint*)scene.sections[SCENE_SECTION_INDICES] + sm->firstIndex;
+            m->numIndices = sm->numIndices;
+        }
+    } else {
+        buildTreeMeshes(forest.lodMesh);
+    }
+
+    if (hasInstancing()) forest.program = compileProgram(forestVertexShader, forestFragmentShader);
+    if (forest.program) {
+        forest.instanceAttrib = glGetAttribLocation(forest.program, "instance");
+        forest.fogUniform = glGetUniformLocation(forest.program, "fogEnabled");
+        for (int lod = 0; lod < FOREST_LODS; lod++) {
+            MeshBuilder* m = &forest.lodMesh[lod];
+            glGenBuffers(1, &forest.lodVbo[lod]);
+            glGenBuffers(1, &forest.lodIbo[lod]);
+            glBindBuffer(GL_ARRAY_BUFFER, forest.lodVbo[lod]);
+            glBufferData(GL_ARRAY_BUFFER, m->numVerts * sizeof(MeshVertex), m->verts, GL_STATIC_DRAW);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, forest.lodIbo[lod]);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, m->numIndices * sizeof(GLuint), m->indices, GL_STATIC_DRAW);
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+}
+
+/**
+ * Bounds of a static object: the cabin or a forest chunk
+ * @param ctx Unused
+ * @param item 0 for the cabin, 1 + chunk index for a chunk
+ * @param min,max Receive the bounds
+ */
+void staticObjectBox(void* ctx, int item, float* min, float* max) {
+    (void)ctx;
+    if (item == 0) {
+        min[0] = layout.cabinX - CABIN_HALF_WIDTH; min[1] = 0.0f; min[2] = layout.cabinZ - CABIN_HALF_DEPTH;
+        max[0] = layout.cabinX + CABIN_HALF_WIDTH; max[1] = CABIN_HEIGHT; max[2] = layout.cabinZ + CABIN_HALF_DEPTH;
+        return;
+    }
+    memcpy(min, forest.chunks[item - 1].min, 3 * sizeof(float));
+    memcpy(max, forest.chunks[item - 1].max, 3 * sizeof(float));
+}
+
+/**
+ * Rebuild the static hierarchy after the forest changes
+ */
+void indexStaticObjects() {
+    bvhBuild(&sceneIndex.statics, 1 + forest.chunksX * forest.chunksZ, staticObjectBox, NULL);
+}
+
+/**
+ * Mark a static object that survived culling: the cabin is flagged, a
+ * chunk gets a detail level from its distance
+ * @param ctx View frustum (for the eye position)
+ * @param item Static object
+ */
+void visitStaticObject(void* ctx, int item) {
+    const ViewFrustum* view = ctx;
+    if (item == 0) {
+        sceneIndex.cabinVisible = 1;
+        return;
+    }
+    const ForestChunk* c = &forest.chunks[item - 1];
+    if (c->count == 0) return;
+    if (view->occlusion && boxOccluded(c->min, c->max)) {
+        occlusion.rejected += c->count;
+        return;
+    }
+    float dx = (c->min[0] + c->max[0]) * 0.5f - view->eye[0];
+    float dz = (c->min[2] + c->max[2]) * 0.5f - view->eye[2];
+    float dist = sqrtf(dx * dx + dz * dz);
+    forest.chunkLod[item - 1] = dist < FOREST_LOD_NEAR ? 0 : dist < FOREST_LOD_FAR ? 1 : 2;
+}
+
+/**
+ * Cull chunks (and the cabin) against the view through the static
+ * hierarchy and pick a detail level for the visible chunks
+ * @param f Forest to classify
+ * @param view Current view frustum
+ */
+void classifyForestChunks(Forest* f, const ViewFrustum* view) {
+    memset(f->chunkLod, -1, f->chunksX * f->chunksZ);
+    sceneIndex.cabinVisible = 0;
+    bvhCull(&sceneIndex.statics, view, visitStaticObject, (void*)view);
+}
+
+/**
+ * Draw one run of consecutive trees with the instancing shader
+ * @param f Forest being drawn
+ * @param lod Detail level of the bound tree mesh
+ * @param first First tree of the run
+ * @param count Number of trees in the run
+ */
+void drawForestRun(Forest* f, int lod, int first, int count) {
+    if (count == 0) return;
+    glVertexAttribPointer(f->instanceAttrib, 4, GL_FLOAT, GL_FALSE, sizeof(TreeInstance),
+                          (const char*)NULL + first * sizeof(TreeInstance));
+    glDrawElementsInstanced(GL_TRIANGLES, f->lodMesh[lod].numIndices, GL_UNSIGNED_INT, NULL, count);
+    f->visibleTrees += count;
+    f->drawCalls++;
+}
+
+/**
+ * Draw visible chunks with hardware instancing
+ * Adjacent chunks at the same detail level are merged into one draw call
+ * @param f Forest to draw
+ */
+void drawForestInstanced(Forest* f) {
+    glUseProgram(f->program);
+    glUniform1i(f->fogUniform, glIsEnabled(GL_FOG));
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glEnableVertexAttribArray(f->instanceAttrib);
+    glVertexAttribDivisor(f->instanceAttrib, 1);
+
+    for (int lod = 0; lod < FOREST_LODS; lod++) {
+        glBindBuffer(GL_ARRAY_BUFFER, f->lodVbo[lod]);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, f->lodIbo[lod]);
+        glVertexPointer(3, GL_FLOAT, sizeof(MeshVertex), (const char*)NULL + offsetof(MeshVertex, pos));
+        glNormalPointer(GL_FLOAT, sizeof(MeshVertex), (const char*)NULL + offsetof(MeshVertex, normal));
+        glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(MeshVertex), (const char*)NULL + offsetof(MeshVertex, color));
+        glBindBuffer(GL_ARRAY_BUFFER, f->instanceVbo);
+
+        int runFirst = 0, runCount = 0;
+        for (int i = 0; i < f->chunksX * f->chunksZ; i++) {
+            if (f->chunkLod[i] != lod) continue;
+            ForestChunk* c = &f->chunks[i];
+            if (runCount && c->first == runFirst + runCount) {
+                runCount += c->count;
+            } else {
+                drawForestRun(f, lod, runFirst, runCount);
+                runFirst = c->first;
+                runCount = c->count;
+            }
+        }
+        drawForestRun(f, lod, runFirst, runCount);
+    }
+
+    glVertexAttribDivisor(f->instanceAttrib, 0);
+    glDisableVertexAttribArray(f->instanceAttrib);
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glUseProgram(0);
+}
+
+/**
+ * Merge every tree of a chunk into one mesh at medium detail
+ * @param f Forest owning the chunk
+ * @param c Chunk to build
+ */
+void buildForestChunkMesh(Forest* f, ForestChunk* c) {
+    const MeshBuilder* proto = &f->lodMesh[1];
+    c->verts = malloc((size_t)c->count * proto->numVerts * sizeof(MeshVertex));
+    c->indices = malloc((size_t)c->count * proto->numIndices * sizeof(GLuint));
+    if (!c->verts || !c->indices) {
+        fprintf(stderr, "Out of memory merging forest chunk\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < c->count; i++) {
+        const TreeInstance* t = &f->trees[c->first + i];
+        MeshVertex* dst = c->verts + i * proto->numVerts;
+        for (int v = 0; v < proto->numVerts; v++) {
+            dst[v] = proto->verts[v];
+            dst[v].pos[0] = proto->verts[v].pos[0] * t->scale + t->x;
+            dst[v].pos[1] = proto->verts[v].pos[1] * t->scale + t->y;
+            dst[v].pos[2] = proto->verts[v].pos[2] * t->scale + t->z;
+        }
+        GLuint* idx = c->indices + i * proto->numIndices;
+        for (int k = 0; k < proto->numIndices; k++) idx[k] = proto->indices[k] + i * proto->numVerts;
+    }
+    c->numIndices = c->count * proto->numIndices;
+
+    if (sceneCache.useBuffers) {
+        glGenBuffers(1, &c->vbo);
+        glGenBuffers(1, &c->ibo);
+        glBindBuffer(GL_ARRAY_BUFFER, c->vbo);
+        glBufferData(GL_ARRAY_BUFFER, (size_t)c->count * proto->numVerts * sizeof(MeshVertex), c->verts, GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, c->ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, c->numIndices * sizeof(GLuint), c->indices, GL_STATIC_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        free(c->verts);
+        free(c->indices);
+        c->verts = NULL;
+        c->indices = NULL;
+    }
+}
+
+/**
+ * Draw visible chunks from merged per-chunk meshes (no shader path)
+ * Meshes are merged the first time a chunk becomes visible
+ * @param f Forest to draw
+ */
+void drawForestMerged(Forest* f) {
+    for (int i = 0; i < f->chunksX * f->chunksZ; i++) {
+        if (f->chunkLod[i] < 0) continue;
+        ForestChunk* c = &f->chunks[i];
+        if (!c->numIndices) buildForestChunkMesh(f, c);
+
+        if (c->vbo) {
+            glBindBuffer(GL_ARRAY_BUFFER, c->vbo);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, c->ibo);
+            drawMeshArrays(NULL, NULL, c->numIndices);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        } else {
+            drawMeshArrays((const char*)c->verts, c->indices, c->numIndices);
+        }
+        f->visibleTrees += c->count;
+        f->drawCalls++;
+    }
+}
+
+/**
+ * Draw all trees in view
+ * Must be called with only the camera transform on the modelview stack
+ */
+void drawForest() {
+    ViewFrustum view;
+    extractFrustum(&view);
+    profileBegin(PASS_OCCLUSION);
+    view.occlusion = waitOcclusion();
+    profileEnd(PASS_OCCLUSION);
+    drawForestView(&view);
+}
+
+/**
+ * Draw the trees inside a view volume
+ * @param view Volume to cull against; detail levels follow view->eye
+ */
+void drawForestView(const ViewFrustum* view) {
+    classifyForestChunks(&forest, view);
+    drawForestChunks(&forest);
+}
+
+/**
+ * Draw the trees of the chunks picked by the last classifyForestChunks()
+ * @param f Forest being drawn
+ */
+void drawForestChunks(Forest* f) {
+    f->visibleTrees = 0;
+    f->drawCalls = 0;
+    if (f->program) drawForestInstanced(f);
+    else drawForestMerged(f);
+}
+
+/* Instanced solid shader: model matrix rows and color per instance, lit like the trees */
+const char* renderQueueVertexShader =
+    "#version 120\n"
+    "attribute vec4 row0, row1, row2; // Model matrix rows\n"
+    "attribute vec4 instanceColor;\n"
+    "varying vec4 color;\n"
+    "void main() {\n"
+    "    vec4 world = vec4(dot(row0, gl_Vertex), dot(row1, gl_Vertex), dot(row2, gl_Vertex), 1.0);\n"
+    "    vec3 normal = vec3(dot(row0.xyz, gl_Normal), dot(row1.xyz, gl_Normal), dot(row2.xyz, gl_Normal));\n"
+    "    vec4 eye = gl_ModelViewMatrix * world;\n"
+    "    vec3 n = normalize(gl_NormalMatrix * normal);\n"
+    "    vec3 l = normalize(gl_LightSource[0].position.xyz);\n"
+    "    vec3 light = gl_LightModel.ambient.rgb + gl_LightSource[0].ambient.rgb +\n"
+    "                 gl_LightSource[0].diffuse.rgb * max(dot(n, l), 0.0);\n"
+    "    color = vec4(min(instanceColor.rgb * light, 1.0), instanceColor.a);\n"
+    "    gl_FogFragCoord = abs(eye.z);\n"
+    "    gl_Position = gl_ProjectionMatrix * eye;\n"
+    "}\n";
+
+/**
+ * Wait until the GPU has finished reading a ring region
+ * @param q Render queue
+ * @param region Region about to be rewritten or released
+ */
+void waitRenderRegion(RenderQueue* q, int region) {
+#ifdef HAVE_BUFFER_STORAGE
+    if (!q->fences[region]) return;
+    while (glClientWaitSync(q->fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+    glDeleteSync(q->fences[region]);
+    q->fences[region] = NULL;
+#else
+    (void)q;
+    (void)region;
+#endif
+}
+
+/**
+ * (Re)create the instance ring with regions of at least the given size
+ * Persistent storage is immutable, so growing drains every region and
+ * replaces the buffer; this only happens while the queue is warming up.
+ * @param q Render queue
+ * @param regionBytes Bytes needed by one frame
+ */
+void resizeRenderRing(RenderQueue* q, size_t regionBytes) {
+    size_t size = q->regionBytes ? q->regionBytes : RENDER_RING_MIN_BYTES;
+    while (size < regionBytes) size *= 2;
+
+    if (q->program) {
+        for (int i = 0; i < RENDER_QUEUE_FRAMES; i++) waitRenderRegion(q, i);
+        if (q->ring) glDeleteBuffers(1, &q->ring); // Also unmaps it
+        q->mapped = NULL;
+        q->region = 0;
+        glGenBuffers(1, &q->ring);
+#ifdef HAVE_BUFFER_STORAGE
+        if (q->persistent) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBindBuffer(GL_ARRAY_BUFFER, q->ring);
+            glBufferStorage(GL_ARRAY_BUFFER, size * RENDER_QUEUE_FRAMES, NULL, flags);
+            q->mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, size * RENDER_QUEUE_FRAMES, flags);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+#endif
+    }
+
+    if (!q->mapped) {
+        RenderInstance* staging = realloc(q->staging, size);
+        if (!staging) {
+            fprintf(stderr, "Out of memory growing the render queue\n");
+            exit(1);
+        }
+        q->staging = staging;
+    }
+    q->regionBytes = size;
+}
+
+/**
+ * Compile the instancing shader and create the instance ring
+ * Call once a GL context exists. Without instancing the queue still sorts,
+ * but replays each item with its own matrix and draw call.
+ */
+void initRenderQueue() {
+    RenderQueue* q = &renderQueue;
+    if (sceneCache.useBuffers && hasInstancing()) {
+        q->program = compileProgram(renderQueueVertexShader, forestFragmentShader);
+    }
+    if (q->program) {
+        q->rowAttrib[0] = glGetAttribLocation(q->program, "row0");
+        q->rowAttrib[1] = glGetAttribLocation(q->program, "row1");
+        q->rowAttrib[2] = glGetAttribLocation(q->program, "row2");
+        q->colorAttrib = glGetAttribLocation(q->program, "instanceColor");
+        q->fogUniform = glGetUniformLocation(q->program, "fogEnabled");
+#ifdef HAVE_BUFFER_STORAGE
+        q->persistent = glVersionAtLeast(4, 4) || hasExtension("GL_ARB_buffer_storage");
+#endif
+    }
+    resizeRenderRing(q, RENDER_RING_MIN_BYTES);
+}
+
+/**
+ * Start queueing: geom* solids are recorded in world space until
+ * renderQueueFlush(), which draws them with the current camera
+ */
+void renderQueueBegin() {
+    RenderQueue* q = &renderQueue;
+#ifdef HAVE_BUFFER_STORAGE
+    // Fence last frame's region now that its redraws (shadows) are issued too
+    if (q->drawn && q->mapped) {
+        q->fences[q->region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        q->region = (q->region + 1) % RENDER_QUEUE_FRAMES;
+    }
+#endif
+    q->drawn = 0;
+    glGetFloatv(GL_MODELVIEW_MATRIX, q->view);
+    q->numItems = 0;
+    q->depth = 0;
+    memset(q->matrix[0], 0, sizeof(q->matrix[0]));
+    q->matrix[0][0] = q->matrix[0][5] = q->matrix[0][10] = q->matrix[0][15] = 1.0;
+    q->color[0] = q->color[1] = q->color[2] = q->color[3] = 255;
+    geomQueue = q;
+}
+
+/**
+ * Queue a library solid with the queue's current transform and color
+ * @param kind Shape
+ * @param a Cube size or sphere radius
+ * @param slices,stacks Tessellation (unused for cubes)
+ */
+void queuePrimitive(PrimitiveKind kind, float a, int slices, int stacks) {
+    RenderQueue* q = geomQueue;
+    CachedPrimitive* c = findPrimitive(kind, a, slices, stacks);
+    const GLfloat* m = q->matrix[q->depth];
+    GLfloat mv[16];
+    memcpy(mv, q->view, sizeof(mv));
+    multMatrix(mv, m);
+
+    growArray((void**)&q->items, q->numItems, &q->maxItems, sizeof(RenderItem));
+    RenderItem* item = &q->items[q->numItems++];
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 4; col++) item->instance.rows[row][col] = m[col * 4 + row];
+    }
+    memcpy(item->instance.color, q->color, sizeof(q->color));
+    item->bucket = (int)(c - primitiveCache) * PRIMITIVE_LODS + primitiveLevel(c, mv);
+    item->depth = -mv[14];
+}
+
+/**
+ * Draw a run of sorted instances that share one mesh level
+ * @param q Render queue (arrays enabled, shader bound if instancing)
+ * @param bucket Mesh level shared by the run
+ * @param first Index of the run's first instance
+ * @param count Instances in the run
+ * @return Draw calls issued
+ */
+int drawRenderRun(RenderQueue* q, int bucket, int first, int count) {
+    CachedPrimitive* c = &primitiveCache[bucket / PRIMITIVE_LODS];
+    int lod = bucket % PRIMITIVE_LODS;
+    const char* indices = bindPrimitive(c) + c->first[lod] * sizeof(GLuint);
+    int calls;
+
+    if (q->program) {
+        const char* offset = (const char*)NULL + q->region * q->regionBytes + first * sizeof(RenderInstance);
+        glBindBuffer(GL_ARRAY_BUFFER, q->ring);
+        for (int row = 0; row < 3; row++) {
+            glVertexAttribPointer(q->rowAttrib[row], 4, GL_FLOAT, GL_FALSE, sizeof(RenderInstance),
+                                  offset + row * 4 * sizeof(GLfloat));
+        }
+        glVertexAttribPointer(q->colorAttrib, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(RenderInstance),
+                              offset + offsetof(RenderInstance, color));
+        glDrawElementsInstanced(GL_TRIANGLES, c->count[lod], GL_UNSIGNED_INT, indices, count);
+        calls = 1;
+    } else {
+        for (int i = first; i < first + count; i++) {
+            const RenderInstance* r = &q->packed[i];
+            GLfloat m[16] = {
+                r->rows[0][0], r->rows[1][0], r->rows[2][0], 0,
+                r->rows[0][1], r->rows[1][1], r->rows[2][1], 0,
+                r->rows[0][2], r->rows[1][2], r->rows[2][2], 0,
+                r->rows[0][3], r->rows[1][3], r->rows[2][3], 1
+            };
+            glPushMatrix();
+            glMultMatrixf(m);
+            glColor4ubv(r->color);
+            glDrawElements(GL_TRIANGLES, c->count[lod], GL_UNSIGNED_INT, indices);
+            glPopMatrix();
+        }
+        calls = count;
+    }
+    primitiveTriangles += (long long)c->count[lod] / 3 * count;
+    return calls;
+}
+
+/**
+ * Stop queueing and draw everything queued since renderQueueBegin()
+ * The modelview matrix must hold the camera only.
+ */
+void renderQueueFlush() {
+    renderQueuePack();
+    renderQueue.drawCalls = renderQueueDraw(&renderQueue);
+}
+
+/**
+ * Stop queueing and pack everything queued since renderQueueBegin() for
+ * renderQueueDraw()
+ * Opaque instances are grouped by mesh level (one draw call per group),
+ * then translucent ones follow back to front, merging neighbours that
+ * share a mesh level.
+ */
+void renderQueuePack() {
+    RenderQueue* q = &renderQueue;
+    geomQueue = NULL;
+    q->drawCalls = q->instances = 0;
+    if (q->numItems == 0) return;
+
+    // Counting sort of the opaque items by bucket, radix sort of the
+    // translucent ones, farthest first
+    q->numBuckets = numCachedPrimitives * PRIMITIVE_LODS;
+    if (q->numBuckets + 1 > q->maxBuckets) {
+        free(q->start);
+        free(q->next);
+        q->maxBuckets = q->numBuckets * 2 + 1;
+        q->start = malloc(q->maxBuckets * sizeof(int));
+        q->next = malloc(q->maxBuckets * sizeof(int));
+        if (!q->start || !q->next) {
+            fprintf(stderr, "Out of memory sorting the render queue\n");
+            exit(1);
+        }
+    }
+    int *start = q->start, *next = q->next;
+    memset(start, 0, (q->numBuckets + 1) * sizeof(int));
+    q->numOpaque = q->numTranslucent = 0;
+    reserveRadixSort(&q->sorter, q->numItems);
+    for (int i = 0; i < q->numItems; i++) {
+        const RenderItem* item = &q->items[i];
+        if (item->instance.color[3] == 255) {
+            start[item->bucket + 1]++;
+            q->numOpaque++;
+            continue;
+        }
+        q->sorter.keys[0][q->numTranslucent] = depthSortKey(-item->depth);
+        q->sorter.values[0][q->numTranslucent++] = i;
+    }
+    q->order = radixSort(&q->sorter, q->numTranslucent);
+    for (int b = 0; b < q->numBuckets; b++) start[b + 1] += start[b];
+    memcpy(next, start, q->numBuckets * sizeof(int));
+
+    // Pack instances in draw order into this frame's ring region
+    size_t bytes = q->numItems * sizeof(RenderInstance);
+    if (bytes > q->regionBytes) resizeRenderRing(q, bytes);
+    RenderInstance* out = q->staging;
+    if (q->mapped) {
+        waitRenderRegion(q, q->region);
+        out = (RenderInstance*)(q->mapped + q->region * q->regionBytes);
+    }
+    for (int i = 0; i < q->numItems; i++) {
+        const RenderItem* item = &q->items[i];
+        if (item->instance.color[3] == 255) out[next[item->bucket]++] = item->instance;
+    }
+    for (int i = 0; i < q->numTranslucent; i++) out[q->numOpaque + i] = q->items[q->order[i]].instance;
+    if (q->program && !q->mapped) {
+        glBindBuffer(GL_ARRAY_BUFFER, q->ring);
+        glBufferData(GL_ARRAY_BUFFER, bytes, q->staging, GL_STREAM_DRAW); // Orphans last frame's copy
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    q->packed = out;
+    q->drawn = 1;
+    q->instances = q->numItems;
+}
+
+/**
+ * Draw the instances packed by the last renderQueueFlush() with the
+ * current matrices (the flush itself, and again for shadow maps)
+ * @param q Render queue
+ * @return Draw calls issued
+ */
+int renderQueueDraw(RenderQueue* q) {
+    if (!q->drawn) return 0;
+    int calls = 0;
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    if (q->program) {
+        glUseProgram(q->program);
+        glUniform1i(q->fogUniform, glIsEnabled(GL_FOG));
+        for (int row = 0; row < 3; row++) {
+            glEnableVertexAttribArray(q->rowAttrib[row]);
+            glVertexAttribDivisor(q->rowAttrib[row], 1);
+        }
+        glEnableVertexAttribArray(q->colorAttrib);
+        glVertexAttribDivisor(q->colorAttrib, 1);
+    }
+
+    // Opaque groups, then translucent runs that share a mesh level
+    for (int b = 0; b < q->numBuckets; b++) {
+        if (q->start[b + 1] > q->start[b]) calls += drawRenderRun(q, b, q->start[b], q->start[b + 1] - q->start[b]);
+    }
+    glDepthMask(GL_FALSE); // Translucent solids don't hide what is drawn behind them later
+    for (int first = 0; first < q->numTranslucent; ) {
+        int bucket = q->items[q->order[first]].bucket, count = 1;
+        while (first + count < q->numTranslucent && q->items[q->order[first + count]].bucket == bucket) count++;
+        calls += drawRenderRun(q, bucket, q->numOpaque + first, count);
+        first += count;
+    }
+    glDepthMask(GL_TRUE);
+
+    if (q->program) {
+        for (int row = 0; row < 3; row++) {
+            glVertexAttribDivisor(q->rowAttrib[row], 0);
+            glDisableVertexAttribArray(q->rowAttrib[row]);
+        }
+        glVertexAttribDivisor(q->colorAttrib, 0);
+        glDisableVertexAttribArray(q->colorAttrib);
+        glUseProgram(0);
+    }
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    return calls;
+}
+
+/**
+ * Terrain height at a lattice point: fractal hills that grow rougher
+ * away from the cabin, mountain ranges modulating their size, the
+ * layout's hills and a flat clearing around the cabin
+ * @param ix,iz Lattice coordinates (multiples of TERRAIN_SPACING)
+ * @return Height in world units (never below 0)
+ */
+float terrainSample(int ix, int iz) {
+    float x = ix * TERRAIN_SPACING, z = iz * TERRAIN_SPACING;
+    float n = 0.0f, amplitude = 1.0f, frequency = 1.0f / 96.0f;
+    for (int octave = 0; octave < 5; octave++) {
+        n += amplitude * valueNoise(x * frequency, z * frequency, terrain.seed + 16 + octave);
+        amplitude *= 0.5f;
+        frequency *= 2.0f;
+    }
+    n /= 1.9375f; // Sum of the octave amplitudes
+
+    // Taller relief in the mountain ranges, none in the clearing
+    float relief = 12.0f + 48.0f * valueNoise(x / 512.0f, z / 512.0f, terrain.seed + 15);
+    float cx = x - layout.clearingX, cz = z - layout.clearingZ;
+    float open = fminf(1.0f, fmaxf(0.0f, (sqrtf(cx * cx + cz * cz) - layout.clearingRadius) / 48.0f));
+    float h = n * n * relief * open * open * (3.0f - 2.0f * open);
+
+    // The hills of the scene layout
+    for (int i = 0; i < layout.numHills; i++) {
+        const Hill* hill = &layout.hills[i];
+        float dx = x - hill->x, dz = z - hill->z;
+        float d = sqrtf(dx * dx + dz * dz);
+        if (d < hill->radius) h += 0.5f * hill->height * (1.0f + cosf(d * (float)M_PI / hill->radius));
+    }
+    return h;
+}
+
+/**
+ * Ground height at any world position
+ * Reads the height table near the origin (where people and trees are)
+ * and samples the noise elsewhere. Interpolates across the same triangle
+ * split as the full-detail mesh, so feet sit exactly on the drawn ground.
+ * @param x,z World position
+ * @return Height in world units
+ */
+float terrainHeight(float x, float z) {
+    float gx = x / TERRAIN_SPACING, gz = z / TERRAIN_SPACING;
+    int ix = (int)floorf(gx), iz = (int)floorf(gz);
+    int tx = ix + TERRAIN_TABLE_HALF, tz = iz + TERRAIN_TABLE_HALF;
+    float fx = gx - ix, fz = gz - iz, h00, h10, h01, h11;
+
+    if (terrain.heights && tx >= 0 && tz >= 0 && tx < terrain.tableSize - 1 && tz < terrain.tableSize - 1) {
+        const float* row = terrain.heights + tz * terrain.tableSize + tx;
+        h00 = row[0];
+        h10 = row[1];
+        h01 = row[terrain.tableSize];
+        h11 = row[terrain.tableSize + 1];
+    } else {
+        h00 = terrainSample(ix, iz);
+        h10 = terrainSample(ix + 1, iz);
+        h01 = terrainSample(ix, iz + 1);
+        h11 = terrainSample(ix + 1, iz + 1);
+    }
+    if (fz > fx) return h00 + fz * (h01 - h00) + fx * (h11 - h01);
+    return h00 + fx * (h10 - h00) + fz * (h11 - h10);
+}
+
+/**
+ * Generate one chunk: heights, normals from neighboring samples and
+ * colors from height and slope
+ * @param cx,cz Chunk coordinates
+ * @param out Receives TERRAIN_CHUNK_VERTS^2 vertices, row-major
+ * @param min,max Receive the chunk's bounding box
+ */
+void buildTerrainChunk(int cx, int cz, MeshVertex* out, float* min, float* max) {
+    float h[TERRAIN_CHUNK_VERTS + 2][TERRAIN_CHUNK_VERTS + 2]; // One extra sample each side
+    int x0 = cx * TERRAIN_CHUNK_QUADS, z0 = cz * TERRAIN_CHUNK_QUADS;
+
+    for (int j = 0; j < TERRAIN_CHUNK_VERTS + 2; j++) {
+        for (int i = 0; i < TERRAIN_CHUNK_VERTS + 2; i++) h[j][i] = terrainSample(x0 + i - 1, z0 + j - 1);
+    }
+
+    min[0] = x0 * TERRAIN_SPACING;
+    min[2] = z0 * TERRAIN_SPACING;
+    max[0] = min[0] + TERRAIN_CHUNK_SIZE;
+    max[2] = min[2] + TERRAIN_CHUNK_SIZE;
+    min[1] = max[1] = h[1][1];
+    for (int j = 0; j < TERRAIN_CHUNK_VERTS; j++) {
+        for (int i = 0; i < TERRAIN_CHUNK_VERTS; i++) {
+            MeshVertex* v = &out[j * TERRAIN_CHUNK_VERTS + i];
+            float y = h[j + 1][i + 1];
+            float nx = h[j + 1][i] - h[j + 1][i + 2];
+            float nz = h[j][i + 1] - h[j + 2][i + 1];
+            float ny = 2.0f * TERRAIN_SPACING;
+            float len = sqrtf(nx * nx + ny * ny + nz * nz);
+            v->pos[0] = (x0 + i) * TERRAIN_SPACING;
+            v->pos[1] = y;
+            v->pos[2] = (z0 + j) * TERRAIN_SPACING;
+            v->normal[0] = nx / len;
+            v->normal[1] = ny / len;
+            v->normal[2] = nz / len;
+
+            // Grass green in the valleys, hill green higher up, then rock
+            // on steep slopes and snow on the peaks
+            float t = fminf(y / 20.0f, 1.0f);
+            float rgb[3] = {0.3f - 0.1f * t, 0.6f - 0.1f * t, 0.2f};
+            float rock = fminf(1.0f, fmaxf(0.0f, (0.7f - v->normal[1]) / 0.15f));
+            float snow = fminf(1.0f, fmaxf(0.0f, (y - 40.0f) / 8.0f));
+            static const float rockColor[3] = {0.45f, 0.42f, 0.38f}, snowColor[3] = {0.95f, 0.95f, 0.97f};
+            for (int k = 0; k < 3; k++) {
+                float c = rgb[k] + (rockColor[k] - rgb[k]) * rock;
+                c += (snowColor[k] - c) * snow;
+                v->color[k] = (GLubyte)(c * 255.0f);
+            }
+            v->color[3] = 255;
+
+            min[1] = fminf(min[1], y);
+            max[1] = fmaxf(max[1], y);
+        }
+    }
+}
+
+/**
+ * Coordinates, in cells of one detail level, of a point near a chunk edge
+ * @param edge 0 = -Z, 1 = +X, 2 = +Z, 3 = -X
+ * @param t Position along the edge
+ * @param depth Cells inward from the edge
+ * @param cells Cells along a side at this level
+ * @param x,z Receive the coordinates
+ */
+void terrainEdgePoint(int edge, int t, int depth, int cells, int* x, int* z) {
+    switch (edge) {
+        case 0: *x = t; *z = depth; break;
+        case 1: *x = cells - depth; *z = t; break;
+        case 2: *x = t; *z = cells - depth; break;
+        default: *x = depth; *z = t; break;
+    }
+}
+
+/**
+ * Append a triangle, wound counter-clockwise seen from above
+ * @param out Index list
+ * @param n Indices in the list (advanced)
+ * @param step Full-detail vertices per cell at this level
+ * @param ax,az,bx,bz,cx,cz Corners in cells of the level
+ */
+void terrainTriangle(GLushort* out, int* n, int step, int ax, int az, int bx, int bz, int cx, int cz) {
+    if ((bz - az) * (cx - ax) - (bx - ax) * (cz - az) < 0) {
+        int tx = bx, tz = bz;
+        bx = cx; bz = cz;
+        cx = tx; cz = tz;
+    }
+    out[(*n)++] = (GLushort)(az * step * TERRAIN_CHUNK_VERTS + ax * step);
+    out[(*n)++] = (GLushort)(bz * step * TERRAIN_CHUNK_VERTS + bx * step);
+    out[(*n)++] = (GLushort)(cz * step * TERRAIN_CHUNK_VERTS + cx * step);
+}
+
+/**
+ * Build the index list for one detail level. Interior cells are regular
+ * quads; each edge is zipped to the ring of vertices one cell inside, and
+ * edges facing a coarser neighbor skip every other vertex so they match
+ * the neighbor's edge exactly (no cracks).
+ * @param out Index list
+ * @param lod Detail level
+ * @param mask Bit e set when the neighbor across edge e is one level coarser
+ * @return Number of indices written
+ */
+int buildTerrainIndices(GLushort* out, int lod, int mask) {
+    int step = 1 << lod, cells = TERRAIN_CHUNK_QUADS >> lod, n = 0;
+
+    for (int z = 1; z < cells - 1; z++) {
+        for (int x = 1; x < cells - 1; x++) {
+            terrainTriangle(out, &n, step, x, z, x, z + 1, x + 1, z + 1);
+            terrainTriangle(out, &n, step, x, z, x + 1, z + 1, x + 1, z);
+        }
+    }
+
+    for (int edge = 0; edge < 4; edge++) {
+        int stride = mask & (1 << edge) ? 2 : 1;
+        int o = 0, i = 1; // Next outer (edge) and inner vertex
+        while (o < cells || i < cells - 1) {
+            int ox, oz, ix, iz, nx, nz;
+            terrainEdgePoint(edge, o, 0, cells, &ox, &oz);
+            terrainEdgePoint(edge, i, 1, cells, &ix, &iz);
+            // Advance whichever side's next segment starts earlier
+            if (i < cells - 1 && (o == cells || 2 * i + 1 < 2 * o + stride)) {
+                terrainEdgePoint(edge, ++i, 1, cells, &nx, &nz);
+            } else {
+                o += stride;
+                terrainEdgePoint(edge, o, 0, cells, &nx, &nz);
+            }
+            terrainTriangle(out, &n, step, ox, oz, ix, iz, nx, nz);
+        }
+    }
+    return n;
+}
+
+/**
+ * Detail level of a chunk, from its horizontal distance to the eye
+ * Levels change every TERRAIN_LOD_DISTANCE * 2^level units, well over a
+ * chunk apart, so neighbors never differ by more than one level.
+ * @param cx,cz Chunk coordinates
+ * @param ex,ez Eye position
+ * @return Level, 0 = full detail
+ */
+int terrainChunkLod(int cx, int cz, float ex, float ez) {
+    float dx = (cx + 0.5f) * TERRAIN_CHUNK_SIZE - ex, dz = (cz + 0.5f) * TERRAIN_CHUNK_SIZE - ez;
+    float dist = sqrtf(dx * dx + dz * dz), range = TERRAIN_LOD_DISTANCE;
+    int lod = 0;
+    while (lod < TERRAIN_LODS - 1 && dist >= range) {
+        lod++;
+        range *= 2.0f;
+    }
+    return lod;
+}
+
+/**
+ * Slot that holds a chunk in the ring
+ * @param cx,cz Chunk coordinates
+ * @return Slot (may currently hold a different chunk)
+ */
+TerrainChunk* terrainSlot(int cx, int cz) {
+    return &terrain.slots[(cz & (TERRAIN_RING - 1)) * TERRAIN_RING + (cx & (TERRAIN_RING - 1))];
+}
+
+/**
+ * Generate the nearest queued chunk
+ * Call with terrain.lock held; it is released while generating. The
+ * result is dropped if the slot was given another chunk meanwhile.
+ * @param scratch Vertex buffer for the generator
+ * @return 0 if nothing was queued
+ */
+int buildNextTerrainChunk(MeshVertex* scratch) {
+    TerrainChunk* best = NULL;
+    for (int i = 0; i < TERRAIN_RING * TERRAIN_RING; i++) {
+        TerrainChunk* c = &terrain.slots[i];
+        if (c->state == CHUNK_QUEUED && (!best || c->priority < best->priority)) best = c;
+    }
+    if (!best) return 0;
+
+    int cx = best->cx, cz = best->cz;
+    unsigned int ticket = best->ticket;
+    float min[3], max[3];
+    best->state = CHUNK_BUILDING;
+    pthread_mutex_unlock(&terrain.lock);
+    buildTerrainChunk(cx, cz, scratch, min, max);
+    pthread_mutex_lock(&terrain.lock);
+
+    if (best->ticket == ticket) {
+        memcpy(best->verts, scratch, TERRAIN_CHUNK_VERTS * TERRAIN_CHUNK_VERTS * sizeof(MeshVertex));
+        memcpy(best->min, min, sizeof(min));
+        memcpy(best->max, max, sizeof(max));
+        best->state = CHUNK_READY;
+    }
+    terrain.pending--;
+    pthread_cond_broadcast(&terrain.built);
+    return 1;
+}
+
+/* Generator thread: build queued chunks until asked to quit */
+void* terrainThreadMain(void* arg) {
+    MeshVertex* scratch = malloc(TERRAIN_CHUNK_VERTS * TERRAIN_CHUNK_VERTS * sizeof(MeshVertex));
+    if (!scratch) {
+        fprintf(stderr, "Out of memory starting a terrain thread\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&terrain.lock);
+    while (!terrain.quit) {
+        if (!buildNextTerrainChunk(scratch)) pthread_cond_wait(&terrain.work, &terrain.lock);
+    }
+    pthread_mutex_unlock(&terrain.lock);
+    free(scratch);
+    return NULL;
+}
+
+/* Stop the generator threads (atexit) */
+void stopTerrain() {
+    pthread_mutex_lock(&terrain.lock);
+    terrain.quit = 1;
+    pthread_cond_broadcast(&terrain.work);
+    pthread_mutex_unlock(&terrain.lock);
+    for (int i = 0; i < terrain.numThreads; i++) pthread_join(terrain.threads[i], NULL);
+    terrain.numThreads = 0;
+}
+
+/**
+ * Build the stitched index lists and the height table, then start the
+ * generator threads. Call once a GL context exists.
+ */
+void initTerrain() {
+    terrain.seed = sceneSeed;
+    terrain.limit = (int)ceilf(terrainSize * 0.5f / TERRAIN_CHUNK_SIZE);
+
+    // One index list per detail level and combination of coarser edges
+    int total = 0;
+    for (int lod = 0; lod < TERRAIN_LODS; lod++) {
+        int cells = TERRAIN_CHUNK_QUADS >> lod;
+        total += 16 * cells * cells * 6;
+    }
+    terrain.indices = malloc(total * sizeof(GLushort));
+    if (!terrain.indices) {
+        fprintf(stderr, "Out of memory initializing the terrain\n");
+        exit(1);
+    }
+    for (int lod = 0, first = 0; lod < TERRAIN_LODS; lod++) {
+        for (int mask = 0; mask < 16; mask++) {
+            terrain.indexFirst[lod][mask] = first;
+            terrain.indexCount[lod][mask] = buildTerrainIndices(terrain.indices + first, lod, mask);
+            first += terrain.indexCount[lod][mask];
+        }
+    }
+    if (sceneCache.useBuffers) {
+        glGenBuffers(1, &terrain.ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrain.ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, total * sizeof(GLushort), terrain.indices, GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+
+    // Heights around the origin, where the crowd and forest sample them
+    initTerrainHeights();
+
+    // Generator threads (chunks are built on the GLUT thread if none start)
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cpus > 2 ? (int)cpus - 1 : 1;
+    if (wanted > TERRAIN_MAX_THREADS) wanted = TERRAIN_MAX_THREADS;
+    pthread_mutex_init(&terrain.lock, NULL);
+    pthread_cond_init(&terrain.work, NULL);
+    pthread_cond_init(&terrain.built, NULL);
+    for (int i = 0; i < wanted; i++) {
+        if (pthread_create(&terrain.threads[terrain.numThreads], NULL, terrainThreadMain, NULL) == 0) terrain.numThreads++;
+    }
+    atexit(stopTerrain);
+}
+
+/**
+ * Fill the height table around the origin for terrain.seed
+ */
+void initTerrainHeights() {
+    terrain.tableSize = 2 * TERRAIN_TABLE_HALF + 1;
+    terrain.heights = malloc((size_t)terrain.tableSize * terrain.tableSize * sizeof(float));
+    if (!terrain.heights) {
+        fprintf(stderr, "Out of memory allocating the terrain height table\n");
+        exit(1);
+    }
+    for (int j = 0; j < terrain.tableSize; j++) {
+        for (int i = 0; i < terrain.tableSize; i++) {
+            terrain.heights[j * terrain.tableSize + i] = terrainSample(i - TERRAIN_TABLE_HALF, j - TERRAIN_TABLE_HALF);
+        }
+    }
+}
+
+/**
+ * Queue the chunks missing around the eye and upload finished ones,
+ * then list the chunks that can be drawn
+ * @param ex,ez Eye position
+ * @param wait Block until every queued chunk is built and uploaded
+ *             (first frame, and headless output so frames are reproducible)
+ */
+void streamTerrain(float ex, float ez, int wait) {
+    int radius = (int)ceilf(TERRAIN_VIEW_DISTANCE / TERRAIN_CHUNK_SIZE);
+    int ccx = (int)floorf(ex / TERRAIN_CHUNK_SIZE), ccz = (int)floorf(ez / TERRAIN_CHUNK_SIZE);
+    int queued = 0;
+
+    pthread_mutex_lock(&terrain.lock);
+    for (int cz = ccz - radius; cz <= ccz + radius; cz++) {
+        for (int cx = ccx - radius; cx <= ccx + radius; cx++) {
+            if (cx < -terrain.limit || cx >= terrain.limit || cz < -terrain.limit || cz >= terrain.limit) continue;
+            float dx = (cx + 0.5f) * TERRAIN_CHUNK_SIZE - ex, dz = (cz + 0.5f) * TERRAIN_CHUNK_SIZE - ez;
+            float dist = sqrtf(dx * dx + dz * dz);
+            if (dist > TERRAIN_VIEW_DISTANCE + TERRAIN_CHUNK_SIZE) continue;
+
+            TerrainChunk* c = terrainSlot(cx, cz);
+            if (c->state != CHUNK_EMPTY && c->cx == cx && c->cz == cz) continue;
+            if (!c->verts) c->verts = malloc(TERRAIN_CHUNK_VERTS * TERRAIN_CHUNK_VERTS * sizeof(MeshVertex));
+            if (!c->verts) {
+                fprintf(stderr, "Out of memory streaming terrain\n");
+                exit(1);
+            }
+            if (c->state != CHUNK_QUEUED) terrain.pending++; // A queued request is simply replaced
+            c->cx = cx;
+            c->cz = cz;
+            c->state = CHUNK_QUEUED;
+            c->ticket++;
+            c->priority = dist;
+            queued++;
+        }
+    }
+    if (queued && terrain.numThreads) pthread_cond_broadcast(&terrain.work);
+    if (!terrain.numThreads) {
+        // No generator threads: build a few chunks per frame here instead
+        if (!terrain.scratch) terrain.scratch = malloc(TERRAIN_CHUNK_VERTS * TERRAIN_CHUNK_VERTS * sizeof(MeshVertex));
+        for (int n = 0; terrain.scratch && (wait || n < TERRAIN_UPLOADS); n++) {
+            if (!buildNextTerrainChunk(terrain.scratch)) break;
+        }
+    }
+    while (wait && terrain.pending > 0) pthread_cond_wait(&terrain.built, &terrain.lock);
+
+    // Upload finished chunks, nearest first, a few per frame
+    for (int n = 0; wait || n < TERRAIN_UPLOADS; n++) {
+        TerrainChunk* best = NULL;
+        for (int i = 0; i < TERRAIN_RING * TERRAIN_RING; i++) {
+            TerrainChunk* c = &terrain.slots[i];
+            if (c->state == CHUNK_READY && (!best || c->priority < best->priority)) best = c;
+        }
+        if (!best) break;
+        if (sceneCache.useBuffers) {
+            if (!best->vbo) glGenBuffers(1, &best->vbo);
+            glBindBuffer(GL_ARRAY_BUFFER, best->vbo);
+            glBufferData(GL_ARRAY_BUFFER, TERRAIN_CHUNK_VERTS * TERRAIN_CHUNK_VERTS * sizeof(MeshVertex),
+                         best->verts, GL_STATIC_DRAW);
+        }
+        best->state = CHUNK_RESIDENT;
+        terrain.generation++;
+    }
+    if (sceneCache.useBuffers) glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    terrain.numResident = 0;
+    for (int i = 0; i < TERRAIN_RING * TERRAIN_RING; i++) {
+        if (terrain.slots[i].state == CHUNK_RESIDENT) terrain.resident[terrain.numResident++] = i;
+    }
+    pthread_mutex_unlock(&terrain.lock);
+}
+
+/**
+ * Stream and draw the terrain chunks in view
+ * Must be called with only the camera transform on the modelview stack
+ */
+void drawTerrain() {
+    cullCameraTerrain();
+    drawTerrainChunks(terrain.cameraDraws, terrain.numCameraDraws);
+}
+
+/**
+ * Stream the terrain around the camera and collect the chunks in its view
+ * into terrain.cameraDraws (redrawn by the shadow pass and stereo eyes)
+ * Must be called with only the camera transform on the modelview stack
+ */
+void cullCameraTerrain() {
+    ViewFrustum view;
+    extractFrustum(&view);
+    streamTerrain(view.eye[0], view.eye[2], !terrain.primed || (headless && headlessOutput));
+    terrain.primed = 1;
+    terrain.numCameraDraws = cullTerrain(&view, terrain.cameraDraws);
+    terrain.visibleChunks = terrain.numCameraDraws;
+}
+
+/**
+ * Draw the resident terrain chunks inside a view volume
+ * @param view Volume to cull against; detail levels follow view->eye
+ */
+void drawTerrainView(const ViewFrustum* view) {
+    TerrainDraw draws[TERRAIN_RING * TERRAIN_RING];
+    terrain.visibleChunks = cullTerrain(view, draws);
+    drawTerrainChunks(draws, terrain.visibleChunks);
+}
+
+/**
+ * Collect the resident terrain chunks inside a view volume
+ * @param view Volume to cull against; detail levels follow view->eye
+ * @param out Receives one entry per visible chunk
+ * @return Number of visible chunks
+ */
+int cullTerrain(const ViewFrustum* view, TerrainDraw* out) {
+    static const int edgeX[4] = {0, 1, 0, -1}, edgeZ[4] = {-1, 0, 1, 0};
+    float ex = view->eye[0], ez = view->eye[2];
+    int count = 0;
+
+    for (int k = 0; k < terrain.numResident; k++) {
+        TerrainChunk* c = &terrain.slots[terrain.resident[k]];
+        if (!boxInFrustum(view, c->min, c->max)) continue;
+
+        // Stitch the edges that face a coarser neighbor
+        int lod = terrainChunkLod(c->cx, c->cz, ex, ez), mask = 0;
+        for (int edge = 0; edge < 4; edge++) {
+            if (terrainChunkLod(c->cx + edgeX[edge], c->cz + edgeZ[edge], ex, ez) > lod) mask |= 1 << edge;
+        }
+        out[count].chunk = c;
+        out[count].lod = lod;
+        out[count].mask = mask;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Draw terrain chunks collected by cullTerrain()
+ * @param draws Chunks with their detail levels
+ * @param count Number of chunks
+ */
+void drawTerrainChunks(const TerrainDraw* draws, int count) {
+    const char* indexBase = (const char*)terrain.indices;
+    if (terrain.ibo) {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrain.ibo);
+        indexBase = NULL;
+    }
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+
+    for (int k = 0; k < count; k++) {
+        const TerrainChunk* c = draws[k].chunk;
+        int lod = draws[k].lod, mask = draws[k].mask;
+        const char* base = (const char*)c->verts;
+        if (c->vbo) {
+            glBindBuffer(GL_ARRAY_BUFFER, c->vbo);
+            base = NULL;
+        }
+        glVertexPointer(3, GL_FLOAT, sizeof(MeshVertex), base + offsetof(MeshVertex, pos));
+        glNormalPointer(GL_FLOAT, sizeof(MeshVertex), base + offsetof(MeshVertex, normal));
+        glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(MeshVertex), base + offsetof(MeshVertex, color));
+        glDrawElements(GL_TRIANGLES, terrain.indexCount[lod][mask], GL_UNSIGNED_SHORT,
+                       indexBase + terrain.indexFirst[lod][mask] * sizeof(GLushort));
+    }
+
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    if (sceneCache.useBuffers) {
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+}
+
+/* Receiver pass: ftransform() keeps depths identical to the fixed-function pass */
+const char* shadowVertexShader =
+    "#version 120\n"
+    "varying vec4 eyePos;\n"
+    "varying vec3 normal;\n"
+    "void main() {\n"
+    "    eyePos = gl_ModelViewMatrix * gl_Vertex;\n"
+    "    normal = gl_NormalMatrix * gl_Normal;\n"
+    "    gl_FogFragCoord = abs(eyePos.z);\n"
+    "    gl_Position = ftransform();\n"
+    "}\n";
+
+/* Blends black over the light a receiver would lose to its shadow */
+const char* shadowFragmentShader =
+    "#version 120\n"
+    "uniform sampler2DShadow cascade0, cascade1, cascade2, dynamic;\n"
+    "uniform mat4 shadowMatrix[3]; // Eye space to shadow map coordinates\n"
+    "uniform vec2 splits;          // Far distances of the first two cascades\n"
+    "uniform int twoSided;\n"
+    "uniform int fogEnabled;\n"
+    "varying vec4 eyePos;\n"
+    "varying vec3 normal;\n"
+    "void main() {\n"
+    "    float lit;\n"
+    "    if (-eyePos.z < splits.x) {\n"
+    "        vec4 p = shadowMatrix[0] * eyePos;\n"
+    "        lit = shadow2DProj(cascade0, p).r * shadow2DProj(dynamic, p).r;\n"
+    "    }\n"
+    "    else if (-eyePos.z < splits.y) lit = shadow2DProj(cascade1, shadowMatrix[1] * eyePos).r;\n"
+    "    else lit = shadow2DProj(cascade2, shadowMatrix[2] * eyePos).r;\n"
+    "    vec3 n = normalize(normal);\n"
+    "    if (twoSided != 0 && !gl_FrontFacing) n = -n;\n"
+    "    vec3 direct = gl_LightSource[0].diffuse.rgb * max(dot(n, normalize(gl_LightSource[0].position.xyz)), 0.0);\n"
+    "    vec3 total = gl_LightModel.ambient.rgb + gl_LightSource[0].ambient.rgb + direct;\n"
+    "    float alpha = (1.0 - lit) * dot(direct, vec3(1.0)) / max(dot(total, vec3(1.0)), 0.001);\n"
+    "    if (fogEnabled != 0) alpha *= clamp((gl_Fog.end - gl_FogFragCoord) * gl_Fog.scale, 0.0, 1.0);\n"
+    "    gl_FragColor = vec4(0.0, 0.0, 0.0, alpha);\n"
+    "}\n";
+
+/**
+ * Create a depth texture with hardware comparison and a framebuffer for it
+ * @param fbo Receives the framebuffer
+ * @param depth Receives the depth texture
+ * @return 1 if the framebuffer is complete
+ */
+int createShadowMap(GLuint* fbo, GLuint* depth) {
+    GLfloat border[4] = {1.0, 1.0, 1.0, 1.0}; // Outside the map counts as lit
+    glGenTextures(1, depth);
+    glBindTexture(GL_TEXTURE_2D, *depth);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 0,
+                 GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); // 2x2 filtered comparisons
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, *fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, *depth, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    int complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return complete;
+}
+
+/**
+ * Create the cascade maps and compile the receiver shader
+ * Needs framebuffer objects and depth comparison (GL 3.0);
+ * shadows stay off without them
+ */
+void initShadows() {
+    Shadows* s = &shadows;
+    if (!sceneCache.useBuffers || !glVersionAtLeast(3, 0)) return;
+    s->program = compileProgram(shadowVertexShader, shadowFragmentShader);
+    if (!s->program) return;
+
+    int ok = createShadowMap(&s->dynamicFbo, &s->dynamicDepth);
+    for (int i = 0; i < SHADOW_CASCADES; i++) ok = ok && createShadowMap(&s->cascades[i].fbo, &s->cascades[i].depth);
+    if (!ok) {
+        fprintf(stderr, "Shadow map framebuffer incomplete; shadows disabled\n");
+        glDeleteProgram(s->program);
+        s->program = 0;
+        return;
+    }
+
+    glUseProgram(s->program);
+    glUniform1i(glGetUniformLocation(s->program, "cascade0"), 0);
+    glUniform1i(glGetUniformLocation(s->program, "cascade1"), 1);
+    glUniform1i(glGetUniformLocation(s->program, "cascade2"), 2);
+    glUniform1i(glGetUniformLocation(s->program, "dynamic"), 3);
+    glUseProgram(0);
+    s->matrixUniform = glGetUniformLocation(s->program, "shadowMatrix");
+    s->splitUniform = glGetUniformLocation(s->program, "splits");
+    s->twoSidedUniform = glGetUniformLocation(s->program, "twoSided");
+    s->fogUniform = glGetUniformLocation(s->program, "fogEnabled");
+    s->enabled = 1;
+}
+
+/**
+ * Build a cascade's light transform: an orthographic box facing the
+ * light that holds the cascade's sphere plus casters toward the light
+ * @param c Cascade (center and radius set)
+ * @param angle Sun/moon angle (radians)
+ */
+void setShadowLight(ShadowCascade* c, float angle) {
+    static const GLfloat bias[16] = {0.5, 0, 0, 0, 0, 0.5, 0, 0, 0, 0, 0.5, 0, 0.5, 0.5, 0.5, 1};
+    float lx = cosf(angle), ly = sinf(angle);
+    float axes[3][3] = {{-ly, lx, 0}, {0, 0, 1}, {lx, ly, 0}}; // Light x, y and z (toward the light)
+    float back = c->radius + SHADOW_CASTER_RANGE;
+    float eye[3] = {c->center[0] + lx * back, c->center[1] + ly * back, c->center[2]};
+
+    memset(c->view, 0, sizeof(c->view));
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) c->view[col * 4 + row] = axes[row][col];
+        c->view[12 + row] = -(axes[row][0] * eye[0] + axes[row][1] * eye[1] + axes[row][2] * eye[2]);
+    }
+    c->view[15] = 1.0;
+
+    memset(c->proj, 0, sizeof(c->proj));
+    c->proj[0] = c->proj[5] = 1.0f / c->radius;
+    c->proj[10] = -2.0f / (back + c->radius); // Near plane at the eye
+    c->proj[14] = -1.0;
+    c->proj[15] = 1.0;
+
+    memcpy(c->lightMatrix, bias, sizeof(bias));
+    multMatrix(c->lightMatrix, c->proj);
+    multMatrix(c->lightMatrix, c->view);
+}
+
+/* Draw with a cascade's light transform */
+void loadShadowMatrices(const ShadowCascade* c) {
+    glMatrixMode(GL_PROJECTION);
+    glLoadMatrixf(c->proj);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadMatrixf(c->view);
+}
+
+/**
+ * Draw the static shadow casters: terrain, cabin and trees
+ * @param view Light volume to cull against, with the camera's eye for detail levels
+ */
+void drawShadowCasters(const ViewFrustum* view) {
+    int chunks = terrain.visibleChunks, trees = forest.visibleTrees, calls = forest.drawCalls;
+    int cabin = sceneIndex.cabinVisible;
+    drawTerrainView(view);
+    if (useSceneCache) {
+        drawForestView(view);
+        if (sceneIndex.cabinVisible) drawSceneCache();
+    } else {
+        drawCabinImmediate();
+        drawForestImmediate();
+    }
+    // The HUD and benchmarks report the camera's view
+    terrain.visibleChunks = chunks;
+    forest.visibleTrees = trees;
+    forest.drawCalls = calls;
+    sceneIndex.cabinVisible = cabin;
+}
+
+/**
+ * Redraw a cascade's cached map if it no longer covers its view slice or
+ * was drawn for other terrain; a map that is only stale because the light
+ * moved is redrawn when allowStale is 0
+ * @param s Shadow state
+ * @param i Cascade index
+ * @param camera Camera modelview matrix
+ * @param projection Camera projection matrix
+ * @param allowStale Keep a map whose light is out of date
+ * @return 1 if the map was redrawn
+ */
+int updateShadowCascade(Shadows* s, int i, const GLfloat* camera, const GLfloat* projection, int allowStale) {
+    ShadowCascade* c = &s->cascades[i];
+
+    // Bounding sphere of the slice between the split distances
+    float near = shadowSplits[i], far = shadowSplits[i + 1];
+    float tanX = 1.0f / projection[0], tanY = 1.0f / projection[5];
+    float half = (far - near) * 0.5f;
+    float radius = sqrtf(half * half + far * far * (tanX * tanX + tanY * tanY));
+    float center[3], moved = 0.0f;
+    for (int j = 0; j < 3; j++) {
+        float eye = -(camera[j * 4] * camera[12] + camera[j * 4 + 1] * camera[13] + camera[j * 4 + 2] * camera[14]);
+        center[j] = eye - camera[j * 4 + 2] * (near + half); // Along the view direction
+        moved += (center[j] - c->center[j]) * (center[j] - c->center[j]);
+    }
+
+    if (c->valid && c->generation == terrain.generation && sqrtf(moved) + radius <= c->radius &&
+        (allowStale || fabsf(viewSunAngle - c->sunAngle) < SHADOW_SUN_STEP)) return 0;
+
+    // Redraw around the current slice with room to move before the next one
+    memcpy(c->center, center, sizeof(center));
+    c->radius = radius * SHADOW_COVER;
+    c->sunAngle = viewSunAngle;
+    c->generation = terrain.generation;
+    c->valid = 1;
+    setShadowLight(c, viewSunAngle);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, c->fbo);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    loadShadowMatrices(c);
+    ViewFrustum lightView;
+    extractFrustum(&lightView);
+    for (int j = 0; j < 3; j++) {
+        lightView.eye[j] = -(camera[j * 4] * camera[12] + camera[j * 4 + 1] * camera[13] + camera[j * 4 + 2] * camera[14]);
+    }
+    drawShadowCasters(&lightView);
+    s->refreshes++;
+    return 1;
+}
+
+/**
+ * Draw the receivers again for a pass shader: the terrain chunks culled
+ * for the camera and the cabin
+ * @param twoSidedUniform The shader's flag for lighting back faces
+ */
+void drawReceivers(GLint twoSidedUniform) {
+    glUniform1i(twoSidedUniform, 0);
+    drawTerrainChunks(terrain.cameraDraws, terrain.numCameraDraws); // As culled for the lit pass
+    glUniform1i(twoSidedUniform, 1);
+    if (useSceneCache) drawSceneCache();
+    else drawCabinImmediate();
+}
+
+/**
+ * Draw the receivers (terrain and cabin) again, darkened where shadowed
+ * @param s Shadow state
+ * @param camera Camera modelview matrix (loaded)
+ * @param view Camera view frustum (its eye position is used)
+ */
+void applyShadows(Shadows* s, const GLfloat* camera, const ViewFrustum* view) {
+    GLfloat inverse[16] = {0}, matrices[SHADOW_CASCADES][16];
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 3; col++) inverse[col * 4 + row] = camera[row * 4 + col];
+        inverse[12 + row] = view->eye[row];
+    }
+    inverse[15] = 1.0;
+
+    for (int i = 0; i < SHADOW_CASCADES; i++) {
+        ShadowCascade* c = &s->cascades[i];
+        memcpy(matrices[i], c->lightMatrix, sizeof(matrices[i]));
+        multMatrix(matrices[i], inverse);
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, c->depth);
+    }
+    glActiveTexture(GL_TEXTURE0 + SHADOW_CASCADES);
+    glBindTexture(GL_TEXTURE_2D, s->dynamicDepth);
+
+    glUseProgram(s->program);
+    glUniformMatrix4fv(s->matrixUniform, SHADOW_CASCADES, GL_FALSE, matrices[0]);
+    glUniform2f(s->splitUniform, shadowSplits[1], shadowSplits[2]);
+    glUniform1i(s->fogUniform, glIsEnabled(GL_FOG));
+    glDepthMask(GL_FALSE);
+    glDepthFunc(GL_LEQUAL); // Same surfaces as the lit pass
+    drawReceivers(s->twoSidedUniform);
+    glDepthFunc(GL_LESS);
+    glDepthMask(GL_TRUE);
+    glUseProgram(0);
+
+    for (int i = SHADOW_CASCADES; i >= 0; i--) {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+}
+
+/**
+ * Bring the shadow maps up to date and darken the shadowed receivers
+ * Call after the queued solids were flushed, with only the camera
+ * transform on the modelview stack
+ */
+void drawShadows() {
+    GLfloat camera[16], projection[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, camera);
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    ViewFrustum view;
+    extractFrustum(&view);
+    if (!updateShadows(camera, projection)) return;
+
+    profileBegin(PASS_SHADOW_APPLY);
+    applyShadows(&shadows, camera, &view);
+    profileEnd(PASS_SHADOW_APPLY);
+}
+
+/**
+ * Bring the cached and dynamic shadow maps up to date for a camera
+ * Call after the queued solids were packed; the camera matrices and
+ * framebuffer are restored afterwards
+ * @param camera Camera modelview matrix
+ * @param projection Camera projection matrix
+ * @return 1 if the receivers should be darkened this frame
+ */
+int updateShadows(const GLfloat* camera, const GLfloat* projection) {
+    Shadows* s = &shadows;
+    if (!s->enabled || sinf(viewSunAngle) < SHADOW_MIN_ELEVATION) return 0;
+
+    GLint previous;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previous);
+
+    // Depth-only passes from the light
+    glPushAttrib(GL_VIEWPORT_BIT | GL_ENABLE_BIT | GL_COLOR_BUFFER_BIT | GL_POLYGON_BIT);
+    glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2.0, 4.0); // Slope-scaled bias against self-shadowing
+
+    // Uncovered maps are redrawn now; light movement refreshes one per frame
+    profileBegin(PASS_SHADOW_STATIC);
+    int refreshed = 0;
+    for (int i = 0; i < SHADOW_CASCADES; i++) refreshed |= updateShadowCascade(s, i, camera, projection, 1);
+    for (int i = 0; i < SHADOW_CASCADES && !refreshed; i++) refreshed = updateShadowCascade(s, i, camera, projection, 0);
+    profileEnd(PASS_SHADOW_STATIC);
+
+    profileBegin(PASS_SHADOW_DYNAMIC);
+    glBindFramebuffer(GL_FRAMEBUFFER, s->dynamicFbo);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    loadShadowMatrices(&s->cascades[0]);
+    drawSkinnedCrowd();
+    renderQueueDraw(&renderQueue);
+    profileEnd(PASS_SHADOW_DYNAMIC);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, previous);
+    glPopAttrib();
+    glMatrixMode(GL_PROJECTION);
+    glLoadMatrixf(projection);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadMatrixf(camera);
+    return 1;
+}
+
+/* Point light pass: the same transform as the shadow pass, plus the albedo */
+const char* lightVertexShader =
+    "#version 130\n"
+    "out vec4 eyePos;\n"
+    "out vec3 normal;\n"
+    "void main() {\n"
+    "    eyePos = gl_ModelViewMatrix * gl_Vertex;\n"
+    "    normal = gl_NormalMatrix * gl_Normal;\n"
+    "    gl_FrontColor = gl_Color;\n"
+    "    gl_FogFragCoord = abs(eyePos.z);\n"
+    "    gl_Position = ftransform();\n"
+    "}\n";
+
+/* Adds the lights listed for the fragment's cluster (blended additively) */
+const char* lightFragmentShader =
+    "#version 130\n"
+    "uniform sampler2D lights;     // Row 0: eye position and radius, row 1: color\n"
+    "uniform usampler2D clusters;  // First index and count, one row per slice\n"
+    "uniform usampler2D indices;   // Light indices grouped by cluster\n"
+    "uniform vec4 viewport;\n"
+    "uniform vec2 depthSlices;     // log(distance) * x + y gives the slice\n"
+    "uniform ivec4 grid;           // Tiles across and up, slices, index row width\n"
+    "uniform int twoSided;\n"
+    "uniform int fogEnabled;\n"
+    "in vec4 eyePos;\n"
+    "in vec3 normal;\n"
+    "void main() {\n"
+    "    ivec2 tile = ivec2(clamp((gl_FragCoord.xy - viewport.xy) / viewport.zw, 0.0, 0.999) * vec2(grid.xy));\n"
+    "    int slice = int(clamp(log(-eyePos.z) * depthSlices.x + depthSlices.y, 0.0, float(grid.z - 1)));\n"
+    "    uvec2 cluster = texelFetch(clusters, ivec2(tile.y * grid.x + tile.x, slice), 0).rg;\n"
+    "    vec3 n = normalize(normal);\n"
+    "    if (twoSided != 0 && !gl_FrontFacing) n = -n;\n"
+    "    vec3 sum = vec3(0.0);\n"
+    "    for (uint k = cluster.x; k < cluster.x + cluster.y; k++) {\n"
+    "        int light = int(texelFetch(indices, ivec2(int(k) % grid.w, int(k) / grid.w), 0).r);\n"
+    "        vec4 p = texelFetch(lights, ivec2(light, 0), 0);\n"
+    "        vec3 toLight = p.xyz - eyePos.xyz;\n"
+    "        float dist = max(length(toLight), 0.001);\n"
+    "        float falloff = clamp(1.0 - dist / p.w, 0.0, 1.0);\n"
+    "        sum += texelFetch(lights, ivec2(light, 1), 0).rgb * (falloff * falloff * max(dot(n, toLight / dist), 0.0));\n"
+    "    }\n"
+    "    if (fogEnabled != 0) sum *= clamp((gl_Fog.end - gl_FogFragCoord) * gl_Fog.scale, 0.0, 1.0);\n"
+    "    gl_FragColor = vec4(sum * gl_Color.rgb, 1.0);\n"
+    "}\n";
+
+/* Set one light's position, reach and color */
+void setLight(LightField* l, int i, float x, float y, float z, float radius, float red, float green, float blue) {
+    l->x[i] = x;
+    l->y[i] = y;
+    l->z[i] = z;
+    l->radius[i] = radius;
+    l->red[i] = red;
+    l->green[i] = green;
+    l->blue[i] = blue;
+}
+
+/**
+ * Size the light arrays and fill them from light entities
+ * @param l Light field to rebuild
+ * @param lights Lights, cabin lights first
+ * @param count Number of lights
+ * @param version Light archetype version they were gathered at
+ */
+void buildLightField(LightField* l, const PointLight* lights, int count, int version) {
+    float** arrays[LIGHT_ARRAYS] = {&l->x, &l->y, &l->z, &l->radius, &l->red, &l->green, &l->blue,
+                                    &l->viewX, &l->viewY, &l->viewZ};
+    l->count = count;
+    l->capacity = (l->count + LIGHT_LANES - 1) & ~(LIGHT_LANES - 1);
+    for (int i = 0; i < LIGHT_ARRAYS + 6; i++) {
+        void** array = i < LIGHT_ARRAYS ? (void**)arrays[i] : (void**)&l->bounds[i - LIGHT_ARRAYS];
+        free(*array);
+        if (posix_memalign(array, 32, l->capacity * sizeof(float)) != 0) {
+            fprintf(stderr, "Out of memory allocating %d lights\n", l->count);
+            exit(1);
+        }
+        memset(*array, 0, l->capacity * sizeof(float));
+    }
+    for (int i = 0; i < count; i++) {
+        const PointLight* p = &lights[i];
+        setLight(l, i, p->x, p->y, p->z, p->radius, p->red, p->green, p->blue);
+    }
+    l->version = version;
+}
+
+/* Spawn a light entity */
+void spawnLight(const PointLight* p) {
+    const Archetype* a = &world.archetypes[ARCHETYPE_LIGHT];
+    spawnEntity(ARCHETYPE_LIGHT);
+    int row = a->count - 1;
+    *(float*)entityField(a, row, COLUMN_X) = p->x;
+    *(float*)entityField(a, row, COLUMN_Y) = p->y;
+    *(float*)entityField(a, row, COLUMN_Z) = p->z;
+    *(float*)entityField(a, row, COLUMN_RADIUS) = p->radius;
+    *(float*)entityField(a, row, COLUMN_RED) = p->red;
+    *(float*)entityField(a, row, COLUMN_GREEN) = p->green;
+    *(float*)entityField(a, row, COLUMN_BLUE) = p->blue;
+}
+
+/**
+ * Copy the light entities out, in row order
+ * @param out Receives one light per light entity
+ */
+void gatherLights(PointLight* out) {
+    const Archetype* a = &world.archetypes[ARCHETYPE_LIGHT];
+    for (int chunk = 0; chunk < usedChunks(a); chunk++) {
+        void* const* c = a->chunks[chunk].columns;
+        const float *x = c[COLUMN_X], *y = c[COLUMN_Y], *z = c[COLUMN_Z], *radius = c[COLUMN_RADIUS];
+        const float *red = c[COLUMN_RED], *green = c[COLUMN_GREEN], *blue = c[COLUMN_BLUE];
+        PointLight* p = out + (chunk << ENTITY_CHUNK_SHIFT);
+        for (int r = 0; r < chunkRows(a, chunk); r++) {
+            p[r] = (PointLight){x[r], y[r], z[r], radius[r], red[r], green[r], blue[r]};
+        }
+    }
+}
+
+/**
+ * Spawn a lantern at a random spot around the clearing, clear of the cabin
+ * @param rng Placement stream
+ * @param spread Lanterns fall within +/- spread of the clearing's center
+ */
+void spawnLantern(Rng* rng, float spread) {
+    float cx = layout.cabinX, cz = layout.cabinZ, x, z;
+    do {
+        x = layout.clearingX + (rngFloat(rng) * 2.0f - 1.0f) * spread;
+        z = layout.clearingZ + (rngFloat(rng) * 2.0f - 1.0f) * spread;
+    } while (fabsf(x - cx) < CABIN_HALF_WIDTH + 1.0f && fabsf(z - cz) < CABIN_HALF_DEPTH + 1.0f);
+    float warm = rngFloat(rng);
+    PointLight p = {x, terrainHeight(x, z) + LANTERN_HEIGHT, z, LANTERN_RADIUS,
+                    0.5f, 0.3f + 0.12f * warm, 0.12f + 0.1f * warm};
+    spawnLight(&p);
+}
+
+/**
+ * Spawn the cabin lights and scatter lanterns around the clearing
+ * Lanterns spread further out as there are more of them, keeping their
+ * density (and the lights per cluster) roughly constant. The light field
+ * is built from the entities at once; only call while the simulation
+ * thread is not running.
+ * @param count Number of lanterns
+ * @param seed Seed for lantern placement
+ */
+void initLights(int count, unsigned int seed) {
+    LightField* l = &lightField;
+    const Archetype* a = &world.archetypes[ARCHETYPE_LIGHT];
+    if (count < 0) count = 0;
+    if (count > MAX_LIGHTS - CABIN_LIGHTS) count = MAX_LIGHTS - CABIN_LIGHTS;
+    clearArchetype(ARCHETYPE_LIGHT);
+
+    // Warm light through the two front windows, a dull glow above the chimney
+    float cx = layout.cabinX, cz = layout.cabinZ;
+    PointLight cabin[CABIN_LIGHTS] = {
+        {cx - 1.2f, 1.25f, cz + CABIN_HALF_DEPTH + 0.4f, 6.0f, 1.0f, 0.65f, 0.3f},
+        {cx + 1.2f, 1.25f, cz + CABIN_HALF_DEPTH + 0.4f, 6.0f, 1.0f, 0.65f, 0.3f},
+        {cx - 1.2f, 3.8f, cz - 0.8f, 5.0f, 0.8f, 0.3f, 0.1f}
+    };
+    for (int i = 0; i < CABIN_LIGHTS; i++) spawnLight(&cabin[i]);
+
+    Rng rng;
+    rngSeed(&rng, seed, RNG_STREAM_LIGHTS, 0);
+    float spread = fmaxf(TERRAIN_CLEARING, sqrtf((float)count) * LANTERN_SPACING * 0.5f);
+    for (int i = 0; i < count; i++) spawnLantern(&rng, spread);
+    rngSeed(&lanternRng, seed, RNG_STREAM_LIGHTS, 1);
+
+    // Snapshots are marked as matching until lanterns come or go
+    PointLight* lights = malloc(a->count * sizeof(PointLight));
+    if (!lights) {
+        fprintf(stderr, "Out of memory allocating %d lights\n", a->count);
+        exit(1);
+    }
+    gatherLights(lights);
+    buildLightField(l, lights, a->count, a->version);
+    free(lights);
+    for (int i = 0; i < 3; i++) snapshots[i].lightVersion = a->version;
+
+    // Slice boundaries match the shader's log(distance) mapping
+    for (int k = 0; k <= CLUSTER_Z; k++) {
+        l->slices[k] = powf(TERRAIN_VIEW_DISTANCE, (float)k / CLUSTER_Z); // The near plane is at 1
+    }
+}
+
+/**
+ * Add or take away a tenth of the lanterns (at least one); the cabin
+ * lights stay
+ * New lanterns spread over the area as many lanterns would cover; the
+ * ones taken away are picked from the same stream.
+ * @param direction 1 to add, -1 to take away
+ */
+void resizeLanterns(int direction) {
+    const Archetype* a = &world.archetypes[ARCHETYPE_LIGHT];
+    int lanterns = a->count - CABIN_LIGHTS;
+    int step = lanterns / 10 > 1 ? lanterns / 10 : 1;
+    if (direction > 0 && a->count + step <= MAX_LIGHTS && liveEntities() + step <= MAX_ENTITIES) {
+        float spread = fmaxf(TERRAIN_CLEARING, sqrtf((float)(lanterns + step)) * LANTERN_SPACING * 0.5f);
+        for (int i = 0; i < step; i++) spawnLantern(&lanternRng, spread);
+    }
+    // The last row is always a lantern, so the cabin lights keep their rows
+    for (int i = 0; direction < 0 && i < step && a->count > CABIN_LIGHTS; i++) {
+        int row = CABIN_LIGHTS + rngRange(&lanternRng, a->count - CABIN_LIGHTS);
+        despawnEntity(*(Entity*)entityField(a, row, COLUMN_ENTITY));
+    }
+}
+
+/**
+ * Queue a post and a glass lamp for each lantern
+ * Lanterns are many small solids of two shapes, so the render queue
+ * draws them all as one opaque and a few translucent instanced runs.
+ * Call between renderQueueBegin() and the flush or pack.
+ */
+void queueLanterns() {
+    const LightField* l = &lightField;
+    for (int i = CABIN_LIGHTS; i < l->count; i++) {
+        geomPushMatrix();
+        geomTranslatef(l->x[i], l->y[i], l->z[i]);
+        geomPushMatrix();
+        geomTranslatef(0.0, -(LANTERN_HEIGHT + 0.15f) * 0.5f, 0.0); // Up to the bottom of the lamp
+        geomColor3f(0.25, 0.18, 0.1); // Dark wood
+        geomScalef(0.08, LANTERN_HEIGHT - 0.15f, 0.08);
+        geomSolidCube(1.0);
+        geomPopMatrix();
+        geomColor4f(1.0, 0.8, 0.45, 0.6); // Warm glass
+        geomSolidSphere(0.15, 8, 6);
+        geomPopMatrix();
+    }
+}
+
+/**
+ * Rebuild the light arrays from the light entities of the frame being
+ * drawn, if lanterns came or went since they were built
+ */
+void updateLightView() {
+    if (frame->lightVersion > lightField.version) {
+        buildLightField(&lightField, frame->lights, frame->numLights, frame->lightVersion);
+    }
+}
+
+/**
+ * Create the light, cluster and index textures and compile the receiver shader
+ * Needs integer textures (GL 3.0); point lights stay off without them
+ */
+void initLightPass() {
+    LightField* l = &lightField;
+    if (!sceneCache.useBuffers || !glVersionAtLeast(3, 0)) return;
+    l->program = compileProgram(lightVertexShader, lightFragmentShader);
+    if (!l->program) return;
+
+    GLuint textures[3];
+    glGenTextures(3, textures);
+    l->lightTexture = textures[0];
+    l->clusterTexture = textures[1];
+    l->indexTexture = textures[2];
+    l->maxIndices = CLUSTER_INDEX_WIDTH * 16;
+    l->indices = calloc(l->maxIndices, sizeof(unsigned short));
+    if (!l->indices) {
+        fprintf(stderr, "Out of memory allocating light clusters\n");
+        exit(1);
+    }
+    glBindTexture(GL_TEXTURE_2D, l->lightTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, MAX_LIGHTS, 2, 0, GL_RGBA, GL_FLOAT, NULL);
+    glBindTexture(GL_TEXTURE_2D, l->clusterTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, CLUSTER_X * CLUSTER_Y, CLUSTER_Z, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, NULL);
+    glBindTexture(GL_TEXTURE_2D, l->indexTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R16UI, CLUSTER_INDEX_WIDTH, l->maxIndices / CLUSTER_INDEX_WIDTH, 0,
+                 GL_RED_INTEGER, GL_UNSIGNED_SHORT, NULL);
+    for (int i = 0; i < 3; i++) {
+        glBindTexture(GL_TEXTURE_2D, textures[i]); // Fetched by texel, never filtered
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glUseProgram(l->program);
+    glUniform1i(glGetUniformLocation(l->program, "lights"), 0);
+    glUniform1i(glGetUniformLocation(l->program, "clusters"), 1);
+    glUniform1i(glGetUniformLocation(l->program, "indices"), 2);
+    glUseProgram(0);
+    l->viewportUniform = glGetUniformLocation(l->program, "viewport");
+    l->depthUniform = glGetUniformLocation(l->program, "depthSlices");
+    l->gridUniform = glGetUniformLocation(l->program, "grid");
+    l->twoSidedUniform = glGetUniformLocation(l->program, "twoSided");
+    l->fogUniform = glGetUniformLocation(l->program, "fogEnabled");
+}
+
+/**
+ * Find the clusters one light reaches (scalar path and SIMD tail)
+ * The light's eye-space box is projected at its nearest and farthest
+ * depth, which bounds its screen extent under any frustum, including the
+ * off-axis ones of the stereo eyes.
+ * @param l Light field
+ * @param i Light index
+ * @param mv Camera modelview matrix
+ * @param pr Camera projection matrix
+ */
+void boundLight(LightField* l, int i, const GLfloat* mv, const GLfloat* pr) {
+    float x = l->x[i], y = l->y[i], z = l->z[i], r = l->radius[i];
+    float vx = mv[0] * x + mv[4] * y + mv[8] * z + mv[12];
+    float vy = mv[1] * x + mv[5] * y + mv[9] * z + mv[13];
+    float vz = mv[2] * x + mv[6] * y + mv[10] * z + mv[14];
+    l->viewX[i] = vx;
+    l->viewY[i] = vy;
+    l->viewZ[i] = vz;
+
+    float near = l->slices[0], far = l->slices[CLUSTER_Z];
+    float zmin = -vz - r, zmax = -vz + r;
+    float izn = 1.0f / (zmin > near ? zmin : near), izf = 1.0f / (zmax > near ? zmax : near);
+    float xh = vx + r, xl = vx - r, yh = vy + r, yl = vy - r;
+    float x1 = pr[0] * (xh * izn > xh * izf ? xh * izn : xh * izf) - pr[8];
+    float x0 = pr[0] * (xl * izn < xl * izf ? xl * izn : xl * izf) - pr[8];
+    float y1 = pr[5] * (yh * izn > yh * izf ? yh * izn : yh * izf) - pr[9];
+    float y0 = pr[5] * (yl * izn < yl * izf ? yl * izn : yl * izf) - pr[9];
+    if (zmax <= near || zmin >= far || x1 < -1.0f || x0 > 1.0f || y1 < -1.0f || y0 > 1.0f) {
+        l->bounds[0][i] = CLUSTER_X;
+        l->bounds[1][i] = 0;
+        return;
+    }
+
+    float tiles[4] = {(x0 + 1.0f) * 0.5f * CLUSTER_X, (x1 + 1.0f) * 0.5f * CLUSTER_X,
+                      (y0 + 1.0f) * 0.5f * CLUSTER_Y, (y1 + 1.0f) * 0.5f * CLUSTER_Y};
+    float limits[4] = {CLUSTER_X - 1, CLUSTER_X - 1, CLUSTER_Y - 1, CLUSTER_Y - 1};
+    for (int j = 0; j < 4; j++) {
+        float t = tiles[j] < 0.0f ? 0.0f : tiles[j];
+        l->bounds[j][i] = (int)(t < limits[j] ? t : limits[j]);
+    }
+    int z0 = 0, z1 = 0;
+    for (int k = 1; k < CLUSTER_Z; k++) {
+        z0 += l->slices[k] <= zmin;
+        z1 += l->slices[k] <= zmax;
+    }
+    l->bounds[4][i] = z0;
+    l->bounds[5][i] = z1;
+}
+
+/**
+ * Find the clusters every light reaches, LIGHT_LANES (AVX) or 4 (SSE)
+ * lights per instruction; same results as boundLight()
+ * @param l Light field
+ * @param mv Camera modelview matrix
+ * @param pr Camera projection matrix
+ */
+void boundLights(LightField* l, const GLfloat* mv, const GLfloat* pr) {
+    int i = 0;
+#if defined(__AVX__)
+    const __m256 m0 = _mm256_set1_ps(mv[0]), m1 = _mm256_set1_ps(mv[1]), m2 = _mm256_set1_ps(mv[2]);
+    const __m256 m4 = _mm256_set1_ps(mv[4]), m5 = _mm256_set1_ps(mv[5]), m6 = _mm256_set1_ps(mv[6]);
+    const __m256 m8 = _mm256_set1_ps(mv[8]), m9 = _mm256_set1_ps(mv[9]), m10 = _mm256_set1_ps(mv[10]);
+    const __m256 m12 = _mm256_set1_ps(mv[12]), m13 = _mm256_set1_ps(mv[13]), m14 = _mm256_set1_ps(mv[14]);
+    const __m256 p0 = _mm256_set1_ps(pr[0]), p5 = _mm256_set1_ps(pr[5]);
+    const __m256 p8 = _mm256_set1_ps(pr[8]), p9 = _mm256_set1_ps(pr[9]);
+    const __m256 near = _mm256_set1_ps(l->slices[0]), far = _mm256_set1_ps(l->slices[CLUSTER_Z]);
+    const __m256 one = _mm256_set1_ps(1.0f), minusOne = _mm256_set1_ps(-1.0f), zero = _mm256_setzero_ps();
+    const __m256 halfX = _mm256_set1_ps(0.5f * CLUSTER_X), halfY = _mm256_set1_ps(0.5f * CLUSTER_Y);
+    const __m256 lastX = _mm256_set1_ps(CLUSTER_X - 1), lastY = _mm256_set1_ps(CLUSTER_Y - 1);
+    const __m256 hidden = _mm256_set1_ps(CLUSTER_X);
+    for (; i + 8 <= l->capacity; i += 8) {
+        __m256 x = _mm256_load_ps(l->x + i), y = _mm256_load_ps(l->y + i), z = _mm256_load_ps(l->z + i);
+        __m256 r = _mm256_load_ps(l->radius + i);
+        __m256 vx = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m0, x), _mm256_mul_ps(m4, y)),
+                                  _mm256_add_ps(_mm256_mul_ps(m8, z), m12));
+        __m256 vy = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m1, x), _mm256_mul_ps(m5, y)),
+                                  _mm256_add_ps(_mm256_mul_ps(m9, z), m13));
+        __m256 vz = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m2, x), _mm256_mul_ps(m6, y)),
+                                  _mm256_add_ps(_mm256_mul_ps(m10, z), m14));
+        _mm256_store_ps(l->viewX + i, vx);
+        _mm256_store_ps(l->viewY + i, vy);
+        _mm256_store_ps(l->viewZ + i, vz);
+
+        __m256 zmin = _mm256_sub_ps(_mm256_sub_ps(zero, vz), r), zmax = _mm256_sub_ps(r, vz);
+        __m256 izn = _mm256_div_ps(one, _mm256_max_ps(zmin, near));
+        __m256 izf = _mm256_div_ps(one, _mm256_max_ps(zmax, near));
+        __m256 xh = _mm256_add_ps(vx, r), xl = _mm256_sub_ps(vx, r);
+        __m256 yh = _mm256_add_ps(vy, r), yl = _mm256_sub_ps(vy, r);
+        __m256 x1 = _mm256_sub_ps(_mm256_mul_ps(p0, _mm256_max_ps(_mm256_mul_ps(xh, izn), _mm256_mul_ps(xh, izf))), p8);
+        __m256 x0 = _mm256_sub_ps(_mm256_mul_ps(p0, _mm256_min_ps(_mm256_mul_ps(xl, izn), _mm256_mul_ps(xl, izf))), p8);
+        __m256 y1 = _mm256_sub_ps(_mm256_mul_ps(p5, _mm256_max_ps(_mm256_mul_ps(yh, izn), _mm256_mul_ps(yh, izf))), p9);
+        __m256 y0 = _mm256_sub_ps(_mm256_mul_ps(p5, _mm256_min_ps(_mm256_mul_ps(yl, izn), _mm256_mul_ps(yl, izf))), p9);
+        __m256 visible = _mm256_and_ps(_mm256_cmp_ps(zmax, near, _CMP_GT_OQ), _mm256_cmp_ps(zmin, far, _CMP_LT_OQ));
+        visible = _mm256_and_ps(visible, _mm256_and_ps(_mm256_cmp_ps(x1, minusOne, _CMP_GE_OQ), _mm256_cmp_ps(x0, one, _CMP_LE_OQ)));
+        visible = _mm256_and_ps(visible, _mm256_and_ps(_mm256_cmp_ps(y1, minusOne, _CMP_GE_OQ), _mm256_cmp_ps(y0, one, _CMP_LE_OQ)));
+
+        // Tiles: clamped, then truncated like the scalar cast
+        x0 = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_add_ps(x0, one), halfX), zero), lastX);
+        x1 = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_add_ps(x1, one), halfX), zero), lastX);
+        y0 = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_add_ps(y0, one), halfY), zero), lastY);
+        y1 = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_add_ps(y1, one), halfY), zero), lastY);
+        x0 = _mm256_or_ps(_mm256_and_ps(visible, x0), _mm256_andnot_ps(visible, hidden));
+        x1 = _mm256_and_ps(visible, x1);
+
+        // Slices: count the boundaries in front of each end
+        __m256 z0 = zero, z1 = zero;
+        for (int k = 1; k < CLUSTER_Z; k++) {
+            __m256 boundary = _mm256_set1_ps(l->slices[k]);
+            z0 = _mm256_add_ps(z0, _mm256_and_ps(_mm256_cmp_ps(boundary, zmin, _CMP_LE_OQ), one));
+            z1 = _mm256_add_ps(z1, _mm256_and_ps(_mm256_cmp_ps(boundary, zmax, _CMP_LE_OQ), one));
+        }
+        _mm256_store_si256((__m256i*)(l->bounds[0] + i), _mm256_cvttps_epi32(x0));
+        _mm256_store_si256((__m256i*)(l->bounds[1] + i), _mm256_cvttps_epi32(x1));
+        _mm256_store_si256((__m256i*)(l->bounds[2] + i), _mm256_cvttps_epi32(y0));
+        _mm256_store_si256((__m256i*)(l->bounds[3] + i), _mm256_cvttps_epi32(y1));
+        _mm256_store_si256((__m256i*)(l->bounds[4] + i), _mm256_cvttps_epi32(z0));
+        _mm256_store_si256((__m256i*)(l->bounds[5] + i), _mm256_cvttps_epi32(z1));
+    }
+#elif defined(__SSE2__)
+    const __m128 m0 = _mm_set1_ps(mv[0]), m1 = _mm_set1_ps(mv[1]), m2 = _mm_set1_ps(mv[2]);
+    const __m128 m4 = _mm_set1_ps(mv[4]), m5 = _mm_set1_ps(mv[5]), m6 = _mm_set1_ps(mv[6]);
+    const __m128 m8 = _mm_set1_ps(mv[8]), m9 = _mm_set1_ps(mv[9]), m10 = _mm_set1_ps(mv[10]);
+    const __m128 m12 = _mm_set1_ps(mv[12]), m13 = _mm_set1_ps(mv[13]), m14 = _mm_set1_ps(mv[14]);
+    const __m128 p0 = _mm_set1_ps(pr[0]), p5 = _mm_set1_ps(pr[5]);
+    const __m128 p8 = _mm_set1_ps(pr[8]), p9 = _mm_set1_ps(pr[9]);
+    const __m128 near = _mm_set1_ps(l->slices[0]), far = _mm_set1_ps(l->slices[CLUSTER_Z]);
+    const __m128 one = _mm_set1_ps(1.0f), minusOne = _mm_set1_ps(-1.0f), zero = _mm_setzero_ps();
+    const __m128 halfX = _mm_set1_ps(0.5f * CLUSTER_X), halfY = _mm_set1_ps(0.5f * CLUSTER_Y);
+    const __m128 lastX = _mm_set1_ps(CLUSTER_X - 1), lastY = _mm_set1_ps(CLUSTER_Y - 1);
+    const __m128 hidden = _mm_set1_ps(CLUSTER_X);
+    for (; i + 4 <= l->capacity; i += 4) {
+        __m128 x = _mm_load_ps(l->x + i), y = _mm_load_ps(l->y + i), z = _mm_load_ps(l->z + i);
+        __m128 r = _mm_load_ps(l->radius + i);
+        __m128 vx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, x), _mm_mul_ps(m4, y)), _mm_add_ps(_mm_mul_ps(m8, z), m12));
+        __m128 vy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m1, x), _mm_mul_ps(m5, y)), _mm_add_ps(_mm_mul_ps(m9, z), m13));
+        __m128 vz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m2, x), _mm_mul_ps(m6, y)), _mm_add_ps(_mm_mul_ps(m10, z), m14));
+        _mm_store_ps(l->viewX + i, vx);
+        _mm_store_ps(l->viewY + i, vy);
+        _mm_store_ps(l->viewZ + i, vz);
+
+        __m128 zmin = _mm_sub_ps(_mm_sub_ps(zero, vz), r), zmax = _mm_sub_ps(r, vz);
+        __m128 izn = _mm_div_ps(one, _mm_max_ps(zmin, near));
+        __m128 izf = _mm_div_ps(one, _mm_max_ps(zmax, near));
+        __m128 xh = _mm_add_ps(vx, r), xl = _mm_sub_ps(vx, r);
+        __m128 yh = _mm_add_ps(vy, r), yl = _mm_sub_ps(vy, r);
+        __m128 x1 = _mm_sub_ps(_mm_mul_ps(p0, _mm_max_ps(_mm_mul_ps(xh, izn), _mm_mul_ps(xh, izf))), p8);
+        __m128 x0 = _mm_sub_ps(_mm_mul_ps(p0, _mm_min_ps(_mm_mul_ps(xl, izn), _mm_mul_ps(xl, izf))), p8);
+        __m128 y1 = _mm_sub_ps(_mm_mul_ps(p5, _mm_max_ps(_mm_mul_ps(yh, izn), _mm_mul_ps(yh, izf))), p9);
+        __m128 y0 = _mm_sub_ps(_mm_mul_ps(p5, _mm_min_ps(_mm_mul_ps(yl, izn), _mm_mul_ps(yl, izf))), p9);
+        __m128 visible = _mm_and_ps(_mm_cmpgt_ps(zmax, near), _mm_cmplt_ps(zmin, far));
+        visible = _mm_and_ps(visible, _mm_and_ps(_mm_cmpge_ps(x1, minusOne), _mm_cmple_ps(x0, one)));
+        visible = _mm_and_ps(visible, _mm_and_ps(_mm_cmpge_ps(y1, minusOne), _mm_cmple_ps(y0, one)));
+
+        x0 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_add_ps(x0, one), halfX), zero), lastX);
+        x1 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_add_ps(x1, one), halfX), zero), lastX);
+        y0 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_add_ps(y0, one), halfY), zero), lastY);
+        y1 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_add_ps(y1, one), halfY), zero), lastY);
+        x0 = _mm_or_ps(_mm_and_ps(visible, x0), _mm_andnot_ps(visible, hidden));
+        x1 = _mm_and_ps(visible, x1);
+
+        __m128 z0 = zero, z1 = zero;
+        for (int k = 1; k < CLUSTER_Z; k++) {
+            __m128 boundary = _mm_set1_ps(l->slices[k]);
+            z0 = _mm_add_ps(z0, _mm_and_ps(_mm_cmple_ps(boundary, zmin), one));
+            z1 = _mm_add_ps(z1, _mm_and_ps(_mm_cmple_ps(boundary, zmax), one));
+        }
+        _mm_store_si128((__m128i*)(l->bounds[0] + i), _mm_cvttps_epi32(x0));
+        _mm_store_si128((__m128i*)(l->bounds[1] + i), _mm_cvttps_epi32(x1));
+        _mm_store_si128((__m128i*)(l->bounds[2] + i), _mm_cvttps_epi32(y0));
+        _mm_store_si128((__m128i*)(l->bounds[3] + i), _mm_cvttps_epi32(y1));
+        _mm_store_si128((__m128i*)(l->bounds[4] + i), _mm_cvttps_epi32(z0));
+        _mm_store_si128((__m128i*)(l->bounds[5] + i), _mm_cvttps_epi32(z1));
+    }
+#endif
+    for (; i < l->count; i++) boundLight(l, i, mv, pr);
+}
+
+/**
+ * Bin the lights into the clusters of the current view and upload the
+ * light data and cluster lists for the receiver pass
+ * Flicker follows the simulation tick, so replays and headless runs
+ * light the scene identically.
+ * @param l Light field
+ */
+void binLights(LightField* l) {
+    GLfloat mv[16], pr[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+    glGetFloatv(GL_PROJECTION_MATRIX, pr);
+    boundLights(l, mv, pr);
+
+    // Count the lights per cluster, then fill the lists in light order
+    memset(l->clusters, 0, sizeof(l->clusters));
+    int total = 0;
+    l->binned = 0;
+    for (int i = 0; i < l->count; i++) {
+        int x0 = l->bounds[0][i], x1 = l->bounds[1][i];
+        if (x0 > x1) continue;
+        int y0 = l->bounds[2][i], y1 = l->bounds[3][i], z0 = l->bounds[4][i], z1 = l->bounds[5][i];
+        for (int cz = z0; cz <= z1; cz++) {
+            for (int cy = y0; cy <= y1; cy++) {
+                for (int cx = x0; cx <= x1; cx++) l->clusters[((cz * CLUSTER_Y + cy) * CLUSTER_X + cx) * 2 + 1]++;
+            }
+        }
+        total += (x1 - x0 + 1) * (y1 - y0 + 1) * (z1 - z0 + 1);
+        l->binned++;
+    }
+    if (total > l->maxIndices) {
+        int rows = (total * 2 + CLUSTER_INDEX_WIDTH - 1) / CLUSTER_INDEX_WIDTH;
+        l->maxIndices = rows * CLUSTER_INDEX_WIDTH;
+        free(l->indices);
+        l->indices = calloc(l->maxIndices, sizeof(unsigned short));
+        if (!l->indices) {
+            fprintf(stderr, "Out of memory allocating light clusters\n");
+            exit(1);
+        }
+        glBindTexture(GL_TEXTURE_2D, l->indexTexture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R16UI, CLUSTER_INDEX_WIDTH, rows, 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, NULL);
+    }
+    unsigned int first = 0;
+    for (int c = 0; c < CLUSTER_COUNT; c++) {
+        l->clusters[c * 2] = l->cursor[c] = first;
+        first += l->clusters[c * 2 + 1];
+    }
+    for (int i = 0; i < l->count; i++) {
+        int x0 = l->bounds[0][i], x1 = l->bounds[1][i];
+        if (x0 > x1) continue;
+        for (int cz = l->bounds[4][i]; cz <= l->bounds[5][i]; cz++) {
+            for (int cy = l->bounds[2][i]; cy <= l->bounds[3][i]; cy++) {
+                for (int cx = x0; cx <= x1; cx++) {
+                    l->indices[l->cursor[(cz * CLUSTER_Y + cy) * CLUSTER_X + cx]++] = (unsigned short)i;
+                }
+            }
+        }
+    }
+    l->numIndices = total;
+
+    // Eye-space positions and flickering colors, one texel each
+    float t = frame->tick / LIGHT_FLICKER_TICKS;
+    float* color = l->texels + MAX_LIGHTS * 4;
+    for (int i = 0; i < l->count; i++) {
+        float flicker = 0.6f + 0.4f * valueNoise(t, (float)i, sceneSeed);
+        l->texels[i * 4] = l->viewX[i];
+        l->texels[i * 4 + 1] = l->viewY[i];
+        l->texels[i * 4 + 2] = l->viewZ[i];
+        l->texels[i * 4 + 3] = l->radius[i];
+        color[i * 4] = l->red[i] * flicker;
+        color[i * 4 + 1] = l->green[i] * flicker;
+        color[i * 4 + 2] = l->blue[i] * flicker;
+        color[i * 4 + 3] = 1.0f;
+    }
+
+    glBindTexture(GL_TEXTURE_2D, l->lightTexture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, l->count, 1, GL_RGBA, GL_FLOAT, l->texels);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 1, l->count, 1, GL_RGBA, GL_FLOAT, color);
+    glBindTexture(GL_TEXTURE_2D, l->clusterTexture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CLUSTER_X * CLUSTER_Y, CLUSTER_Z, GL_RG_INTEGER, GL_UNSIGNED_INT, l->clusters);
+    if (total > 0) {
+        glBindTexture(GL_TEXTURE_2D, l->indexTexture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, CLUSTER_INDEX_WIDTH, (total + CLUSTER_INDEX_WIDTH - 1) / CLUSTER_INDEX_WIDTH,
+                        GL_RED_INTEGER, GL_UNSIGNED_SHORT, l->indices);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/**
+ * Draw a glowing point in each lit lantern in view (the posts and lamps
+ * are queued solids)
+ * @param l Light field (binned for the current view)
+ */
+void drawLanternGlow(const LightField* l) {
+    const float* color = l->texels + MAX_LIGHTS * 4;
+    glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT | GL_POINT_BIT);
+    glDisable(GL_LIGHTING);
+    glPointSize(4.0);
+    glBegin(GL_POINTS);
+    for (int i = CABIN_LIGHTS; i < l->count; i++) {
+        if (l->bounds[0][i] > l->bounds[1][i]) continue;
+        glColor3f(fminf(color[i * 4], 1.0f), fminf(color[i * 4 + 1], 1.0f), fminf(color[i * 4 + 2], 1.0f));
+        glVertex3f(l->x[i], l->y[i], l->z[i]);
+    }
+    glEnd();
+    glPopAttrib();
+}
+
+/**
+ * Bin the point lights for the current view and add their light to the
+ * terrain and cabin; only at night
+ * Call after the shadows, with only the camera transform on the
+ * modelview stack (once per eye in stereo)
+ */
+void drawPointLights() {
+    LightField* l = &lightField;
+    l->binned = l->numIndices = 0;
+    if (!l->program || frame->isDay || l->count == 0) return;
+
+    profileBegin(PASS_LIGHT_BIN);
+    binLights(l);
+    profileEnd(PASS_LIGHT_BIN);
+
+    profileBegin(PASS_LIGHTS);
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    float scale = CLUSTER_Z / logf(l->slices[CLUSTER_Z] / l->slices[0]);
+    GLuint textures[3] = {l->lightTexture, l->clusterTexture, l->indexTexture};
+    for (int i = 0; i < 3; i++) {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+    }
+    glUseProgram(l->program);
+    glUniform4f(l->viewportUniform, viewport[0], viewport[1], viewport[2], viewport[3]);
+    glUniform2f(l->depthUniform, scale, -logf(l->slices[0]) * scale);
+    glUniform4i(l->gridUniform, CLUSTER_X, CLUSTER_Y, CLUSTER_Z, CLUSTER_INDEX_WIDTH);
+    glUniform1i(l->fogUniform, glIsEnabled(GL_FOG));
+    glBlendFunc(GL_ONE, GL_ONE); // Added to the lit surfaces
+    glDepthMask(GL_FALSE);
+    glDepthFunc(GL_LEQUAL);
+    drawReceivers(l->twoSidedUniform);
+    glDepthFunc(GL_LESS);
+    glDepthMask(GL_TRUE);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glUseProgram(0);
+    for (int i = 2; i >= 0; i--) {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    drawLanternGlow(l);
+    profileEnd(PASS_LIGHTS);
+}
+
+/**
+ * Allocate the particle pool
+ * @param p Pool to initialize
+ * @param capacity Maximum live particles (rounded up to the SIMD width)
+ * @param seed Seed for particle placement
+ */
+void initParticles(ParticlePool* p, int capacity, unsigned int seed) {
+    float** arrays[PARTICLE_ARRAYS] = {&p->x, &p->y, &p->z, &p->vx, &p->vy, &p->vz, &p->life};
+    p->capacity = (capacity + PARTICLE_LANES - 1) & ~(PARTICLE_LANES - 1);
+    p->count = 0;
+    p->mode = 1;
+    rngSeed(&p->rng, seed, RNG_STREAM_PARTICLES, 0);
+
+    for (int i = 0; i < PARTICLE_ARRAYS; i++) {
+        void* mem = NULL;
+        if (posix_memalign(&mem, 32, p->capacity * sizeof(float)) != 0) {
+            fprintf(stderr, "Out of memory allocating %d particles\n", capacity);
+            exit(1);
+        }
+        memset(mem, 0, p->capacity * sizeof(float));
+        *arrays[i] = mem;
+    }
+    p->flagged = malloc(p->capacity * sizeof(int));
+    p->chunkFlagged = calloc(p->capacity / PARTICLE_CHUNK + 1, sizeof(int));
+    if (!p->flagged || !p->chunkFlagged) {
+        fprintf(stderr, "Out of memory allocating %d particles\n", capacity);
+        exit(1);
+    }
+}
+
+/**
+ * Release the particle pool's storage
+ * @param p Pool to free
+ */
+void freeParticles(ParticlePool* p) {
+    float** arrays[PARTICLE_ARRAYS] = {&p->x, &p->y, &p->z, &p->vx, &p->vy, &p->vz, &p->life};
+    for (int i = 0; i < PARTICLE_ARRAYS; i++) {
+        free(*arrays[i]);
+        *arrays[i] = NULL;
+    }
+    free(p->flagged);
+    free(p->chunkFlagged);
+    p->flagged = p->chunkFlagged = NULL;
+    p->count = p->capacity = 0;
+}
+
+/**
+ * Place a particle at a random position with its mode's initial velocity
+ * @param p Particle pool
+ * @param i Slot to fill
+ * @param y Starting height
+ */
+void spawnParticle(ParticlePool* p, int i, float y) {
+    const PrecipitationParams* w = &precipitationModes[p->mode];
+    p->x[i] = (rngFloat(&p->rng) * 2.0f - 1.0f) * PARTICLE_AREA;
+    p->z[i] = (rngFloat(&p->rng) * 2.0f - 1.0f) * PARTICLE_AREA;
+    p->y[i] = y;
+    p->vx[i] = windX + (rngFloat(&p->rng) - 0.5f) * w->jitter;
+    p->vy[i] = w->terminal * (0.8f + 0.2f * rngFloat(&p->rng));
+    p->vz[i] = windZ + (rngFloat(&p->rng) - 0.5f) * w->jitter;
+    p->life[i] = w->lifetime * (0.5f + 0.5f * rngFloat(&p->rng));
+}
+
+/**
+ * Integrate one chunk of particles and flag those that land or expire
+ * Runs 8 (AVX) or 4 (SSE) particles per instruction. Flagged indices are
+ * written to p->flagged starting at the chunk's first slot.
+ * @param p Particle pool
+ * @param chunk Chunk index (PARTICLE_CHUNK particles each)
+ * @param dt Time step in seconds
+ */
+void integrateParticleChunk(ParticlePool* p, int chunk, float dt) {
+    const PrecipitationParams* w = &precipitationModes[p->mode];
+    float relax = fminf(w->drag * dt, 1.0f); // Fraction of the way to wind speed
+    int begin = chunk * PARTICLE_CHUNK;
+    int end = begin + PARTICLE_CHUNK < p->count ? begin + PARTICLE_CHUNK : p->count;
+    int* flagged = p->flagged + begin;
+    int numFlagged = 0;
+    int i = begin;
+
+#if defined(__AVX__)
+    int padded = (end + 7) & ~7;
+    const __m256 vdt = _mm256_set1_ps(dt), vrelax = _mm256_set1_ps(relax);
+    const __m256 vwindX = _mm256_set1_ps(windX), vwindZ = _mm256_set1_ps(windZ);
+    const __m256 vfall = _mm256_set1_ps(w->gravity * dt), vterminal = _mm256_set1_ps(w->terminal);
+    const __m256 vedge = _mm256_set1_ps(PARTICLE_AREA), vnedge = _mm256_set1_ps(-PARTICLE_AREA);
+    const __m256 vwrap = _mm256_set1_ps(2.0f * PARTICLE_AREA), vzero = _mm256_setzero_ps();
+    for (; i < padded; i += 8) {
+        __m256 vx = _mm256_load_ps(p->vx + i), vy = _mm256_load_ps(p->vy + i), vz = _mm256_load_ps(p->vz + i);
+        vx = _mm256_add_ps(vx, _mm256_mul_ps(_mm256_sub_ps(vwindX, vx), vrelax));
+        vz = _mm256_add_ps(vz, _mm256_mul_ps(_mm256_sub_ps(vwindZ, vz), vrelax));
+        vy = _mm256_max_ps(_mm256_add_ps(vy, vfall), vterminal);
+
+        __m256 x = _mm256_add_ps(_mm256_load_ps(p->x + i), _mm256_mul_ps(vx, vdt));
+        __m256 y = _mm256_add_ps(_mm256_load_ps(p->y + i), _mm256_mul_ps(vy, vdt));
+        __m256 z = _mm256_add_ps(_mm256_load_ps(p->z + i), _mm256_mul_ps(vz, vdt));
+        __m256 life = _mm256_sub_ps(_mm256_load_ps(p->life + i), vdt);
+
+        // Wrap horizontally so wind never empties the area
+        x = _mm256_sub_ps(x, _mm256_and_ps(_mm256_cmp_ps(x, vedge, _CMP_GT_OQ), vwrap));
+        x = _mm256_add_ps(x, _mm256_and_ps(_mm256_cmp_ps(x, vnedge, _CMP_LT_OQ), vwrap));
+        z = _mm256_sub_ps(z, _mm256_and_ps(_mm256_cmp_ps(z, vedge, _CMP_GT_OQ), vwrap));
+        z = _mm256_add_ps(z, _mm256_and_ps(_mm256_cmp_ps(z, vnedge, _CMP_LT_OQ), vwrap));
+
+        _mm256_store_ps(p->x + i, x); _mm256_store_ps(p->y + i, y); _mm256_store_ps(p->z + i, z);
+        _mm256_store_ps(p->vx + i, vx); _mm256_store_ps(p->vy + i, vy); _mm256_store_ps(p->vz + i, vz);
+        _mm256_store_ps(p->life + i, life);
+
+        int bits = _mm256_movemask_ps(_mm256_or_ps(_mm256_cmp_ps(y, vzero, _CMP_LT_OQ),
+                                                   _mm256_cmp_ps(life, vzero, _CMP_LE_OQ)));
+        while (bits) {
+            int lane = __builtin_ctz(bits);
+            bits &= bits - 1;
+            if (i + lane < end) flagged[numFlagged++] = i + lane;
+        }
+    }
+#elif defined(__SSE__)
+    int padded = (end + 3) & ~3;
+    const __m128 vdt = _mm_set1_ps(dt), vrelax = _mm_set1_ps(relax);
+    const __m128 vwindX = _mm_set1_ps(windX), vwindZ = _mm_set1_ps(windZ);
+    const __m128 vfall = _mm_set1_ps(w->gravity * dt), vterminal = _mm_set1_ps(w->terminal);
+    const __m128 vedge = _mm_set1_ps(PARTICLE_AREA), vnedge = _mm_set1_ps(-PARTICLE_AREA);
+    const __m128 vwrap = _mm_set1_ps(2.0f * PARTICLE_AREA), vzero = _mm_setzero_ps();
+    for (; i < padded; i += 4) {
+        __m128 vx = _mm_load_ps(p->vx + i), vy = _mm_load_ps(p->vy + i), vz = _mm_load_ps(p->vz + i);
+        vx = _mm_add_ps(vx, _mm_mul_ps(_mm_sub_ps(vwindX, vx), vrelax));
+        vz = _mm_add_ps(vz, _mm_mul_ps(_mm_sub_ps(vwindZ, vz), vrelax));
+        vy = _mm_max_ps(_mm_add_ps(vy, vfall), vterminal);
+
+        __m128 x = _mm_add_ps(_mm_load_ps(p->x + i), _mm_mul_ps(vx, vdt));
+        __m128 y = _mm_add_ps(_mm_load_ps(p->y + i), _mm_mul_ps(vy, vdt));
+        __m128 z = _mm_add_ps(_mm_load_ps(p->z + i), _mm_mul_ps(vz, vdt));
+        __m128 life = _mm_sub_ps(_mm_load_ps(p->life + i), vdt);
+
+        // Wrap horizontally so wind never empties the area
+        x = _mm_sub_ps(x, _mm_and_ps(_mm_cmpgt_ps(x, vedge), vwrap));
+        x = _mm_add_ps(x, _mm_and_ps(_mm_cmplt_ps(x, vnedge), vwrap));
+        z = _mm_sub_ps(z, _mm_and_ps(_mm_cmpgt_ps(z, vedge), vwrap));
+        z = _mm_add_ps(z, _mm_and_ps(_mm_cmplt_ps(z, vnedge), vwrap));
+
+        _mm_store_ps(p->x + i, x); _mm_store_ps(p->y + i, y); _mm_store_ps(p->z + i, z);
+        _mm_store_ps(p->vx + i, vx); _mm_store_ps(p->vy + i, vy); _mm_store_ps(p->vz + i, vz);
+        _mm_store_ps(p->life + i, life);
+
+        int bits = _mm_movemask_ps(_mm_or_ps(_mm_cmplt_ps(y, vzero), _mm_cmple_ps(life, vzero)));
+        while (bits) {
+            int lane = __builtin_ctz(bits);
+            bits &= bits - 1;
+            if (i + lane < end) flagged[numFlagged++] = i + lane;
+        }
+    }
+#endif
+    for (; i < end; i++) {
+        p->vx[i] += (windX - p->vx[i]) * relax;
+        p->vz[i] += (windZ - p->vz[i]) * relax;
+        p->vy[i] = fmaxf(p->vy[i] + w->gravity * dt, w->terminal);
+        p->x[i] += p->vx[i] * dt;
+        p->y[i] += p->vy[i] * dt;
+        p->z[i] += p->vz[i] * dt;
+        p->life[i] -= dt;
+        if (p->x[i] > PARTICLE_AREA) p->x[i] -= 2.0f * PARTICLE_AREA;
+        if (p->x[i] < -PARTICLE_AREA) p->x[i] += 2.0f * PARTICLE_AREA;
+        if (p->z[i] > PARTICLE_AREA) p->z[i] -= 2.0f * PARTICLE_AREA;
+        if (p->z[i] < -PARTICLE_AREA) p->z[i] += 2.0f * PARTICLE_AREA;
+        if (p->y[i] < 0.0f || p->life[i] <= 0.0f) flagged[numFlagged++] = i;
+    }
+    p->chunkFlagged[chunk] = numFlagged;
+}
+
+/* Worker entry point for integrateParticleChunk() */
+void particleJob(void* ctx, int begin, int end) {
+    ParticlePool* p = ctx;
+    for (int chunk = begin; chunk < end; chunk++) integrateParticleChunk(p, chunk, p->stepDt);
+}
+
+/**
+ * Precipitation system, serial part: start advancing every live particle
+ * by one time step
+ * Chunks are integrated in parallel (particleJob); particles that land or
+ * expire are then respawned (or retired when the weather no longer
+ * emits) by finishParticleStep() in a serial pass so the RNG sequence
+ * stays ordered.
+ * @param ctx Particle pool
+ * @param dt Time step in seconds
+ * @return Chunks to integrate
+ */
+int beginParticleStep(void* ctx, float dt) {
+    ParticlePool* p = ctx;
+    if (environment.weatherMode == 1 || environment.weatherMode == 2) p->mode = environment.weatherMode;
+    p->stepDt = dt;
+    p->stepChunks = (p->count + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK;
+    return p->stepChunks;
+}
+
+/**
+ * Precipitation system, after integration: respawn or retire the
+ * particles that landed, and top the pool up while the weather emits
+ * @param ctx Particle pool
+ */
+void finishParticleStep(void* ctx) {
+    ParticlePool* p = ctx;
+    int emitting = (environment.weatherMode == 1 || environment.weatherMode == 2);
+
+    // Descending order: a retired slot is refilled from the end of the
+    // live range, which never holds an unprocessed flagged particle
+    for (int chunk = p->stepChunks - 1; chunk >= 0; chunk--) {
+        const int* flagged = p->flagged + chunk * PARTICLE_CHUNK;
+        for (int k = p->chunkFlagged[chunk] - 1; k >= 0; k--) {
+            int slot = flagged[k];
+            if (emitting) {
+                spawnParticle(p, slot, PARTICLE_CEILING + rngFloat(&p->rng) * 2.0f);
+                continue;
+            }
+            int last = --p->count;
+            p->x[slot] = p->x[last]; p->y[slot] = p->y[last]; p->z[slot] = p->z[last];
+            p->vx[slot] = p->vx[last]; p->vy[slot] = p->vy[last]; p->vz[slot] = p->vz[last];
+            p->life[slot] = p->life[last];
+        }
+    }
+
+    // Ramp up to a full pool over about a second when weather starts
+    if (emitting && p->count < p->capacity) {
+        int spawn = (int)(p->capacity * p->stepDt) + 1;
+        if (spawn > p->capacity - p->count) spawn = p->capacity - p->count;
+        for (int k = 0; k < spawn; k++) {
+            spawnParticle(p, p->count++, rngFloat(&p->rng) * PARTICLE_CEILING);
+        }
+    }
+}
+
+/**
+ * Write one streak (two vertices) per particle along its velocity
+ * @param p Particle pool
+ * @param begin,end Range of particles to write
+ * @param out Destination holding 6 floats per particle
+ */
+void writeParticleLines(const ParticlePool* p, int begin, int end, float* out) {
+    const PrecipitationParams* w = &precipitationModes[p->mode];
+    float* v = out + begin * 6;
+    for (int i = begin; i < end; i++, v += 6) {
+        v[0] = p->x[i];
+        v[1] = p->y[i];
+        v[2] = p->z[i];
+        v[3] = p->x[i] - p->vx[i] * w->streak;
+        v[4] = p->y[i] - p->vy[i] * w->streak;
+        v[5] = p->z[i] - p->vz[i] * w->streak;
+    }
+}
+
+/**
+ * Render precipitation from the current snapshot
+ * The simulation has already expanded particles into streaks; they are
+ * uploaded together and drawn with a single glDrawArrays call
+ * @param upload Copy this frame's streaks to the buffer (the second
+ *               stereo eye draws the copy the first one made)
+ */
+void drawRainOrSnow(int upload) {
+    if (frame->numParticles == 0) return;
+
+    // Blue for rain, white for snow
+    const PrecipitationParams* w = &precipitationModes[frame->particleMode];
+    glColor3f(w->color[0], w->color[1], w->color[2]);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    if (sceneCache.useBuffers) {
+        if (!precipitationVbo) glGenBuffers(1, &precipitationVbo);
+        glBindBuffer(GL_ARRAY_BUFFER, precipitationVbo);
+        if (upload) glBufferData(GL_ARRAY_BUFFER, frame->numParticles * 6 * sizeof(float), frame->particleLines, GL_STREAM_DRAW);
+        glVertexPointer(3, GL_FLOAT, 0, NULL);
+        glDrawArrays(GL_LINES, 0, frame->numParticles * 2);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    } else {
+        glVertexPointer(3, GL_FLOAT, 0, frame->particleLines);
+        glDrawArrays(GL_LINES, 0, frame->numParticles * 2);
+    }
+    glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+/**
+ * Bake one impostor: a cluster of puffs seen from the side, shaded
+ * brighter toward the top, with noisy, thinning edges
+ * @param texels Atlas (luminance, alpha pairs)
+ * @param cell Atlas cell to fill
+ * @param seed Scene seed
+ */
+void bakeCloudSprite(GLubyte* texels, int cell, unsigned int seed) {
+    float puffs[8][3];      // Center x, y and radius in sprite units ([-1, 1])
+    Rng rng;
+    rngSeed(&rng, seed, RNG_STREAM_CLOUDS, cell);
+    int numPuffs = 4 + rngRange(&rng, 5);
+    for (int i = 0; i < numPuffs; i++) {
+        float x = (rngFloat(&rng) * 2.0f - 1.0f) * 0.5f;
+        puffs[i][2] = 0.25f + 0.2f * rngFloat(&rng) * (1.0f - fabsf(x)); // Biggest in the middle
+        puffs[i][0] = x;
+        puffs[i][1] = (rngFloat(&rng) - 0.4f) * 0.3f;
+    }
+
+    int atlasSize = CLOUD_SPRITE_SIZE * CLOUD_ATLAS_GRID;
+    int x0 = (cell % CLOUD_ATLAS_GRID) * CLOUD_SPRITE_SIZE, y0 = (cell / CLOUD_ATLAS_GRID) * CLOUD_SPRITE_SIZE;
+    for (int py = 0; py < CLOUD_SPRITE_SIZE; py++) {
+        for (int px = 0; px < CLOUD_SPRITE_SIZE; px++) {
+            float u = (px + 0.5f) / CLOUD_SPRITE_SIZE * 2.0f - 1.0f;
+            float v = (py + 0.5f) / CLOUD_SPRITE_SIZE * 2.0f - 1.0f;
+            float thickness = 0.0f, front = -1.0f, shade = 0.0f;
+            for (int i = 0; i < numPuffs; i++) {
+                float dx = u - puffs[i][0], dy = v - puffs[i][1], r = puffs[i][2];
+                float h2 = r * r - dx * dx - dy * dy;
+                if (h2 <= 0.0f) continue;
+                float h = sqrtf(h2);
+                thickness += 2.0f * h;
+                if (h > front) {
+                    front = h;
+                    shade = dy / r; // Upward component of the visible surface normal
+                }
+            }
+            float wisps = 0.6f + 0.8f * valueNoise(u * 6.0f + cell * 17.0f, v * 6.0f, seed + 40);
+            float alpha = 1.0f - expf(-4.0f * thickness * wisps);
+            float light = 0.72f + 0.28f * shade;
+            GLubyte* t = &texels[((y0 + py) * atlasSize + x0 + px) * 2];
+            t[0] = (GLubyte)(fminf(light, 1.0f) * 255.0f);
+            t[1] = (GLubyte)(alpha * 255.0f);
+        }
+    }
+}
+
+/**
+ * Size the cloud layer and the tile it repeats over for a number of clouds
+ * @param l Layer to resize (its clouds are discarded)
+ * @param count Number of clouds
+ */
+void allocCloudLayer(CloudLayer* l, int count) {
+    free(l->clouds);
+    l->count = count;
+    l->clouds = malloc((count ? count : 1) * sizeof(Cloud));
+    if (!l->clouds) {
+        fprintf(stderr, "Out of memory allocating %d clouds\n", count);
+        exit(1);
+    }
+    l->half = fmaxf(CLOUD_MIN_FIELD, sqrtf(count / CLOUD_DENSITY) * 0.5f);
+}
+
+/**
+ * Pick a random cloud
+ * @param c Receives the cloud
+ * @param rng Placement stream
+ * @param half Clouds fall within +/- half of the origin on both axes
+ */
+void placeCloud(Cloud* c, Rng* rng, float half) {
+    c->x = (rngFloat(rng) * 2.0f - 1.0f) * half;
+    c->z = (rngFloat(rng) * 2.0f - 1.0f) * half;
+    c->y = 15.0f + 15.0f * rngFloat(rng);
+    c->size = 2.5f + 4.0f * rngFloat(rng);
+    c->cover = rngFloat(rng);
+    c->phase = rngFloat(rng) * 2.0f * M_PI;
+    c->sprite = rngRange(rng, CLOUD_ATLAS_GRID * CLOUD_ATLAS_GRID);
+}
+
+/* Spawn a cloud entity */
+void spawnCloud(const Cloud* c) {
+    const Archetype* a = &world.archetypes[ARCHETYPE_CLOUD];
+    spawnEntity(ARCHETYPE_CLOUD);
+    int row = a->count - 1;
+    *(float*)entityField(a, row, COLUMN_X) = c->x;
+    *(float*)entityField(a, row, COLUMN_Y) = c->y;
+    *(float*)entityField(a, row, COLUMN_Z) = c->z;
+    *(float*)entityField(a, row, COLUMN_SCALE) = c->size;
+    *(float*)entityField(a, row, COLUMN_COVER) = c->cover;
+    *(float*)entityField(a, row, COLUMN_PHASE) = c->phase;
+    *(int*)entityField(a, row, COLUMN_SPRITE) = c->sprite;
+}
+
+/**
+ * Copy the cloud entities out, in row order
+ * @param out Receives one cloud per cloud entity
+ */
+void gatherClouds(Cloud* out) {
+    const Archetype* a = &world.archetypes[ARCHETYPE_CLOUD];
+    for (int chunk = 0; chunk < usedChunks(a); chunk++) {
+        void* const* c = a->chunks[chunk].columns;
+        const float *x = c[COLUMN_X], *y = c[COLUMN_Y], *z = c[COLUMN_Z], *size = c[COLUMN_SCALE];
+        const float *cover = c[COLUMN_COVER], *phase = c[COLUMN_PHASE];
+        const int* sprite = c[COLUMN_SPRITE];
+        Cloud* p = out + (chunk << ENTITY_CHUNK_SHIFT);
+        for (int r = 0; r < chunkRows(a, chunk); r++) {
+            p[r] = (Cloud){x[r], y[r], z[r], size[r], cover[r], phase[r], sprite[r]};
+        }
+    }
+}
+
+/**
+ * Bake the impostor atlas (once), scatter the cloud layer and spawn its
+ * clouds as entities
+ * Only call while the simulation thread is not running.
+ * @param count Number of clouds
+ * @param seed Scene seed
+ */
+void initClouds(int count, unsigned int seed) {
+    CloudLayer* l = &cloudLayer;
+    if (!l->atlas) {
+        int atlasSize = CLOUD_SPRITE_SIZE * CLOUD_ATLAS_GRID;
+        GLubyte* texels = calloc((size_t)atlasSize * atlasSize, 2);
+        if (!texels) {
+            fprintf(stderr, "Out of memory baking cloud sprites\n");
+            exit(1);
+        }
+        for (int cell = 0; cell < CLOUD_ATLAS_GRID * CLOUD_ATLAS_GRID; cell++) bakeCloudSprite(texels, cell, seed);
+        glGenTextures(1, &l->atlas);
+        glBindTexture(GL_TEXTURE_2D, l->atlas);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        gluBuild2DMipmaps(GL_TEXTURE_2D, GL_LUMINANCE_ALPHA, atlasSize, atlasSize, GL_LUMINANCE_ALPHA,
+                          GL_UNSIGNED_BYTE, texels);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        free(texels);
+        transparent.textures[SPRITE_CLOUD] = l->atlas;
+    }
+
+    allocCloudLayer(l, count > 0 ? count : 0);
+    Rng rng;
+    rngSeed(&rng, seed, RNG_STREAM_CLOUDS, CLOUD_ATLAS_GRID * CLOUD_ATLAS_GRID);
+    for (int i = 0; i < l->count; i++) placeCloud(&l->clouds[i], &rng, l->half);
+
+    // Snapshots are marked as matching until clouds gather or clear
+    clearArchetype(ARCHETYPE_CLOUD);
+    for (int i = 0; i < l->count; i++) spawnCloud(&l->clouds[i]);
+    l->version = world.archetypes[ARCHETYPE_CLOUD].version;
+    for (int i = 0; i < 3; i++) snapshots[i].cloudVersion = l->version;
+    rngSeed(&cloudRng, seed, RNG_STREAM_CLOUDS, CLOUD_ATLAS_GRID * CLOUD_ATLAS_GRID + 1);
+}
+
+/**
+ * Gather or clear away a tenth of the clouds (at least one)
+ * New clouds spread over the tile a layer of the new size repeats over;
+ * the ones cleared away are picked from the same stream.
+ * @param direction 1 to gather, -1 to clear away
+ */
+void resizeClouds(int direction) {
+    const Archetype* a = &world.archetypes[ARCHETYPE_CLOUD];
+    int step = a->count / 10 > 1 ? a->count / 10 : 1;
+    if (direction > 0 && liveEntities() + step <= MAX_ENTITIES) {
+        float half = fmaxf(CLOUD_MIN_FIELD, sqrtf((a->count + step) / CLOUD_DENSITY) * 0.5f);
+        for (int i = 0; i < step; i++) {
+            Cloud c;
+            placeCloud(&c, &cloudRng, half);
+            spawnCloud(&c);
+        }
+    }
+    for (int i = 0; direction < 0 && i < step && a->count > 0; i++) {
+        despawnEntity(*(Entity*)entityField(a, rngRange(&cloudRng, a->count), COLUMN_ENTITY));
+    }
+}
+
+/**
+ * Rebuild the cloud layer from the cloud entities of the frame being
+ * drawn, if clouds gathered or cleared since it was built
+ */
+void updateCloudView() {
+    CloudLayer* l = &cloudLayer;
+    if (frame->cloudVersion <= l->version) return;
+    allocCloudLayer(l, frame->numClouds);
+    memcpy(l->clouds, frame->clouds, l->count * sizeof(Cloud));
+    l->version = frame->cloudVersion;
+}
+
+/**
+ * Add the billboards of the clouds in view to the transparent pass
+ * Clouds drift with the wind and sway with the sun, show up as the
+ * weather's cover allows, and take their tint from the sun's height.
+ * Must be called with only the camera transform on the modelview stack.
+ */
+void collectClouds() {
+    CloudLayer* l = &cloudLayer;
+    l->drawn = 0;
+    if (l->count == 0) return;
+
+    ViewFrustum view;
+    extractFrustum(&view);
+    float cover = cloudCover[frame->weatherMode], side = l->half * 2.0f;
+
+    // Lit white by day (warmer near the horizon), gray in rain, dim blue at night
+    float sun = fmaxf(0.0f, sinf(viewSunAngle)), tint[3];
+    if (frame->isDay) {
+        tint[0] = 1.0f;
+        tint[1] = 0.8f + 0.2f * sun;
+        tint[2] = 0.7f + 0.3f * sun;
+    } else {
+        tint[0] = tint[1] = 0.3f;
+        tint[2] = 0.4f;
+    }
+    float gray = frame->weatherMode == 1 ? 0.7f : 1.0f;
+
+    for (int i = 0; i < l->count; i++) {
+        const Cloud* c = &l->clouds[i];
+        float fade = fminf(1.0f, (cover - c->cover) / CLOUD_FADE);
+        if (fade <= 0.0f) continue;
+
+        // Wrap the drifting layer into the tile centered on the camera
+        float x = c->x + windX * viewTime + 2.0f * sinf(viewSunAngle + c->phase) - view.eye[0];
+        float z = c->z + windZ * viewTime - view.eye[2];
+        x -= side * floorf(x / side + 0.5f);
+        z -= side * floorf(z / side + 0.5f);
+        float dist = sqrtf(x * x + z * z);
+        fade *= fminf(1.0f, (fminf(l->half, TERRAIN_VIEW_DISTANCE) - dist) / 32.0f); // Fade out at the edge
+        if (fade <= 0.0f) continue;
+        x += view.eye[0];
+        z += view.eye[2];
+
+        float min[3] = {x - c->size, c->y - c->size, z - c->size};
+        float max[3] = {x + c->size, c->y + c->size, z + c->size};
+        if (!boxInFrustum(&view, min, max)) continue;
+
+        GLubyte color[4] = {
+            (GLubyte)(tint[0] * gray * 255.0f), (GLubyte)(tint[1] * gray * 255.0f),
+            (GLubyte)(tint[2] * gray * 255.0f), (GLubyte)(fade * 0.9f * 255.0f)
+        };
+        float u0 = (float)(c->sprite % CLOUD_ATLAS_GRID) / CLOUD_ATLAS_GRID;
+        float v0 = (float)(c->sprite / CLOUD_ATLAS_GRID) / CLOUD_ATLAS_GRID;
+        float uv[4] = {u0, v0, u0 + 1.0f / CLOUD_ATLAS_GRID, v0 + 1.0f / CLOUD_ATLAS_GRID};
+        addSprite(x, c->y, z, c->size, c->size * 0.6f, uv, color, SPRITE_CLOUD); // Wider than tall
+        l->drawn++;
+    }
+}
+
+/**
+ * Bake the smoke puff sprite: a soft round blob, brighter on top, whose
+ * edge is broken up by noise
+ */
+void initSmoke() {
+    if (transparent.textures[SPRITE_SMOKE]) return;
+    GLubyte texels[SMOKE_SPRITE_SIZE * SMOKE_SPRITE_SIZE * 2];
+    for (int py = 0; py < SMOKE_SPRITE_SIZE; py++) {
+        for (int px = 0; px < SMOKE_SPRITE_SIZE; px++) {
+            float u = (px + 0.5f) / SMOKE_SPRITE_SIZE * 2.0f - 1.0f;
+            float v = (py + 0.5f) / SMOKE_SPRITE_SIZE * 2.0f - 1.0f;
+            float edge = 1.0f - (u * u + v * v) / (0.75f + 0.25f * valueNoise(u * 4.0f, v * 4.0f, sceneSeed + 50));
+            float alpha = edge > 0.0f ? edge * edge : 0.0f;
+            GLubyte* t = &texels[(py * SMOKE_SPRITE_SIZE + px) * 2];
+            t[0] = (GLubyte)((0.8f + 0.2f * v) * 255.0f);
+            t[1] = (GLubyte)(fminf(alpha, 1.0f) * 255.0f);
+        }
+    }
+    glGenTextures(1, &transparent.textures[SPRITE_SMOKE]);
+    glBindTexture(GL_TEXTURE_2D, transparent.textures[SPRITE_SMOKE]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    gluBuild2DMipmaps(GL_TEXTURE_2D, GL_LUMINANCE_ALPHA, SMOKE_SPRITE_SIZE, SMOKE_SPRITE_SIZE, GL_LUMINANCE_ALPHA,
+                      GL_UNSIGNED_BYTE, texels);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+/**
+ * Add the chimney plume's puffs to the transparent pass
+ * Each puff leaves the chimney top rising, slows down, drifts downwind,
+ * wanders sideways and grows as it thins out. With more puffs each one
+ * is fainter and smaller, so the plume keeps roughly the same density and
+ * the pixels filled grow only with the square root of the count.
+ */
+void collectSmoke() {
+    int count = smokePuffs;
+    if (count == 0) return;
+
+    // The whole plume's bounds over a puff's lifetime
+    ViewFrustum view;
+    extractFrustum(&view);
+    float reach = SMOKE_DRIFT * SMOKE_LIFETIME, wander = SMOKE_SPREAD * sqrtf(SMOKE_LIFETIME);
+    float size = 0.25f + 0.12f * SMOKE_LIFETIME + wander;
+    float top[3] = {layout.cabinX + chimneyTop[0], chimneyTop[1], layout.cabinZ + chimneyTop[2]};
+    float min[3] = {top[0] + fminf(0.0f, windX * reach) - size, top[1] - size,
+                    top[2] + fminf(0.0f, windZ * reach) - size};
+    float max[3] = {top[0] + fmaxf(0.0f, windX * reach) + size,
+                    top[1] + SMOKE_RISE * SMOKE_LIFETIME * 0.5f + size,
+                    top[2] + fmaxf(0.0f, windZ * reach) + size};
+    if (!boxInFrustum(&view, min, max)) return;
+
+    // Lit gray by day, dim blue at night, like the clouds
+    float sun = fmaxf(0.0f, sinf(viewSunAngle)), tint[3];
+    if (frame->isDay) {
+        tint[0] = tint[1] = tint[2] = 0.75f + 0.25f * sun;
+    } else {
+        tint[0] = tint[1] = 0.3f;
+        tint[2] = 0.4f;
+    }
+    float thin = sqrtf(fminf(1.0f, (float)DEFAULT_SMOKE_PUFFS / count));
+    float opacity = SMOKE_OPACITY * thin * 255.0f, scale = sqrtf(thin);
+    static const float uv[4] = {0.0f, 0.0f, 1.0f, 1.0f};
+
+    double clock = viewTime / SMOKE_LIFETIME;
+    for (int i = 0; i < count; i++) {
+        double t = clock + (double)i / count;
+        int born = (int)floor(t);            // Times this puff has left the chimney
+        float u = (float)(t - born), age = u * SMOKE_LIFETIME;
+        GLubyte alpha = (GLubyte)(opacity * fminf(1.0f, u * 10.0f) * (1.0f - u) * (1.0f - u));
+        if (alpha == 0) continue;
+
+        float spread = SMOKE_SPREAD * sqrtf(age);
+        float x = top[0] + windX * SMOKE_DRIFT * age + (latticeNoise(i, born, sceneSeed + 51) * 2.0f - 1.0f) * spread;
+        float y = top[1] + SMOKE_RISE * age * (1.0f - 0.5f * u);
+        float z = top[2] + windZ * SMOKE_DRIFT * age + (latticeNoise(i, born, sceneSeed + 52) * 2.0f - 1.0f) * spread;
+        float half = (0.25f + 0.12f * age) * scale;
+        float gray = 0.55f + 0.35f * u;      // Sooty at the chimney, paler as it spreads
+        GLubyte color[4] = {
+            (GLubyte)(tint[0] * gray * 255.0f), (GLubyte)(tint[1] * gray * 255.0f),
+            (GLubyte)(tint[2] * gray * 255.0f), alpha
+        };
+        addSprite(x, y, z, half, half, uv, color, SPRITE_SMOKE);
+    }
+}
+
+/**
+ * Reallocate the transparent pass's lists for a number of sprites
+ * Only called with the lists empty, so nothing is copied.
+ * @param t Transparent pass
+ * @param count Sprites the lists must hold
+ */
+void reserveSprites(TransparentPass* t, int count) {
+    if (count <= t->capacity) return;
+    void** arrays[8] = {(void**)&t->x, (void**)&t->y, (void**)&t->z, (void**)&t->halfWidth,
+                        (void**)&t->halfHeight, (void**)&t->uv, (void**)&t->color, (void**)&t->texture};
+    const size_t sizes[8] = {sizeof(float), sizeof(float), sizeof(float), sizeof(float),
+                             sizeof(float), 4 * sizeof(float), 4, 1};
+    t->capacity = t->capacity ? t->capacity : 256;
+    while (t->capacity < count) t->capacity *= 2;
+    for (int i = 0; i < 8; i++) {
+        free(*arrays[i]);
+        if (posix_memalign(arrays[i], 32, t->capacity * sizes[i]) != 0) {
+            fprintf(stderr, "Out of memory allocating %d sprites\n", t->capacity);
+            exit(1);
+        }
+    }
+    free(t->verts);
+    free(t->runs);
+    t->verts = malloc((size_t)t->capacity * 4 * sizeof(SpriteVertex));
+    t->runs = malloc((t->capacity + 1) * sizeof(int));
+    if (!t->verts || !t->runs) {
+        fprintf(stderr, "Out of memory allocating %d sprites\n", t->capacity);
+        exit(1);
+    }
+    reserveRadixSort(&t->sorter, t->capacity);
+}
+
+/**
+ * Empty the transparent pass for a new frame
+ * @param count Most sprites the frame can add
+ */
+void beginTransparent(int count) {
+    transparent.count = 0;
+    transparent.numRuns = 0;
+    reserveSprites(&transparent, count);
+}
+
+/**
+ * Add a camera-facing sprite to the transparent pass (within the count
+ * given to beginTransparent())
+ * @param x,y,z Center
+ * @param halfWidth,halfHeight Half extents along the camera's axes
+ * @param uv Texture rectangle (u0, v0, u1, v1)
+ * @param color RGBA
+ * @param texture Texture the sprite is cut from
+ */
+void addSprite(float x, float y, float z, float halfWidth, float halfHeight, const float* uv, const GLubyte* color,
+               SpriteTexture texture) {
+    TransparentPass* t = &transparent;
+    int i = t->count++;
+    t->x[i] = x;
+    t->y[i] = y;
+    t->z[i] = z;
+    t->halfWidth[i] = halfWidth;
+    t->halfHeight[i] = halfHeight;
+    memcpy(&t->uv[i * 4], uv, 4 * sizeof(float));
+    memcpy(&t->color[i * 4], color, 4);
+    t->texture[i] = texture;
+}
+
+/**
+ * Fill the sorter with every sprite's depth key and index, 8 (AVX) or 4
+ * (SSE2) sprites per instruction; same keys as depthSortKey()
+ * @param t Transparent pass
+ * @param mv Camera modelview matrix
+ */
+void keySprites(TransparentPass* t, const GLfloat* mv) {
+    unsigned int* keys = t->sorter.keys[0];
+    int* values = t->sorter.values[0];
+    int i = 0;
+#if defined(__AVX__)
+    const __m256 m2 = _mm256_set1_ps(mv[2]), m6 = _mm256_set1_ps(mv[6]);
+    const __m256 m10 = _mm256_set1_ps(mv[10]), m14 = _mm256_set1_ps(mv[14]);
+    const __m256 sign = _mm256_castsi256_ps(_mm256_set1_epi32((int)0x80000000u));
+    const __m256 ones = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    for (; i + 8 <= t->count; i += 8) {
+        __m256 x = _mm256_load_ps(t->x + i), y = _mm256_load_ps(t->y + i), z = _mm256_load_ps(t->z + i);
+        __m256 vz = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(m2, x), _mm256_mul_ps(m6, y)),
+                                  _mm256_add_ps(_mm256_mul_ps(m10, z), m14));
+        __m256 flip = _mm256_blendv_ps(sign, ones, vz); // All bits for negative depths, else the sign
+        _mm256_storeu_ps((float*)(keys + i), _mm256_xor_ps(vz, flip));
+        _mm256_storeu_si256((__m256i*)(values + i), _mm256_setr_epi32(i, i + 1, i + 2, i + 3, i + 4, i + 5, i + 6, i + 7));
+    }
+#elif defined(__SSE2__)
+    const __m128 m2 = _mm_set1_ps(mv[2]), m6 = _mm_set1_ps(mv[6]);
+    const __m128 m10 = _mm_set1_ps(mv[10]), m14 = _mm_set1_ps(mv[14]);
+    const __m128i sign = _mm_set1_epi32((int)0x80000000u), step = _mm_set1_epi32(4);
+    __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+    for (; i + 4 <= t->count; i += 4) {
+        __m128 x = _mm_load_ps(t->x + i), y = _mm_load_ps(t->y + i), z = _mm_load_ps(t->z + i);
+        __m128 vz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m2, x), _mm_mul_ps(m6, y)), _mm_add_ps(_mm_mul_ps(m10, z), m14));
+        __m128i bits = _mm_castps_si128(vz);
+        __m128i flip = _mm_or_si128(_mm_srai_epi32(bits, 31), sign);
+        _mm_storeu_si128((__m128i*)(keys + i), _mm_xor_si128(bits, flip));
+        _mm_storeu_si128((__m128i*)(values + i), index);
+        index = _mm_add_epi32(index, step);
+    }
+#endif
+    for (; i < t->count; i++) {
+        keys[i] = depthSortKey((mv[2] * t->x[i] + mv[6] * t->y[i]) + (mv[10] * t->z[i] + mv[14]));
+        values[i] = i;
+    }
+}
+
+/**
+ * Sort the collected sprites back to front for the current camera and
+ * build their quads in draw order
+ * Must be called with only the camera transform on the modelview stack.
+ */
+void sortTransparent() {
+    TransparentPass* t = &transparent;
+    t->numRuns = 0;
+    if (t->count == 0) return;
+
+    GLfloat mv[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+    keySprites(t, mv);
+    t->order = radixSort(&t->sorter, t->count);
+
+    // Expand each sprite into a quad facing the camera
+    float right[3] = {mv[0], mv[4], mv[8]}, up[3] = {mv[1], mv[5], mv[9]};
+    static const float corners[4][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, 1}};
+    SpriteVertex* v = t->verts;
+    for (int k = 0; k < t->count; k++) {
+        int i = t->order[k];
+        if (k == 0 || t->texture[i] != t->texture[t->order[k - 1]]) t->runs[t->numRuns++] = k;
+        const float* uv = &t->uv[i * 4];
+        for (int c = 0; c < 4; c++) {
+            float sx = corners[c][0] * t->halfWidth[i], sy = corners[c][1] * t->halfHeight[i];
+            v->pos[0] = t->x[i] + right[0] * sx + up[0] * sy;
+            v->pos[1] = t->y[i] + right[1] * sx + up[1] * sy;
+            v->pos[2] = t->z[i] + right[2] * sx + up[2] * sy;
+            v->uv[0] = uv[corners[c][0] < 0.0f ? 0 : 2];
+            v->uv[1] = uv[corners[c][1] < 0.0f ? 1 : 3];
+            memcpy(v->color, &t->color[i * 4], 4);
+            v++;
+        }
+    }
+    t->runs[t->numRuns] = t->count;
+    if (sceneCache.useBuffers) {
+        if (!t->vbo) glGenBuffers(1, &t->vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, t->vbo);
+        glBufferData(GL_ARRAY_BUFFER, (size_t)t->count * 4 * sizeof(SpriteVertex), t->verts, GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+}
+
+/**
+ * Draw the sprites sorted by the last sortTransparent(), one draw call
+ * per run sharing a texture
+ */
+void drawTransparent() {
+    TransparentPass* t = &transparent;
+    if (t->numRuns == 0) return;
+
+    glPushAttrib(GL_ENABLE_BIT | GL_DEPTH_BUFFER_BIT | GL_TEXTURE_BIT);
+    glDisable(GL_LIGHTING);
+    glEnable(GL_TEXTURE_2D);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    glDepthMask(GL_FALSE); // Hidden by the solids, never by each other
+
+    const char* base = (const char*)t->verts;
+    if (sceneCache.useBuffers) {
+        glBindBuffer(GL_ARRAY_BUFFER, t->vbo);
+        base = NULL;
+    }
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(3, GL_FLOAT, sizeof(SpriteVertex), base + offsetof(SpriteVertex, pos));
+    glTexCoordPointer(2, GL_FLOAT, sizeof(SpriteVertex), base + offsetof(SpriteVertex, uv));
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(SpriteVertex), base + offsetof(SpriteVertex, color));
+    for (int r = 0; r < t->numRuns; r++) {
+        int first = t->runs[r];
+        glBindTexture(GL_TEXTURE_2D, t->textures[t->texture[t->order[first]]]);
+        glDrawArrays(GL_QUADS, first * 4, (t->runs[r + 1] - first) * 4);
+    }
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    if (sceneCache.useBuffers) glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glPopAttrib();
+}
+
+/**
+ * Set the camera transform, keeping the eye above the ground
+ * @param dx,dz Eye-space offset of the viewpoint (stereo eyes and their
+ *              shared culling view; 0 for the mono camera)
+ */
+void loadCamera(float dx, float dz) {
+    float a = cameraAngle * M_PI / 180.0;
+    float groundY = fmaxf(terrainHeight(cameraX, cameraZ),
+                          terrainHeight(cameraX + zoom * sinf(a), cameraZ - zoom * cosf(a)) - 3.0f);
+    glLoadIdentity();
+    glTranslatef(dx, -5.0, zoom + dz); // Position camera
+    glRotatef(cameraAngle, 0.0, 1.0, 0.0); // Rotate view
+    glTranslatef(-cameraX, -groundY, -cameraZ); // Look at the camera's ground point
+}
+
+/**
+ * Keep the current matrices and viewport for mouse picking
+ */
+void storePickView() {
+    glGetDoublev(GL_MODELVIEW_MATRIX, pick.modelview);
+    glGetDoublev(GL_PROJECTION_MATRIX, pick.projection);
+    glGetIntegerv(GL_VIEWPORT, pick.viewport);
+}
+
+/**
+ * Create the layers layout's targets: a two-layer color texture array
+ * and one framebuffer per layer sharing a depth buffer
+ * @param width,height Size of one eye's image
+ * @return 1 if both framebuffers are complete
+ */
+int createStereoLayers(int width, int height) {
+    if (!glVersionAtLeast(3, 0)) return 0; // Texture arrays and layer attachments
+    if (!stereo.layers) {
+        glGenTextures(1, &stereo.layers);
+        glGenRenderbuffers(1, &stereo.depth);
+        glGenFramebuffers(2, stereo.fbos);
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, stereo.layers);
+    glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, width, height, 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    glBindRenderbuffer(GL_RENDERBUFFER, stereo.depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+    int complete = 1;
+    for (int i = 0; i < 2; i++) {
+        glBindFramebuffer(GL_FRAMEBUFFER, stereo.fbos[i]);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, stereo.layers, 0, i);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, stereo.depth);
+        complete &= glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    stereo.layerWidth = width;
+    stereo.layerHeight = height;
+    return complete;
+}
+
+/**
+ * Start a stereo frame: size the eye images for the frame, (re)create
+ * the layers when needed and save the mono projection
+ */
+void beginStereo() {
+    stereo.width = dynamicRes.width / 2 > 0 ? dynamicRes.width / 2 : 1;
+    stereo.height = dynamicRes.height;
+
+    // Sized for the whole window, so scaled frames use part of them
+    int width = windowWidth / 2 > 0 ? windowWidth / 2 : 1;
+    if (stereo.layout == STEREO_LAYERS &&
+        (stereo.layerWidth != width || stereo.layerHeight != windowHeight) &&
+        !createStereoLayers(width, windowHeight)) {
+        printf("Stereo layers unsupported, drawing side by side\n");
+        stereo.layout = STEREO_SIDE_BY_SIDE;
+    }
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glMatrixMode(GL_MODELVIEW);
+}
+
+/**
+ * Load the projection and camera transform of one eye, or of the view
+ * the eyes share for culling: a frustum whose apex sits behind them and
+ * whose sides take the outer eye's edges, so it encloses both
+ * @param eye -1 left, 1 right, 0 both
+ */
+void loadStereoView(int eye) {
+    float near = 1.0f, far = TERRAIN_VIEW_DISTANCE;
+    float top = near * tanf(STEREO_FOV * M_PI / 360.0f), right = top * stereo.width / stereo.height;
+    float half = stereo.ipd * 0.5f, shift = half * near / stereo.convergence;
+
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    if (eye) {
+        // Off-axis frusta: both eyes' images coincide at the convergence distance
+        glFrustum(-right - eye * shift, right - eye * shift, -top, top, near, far);
+        glMatrixMode(GL_MODELVIEW);
+        loadCamera(-eye * half, 0.0f);
+        return;
+    }
+    float back = half * near / (right + shift), scale = (near + back) / near;
+    glFrustum(-(right + shift) * scale, (right + shift) * scale, -top * scale, top * scale, near + back, far + back);
+    glMatrixMode(GL_MODELVIEW);
+    loadCamera(0.0f, -back);
+}
+
+/**
+ * Direct drawing at one eye's image and load its view
+ * @param eye -1 left, 1 right
+ */
+void beginEye(int eye) {
+    int index = eye > 0;
+    if (stereo.layout == STEREO_LAYERS) {
+        glBindFramebuffer(GL_FRAMEBUFFER, stereo.fbos[index]);
+        glViewport(0, 0, stereo.width, stereo.height);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    } else {
+        glViewport(index * stereo.width, 0, stereo.width, stereo.height);
+    }
+    loadStereoView(eye);
+}
+
+/**
+ * Finish a stereo frame: copy the layers side by side into the frame
+ * (layers layout) and restore the mono viewport and projection
+ */
+void endStereo() {
+    if (stereo.layout == STEREO_LAYERS) {
+        profileBegin(PASS_COMPOSE);
+        glBindFramebuffer(GL_FRAMEBUFFER, dynamicRes.sceneFbo);
+        for (int i = 0; i < 2; i++) {
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, stereo.fbos[i]);
+            glBlitFramebuffer(0, 0, stereo.width, stereo.height, i * stereo.width, 0, (i + 1) * stereo.width,
+                              stereo.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, dynamicRes.sceneFbo);
+        profileEnd(PASS_COMPOSE);
+    }
+    glViewport(0, 0, dynamicRes.width, dynamicRes.height);
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+}
+
+/**
+ * Size the offscreen target to the window
+ * @param d Dynamic resolution state
+ * @param width,height Window size
+ * @return 1 if the framebuffer is complete
+ */
+int createDynamicTarget(DynamicResolution* d, int width, int height) {
+    if (!d->fbo) {
+        glGenFramebuffers(1, &d->fbo);
+        glGenRenderbuffers(1, &d->color);
+        glGenRenderbuffers(1, &d->depth);
+    }
+    glBindRenderbuffer(GL_RENDERBUFFER, d->color);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, d->depth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, d->fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, d->color);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, d->depth);
+    int complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    d->targetWidth = width;
+    d->targetHeight = height;
+    return complete;
+}
+
+/**
+ * Check for framebuffer blits and timestamp queries, and settle whether
+ * scaling starts on
+ */
+void initDynamicResolution() {
+    DynamicResolution* d = &dynamicRes;
+    d->supported = glVersionAtLeast(3, 0); // Framebuffer objects and blits
+    d->timestamps = glVersionAtLeast(3, 3) || hasExtension("GL_ARB_timer_query");
+    if (d->timestamps) glGenQueries(2 * DYNRES_QUERY_FRAMES, &d->queries[0][0]);
+    if (d->enabled < 0) d->enabled = !headless;
+    if (d->enabled && !d->supported) {
+        printf("Dynamic resolution unsupported (needs OpenGL 3.0)\n");
+        d->enabled = 0;
+    }
+}
+
+/**
+ * Forget the statistics gathered so far (the benchmark's warmup)
+ */
+void resetDynamicResolutionStats() {
+    DynamicResolution* d = &dynamicRes;
+    d->drops = d->raises = 0;
+    d->frames = 0;
+    d->scaleSum = 0.0;
+    d->minScale = d->scale;
+}
+
+/**
+ * Direct the frame's scene at the offscreen target, at the current scale
+ * Sets dynamicRes.width and height, the viewport and the scale that picks
+ * primitive detail levels; with scaling off the scene goes straight to the
+ * window. Timestamp results from earlier frames are collected if they have
+ * arrived, never waited on.
+ */
+void beginDynamicResolution() {
+    DynamicResolution* d = &dynamicRes;
+    d->sceneFbo = 0;
+    d->width = windowWidth;
+    d->height = windowHeight;
+    if (d->enabled && (d->targetWidth != windowWidth || d->targetHeight != windowHeight) &&
+        !createDynamicTarget(d, windowWidth, windowHeight)) {
+        printf("Dynamic resolution target incomplete, drawing at full size\n");
+        d->enabled = 0;
+    }
+    if (d->enabled) {
+        d->width = (int)(windowWidth * d->scale + 0.5f) > 0 ? (int)(windowWidth * d->scale + 0.5f) : 1;
+        d->height = (int)(windowHeight * d->scale + 0.5f) > 0 ? (int)(windowHeight * d->scale + 0.5f) : 1;
+        d->sceneFbo = d->fbo;
+        glBindFramebuffer(GL_FRAMEBUFFER, d->fbo);
+        if (d->timestamps) {
+            d->slot = (d->slot + 1) % DYNRES_QUERY_FRAMES;
+            GLint ready = 0;
+            if (d->issued[d->slot]) glGetQueryObjectiv(d->queries[d->slot][1], GL_QUERY_RESULT_AVAILABLE, &ready);
+            if (ready) {
+                GLuint64 start = 0, end = 0;
+                glGetQueryObjectui64v(d->queries[d->slot][0], GL_QUERY_RESULT, &start);
+                glGetQueryObjectui64v(d->queries[d->slot][1], GL_QUERY_RESULT, &end);
+                d->gpuMs = (end - start) / 1e6;
+            }
+            d->issued[d->slot] = 0;
+            glQueryCounter(d->queries[d->slot][0], GL_TIMESTAMP);
+        }
+    }
+    glViewport(0, 0, d->width, d->height);
+    primitivePixelScale = d->height / (2.0f * tanf(45.0f * M_PI / 360.0f));
+    d->frameStart = nowSeconds();
+}
+
+/**
+ * Pick the next frame's scale from the measured frame time
+ * Pixel cost goes with area, so the sides scale by the square root of the
+ * ratio between the budget and the smoothed time, at most DYNRES_MAX_STEP
+ * per decision.
+ * @param d Dynamic resolution state
+ */
+void updateDynamicResolution(DynamicResolution* d) {
+    float ms = fmaxf(d->cpuMs, d->gpuMs);
+    d->filteredMs = d->frames == 0 ? ms : d->filteredMs + (ms - d->filteredMs) * DYNRES_SMOOTHING;
+    d->frames++;
+    d->scaleSum += d->scale;
+    d->minScale = fminf(d->minScale, d->scale);
+    if (d->settle > 0) {
+        d->settle--; // The last change has not shown in the timings yet
+        return;
+    }
+    if (d->filteredMs <= 0.0f) return;
+
+    float scale = d->scale, grow = d->targetMs * DYNRES_HEADROOM;
+    if (d->filteredMs > d->targetMs) scale *= fmaxf(sqrtf(d->targetMs / d->filteredMs), 1.0f / DYNRES_MAX_STEP);
+    else if (d->filteredMs < grow) scale *= fminf(sqrtf(grow / d->filteredMs), DYNRES_MAX_STEP);
+    scale = fmaxf(DYNRES_MIN_SCALE, fminf(scale, 1.0f));
+    if (fabsf(scale - d->scale) < 0.01f) return; // Not worth a change
+
+    if (scale < d->scale) d->drops++;
+    else d->raises++;
+    d->filteredMs *= scale * scale / (d->scale * d->scale); // Expected time at the new size
+    d->scale = scale;
+    d->settle = DYNRES_SETTLE_FRAMES;
+}
+
+/**
+ * Stretch the scene over the window and let the controller pick the next
+ * frame's scale
+ */
+void endDynamicResolution() {
+    DynamicResolution* d = &dynamicRes;
+    if (!d->enabled) return;
+    profileBegin(PASS_UPSCALE);
+    if (d->timestamps) {
+        glQueryCounter(d->queries[d->slot][1], GL_TIMESTAMP);
+        d->issued[d->slot] = 1;
+    }
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, d->fbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+    glBlitFramebuffer(0, 0, d->width, d->height, 0, 0, windowWidth, windowHeight, GL_COLOR_BUFFER_BIT,
+                      d->width == windowWidth && d->height == windowHeight ? GL_NEAREST : GL_LINEAR);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, windowWidth, windowHeight);
+    profileEnd(PASS_UPSCALE);
+    d->cpuMs = (nowSeconds() - d->frameStart) * 1000.0;
+    updateDynamicResolution(d);
+}
+
+/**
+ * Render every pass of the scene for the mono camera or one eye
+ * Drawing both eyes this way repeats all the work (the benchmark's
+ * baseline for drawStereo())
+ * @param eye -1 left, 1 right, 0 the mono camera
+ */
+void drawView(int eye) {
+    if (eye) beginEye(eye);
+    else loadCamera(0.0f, 0.0f);
+    if (eye <= 0) storePickView(); // Mouse picking uses this frame's camera (the left eye in stereo)
+    beginOcclusion(); // Rasterized while the terrain is streamed and drawn
+
+    // Update lighting based on time
+    updateLighting();
+    
+    // Enable fog if in fog weather mode
+    if (frame->weatherMode == 3) drawFog();
+
+    /* DRAW SCENE ELEMENTS */
+    drawStaticScene(); // Terrain, cabin and trees
+
+    // People are skinned into one buffer; the lanterns are queued and
+    // drawn together as instanced solids, sorted by state
+    renderQueueBegin();
+
+    // Draw the characters in view, between their last two positions
+    profileBegin(PASS_INDEX);
+    updatePeopleIndex();
+    profileEnd(PASS_INDEX);
+    profileBegin(PASS_PEOPLE);
+    ViewFrustum view;
+    extractFrustum(&view);
+    view.occlusion = waitOcclusion();
+    sceneIndex.visiblePeople = 0;
+    beginCrowdSkinning();
+    bvhCull(&sceneIndex.people, &view, drawVisiblePerson, &view);
+    profileEnd(PASS_PEOPLE);
+    profileBegin(PASS_ANIMATION);
+    skinCrowd();
+    drawSkinnedCrowd();
+    profileEnd(PASS_ANIMATION);
+
+    profileBegin(PASS_QUEUE);
+    queueLanterns();
+    renderQueueFlush();
+    profileEnd(PASS_QUEUE);
+
+    // Sun/moon shadows on the terrain and cabin
+    drawShadows();
+
+    // Window, chimney and lantern light after dark
+    drawPointLights();
+
+    // Draw precipitation (particles drain after the weather clears); the
+    // streaks are opaque and write depth like the solids
+    profileBegin(PASS_PRECIPITATION);
+    drawRainOrSnow(1);
+    profileEnd(PASS_PRECIPITATION);
+
+    // Cloud layer and chimney smoke, blended back to front over the rest
+    beginTransparent(cloudLayer.count + smokePuffs);
+    profileBegin(PASS_CLOUDS);
+    collectClouds();
+    profileEnd(PASS_CLOUDS);
+    profileBegin(PASS_SMOKE);
+    collectSmoke();
+    profileEnd(PASS_SMOKE);
+    profileBegin(PASS_SORT);
+    sortTransparent();
+    profileEnd(PASS_SORT);
+    profileBegin(PASS_TRANSPARENT);
+    drawTransparent();
+    profileEnd(PASS_TRANSPARENT);
+}
+
+/**
+ * Render both eyes from one traversal of the scene
+ * Everything view-dependent is decided once from the shared view; each
+ * eye only replays the prepared draws with its own matrices.
+ */
+void drawStereo() {
+    loadStereoView(0);
+    updateLighting();
+    if (frame->weatherMode == 3) drawFog();
+
+    profileBegin(PASS_TERRAIN);
+    cullCameraTerrain();
+    profileEnd(PASS_TERRAIN);
+
+    renderQueueBegin();
+    profileBegin(PASS_INDEX);
+    updatePeopleIndex();
+    profileEnd(PASS_INDEX);
+    profileBegin(PASS_PEOPLE);
+    ViewFrustum view;
+    extractFrustum(&view);
+    sceneIndex.visiblePeople = 0;
+    beginCrowdSkinning();
+    bvhCull(&sceneIndex.people, &view, drawVisiblePerson, NULL);
+    profileEnd(PASS_PEOPLE);
+    profileBegin(PASS_ANIMATION);
+    skinCrowd();
+    profileEnd(PASS_ANIMATION);
+    profileBegin(PASS_QUEUE);
+    queueLanterns();
+    renderQueuePack();
+    profileEnd(PASS_QUEUE);
+
+    // Shadow casters reclassify the forest, so the maps go before the camera's trees
+    GLfloat camera[16], projection[16];
+    glGetFloatv(GL_MODELVIEW_MATRIX, camera);
+    glGetFloatv(GL_PROJECTION_MATRIX, projection);
+    int shadowed = updateShadows(camera, projection);
+    profileBegin(PASS_FOREST);
+    if (useSceneCache) classifyForestChunks(&forest, &view); // Also culls the cabin
+    profileEnd(PASS_FOREST);
+    beginTransparent(cloudLayer.count + smokePuffs);
+    profileBegin(PASS_CLOUDS);
+    collectClouds();
+    profileEnd(PASS_CLOUDS);
+    profileBegin(PASS_SMOKE);
+    collectSmoke();
+    profileEnd(PASS_SMOKE);
+    profileBegin(PASS_SORT);
+    sortTransparent(); // One order for both eyes, from the shared view
+    profileEnd(PASS_SORT);
+
+    for (int eye = -1; eye <= 1; eye += 2) {
+        beginEye(eye);
+        if (eye < 0) storePickView();
+        GLfloat eyeCamera[16];
+        glGetFloatv(GL_MODELVIEW_MATRIX, eyeCamera);
+        ViewFrustum eyeView;
+        extractFrustum(&eyeView);
+
+        profileBegin(PASS_TERRAIN);
+        drawTerrainChunks(terrain.cameraDraws, terrain.numCameraDraws);
+        profileEnd(PASS_TERRAIN);
+        if (useSceneCache) {
+            profileBegin(PASS_FOREST);
+            drawForestChunks(&forest);
+            profileEnd(PASS_FOREST);
+            profileBegin(PASS_STATIC);
+            if (sceneIndex.cabinVisible) drawSceneCache();
+            profileEnd(PASS_STATIC);
+        } else {
+            profileBegin(PASS_CABIN);
+            drawCabinImmediate();
+            profileEnd(PASS_CABIN);
+            profileBegin(PASS_FOREST);
+            drawForestImmediate();
+            profileEnd(PASS_FOREST);
+        }
+        profileBegin(PASS_ANIMATION);
+        drawSkinnedCrowd();
+        profileEnd(PASS_ANIMATION);
+        profileBegin(PASS_QUEUE);
+        renderQueue.drawCalls = renderQueueDraw(&renderQueue);
+        profileEnd(PASS_QUEUE);
+        if (shadowed) {
+            profileBegin(PASS_SHADOW_APPLY);
+            applyShadows(&shadows, eyeCamera, &eyeView);
+            profileEnd(PASS_SHADOW_APPLY);
+        }
+        drawPointLights(); // Binned per eye: the clusters follow each eye's frustum
+        profileBegin(PASS_PRECIPITATION);
+        drawRainOrSnow(eye < 0);
+        profileEnd(PASS_PRECIPITATION);
+        profileBegin(PASS_TRANSPARENT);
+        drawTransparent();
+        profileEnd(PASS_TRANSPARENT);
+    }
+}
+
+/**
+ * Main display function - renders entire scene
+ * Called whenever the display needs updating
+ */
+void display() {
+    // Pick up the latest finished simulation tick, and any trees, lanterns or clouds it changed
+    acquireSnapshot();
+    updateForestView(&forest);
+    updateLightView();
+    updateCloudView();
+    replayViewInput(frame->tick);
+    profileFrameBegin();
+    primitiveTriangles = 0;
+
+    // Clear buffers (offscreen, at a reduced size, when scaling)
+    beginDynamicResolution();
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    if (!stereo.enabled) {
+        drawView(0);
+    } else {
+        beginStereo();
+        if (stereo.naive) {
+            drawView(-1);
+            drawView(1);
+        } else {
+            drawStereo();
+        }
+        endStereo();
+    }
+
+    // Ensure fog is disabled for next frame
+    glDisable(GL_FOG);
+
+    // The HUD goes on top at the window's full size
+    endDynamicResolution();
+    drawProfileHud();
+    
+    // Read the frame back for capture before it is swapped away
+    if (captureTarget) captureFrame();
+    profileFrameEnd();
+    if (!headless) glutSwapBuffers();
+    else if (!captureTarget) glFinish(); // Benchmarking: just wait for the frame to complete
+}
+
+/**
+ * Keyboard input handler
+ * @param key ASCII key pressed
+ * @param x X coordinate of mouse when key pressed
+ * @param y Y coordinate of mouse when key pressed
+ */
+void keyboard(unsigned char key, int x, int y) {
+    if ((key == 'r' || key == 'R') && capture.running) {
+        finishCapture(); // Not an input to record: only ends the capture
+        return;
+    }
+    if (replayEvents) return; // Input comes from the recording
+    switch (key) {
+        case 'd': case 'D': 
+            postSimCommand(SIM_SET_DAY, 1); // Switch to daytime
+            break;
+        case 'n': case 'N': 
+            postSimCommand(SIM_SET_DAY, 0); // Switch to nighttime
+            break;
+        case 'w': case 'W':
+            // Cycle through weather modes
+            postSimCommand(SIM_CYCLE_WEATHER, 0);
+            break;
+        case ']':
+            postSimCommand(SIM_RESIZE_CROWD, 1); // More villagers
+            break;
+        case '[':
+            postSimCommand(SIM_RESIZE_CROWD, -1); // Fewer villagers
+            break;
+        case '}':
+            postSimCommand(SIM_RESIZE_FOREST, 1); // More trees
+            break;
+        case '{':
+            postSimCommand(SIM_RESIZE_FOREST, -1); // Fewer trees
+            break;
+        case '>':
+            postSimCommand(SIM_RESIZE_LANTERNS, 1); // More lanterns
+            break;
+        case '<':
+            postSimCommand(SIM_RESIZE_LANTERNS, -1); // Fewer lanterns
+            break;
+        case ')':
+            postSimCommand(SIM_RESIZE_CLOUDS, 1); // More clouds
+            break;
+        case '(':
+            postSimCommand(SIM_RESIZE_CLOUDS, -1); // Fewer clouds
+            break;
+        default:
+            if (applyViewKey(key, 0)) recordViewInput(key, 0);
+            break;
+    }
+}
+
+/**
+ * Apply a key that only affects the view (camera, overlays, draw path)
+ * @param key ASCII key or GLUT special key constant
+ * @param special 1 for GLUT special keys
+ * @return 1 if the key was handled
+ */
+int applyViewKey(int key, int special) {
+    if (special) {
+        switch (key) {
+            case GLUT_KEY_LEFT: 
+                cameraAngle -= 2.0; // Rotate view left
+                return 1;
+            case GLUT_KEY_RIGHT: 
+                cameraAngle += 2.0; // Rotate view right
+                return 1;
+            case GLUT_KEY_UP: case GLUT_KEY_DOWN: {
+                // Move along the view direction, staying on the terrain
+                float step = key == GLUT_KEY_UP ? TERRAIN_PAN_STEP : -TERRAIN_PAN_STEP;
+                float edge = terrainSize * 0.5f - TERRAIN_CHUNK_SIZE;
+                cameraX += step * sinf(cameraAngle * M_PI / 180.0);
+                cameraZ -= step * cosf(cameraAngle * M_PI / 180.0);
+                cameraX = fmaxf(-edge, fminf(cameraX, edge));
+                cameraZ = fmaxf(-edge, fminf(cameraZ, edge));
+                return 1;
+            }
+        }
+        return 0;
+    }
+    switch (key) {
+        case '+': 
+            zoom += 1.0; // Zoom in
+            return 1;
+        case '-': 
+            zoom -= 1.0; // Zoom out
+            return 1;
+        case 'h': case 'H':
+            // Toggle the timing overlay (timings are only collected while needed)
+            showProfileHud = !showProfileHud;
+            setProfiling(showProfileHud || profileCsvPath);
+            return 1;
+        case 's': case 'S':
+            shadows.enabled = !shadows.enabled && shadows.program;
+            printf("Shadows: %s\n", shadows.enabled ? "on" : "off");
+            return 1;
+        case 'c': case 'C':
+            // Toggle cached/immediate static geometry for comparison
+            useSceneCache = !useSceneCache;
+            printf("Static geometry: %s\n", useSceneCache ? "cached" : "immediate");
+            return 1;
+        case 'o': case 'O':
+            occlusion.enabled = !occlusion.enabled;
+            printf("Occlusion culling: %s\n", occlusion.enabled ? "on" : "off");
+            return 1;
+        case 'u': case 'U':
+            if (!dynamicRes.supported) {
+                printf("Dynamic resolution unsupported (needs OpenGL 3.0)\n");
+                return 1;
+            }
+            dynamicRes.enabled = !dynamicRes.enabled;
+            dynamicRes.settle = DYNRES_SETTLE_FRAMES; // Timings in flight are from the other mode
+            printf("Dynamic resolution: %s\n", dynamicRes.enabled ? "on" : "off");
+            return 1;
+        case 'v': case 'V':
+            stereo.enabled = !stereo.enabled;
+            printf("Stereo: %s\n", !stereo.enabled ? "off" :
+                   stereo.layout == STEREO_LAYERS ? "layers" : "side by side");
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Special key handler (arrow keys)
+ * @param key GLUT key constant
+ * @param x X coordinate of mouse
+ * @param y Y coordinate of mouse
+ */
+void specialKeys(int key, int x, int y) {
+    if (replayEvents) return; // Input comes from the recording
+    if (applyViewKey(key, 1)) recordViewInput(key, 1);
+}
+
+/**
+ * Mouse handler: a left click reports what is under the cursor
+ * @param button Mouse button
+ * @param state GLUT_DOWN or GLUT_UP
+ * @param x,y Cursor position (window coordinates, origin top left)
+ */
+void mouse(int button, int state, int x, int y) {
+    if (button != GLUT_LEFT_BUTTON || state != GLUT_DOWN) return;
+    // The last frame's scene may have been drawn at a reduced size
+    x = x * dynamicRes.width / windowWidth;
+    y = y * dynamicRes.height / windowHeight;
+    pickAt(x, pick.viewport[3] - 1 - y);
+}
+
+/**
+ * Initialize OpenGL settings
+ * Sets up lighting, materials, and other rendering parameters
+ */
+void init() {
+    rngSeed(&environment.flickerRng, sceneSeed, RNG_STREAM_FLICKER, 0); // Seed random streams
+    
+    // Enable depth testing for 3D rendering
+    glEnable(GL_DEPTH_TEST);
+    
+    // Enable lighting
+    glEnable(GL_LIGHTING);
+    glEnable(GL_LIGHT0); // Use light source 0
+    
+    // Enable color material for colored objects
+    glEnable(GL_COLOR_MATERIAL);
+    
+    // Use smooth shading
+    glShadeModel(GL_SMOOTH);
+    
+    // Enable blending for transparency
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    
+    // Set up perspective projection
+    glMatrixMode(GL_PROJECTION);
+    gluPerspective(45.0, 1.0, 1.0, TERRAIN_VIEW_DISTANCE);
+    glMatrixMode(GL_MODELVIEW);
+
+    // Terrain first: people and trees stand on it (buffer objects need GL 1.5)
+    sceneCache.useBuffers = glVersionAtLeast(1, 5);
+    initTerrain();
+    
+    // Initialize character positions
+    initWorld();
+    initPeople();
+
+    // Build the static geometry cache
+    invalidateSceneCache();
+    buildSceneCache();
+
+    // Build tree meshes and place the forest
+    initForest();
+    if (scene.header) loadForestScene(&forest);
+    else generateForest(&forest, forestTreeCount, sceneSeed);
+    initRenderQueue();
+    initDynamicResolution();
+    initShadows();
+    initOcclusion();
+    initLightPass();
+    initLights(lanternCount, sceneSeed);
+    initCrowdObstacles();
+
+    // Allocate the precipitation particle pool
+    initParticles(&precipitation, particleCapacity, sceneSeed);
+
+    // Bake the cloud impostors and spread the cloud layer
+    initClouds(cloudCount, sceneSeed);
+    initSmoke();
+
+    // Collect per-pass timings for the whole run when asked to
+    if (profileCsvPath) {
+        setProfiling(1);
+        atexit(writeProfileCsv);
+    }
+}
+
+/**
+ * Window resize handler
+ * @param w New window width
+ * @param h New window height
+ */
+void reshape(int w, int h) {
+    // Set viewport to new dimensions
+    glViewport(0, 0, w, h);
+    windowWidth = w;
+    windowHeight = h;
+    
+    // Update projection matrix
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluPerspective(45.0, (float)w / (float)h, 1.0, TERRAIN_VIEW_DISTANCE);
+    primitivePixelScale = h / (2.0f * tanf(45.0f * M_PI / 360.0f)); // Picks primitive detail levels
+    glMatrixMode(GL_MODELVIEW);
+}
+
+/**
+ * Bucket of a grid cell in a spatial hash
+ * Cells wrap onto a square table, so neighboring cells map to
+ * neighboring buckets and distant cells that collide are rejected by
+ * the distance test
+ * @param h Spatial hash
+ * @param cx,cz Integer cell coordinates
+ * @return Bucket index
+ */
+int spatialHashBucket(const SpatialHash* h, int cx, int cz) {
+    unsigned int rowMask = (1u << h->rowShift) - 1;
+    return (int)(((unsigned int)cx & rowMask) | (((unsigned int)cz << h->rowShift) & (h->numBuckets - 1)));
+}
+
+/**
+ * Rebuild a spatial hash from a strided array of points
+ * Counting sort by bucket: O(n) with no per-item allocation
+ * @param h Spatial hash to fill (storage grows as needed)
+ * @param xs Pointer to the first point's X coordinate
+ * @param zs Pointer to the first point's Z coordinate
+ * @param stride Bytes between consecutive points
+ * @param count Number of points
+ */
+void buildSpatialHash(SpatialHash* h, const float* xs, const float* zs, size_t stride, int count) {
+    // Keep roughly two buckets per item so chains stay short
+    int buckets = 64, shift = 3;
+    while (buckets < count * 2) buckets *= 2;
+    while ((1 << (shift * 2)) < buckets) shift++;
+    h->rowShift = shift;
+    if (buckets != h->numBuckets) {
+        free(h->cellStart);
+        h->cellStart = malloc((buckets + 1) * sizeof(int));
+        h->numBuckets = buckets;
+    }
+    if (count > h->capacity) {
+        free(h->entries);
+        free(h->sortedX);
+        free(h->sortedZ);
+        free(h->keys);
+        h->entries = malloc(count * sizeof(int));
+        h->sortedX = malloc(count * sizeof(float));
+        h->sortedZ = malloc(count * sizeof(float));
+        h->keys = malloc(count * sizeof(int));
+        h->capacity = count;
+    }
+    if (!h->cellStart || (count && (!h->entries || !h->sortedX || !h->sortedZ || !h->keys))) {
+        fprintf(stderr, "Out of memory building spatial hash\n");
+        exit(1);
+    }
+
+    memset(h->cellStart, 0, (buckets + 1) * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        float x = *(const float*)((const char*)xs + i * stride);
+        float z = *(const float*)((const char*)zs + i * stride);
+        h->keys[i] = spatialHashBucket(h, (int)floorf(x / h->cellSize), (int)floorf(z / h->cellSize));
+        h->cellStart[h->keys[i] + 1]++;
+    }
+    for (int b = 0; b < buckets; b++) h->cellStart[b + 1] += h->cellStart[b];
+
+    // Scatter using cellStart as a moving cursor, then shift it back
+    for (int i = 0; i < count; i++) {
+        int slot = h->cellStart[h->keys[i]]++;
+        h->entries[slot] = i;
+        h->sortedX[slot] = *(const float*)((const char*)xs + i * stride);
+        h->sortedZ[slot] = *(const float*)((const char*)zs + i * stride);
+    }
+    for (int b = buckets; b > 0; b--) h->cellStart[b] = h->cellStart[b - 1];
+    h->cellStart[0] = 0;
+}
+
+/**
+ * Build the static obstacle hash from the tree entities
+ * Call after trees spawn or despawn
+ */
+void initCrowdObstacles() {
+    const Archetype* a = &world.archetypes[ARCHETYPE_TREE];
+    if (a->count > crowd.maxTreeRows) {
+        free(crowd.treeRows);
+        crowd.maxTreeRows = a->count + a->count / 2;
+        crowd.treeRows = malloc(crowd.maxTreeRows * sizeof(TreeInstance));
+        if (!crowd.treeRows) {
+            fprintf(stderr, "Out of memory indexing %d trees\n", a->count);
+            exit(1);
+        }
+    }
+    gatherTrees(crowd.treeRows);
+    crowd.trees.cellSize = CROWD_CELL_SIZE;
+    buildSpatialHash(&crowd.trees, &crowd.treeRows[0].x, &crowd.treeRows[0].z, sizeof(TreeInstance), a->count);
+}
+
+/**
+ * Sum separation and obstacle-avoidance steering for one agent
+ * Villagers are kept sorted by cell, so entry k of the agent hash is row k
+ * @param x,z Position of the agent
+ * @param self Row of the agent (skipped in the neighbor query)
+ * @param sx,sz Output steering vector
+ */
+void crowdSteering(float x, float z, int self, float* sx, float* sz) {
+    int cx = (int)floorf(x / CROWD_CELL_SIZE), cz = (int)floorf(z / CROWD_CELL_SIZE);
+    float ax = 0.0f, az = 0.0f;
+
+    for (int dz = -1; dz <= 1; dz++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            /* SEPARATION FROM NEIGHBORS */
+            const SpatialHash* h = &crowd.agents;
+            int b = spatialHashBucket(h, cx + dx, cz + dz);
+            for (int k = h->cellStart[b]; k < h->cellStart[b + 1]; k++) {
+                float ox = x - h->sortedX[k], oz = z - h->sortedZ[k];
+                float d2 = ox * ox + oz * oz;
+                if (d2 < CROWD_NEIGHBOR_RADIUS * CROWD_NEIGHBOR_RADIUS && d2 > 1e-6f && k != self) {
+                    ax += ox / d2;
+                    az += oz / d2;
+                }
+            }
+
+            /* TREE TRUNKS */
+            h = &crowd.trees;
+            b = spatialHashBucket(h, cx + dx, cz + dz);
+            for (int k = h->cellStart[b]; k < h->cellStart[b + 1]; k++) {
+                float ox = x - h->sortedX[k], oz = z - h->sortedZ[k];
+                float d2 = ox * ox + oz * oz;
+                if (d2 > CROWD_CELL_SIZE * CROWD_CELL_SIZE * 2.0f || d2 < 1e-6f) continue;
+                float reach = CROWD_TREE_RADIUS * crowd.treeRows[h->entries[k]].scale + CROWD_NEIGHBOR_RADIUS;
+                if (d2 < reach * reach) {
+                    ax += CROWD_OBSTACLE_WEIGHT * ox / d2;
+                    az += CROWD_OBSTACLE_WEIGHT * oz / d2;
+                }
+            }
+        }
+    }
+
+    /* CABIN WALLS */
+    float lx = x - layout.cabinX, lz = z - layout.cabinZ; // Relative to the cabin
+    float nx = fmaxf(-CABIN_HALF_WIDTH, fminf(lx, CABIN_HALF_WIDTH)); // Closest point on footprint
+    float nz = fmaxf(-CABIN_HALF_DEPTH, fminf(lz, CABIN_HALF_DEPTH));
+    float ox = lx - nx, oz = lz - nz;
+    float d2 = ox * ox + oz * oz;
+    if (d2 < CROWD_NEIGHBOR_RADIUS * CROWD_NEIGHBOR_RADIUS) {
+        if (d2 < 1e-6f) { ox = lx; oz = lz; d2 = 1e-2f; } // Inside: push from center
+        ax += CROWD_OBSTACLE_WEIGHT * ox / d2;
+        az += CROWD_OBSTACLE_WEIGHT * oz / d2;
+    }
+
+    *sx = ax;
+    *sz = az;
+}
+
+/**
+ * Advance one agent's state machine and movement by one tick
+ * Reads other agents only through the spatial hash and draws only from
+ * the agent's own random stream, so agents can be updated in parallel.
+ * @param v Columns of the agent's chunk
+ * @param i Row within the chunk
+ * @param self Row of the agent in the archetype
+ * @param dt Time step in seconds
+ */
+void updateVillager(const VillagerColumns* v, int i, int self, float dt) {
+    v->timer[i] += dt; // Advance state timer
+
+    if (v->state[i] == 0) { // Standing state
+        // After random interval, start walking
+        if (v->timer[i] > PERSON_IDLE_TIME * (1.0f + rngFloat(&v->rng[i]))) {
+            v->state[i] = 1; // Change to walking
+            v->angle[i] = rngRange(&v->rng[i], 360); // Random direction
+            v->timer[i] = 0; // Reset timer
+        }
+        return;
+    }
+
+    /* LEG ANIMATION */
+    v->legAngle[i] += v->legDirection[i] * PERSON_LEG_SWING * dt; // Swing legs
+    if (fabs(v->legAngle[i]) > 15.0) { // Reverse at max angle
+        v->legDirection[i] *= -1;
+    }
+
+    /* STEERING */
+    // Blend the walking direction with avoidance and turn towards it
+    float sx, sz;
+    crowdSteering(v->x[i], v->z[i], self, &sx, &sz);
+    if (sx != 0.0f || sz != 0.0f) {
+        float fx = sin(v->angle[i] * M_PI / 180.0) + sx;
+        float fz = cos(v->angle[i] * M_PI / 180.0) + sz;
+        float turn = atan2(fx, fz) * 180.0 / M_PI - v->angle[i];
+        turn = fmodf(turn + 540.0f, 360.0f) - 180.0f; // Shortest way round
+        v->angle[i] += fmaxf(-CROWD_MAX_TURN * dt, fminf(turn, CROWD_MAX_TURN * dt));
+    }
+
+    /* MOVEMENT */
+    // Move forward in facing direction
+    v->x[i] += sin(v->angle[i] * M_PI / 180.0) * v->speed[i] * dt;
+    v->z[i] += cos(v->angle[i] * M_PI / 180.0) * v->speed[i] * dt;
+
+    /* RANDOM DIRECTION CHANGE */
+    if (rngFloat(&v->rng[i]) < PERSON_WANDER_RATE * dt) { // About once a second
+        v->angle[i] += rngRange(&v->rng[i], 60) - 30; // -30 to +30 degree change
+    }
+
+    /* BOUNDARY CHECK */
+    // Turn around at edge (only while heading further out)
+    float b = crowd.bound, a = v->angle[i], x = v->x[i], z = v->z[i];
+    float cx = x - layout.clearingX, cz = z - layout.clearingZ; // The area is centered on the clearing
+    if ((cx < -b && sin(a * M_PI / 180.0) < 0) || (cx > b && sin(a * M_PI / 180.0) > 0) ||
+        (cz < -b && cos(a * M_PI / 180.0) < 0) || (cz > b && cos(a * M_PI / 180.0) > 0)) {
+        v->angle[i] += 180;
+    }
+    v->y[i] = terrainHeight(x, z); // Follow the ground
+
+    /* RANDOM STOP */
+    if (v->timer[i] > PERSON_WALK_TIME * (1.0f + rngFloat(&v->rng[i]))) { // After random interval
+        v->state[i] = 0; // Stop walking
+        v->timer[i] = 0;
+        v->legAngle[i] = 0; // Reset legs
+    }
+}
+
+/**
+ * Crowd grid system, serial part: rebuild the neighbor grid from the
+ * villagers' positions, then have the villagers sorted by cell, which
+ * makes neighbor scans and updates cache-friendly
+ * @param ctx Unused
+ * @param dt Unused
+ * @return Columns to reorder
+ */
+int crowdGridBegin(void* ctx, float dt) {
+    (void)ctx;
+    (void)dt;
+    const Archetype* a = &world.archetypes[ARCHETYPE_VILLAGER];
+    crowd.tickStart = nowSeconds();
+    if (a->count > crowd.maxGather) {
+        free(crowd.gatherX);
+        free(crowd.gatherZ);
+        crowd.gatherX = malloc(a->count * sizeof(float));
+        crowd.gatherZ = malloc(a->count * sizeof(float));
+        if (!crowd.gatherX || !crowd.gatherZ) {
+            fprintf(stderr, "Out of memory sorting %d people\n", a->count);
+            exit(1);
+        }
+        crowd.maxGather = a->count;
+    }
+    for (int chunk = 0; chunk < usedChunks(a); chunk++) {
+        size_t bytes = chunkRows(a, chunk) * sizeof(float);
+        memcpy(crowd.gatherX + (chunk << ENTITY_CHUNK_SHIFT), a->chunks[chunk].columns[COLUMN_X], bytes);
+        memcpy(crowd.gatherZ + (chunk << ENTITY_CHUNK_SHIFT), a->chunks[chunk].columns[COLUMN_Z], bytes);
+    }
+    crowd.agents.cellSize = CROWD_CELL_SIZE;
+    buildSpatialHash(&crowd.agents, crowd.gatherX, crowd.gatherZ, sizeof(float), a->count);
+    return beginPermute(ARCHETYPE_VILLAGER);
+}
+
+/* Worker entry point: reorder villager columns by cell */
+void crowdGridJob(void* ctx, int begin, int end) {
+    (void)ctx;
+    permuteColumns(ARCHETYPE_VILLAGER, crowd.agents.entries, begin, end);
+}
+
+/* Crowd grid system, after reordering: swap in the sorted rows */
+void crowdGridEnd(void* ctx) {
+    (void)ctx;
+    endPermute(ARCHETYPE_VILLAGER);
+}
+
+/**
+ * History system: record where everyone was, for render interpolation
+ * @param ctx Unused
+ * @param dt Unused
+ * @return Villager chunks to copy
+ */
+int historyBegin(void* ctx, float dt) {
+    (void)ctx;
+    (void)dt;
+    return usedChunks(&world.archetypes[ARCHETYPE_VILLAGER]);
+}
+
+/* Worker entry point: copy each pose column of some chunks to its history column */
+void historyJob(void* ctx, int begin, int end) {
+    (void)ctx;
+    const Archetype* a = &world.archetypes[ARCHETYPE_VILLAGER];
+    for (int chunk = begin; chunk < end; chunk++) {
+        void* const* c = a->chunks[chunk].columns;
+        size_t bytes = chunkRows(a, chunk) * sizeof(float);
+        memcpy(c[COLUMN_PREV_X], c[COLUMN_X], bytes);
+        memcpy(c[COLUMN_PREV_Y], c[COLUMN_Y], bytes);
+        memcpy(c[COLUMN_PREV_Z], c[COLUMN_Z], bytes);
+        memcpy(c[COLUMN_PREV_ANGLE], c[COLUMN_ANGLE], bytes);
+        memcpy(c[COLUMN_PREV_LEG_ANGLE], c[COLUMN_LEG_ANGLE], bytes);
+    }
+}
+
+/**
+ * Crowd update system, serial part: villagers are updated in rounds, in
+ * batches of CROWD_BATCH rows, until the per-tick budget is spent. Each
+ * villager records the round it was last updated in, so the ones not
+ * reached are the first updated next tick, wherever the grid has moved
+ * their rows; the round ends once every row has been visited.
+ * @param ctx Unused
+ * @param dt Time step in seconds (SIM_DT)
+ * @return Batches
+ */
+int crowdUpdateBegin(void* ctx, float dt) {
+    (void)ctx;
+    crowd.stepDt = dt;
+    // Offline rendering and recorded runs update everyone so results
+    // never depend on machine speed
+    crowd.deadline = headless || exactRuns ? INFINITY : crowd.tickStart + CROWD_BUDGET_MS / 1000.0;
+    int batches = (numPeople + CROWD_BATCH - 1) / CROWD_BATCH;
+    atomic_store(&crowd.updated, 0);
+    atomic_store(&crowd.skipFrom, batches);
+    return batches;
+}
+
+/* Worker entry point: update the villagers of some batches still due this round */
+void crowdUpdateJob(void* ctx, int begin, int end) {
+    (void)ctx;
+    const Archetype* a = &world.archetypes[ARCHETYPE_VILLAGER];
+    int n = a->count;
+    for (int batch = begin; batch < end; batch++) {
+        // Past the deadline only once a batch's worth of villagers is updated
+        if (atomic_load(&crowd.updated) >= CROWD_BATCH && nowSeconds() > crowd.deadline) {
+            int skip = atomic_load(&crowd.skipFrom);
+            while (batch < skip && !atomic_compare_exchange_weak(&crowd.skipFrom, &skip, batch)) {}
+            continue;
+        }
+        int first = batch * CROWD_BATCH, last = first + CROWD_BATCH < n ? first + CROWD_BATCH : n;
+        int updated = 0;
+        VillagerColumns v;
+        villagerColumns(&a->chunks[first >> ENTITY_CHUNK_SHIFT], &v); // Batches never straddle chunks
+        for (int self = first; self < last; self++) {
+            int r = self & ENTITY_ROW_MASK;
+            if (v.round[r] == crowd.round) continue; // Already updated this round
+            updateVillager(&v, r, self, crowd.stepDt);
+            v.round[r] = crowd.round;
+            updated++;
+        }
+        atomic_fetch_add(&crowd.updated, updated);
+    }
+}
+
+/**
+ * Crowd update system, after the batches: start the next round once no
+ * batch was skipped, and keep throughput statistics
+ * @param ctx Unused
+ */
+void crowdUpdateEnd(void* ctx) {
+    (void)ctx;
+    int updated = atomic_load(&crowd.updated);
+    int batches = (numPeople + CROWD_BATCH - 1) / CROWD_BATCH;
+    if (atomic_load(&crowd.skipFrom) == batches) crowd.round++; // Every villager is up to date
+
+    /* THROUGHPUT STATISTICS */
+    double end = nowSeconds();
+    crowd.windowAgents += updated;
+    crowd.windowSeconds += end - crowd.tickStart;
+    crowd.windowTicks++;
+    crowd.windowCoverage += (double)updated / numPeople;
+    if (crowd.windowStart == 0.0) crowd.windowStart = end;
+    if (end - crowd.windowStart >= CROWD_STATS_INTERVAL) {
+        crowd.agentsPerSecond = crowd.windowAgents / crowd.windowSeconds;
+        crowd.coverage = crowd.windowCoverage / crowd.windowTicks;
+        crowd.tickMs = crowd.windowSeconds * 1000.0 / crowd.windowTicks;
+        if (crowdStats) {
+            printf("Crowd: %d agents, %.2f ms/tick, %.0f%% updated per tick, %.2f M agents/s\n",
+                   numPeople, crowd.tickMs, crowd.coverage * 100.0, crowd.agentsPerSecond / 1e6);
+        }
+        crowd.windowStart = end;
+        crowd.windowAgents = crowd.windowTicks = 0;
+        crowd.windowSeconds = crowd.windowCoverage = 0.0;
+    }
+}
+
+/**
+ * Bounds of a person between the last two ticks
+ * @param ctx Unused (reads the front snapshot)
+ * @param item Leaf of the crowd's hierarchy
+ * @param min,max Receive the bounds
+ */
+void personBox(void* ctx, int item, float* min, float* max) {
+    (void)ctx;
+    const Person* p = &frame->people[sceneIndex.slotOf[sceneIndex.personIds[item]]];
+    float x = p->prevX + (p->x - p->prevX) * frameAlpha;
+    float y = p->prevY + (p->y - p->prevY) * frameAlpha;
+    float z = p->prevZ + (p->z - p->prevZ) * frameAlpha;
+    min[0] = x - PERSON_HALF_WIDTH; min[1] = y; min[2] = z - PERSON_HALF_WIDTH;
+    max[0] = x + PERSON_HALF_WIDTH; max[1] = y + PERSON_HEIGHT; max[2] = z + PERSON_HALF_WIDTH;
+}
+
+/**
+ * Bring the crowd's hierarchy up to the frame being drawn: refit it, or
+ * rebuild it when villagers spawned or despawned or refitting has
+ * loosened it.
+ * Leaves stand for person ids, so the tree stays tight while the
+ * simulation reorders the villagers.
+ */
+void updatePeopleIndex() {
+    Bvh* b = &sceneIndex.people;
+    if (frame->personSlots > sceneIndex.maxSlots) {
+        free(sceneIndex.slotOf);
+        sceneIndex.slotOf = malloc(frame->personSlots * sizeof(int));
+        if (!sceneIndex.slotOf) {
+            fprintf(stderr, "Out of memory indexing %d people\n", frame->personSlots);
+            exit(1);
+        }
+        sceneIndex.maxSlots = frame->personSlots;
+    }
+    for (int id = 0; id < frame->personSlots; id++) sceneIndex.slotOf[id] = -1;
+    for (int i = 0; i < frame->numPeople; i++) sceneIndex.slotOf[frame->people[i].id] = i;
+
+    if (b->numItems == frame->numPeople && sceneIndex.crowdVersion == frame->crowdVersion) {
+        bvhRefit(b, personBox, NULL);
+        if (b->area <= b->builtArea * BVH_LOOSENESS) return;
+    }
+
+    // Leaves index the live ids in ascending order
+    if (frame->numPeople > sceneIndex.maxPersonIds) {
+        free(sceneIndex.personIds);
+        sceneIndex.personIds = malloc(frame->numPeople * sizeof(int));
+        if (!sceneIndex.personIds) {
+            fprintf(stderr, "Out of memory indexing %d people\n", frame->numPeople);
+            exit(1);
+        }
+        sceneIndex.maxPersonIds = frame->numPeople;
+    }
+    int count = 0;
+    for (int id = 0; id < frame->personSlots; id++) {
+        if (sceneIndex.slotOf[id] >= 0) sceneIndex.personIds[count++] = id;
+    }
+    sceneIndex.crowdVersion = frame->crowdVersion;
+    bvhBuild(b, count, personBox, NULL);
+}
+
+/**
+ * Add a person that survived culling to the skinned crowd, between their
+ * last two poses
+ * @param ctx View frustum the person was culled against (NULL: no
+ *            occlusion test)
+ * @param item Leaf of the crowd's hierarchy
+ */
+void drawVisiblePerson(void* ctx, int item) {
+    const ViewFrustum* view = ctx;
+    Person p = frame->people[sceneIndex.slotOf[sceneIndex.personIds[item]]];
+    p.x = p.prevX + (p.x - p.prevX) * frameAlpha;
+    p.y = p.prevY + (p.y - p.prevY) * frameAlpha;
+    p.z = p.prevZ + (p.z - p.prevZ) * frameAlpha;
+    if (view && view->occlusion) {
+        float min[3] = {p.x - PERSON_HALF_WIDTH, p.y, p.z - PERSON_HALF_WIDTH};
+        float max[3] = {p.x + PERSON_HALF_WIDTH, p.y + PERSON_HEIGHT, p.z + PERSON_HALF_WIDTH};
+        if (boxOccluded(min, max)) {
+            occlusion.rejected++;
+            return;
+        }
+    }
+    float turn = fmodf(p.angle - p.prevAngle + 540.0f, 360.0f) - 180.0f; // Shortest way round
+    p.angle = p.prevAngle + turn * frameAlpha;
+    p.legAngle = p.prevLegAngle + (p.legAngle - p.prevLegAngle) * frameAlpha;
+    addSkinnedPerson(&p);
+    sceneIndex.visiblePeople++;
+}
+
+/**
+ * Intersect a ray with a sphere
+ * @param origin,dir Ray (dir normalized)
+ * @param center,radius Sphere
+ * @return Entry distance, or -1 for a miss
+ */
+float raySphere(const float* origin, const float* dir, const float* center, float radius) {
+    float o[3] = {origin[0] - center[0], origin[1] - center[1], origin[2] - center[2]};
+    float b = o[0] * dir[0] + o[1] * dir[1] + o[2] * dir[2];
+    float c = o[0] * o[0] + o[1] * o[1] + o[2] * o[2] - radius * radius;
+    float disc = b * b - c;
+    if (disc < 0.0f) return -1.0f;
+    float t = -b - sqrtf(disc);
+    return t >= 0.0f ? t : (c <= 0.0f ? 0.0f : -1.0f);
+}
+
+/**
+ * Ray test against a static object: the cabin's box, or each tree's
+ * trunk and foliage in a chunk
+ * @param ctx Pick state (receives the tree hit)
+ * @param item Static object
+ * @param origin,dir Ray
+ * @param maxT Nearest hit so far
+ * @return Hit distance, or -1
+ */
+float staticObjectRayHit(void* ctx, int item, const float* origin, const float* dir, float maxT) {
+    PickState* ps = ctx;
+    float min[3], max[3], best = -1.0f;
+    if (item == 0) {
+        staticObjectBox(NULL, 0, min, max);
+        return rayBox(origin, dir, min, max, maxT);
+    }
+    const ForestChunk* c = &forest.chunks[item - 1];
+    for (int i = c->first; i < c->first + c->count; i++) {
+        const TreeInstance* t = &forest.trees[i];
+        float trunkMin[3] = {t->x - 0.1f * t->scale, t->y, t->z - 0.1f * t->scale};
+        float trunkMax[3] = {t->x + 0.1f * t->scale, t->y + 2.0f * t->scale, t->z + 0.1f * t->scale};
+        float crown[3] = {t->x, t->y + 2.5f * t->scale, t->z};
+        float d = rayBox(origin, dir, trunkMin, trunkMax, maxT), e = raySphere(origin, dir, crown, 0.7f * t->scale);
+        if (e >= 0.0f && (d < 0.0f || e < d)) d = e;
+        if (d >= 0.0f && d < maxT) {
+            maxT = best = d;
+            ps->tree = i;
+        }
+    }
+    return best;
+}
+
+/**
+ * Ray test against a person's bounding box
+ * @param ctx Unused
+ * @param item Leaf of the crowd's hierarchy
+ * @param origin,dir Ray
+ * @param maxT Nearest hit so far
+ * @return Hit distance, or -1
+ */
+float personRayHit(void* ctx, int item, const float* origin, const float* dir, float maxT) {
+    float min[3], max[3];
+    personBox(ctx, item, min, max);
+    return rayBox(origin, dir, min, max, maxT);
+}
+
+/**
+ * Identify what lies under a window position in the last frame drawn:
+ * both hierarchies are ray cast, then the ground is marched
+ * @param x,y Window position (GL convention, origin bottom left)
+ */
+void pickAt(int x, int y) {
+    GLdouble nx, ny, nz, fx, fy, fz;
+    gluUnProject(x, y, 0.0, pick.modelview, pick.projection, pick.viewport, &nx, &ny, &nz);
+    gluUnProject(x, y, 1.0, pick.modelview, pick.projection, pick.viewport, &fx, &fy, &fz);
+    float origin[3] = {nx, ny, nz}, dir[3] = {fx - nx, fy - ny, fz - nz};
+    float t = sqrtf(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+    for (int a = 0; a < 3; a++) dir[a] /= t;
+
+    pick.tree = -1;
+    int object = bvhRaycast(&sceneIndex.statics, origin, dir, staticObjectRayHit, &pick, &t);
+    int person = bvhRaycast(&sceneIndex.people, origin, dir, personRayHit, NULL, &t);
+    float hx = origin[0] + dir[0] * t, hz = origin[2] + dir[2] * t;
+    if (person >= 0) {
+        snprintf(pick.text, sizeof(pick.text), "person %d at (%.1f, %.1f), %.1f away", sceneIndex.personIds[person],
+                 hx, hz, t);
+    } else if (object == 0) {
+        snprintf(pick.text, sizeof(pick.text), "cabin, %.1f away", t);
+    } else if (object > 0) {
+        const TreeInstance* tr = &forest.trees[pick.tree];
+        snprintf(pick.text, sizeof(pick.text), "tree %d at (%.1f, %.1f), %.1f away", pick.tree, tr->x, tr->z, t);
+    } else {
+        // Nothing indexed: march to the first point below the ground
+        float step = 0.25f, d = 0.0f;
+        while (d < t && origin[1] + dir[1] * d > terrainHeight(origin[0] + dir[0] * d, origin[2] + dir[2] * d)) d += step;
+        if (d < t) {
+            snprintf(pick.text, sizeof(pick.text), "ground at (%.1f, %.1f), %.1f away",
+                     origin[0] + dir[0] * d, origin[2] + dir[2] * d, d);
+        } else {
+            snprintf(pick.text, sizeof(pick.text), "sky");
+        }
+    }
+    printf("Picked %s\n", pick.text);
+}
+
+/**
+ * Record the villager in its bind pose, one bone after another
+ * @param s Mesh to build
+ * @param slices,stacks Tessellation of the head
+ */
+void buildVillagerMesh(SkinMesh* s, int slices, int stacks) {
+    MeshBuilder* m = &s->mesh;
+    meshReset(m);
+    geomTarget = m;
+    s->boneFirst[BONE_ROOT] = s->boneFirst[BONE_TORSO] = 0; // The root carries no geometry
+
+    /* BODY */
+    geomColor3f(0.8, 0.6, 0.4);              // Shirt color
+    geomPushMatrix();
+    geomTranslatef(0.0, 1.0, 0.0);           // Move up to chest height
+    geomScalef(0.4, 0.6, 0.2);               // Scale to torso shape
+    geomSolidCube(1.0);
+    geomPopMatrix();
+
+    /* HEAD */
+    s->boneFirst[BONE_HEAD] = m->numVerts;
+    geomColor3f(1.0, 0.8, 0.6);              // Skin color
+    geomPushMatrix();
+    geomTranslatef(0.0, 1.6, 0.0);           // Head position
+    geomSolidSphere(0.2, slices, stacks);    // Spherical head
+    geomPopMatrix();
+
+    /* LEGS */
+    geomColor3f(0.2, 0.2, 0.8);              // Pants color
+    for (int leg = BONE_LEFT_LEG; leg <= BONE_RIGHT_LEG; leg++) {
+        s->boneFirst[leg] = m->numVerts;
+        geomPushMatrix();
+        geomTranslatef(boneJoints[leg][0], 0.0, 0.0); // Hanging from the hip
+        geomScalef(0.1, 0.8, 0.1);
+        geomSolidCube(1.0);
+        geomPopMatrix();
+    }
+    s->boneFirst[BONES] = m->numVerts;
+    geomTarget = NULL;
+}
+
+/**
+ * Sample the idle and walk cycles into key tables
+ * The walk swings the legs through the same triangle wave as the
+ * simulation, so its phase can be read back from the leg angle, and dips
+ * the hips at each stride; idling breathes and looks around.
+ * @param s Crowd skinning state
+ */
+void buildAnimationClips(CrowdSkin* s) {
+    for (int k = 0; k <= ANIM_KEYS; k++) {
+        float t = (float)(k % ANIM_KEYS) / ANIM_KEYS, w = 2.0f * M_PI * t;
+        float* idle = s->clips[CLIP_IDLE][k];
+        float* walk = s->clips[CLIP_WALK][k];
+        memset(idle, 0, ANIM_CHANNELS * sizeof(float));
+        memset(walk, 0, ANIM_CHANNELS * sizeof(float));
+
+        idle[CHANNEL_TORSO_PITCH] = 1.5f * sinf(2.0f * w);
+        idle[CHANNEL_HEAD_YAW] = 30.0f * sinf(w);
+        idle[CHANNEL_HEAD_PITCH] = 5.0f * sinf(2.0f * w + 1.0f);
+
+        float swing = t < 0.5f ? -15.0f + 60.0f * t : 45.0f - 60.0f * t;
+        walk[CHANNEL_LEFT_LEG] = swing;
+        walk[CHANNEL_RIGHT_LEG] = -swing;
+        walk[CHANNEL_BOB] = -0.015f * (1.0f + cosf(2.0f * w)); // Lowest with the legs apart
+        walk[CHANNEL_TORSO_PITCH] = 4.0f;
+        walk[CHANNEL_TORSO_ROLL] = 3.0f * sinf(w);
+        walk[CHANNEL_HEAD_PITCH] = -3.0f;    // Eyes ahead over the lean
+    }
+}
+
+/**
+ * Evaluate a clip at a point of its cycle
+ * Interpolates between the two neighbouring keys, all channels at once.
+ * @param clip Key table
+ * @param phase Position in the cycle [0, 1)
+ * @param out Receives ANIM_CHANNELS values
+ */
+void samplePose(const float (*clip)[ANIM_CHANNELS], float phase, float* out) {
+    float key = phase * ANIM_KEYS;
+    int k = key < ANIM_KEYS ? (int)key : ANIM_KEYS - 1;
+    float f = key - k;
+    const float *a = clip[k], *b = clip[k + 1];
+#if defined(__AVX__)
+    __m256 va = _mm256_loadu_ps(a);
+    _mm256_storeu_ps(out, _mm256_add_ps(va, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(b), va), _mm256_set1_ps(f))));
+#elif defined(__SSE__)
+    for (int c = 0; c < ANIM_CHANNELS; c += 4) {
+        __m128 va = _mm_loadu_ps(a + c);
+        _mm_storeu_ps(out + c, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(b + c), va), _mm_set1_ps(f))));
+    }
+#else
+    for (int c = 0; c < ANIM_CHANNELS; c++) out[c] = a[c] + (b[c] - a[c]) * f;
+#endif
+}
+
+/**
+ * Post-multiply a rotation about a joint
+ * @param m Column-major 4x4 matrix to update
+ * @param joint Pivot of the rotation
+ * @param angle Degrees
+ * @param x,y,z Axis
+ */
+void rotateAboutJoint(GLfloat* m, const float* joint, float angle, float x, float y, float z) {
+    GLfloat r[16];
+    rotationMatrix(r, angle, x, y, z);
+    for (int a = 0; a < 3; a++) r[12 + a] = joint[a] - r[a] * joint[0] - r[4 + a] * joint[1] - r[8 + a] * joint[2];
+    multMatrix(m, r);
+}
+
+/**
+ * Turn a pose into bone transforms, each relative to the bind pose
+ * @param pose ANIM_CHANNELS values
+ * @param bones Receives a column-major matrix per bone
+ */
+void poseBones(const float* pose, GLfloat (*bones)[16]) {
+    static const GLfloat identity[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    memcpy(bones[BONE_ROOT], identity, sizeof(identity));
+    bones[BONE_ROOT][13] = pose[CHANNEL_BOB];
+
+    memcpy(bones[BONE_TORSO], bones[BONE_ROOT], sizeof(identity));
+    rotateAboutJoint(bones[BONE_TORSO], boneJoints[BONE_TORSO], pose[CHANNEL_TORSO_PITCH], 1.0, 0.0, 0.0);
+    rotateAboutJoint(bones[BONE_TORSO], boneJoints[BONE_TORSO], pose[CHANNEL_TORSO_ROLL], 0.0, 0.0, 1.0);
+
+    memcpy(bones[BONE_HEAD], bones[BONE_TORSO], sizeof(identity)); // The head rides on the torso
+    rotateAboutJoint(bones[BONE_HEAD], boneJoints[BONE_HEAD], pose[CHANNEL_HEAD_YAW], 0.0, 1.0, 0.0);
+    rotateAboutJoint(bones[BONE_HEAD], boneJoints[BONE_HEAD], pose[CHANNEL_HEAD_PITCH], 1.0, 0.0, 0.0);
+
+    memcpy(bones[BONE_LEFT_LEG], bones[BONE_ROOT], sizeof(identity));
+    rotateAboutJoint(bones[BONE_LEFT_LEG], boneJoints[BONE_LEFT_LEG], pose[CHANNEL_LEFT_LEG], 1.0, 0.0, 0.0);
+    memcpy(bones[BONE_RIGHT_LEG], bones[BONE_ROOT], sizeof(identity));
+    rotateAboutJoint(bones[BONE_RIGHT_LEG], boneJoints[BONE_RIGHT_LEG], pose[CHANNEL_RIGHT_LEG], 1.0, 0.0, 0.0);
+}
+
+#if defined(__AVX__)
+/* One value in each 128-bit lane */
+__m256 splatPair(float a, float b) {
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(a)), _mm_set1_ps(b), 1);
+}
+#endif
+
+/**
+ * Transform a run of vertices by one matrix (the skinning kernel)
+ * The matrix must be rigid: normals take its rotation unchanged. The
+ * vector paths store each position and normal as four floats, spilling
+ * into the next field, so the fields are written in order and the color
+ * is copied last.
+ * @param in Source vertices
+ * @param out Destination (not overlapping in)
+ * @param count Vertices
+ * @param m Column-major 4x4 matrix with an affine bottom row
+ */
+void skinVertices(const MeshVertex* in, MeshVertex* out, int count, const GLfloat* m) {
+    int i = 0;
+#if defined(__AVX__)
+    // Two vertices per iteration, one in each lane
+    __m256 c0 = _mm256_broadcast_ps((const __m128*)m), c1 = _mm256_broadcast_ps((const __m128*)(m + 4));
+    __m256 c2 = _mm256_broadcast_ps((const __m128*)(m + 8)), c3 = _mm256_broadcast_ps((const __m128*)(m + 12));
+    for (; i + 2 <= count; i += 2) {
+        const MeshVertex *a = &in[i], *b = &in[i + 1];
+        __m256 p = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(c0, splatPair(a->pos[0], b->pos[0])),
+                                               _mm256_mul_ps(c1, splatPair(a->pos[1], b->pos[1]))),
+                                 _mm256_add_ps(_mm256_mul_ps(c2, splatPair(a->pos[2], b->pos[2])), c3));
+        __m256 n = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(c0, splatPair(a->normal[0], b->normal[0])),
+                                               _mm256_mul_ps(c1, splatPair(a->normal[1], b->normal[1]))),
+                                 _mm256_mul_ps(c2, splatPair(a->normal[2], b->normal[2])));
+        _mm_storeu_ps(out[i].pos, _mm256_castps256_ps128(p));
+        _mm_storeu_ps(out[i].normal, _mm256_castps256_ps128(n));
+        memcpy(out[i].color, a->color, sizeof(a->color));
+        _mm_storeu_ps(out[i + 1].pos, _mm256_extractf128_ps(p, 1));
+        _mm_storeu_ps(out[i + 1].normal, _mm256_extractf128_ps(n, 1));
+        memcpy(out[i + 1].color, b->color, sizeof(b->color));
+    }
+#elif defined(__SSE__)
+    __m128 c0 = _mm_loadu_ps(m), c1 = _mm_loadu_ps(m + 4), c2 = _mm_loadu_ps(m + 8), c3 = _mm_loadu_ps(m + 12);
+    for (; i < count; i++) {
+        const MeshVertex* a = &in[i];
+        __m128 p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(a->pos[0])), _mm_mul_ps(c1, _mm_set1_ps(a->pos[1]))),
+                              _mm_add_ps(_mm_mul_ps(c2, _mm_set1_ps(a->pos[2])), c3));
+        __m128 n = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(a->normal[0])), _mm_mul_ps(c1, _mm_set1_ps(a->normal[1]))),
+                              _mm_mul_ps(c2, _mm_set1_ps(a->normal[2])));
+        _mm_storeu_ps(out[i].pos, p);
+        _mm_storeu_ps(out[i].normal, n);
+        memcpy(out[i].color, a->color, sizeof(a->color));
+    }
+#endif
+    for (; i < count; i++) {
+        const MeshVertex* a = &in[i];
+        MeshVertex* o = &out[i];
+        for (int r = 0; r < 3; r++) {
+            o->pos[r] = m[r] * a->pos[0] + m[4 + r] * a->pos[1] + m[8 + r] * a->pos[2] + m[12 + r];
+            o->normal[r] = m[r] * a->normal[0] + m[4 + r] * a->normal[1] + m[8 + r] * a->normal[2];
+        }
+        memcpy(o->color, a->color, sizeof(a->color));
+    }
+}
+
+/**
+ * Skin a villager mesh in a pose, bone by bone
+ * @param s Mesh level
+ * @param pose ANIM_CHANNELS values
+ * @param place Model transform
+ * @param out Receives the mesh's vertices
+ */
+void skinPose(const SkinMesh* s, const float* pose, const GLfloat* place, MeshVertex* out) {
+    GLfloat bones[BONES][16];
+    poseBones(pose, bones);
+    for (int b = 0; b < BONES; b++) {
+        int first = s->boneFirst[b], count = s->boneFirst[b + 1] - first;
+        if (count == 0) continue;
+        GLfloat m[16];
+        memcpy(m, place, sizeof(m));
+        multMatrix(m, bones[b]);
+        skinVertices(s->mesh.verts + first, out + first, count, m);
+    }
+}
+
+/**
+ * Build the clips, the villager mesh at each level and the pooled poses
+ * @param s Crowd skinning state
+ */
+void initCrowdSkin(CrowdSkin* s) {
+    static const GLfloat identity[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    buildAnimationClips(s);
+    buildVillagerMesh(&s->meshes[SKIN_FINE], 10, 10);
+    buildVillagerMesh(&s->meshes[SKIN_COARSE], 6, 4);
+    for (int level = 0; level < SKIN_LEVELS; level++) {
+        SkinMesh* m = &s->meshes[level];
+        int n = m->mesh.numVerts;
+        m->pool = malloc(CLIPS * ANIM_POOL_POSES * n * sizeof(MeshVertex));
+        if (!m->pool) {
+            fprintf(stderr, "Out of memory building the villager poses\n");
+            exit(1);
+        }
+        for (int clip = 0; clip < CLIPS; clip++) {
+            for (int k = 0; k < ANIM_POOL_POSES; k++) {
+                float pose[ANIM_CHANNELS];
+                samplePose(s->clips[clip], (float)k / ANIM_POOL_POSES, pose);
+                skinPose(m, pose, identity, m->pool + (clip * ANIM_POOL_POSES + k) * n);
+            }
+        }
+    }
+    s->ready = 1;
+}
+
+/**
+ * Start collecting the villagers to skin for a view
+ * The modelview matrix must hold the camera only; it decides each
+ * villager's level of detail.
+ */
+void beginCrowdSkinning() {
+    CrowdSkin* s = &crowdSkin;
+    if (!s->ready) initCrowdSkin(s);
+    glGetFloatv(GL_MODELVIEW_MATRIX, s->view);
+    s->numAgents = 0;
+    s->frame++;
+
+    // Person ids are reused as villagers come and go, so cached poses are dropped
+    if (frame->personSlots > s->maxPoses) {
+        s->maxPoses = frame->personSlots + frame->personSlots / 2;
+        s->poses = realloc(s->poses, s->maxPoses * sizeof(s->poses[0]));
+        s->posedFrame = realloc(s->posedFrame, s->maxPoses * sizeof(long long));
+        if (!s->poses || !s->posedFrame) {
+            fprintf(stderr, "Out of memory caching %d villager poses\n", s->maxPoses);
+            exit(1);
+        }
+        s->crowdVersion = -1;
+    }
+    if (frame->crowdVersion != s->crowdVersion) {
+        for (int id = 0; id < s->maxPoses; id++) s->posedFrame[id] = -1;
+        s->crowdVersion = frame->crowdVersion;
+    }
+}
+
+/**
+ * Add a villager to the crowd skinned this frame
+ * @param p Pose, interpolated to the frame
+ */
+void addSkinnedPerson(const Person* p) {
+    CrowdSkin* s = &crowdSkin;
+    growArray((void**)&s->agents, s->numAgents, &s->maxAgents, sizeof(SkinAgent));
+    SkinAgent* a = &s->agents[s->numAgents++];
+    a->id = p->id;
+    if (p->gait) {
+        // Read the walk phase back from the leg swing
+        a->clip = CLIP_WALK;
+        a->phase = p->gait > 0 ? (p->legAngle + 15.0f) / 60.0f : 0.5f + (15.0f - p->legAngle) / 60.0f;
+    } else {
+        // Idle villagers are kept out of step with each other
+        a->clip = CLIP_IDLE;
+        a->phase = fmod(viewTime / ANIM_IDLE_PERIOD, 1.0) + latticeNoise(p->id, 0, 17u);
+    }
+    a->phase -= floorf(a->phase);
+    const GLfloat* v = s->view;
+    a->depth = -(v[2] * p->x + v[6] * (p->y + 0.5f * PERSON_HEIGHT) + v[10] * p->z + v[14]);
+    rotationMatrix(a->place, p->angle, 0.0, 1.0, 0.0); // Face the direction
+    a->place[12] = p->x;
+    a->place[13] = p->y;
+    a->place[14] = p->z;
+}
+
+/**
+ * Make room in a mesh level's index buffer for a number of villagers
+ * Every villager has a fixed-size slot in the vertex buffer, so the
+ * indices are the mesh's repeated with a growing offset and only change
+ * when the crowd in view outgrows them.
+ * @param m Mesh level
+ * @param agents Villagers to draw
+ */
+void reserveSkinIndices(SkinMesh* m, int agents) {
+    if (agents <= m->maxAgents) return;
+    int n = m->mesh.numIndices, v = m->mesh.numVerts;
+    int capacity = m->maxAgents ? m->maxAgents : 256;
+    while (capacity < agents) capacity *= 2;
+    GLuint* indices = realloc(m->indices, (size_t)capacity * n * sizeof(GLuint));
+    if (!indices) {
+        fprintf(stderr, "Out of memory indexing %d villagers\n", agents);
+        exit(1);
+    }
+    for (int a = m->maxAgents; a < capacity; a++) {
+        for (int i = 0; i < n; i++) indices[a * n + i] = m->mesh.indices[i] + a * v;
+    }
+    m->indices = indices;
+    m->maxAgents = capacity;
+    if (sceneCache.useBuffers) {
+        if (!m->ibo) glGenBuffers(1, &m->ibo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, (size_t)capacity * n * sizeof(GLuint), indices, GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+}
+
+/**
+ * Pose and skin the villagers collected since beginCrowdSkinning() into
+ * the shared vertex buffer
+ * Near villagers are posed first so the budget goes to them, then those
+ * in the middle distance whose turn has come (staggered by id).
+ */
+void skinCrowd() {
+    CrowdSkin* s = &crowdSkin;
+    s->evaluated = s->cached = s->pooled = 0;
+    int budget = ANIM_POSE_BUDGET;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < s->numAgents && budget > 0; i++) {
+            const SkinAgent* a = &s->agents[i];
+            int due = pass == 0 ? a->depth < ANIM_NEAR :
+                      a->depth >= ANIM_NEAR && a->depth < ANIM_FAR &&
+                      (s->posedFrame[a->id] < 0 || (s->frame + a->id) % ANIM_MID_INTERVAL == 0);
+            if (!due) continue;
+            samplePose(s->clips[a->clip], a->phase, s->poses[a->id]);
+            s->posedFrame[a->id] = s->frame;
+            s->evaluated++;
+            budget--;
+        }
+    }
+
+    // Each level's villagers sit in fixed-size slots, the fine level first
+    s->count[SKIN_FINE] = s->count[SKIN_COARSE] = 0;
+    for (int i = 0; i < s->numAgents; i++) s->count[s->agents[i].depth >= SKIN_COARSE_DEPTH]++;
+    s->first[SKIN_FINE] = 0;
+    s->first[SKIN_COARSE] = s->count[SKIN_FINE] * s->meshes[SKIN_FINE].mesh.numVerts;
+    int total = s->first[SKIN_COARSE] + s->count[SKIN_COARSE] * s->meshes[SKIN_COARSE].mesh.numVerts;
+    if (total > s->maxVerts) {
+        s->maxVerts = total + total / 2;
+        free(s->verts);
+        s->verts = malloc((size_t)s->maxVerts * sizeof(MeshVertex));
+        if (!s->verts) {
+            fprintf(stderr, "Out of memory skinning %d villagers\n", s->numAgents);
+            exit(1);
+        }
+    }
+
+    int slot[SKIN_LEVELS] = {0, 0};
+    for (int i = 0; i < s->numAgents; i++) {
+        const SkinAgent* a = &s->agents[i];
+        int level = a->depth >= SKIN_COARSE_DEPTH;
+        const SkinMesh* m = &s->meshes[level];
+        int n = m->mesh.numVerts;
+        MeshVertex* out = s->verts + s->first[level] + slot[level]++ * n;
+        if (a->depth < ANIM_FAR && s->posedFrame[a->id] >= 0) {
+            skinPose(m, s->poses[a->id], a->place, out);
+            s->cached += s->posedFrame[a->id] != s->frame;
+        } else {
+            // Distant or over budget: place the nearest pooled pose
+            int k = (int)(a->phase * ANIM_POOL_POSES) % ANIM_POOL_POSES;
+            skinVertices(m->pool + (a->clip * ANIM_POOL_POSES + k) * n, out, n, a->place);
+            s->pooled++;
+        }
+    }
+
+    for (int level = 0; level < SKIN_LEVELS; level++) reserveSkinIndices(&s->meshes[level], s->count[level]);
+    if (sceneCache.useBuffers) {
+        if (!s->vbo) glGenBuffers(1, &s->vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, s->vbo);
+        glBufferData(GL_ARRAY_BUFFER, (size_t)total * sizeof(MeshVertex), s->verts, GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+}
+
+/**
+ * Draw the villagers skinned by the last skinCrowd(), one call per mesh
+ * level; the vertices are in world space, so any camera or light view
+ * can be loaded
+ */
+void drawSkinnedCrowd() {
+    CrowdSkin* s = &crowdSkin;
+    if (s->vbo) glBindBuffer(GL_ARRAY_BUFFER, s->vbo);
+    for (int level = 0; level < SKIN_LEVELS; level++) {
+        const SkinMesh* m = &s->meshes[level];
+        if (s->count[level] == 0) continue;
+        const char* base = (s->vbo ? (const char*)NULL : (const char*)s->verts) + s->first[level] * sizeof(MeshVertex);
+        if (m->ibo) glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m->ibo);
+        drawMeshArrays(base, m->ibo ? NULL : m->indices, s->count[level] * m->mesh.numIndices);
+    }
+    if (s->vbo) {
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+}
+
+
+
+/**
+ * Claim and run job ranges until the current job is exhausted
+ * @param w Worker pool
+ */
+void runWorkerJobs(WorkerPool* w) {
+    int begin;
+    while ((begin = atomic_fetch_add(&w->next, w->grain)) < w->count) {
+        int end = begin + w->grain < w->count ? begin + w->grain : w->count;
+        w->fn(w->ctx, begin, end);
+    }
+}
+
+/**
+ * Helper thread body: wait for a job, work on it, report back
+ * @param arg Worker pool
+ * @return NULL
+ */
+void* workerMain(void* arg) {
+    WorkerPool* w = arg;
+    int seen = 0;
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->generation == seen && !w->quit) pthread_cond_wait(&w->start, &w->lock);
+        if (w->quit) break;
+        seen = w->generation;
+        pthread_mutex_unlock(&w->lock);
+
+        runWorkerJobs(w);
+
+        pthread_mutex_lock(&w->lock);
+        if (--w->active == 0) pthread_cond_signal(&w->done);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/**
+ * Start the helper threads
+ * @param w Worker pool
+ * @param helpers Threads to start besides the calling thread
+ */
+void initWorkers(WorkerPool* w, int helpers) {
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->start, NULL);
+    pthread_cond_init(&w->done, NULL);
+    w->numThreads = 0;
+    for (int i = 0; i < helpers && i < MAX_WORKERS; i++) {
+        if (pthread_create(&w->threads[i], NULL, workerMain, w) != 0) break;
+        w->numThreads++;
+    }
+}
+
+/**
+ * Split count items into grain-sized ranges and run fn on all of them,
+ * using the worker pool and the calling thread; returns when all are done
+ * Only the simulation thread posts jobs, so calls never overlap.
+ * @param count Number of items
+ * @param grain Items per range
+ * @param fn Function called with each [begin, end) range
+ * @param ctx Passed through to fn
+ */
+void parallelFor(int count, int grain, ParallelFn fn, void* ctx) {
+    if (workers.numThreads == 0 || count <= grain) {
+        if (count > 0) fn(ctx, 0, count);
+        return;
+    }
+    WorkerPool* w = &workers;
+    pthread_mutex_lock(&w->lock);
+    w->fn = fn;
+    w->ctx = ctx;
+    w->count = count;
+    w->grain = grain;
+    atomic_store(&w->next, 0);
+    w->active = w->numThreads;
+    w->generation++;
+    pthread_cond_broadcast(&w->start);
+    pthread_mutex_unlock(&w->lock);
+
+    runWorkerJobs(w);
+
+    pthread_mutex_lock(&w->lock);
+    while (w->active > 0) pthread_cond_wait(&w->done, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * Add a system to the simulation step, in the first stage after every
+ * earlier system it shares data with (one writes what the other reads
+ * or writes)
+ * @param name Name for messages
+ * @param reads,writes Components and resources it reads and writes
+ * @param begin Serial setup returning the work items (NULL: none)
+ * @param run Runs a range of work items, on any thread
+ * @param end Serial wrap-up (NULL: none)
+ * @param ctx Passed to begin, run and end
+ * @param report stepMs entry its time is added to (0: total only)
+ */
+void addSystem(const char* name, unsigned int reads, unsigned int writes, SystemBeginFn begin, ParallelFn run,
+               SystemEndFn end, void* ctx, int report) {
+    if (scheduler.numSystems == MAX_SYSTEMS) {
+        fprintf(stderr, "Too many systems (at most %d)\n", MAX_SYSTEMS);
+        exit(1);
+    }
+    System* s = &scheduler.systems[scheduler.numSystems];
+    s->name = name;
+    s->reads = reads;
+    s->writes = writes;
+    s->begin = begin;
+    s->run = run;
+    s->end = end;
+    s->ctx = ctx;
+    s->report = report;
+    s->stage = 0;
+    atomic_init(&s->workNs, 0);
+    for (int i = 0; i < scheduler.numSystems; i++) {
+        const System* o = &scheduler.systems[i];
+        int conflict = (writes & (o->reads | o->writes)) || (reads & o->writes);
+        if (conflict && o->stage >= s->stage) s->stage = o->stage + 1;
+    }
+    if (s->stage >= scheduler.numStages) scheduler.numStages = s->stage + 1;
+    scheduler.numSystems++;
+}
+
+/**
+ * Environment system: advance the day/night cycle and the night light
+ * flicker
+ * @param ctx Environment
+ * @param dt Time step in seconds
+ * @return 0 (no parallel work)
+ */
+int environmentStep(void* ctx, float dt) {
+    Environment* e = ctx;
+
+    /* DAY/NIGHT CYCLE */
+    if (e->isDay) {
+        e->sunAngle += SUN_SPEED * dt; // Advance sun
+        if (e->sunAngle >= 3.14) e->isDay = 0; // Switch to night at sunset
+    } else {
+        e->sunAngle -= SUN_SPEED * dt; // Advance moon
+        if (e->sunAngle <= 0.0) e->isDay = 1; // Switch to day at sunrise
+    }
+
+    /* LIGHT FLICKER FOR NIGHT */
+    e->lightFlicker = 0.7 + 0.3 * (rngRange(&e->flickerRng, 10) / 10.0);
+    return 0;
+}
+
+/**
+ * Set up the systems of a simulation step (once)
+ * In declaration order; the scheduler works out which can share a stage:
+ * the sky, precipitation and crowd grid run together, then the history
+ * copy, then the crowd update.
+ */
+void initSystems() {
+    if (scheduler.numSystems) return;
+    unsigned int villager = world.archetypes[ARCHETYPE_VILLAGER].components;
+    addSystem("environment", RESOURCE_SKY, RESOURCE_SKY, environmentStep, NULL, NULL, &environment, 0);
+    addSystem("precipitation", RESOURCE_WEATHER, RESOURCE_PRECIPITATION, beginParticleStep, particleJob,
+              finishParticleStep, &precipitation, 1);
+    addSystem("crowd grid", COMPONENT_POSITION, villager | RESOURCE_CROWD_GRID, crowdGridBegin, crowdGridJob,
+              crowdGridEnd, NULL, 2);
+    addSystem("history", COMPONENT_POSITION | COMPONENT_HEADING | COMPONENT_GAIT, COMPONENT_HISTORY, historyBegin,
+              historyJob, NULL, NULL, 2);
+    addSystem("crowd", RESOURCE_CROWD_GRID | villager, villager & ~COMPONENT_HISTORY, crowdUpdateBegin,
+              crowdUpdateJob, crowdUpdateEnd, NULL, 2);
+}
+
+/* Worker entry point: run a range of the work items of the current stage */
+void stageJob(void* ctx, int begin, int end) {
+    Scheduler* sc = ctx;
+    for (int k = 0; k < sc->stageSize && begin < end; k++) {
+        System* s = sc->stage[k];
+        int last = s->firstItem + s->items;
+        if (begin >= last) continue;
+        int stop = end < last ? end : last;
+        double start = sc->timed ? nowSeconds() : 0.0;
+        s->run(s->ctx, begin - s->firstItem, stop - s->firstItem);
+        if (sc->timed) atomic_fetch_add(&s->workNs, (long long)((nowSeconds() - start) * 1e9));
+        begin = stop;
+    }
+}
+
+/**
+ * Run every system once, stage by stage: the begin() of each system in
+ * the stage, one parallel job over all their work items, then each end()
+ * @param dt Time step in seconds
+ * @param timed Measure each system (System.ms)
+ */
+void runSystems(float dt, int timed) {
+    Scheduler* sc = &scheduler;
+    sc->timed = timed;
+    for (int stage = 0; stage < sc->numStages; stage++) {
+        int items = 0;
+        sc->stageSize = 0;
+        for (int i = 0; i < sc->numSystems; i++) {
+            System* s = &sc->systems[i];
+            if (s->stage != stage) continue;
+            double start = timed ? nowSeconds() : 0.0;
+            s->items = s->begin ? s->begin(s->ctx, dt) : 0;
+            s->firstItem = items;
+            items += s->items;
+            atomic_store(&s->workNs, 0);
+            sc->stage[sc->stageSize++] = s;
+            if (timed) s->ms = (nowSeconds() - start) * 1000.0;
+        }
+        parallelFor(items, 1, stageJob, sc);
+        for (int k = 0; k < sc->stageSize; k++) {
+            System* s = sc->stage[k];
+            double start = timed ? nowSeconds() : 0.0;
+            if (s->end) s->end(s->ctx);
+            if (timed) s->ms += (nowSeconds() - start) * 1000.0 + atomic_load(&s->workNs) / 1e6;
+        }
+    }
+}
+
+/**
+ * Queue an input command for the simulation thread
+ * Single producer (GLUT thread), single consumer (simulation)
+ * @param type Command
+ * @param arg Command argument
+ */
+void postSimCommand(SimCommandType type, int arg) {
+    int head = atomic_load(&simCommandHead);
+    if (head - atomic_load(&simCommandTail) >= SIM_COMMAND_QUEUE) return; // Full: drop the key press
+    simCommands[head & (SIM_COMMAND_QUEUE - 1)] = (SimCommand){type, arg};
+    atomic_store(&simCommandHead, head + 1);
+}
+
+/**
+ * Apply one input command to the simulation state (and record it)
+ * @param type Command
+ * @param arg Command argument
+ */
+void applySimCommand(SimCommandType type, int arg) {
+    switch (type) {
+        case SIM_SET_DAY:
+            environment.isDay = arg;
+            break;
+        case SIM_CYCLE_WEATHER:
+            environment.weatherMode = (environment.weatherMode + 1) % 4;
+            break;
+        case SIM_RESIZE_CROWD:
+            resizeCrowd(arg);
+            break;
+        case SIM_RESIZE_FOREST:
+            resizeForest(arg);
+            break;
+        case SIM_RESIZE_LANTERNS:
+            resizeLanterns(arg);
+            break;
+        case SIM_RESIZE_CLOUDS:
+            resizeClouds(arg);
+            break;
+    }
+    if (recordFile) fprintf(recordFile, "sim %lld %d %d\n", simTick, type, arg);
+}
+
+/**
+ * Apply queued input commands, then recorded ones, to the simulation state
+ */
+void applySimCommands() {
+    int tail = atomic_load(&simCommandTail);
+    while (tail != atomic_load(&simCommandHead)) {
+        SimCommand* c = &simCommands[tail & (SIM_COMMAND_QUEUE - 1)];
+        applySimCommand(c->type, c->arg);
+        atomic_store(&simCommandTail, ++tail);
+    }
+
+    // Recorded commands for this tick
+    for (; replaySimCursor < numReplayEvents; replaySimCursor++) {
+        const InputEvent* e = &replayEvents[replaySimCursor];
+        if (e->view) continue;
+        if (e->tick > simTick) break;
+        applySimCommand(e->code, e->arg);
+    }
+}
+
+/* Worker entry point for writeParticleLines() into the back snapshot */
+void particleLinesJob(void* ctx, int begin, int end) {
+    writeParticleLines(&precipitation, begin, end, ctx);
+}
+
+/**
+ * Make room in a snapshot array, with some slack when it grows
+ * @param array Current array (freed if it has to grow)
+ * @param capacity Elements it holds, updated when it grows
+ * @param count Elements needed
+ * @param size Bytes per element
+ * @return The array to fill
+ */
+void* reserveSnapshot(void* array, int* capacity, int count, size_t size) {
+    if (count <= *capacity) return array;
+    free(array);
+    *capacity = count + count / 2;
+    array = malloc(*capacity * size);
+    if (!array) {
+        fprintf(stderr, "Out of memory allocating simulation snapshots\n");
+        exit(1);
+    }
+    return array;
+}
+
+/**
+ * Copy the simulation state into the back snapshot and hand it to display()
+ */
+void publishSnapshot() {
+    SimSnapshot* s = &snapshots[snapshotBack];
+    s->tick = simTick;
+    s->tickTime = simClockStart + simTick * (double)SIM_DT;
+    s->sunAngle = environment.sunAngle;
+    s->isDay = environment.isDay;
+    s->weatherMode = environment.weatherMode;
+    s->lightFlicker = environment.lightFlicker;
+
+    // Villager poses, gathered from their columns
+    const Archetype* a = &world.archetypes[ARCHETYPE_VILLAGER];
+    int slots = 0;
+    s->people = reserveSnapshot(s->people, &s->maxPeople, a->count, sizeof(Person));
+    for (int chunk = 0; chunk < usedChunks(a); chunk++) {
+        void* const* c = a->chunks[chunk].columns;
+        const Entity* entities = c[COLUMN_ENTITY];
+        const float *x = c[COLUMN_X], *y = c[COLUMN_Y], *z = c[COLUMN_Z], *angle = c[COLUMN_ANGLE];
+        const float *legAngle = c[COLUMN_LEG_ANGLE], *prevX = c[COLUMN_PREV_X], *prevY = c[COLUMN_PREV_Y];
+        const float *prevZ = c[COLUMN_PREV_Z], *prevAngle = c[COLUMN_PREV_ANGLE], *prevLeg = c[COLUMN_PREV_LEG_ANGLE];
+        const int *legDirection = c[COLUMN_LEG_DIRECTION], *state = c[COLUMN_STATE];
+        Person* out = s->people + (chunk << ENTITY_CHUNK_SHIFT);
+        for (int r = 0; r < chunkRows(a, chunk); r++) {
+            out[r] = (Person){x[r], z[r], y[r], angle[r], legAngle[r], prevX[r], prevY[r], prevZ[r], prevAngle[r],
+                              prevLeg[r], state[r] ? legDirection[r] : 0, entities[r] & ENTITY_SLOT_MASK};
+            if (out[r].id >= slots) slots = out[r].id + 1;
+        }
+    }
+    s->numPeople = a->count;
+    s->personSlots = slots; // Trees and lights hold slots too
+    s->crowdVersion = a->version;
+
+    // Trees, lights and clouds only when they changed; display() rebuilds its views from them
+    const Archetype* trees = &world.archetypes[ARCHETYPE_TREE];
+    if (s->forestVersion != trees->version) {
+        s->trees = reserveSnapshot(s->trees, &s->maxTrees, trees->count, sizeof(TreeInstance));
+        memcpy(s->trees, crowd.treeRows, trees->count * sizeof(TreeInstance)); // Gathered by initCrowdObstacles()
+        s->numTrees = trees->count;
+        s->forestVersion = trees->version;
+    }
+    const Archetype* lights = &world.archetypes[ARCHETYPE_LIGHT];
+    if (s->lightVersion != lights->version) {
+        s->lights = reserveSnapshot(s->lights, &s->maxLights, lights->count, sizeof(PointLight));
+        gatherLights(s->lights);
+        s->numLights = lights->count;
+        s->lightVersion = lights->version;
+    }
+    const Archetype* clouds = &world.archetypes[ARCHETYPE_CLOUD];
+    if (s->cloudVersion != clouds->version) {
+        s->clouds = reserveSnapshot(s->clouds, &s->maxClouds, clouds->count, sizeof(Cloud));
+        gatherClouds(s->clouds);
+        s->numClouds = clouds->count;
+        s->cloudVersion = clouds->version;
+    }
+    parallelFor(precipitation.count, PARTICLE_CHUNK, particleLinesJob, s->particleLines);
+    s->numParticles = precipitation.count;
+    s->particleMode = precipitation.mode;
+
+    // Swap the back slot with the hand-off slot, marking it fresh
+    snapshotBack = atomic_exchange(&snapshotReady, snapshotBack | SNAPSHOT_FRESH) & 3;
+}
+
+/**
+ * Switch display() to the newest published snapshot, if there is one,
+ * and work out how far between its previous and current tick to draw
+ * Rendering runs one tick behind the simulation so there is always a
+ * pair of ticks to interpolate between. Never blocks: the old front slot
+ * becomes the hand-off slot.
+ */
+void acquireSnapshot() {
+    if (atomic_load(&snapshotReady) & SNAPSHOT_FRESH) {
+        snapshotFront = atomic_exchange(&snapshotReady, snapshotFront) & 3;
+    }
+    frame = &snapshots[snapshotFront];
+
+    frameAlpha = fmaxf(0.0f, fminf((simClock() - frame->tickTime) / SIM_DT, 1.0f));
+    viewSunAngle = frame->prevSunAngle + (frame->sunAngle - frame->prevSunAngle) * frameAlpha;
+    viewTime = (frame->tick - 1 + frameAlpha) * SIM_DT;
+}
+
+/**
+ * Advance the whole simulation by one fixed step and publish the result
+ * All rates are per second, so results only depend on the number of
+ * steps taken, never on how often frames are drawn.
+ */
+void simulationStep() {
+    SimSnapshot* s = &snapshots[snapshotBack];
+    int timed = atomic_load(&simProfiling);
+    double start = timed ? nowSeconds() : 0.0;
+    s->prevSunAngle = environment.sunAngle;
+
+    applySimCommands();
+    runSystems(SIM_DT, timed);
+    if (timed) {
+        s->stepMs[0] = (nowSeconds() - start) * 1000.0;
+        s->stepMs[1] = s->stepMs[2] = 0.0f;
+        for (int i = 0; i < scheduler.numSystems; i++) {
+            const System* sys = &scheduler.systems[i];
+            if (sys->report) s->stepMs[sys->report] += sys->ms;
+        }
+    }
+
+    simTick++;
+    publishSnapshot();
+}
+
+/**
+ * Run every simulation step that is due by now (fixed-timestep accumulator)
+ * After a long stall (debugger, window drag) the backlog beyond
+ * SIM_MAX_CATCHUP steps is dropped instead of being replayed.
+ * @return Steps taken
+ */
+int advanceSimulation() {
+    double now = simClock();
+    double behind = now - (simClockStart + simTick * (double)SIM_DT);
+    if (behind > SIM_MAX_CATCHUP * (double)SIM_DT) simClockStart += behind - SIM_DT;
+
+    int steps = 0;
+    while (simClockStart + (simTick + 1) * (double)SIM_DT <= now) {
+        simulationStep();
+        steps++;
+    }
+    return steps;
+}
+
+/**
+ * Simulation thread body: advance the simulation, then sleep until the
+ * next step is due
+ * @param arg Unused
+ * @return NULL
+ */
+void* simulationLoop(void* arg) {
+    while (!atomic_load(&simQuit)) {
+        advanceSimulation();
+
+        double due = simClockStart + (simTick + 1) * (double)SIM_DT;
+        struct timespec next = {(time_t)due, (long)((due - floor(due)) * 1e9)};
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+    return NULL;
+}
+
+/**
+ * Stop the simulation thread and the worker pool (registered with atexit)
+ */
+void stopSimulation() {
+    if (simThreadRunning) {
+        atomic_store(&simQuit, 1);
+        pthread_join(simThread, NULL);
+        simThreadRunning = 0;
+    }
+    pthread_mutex_lock(&workers.lock);
+    workers.quit = 1;
+    pthread_cond_broadcast(&workers.start);
+    pthread_mutex_unlock(&workers.lock);
+    for (int i = 0; i < workers.numThreads; i++) pthread_join(workers.threads[i], NULL);
+    workers.numThreads = 0;
+}
+
+/**
+ * (Re)allocate the snapshot arrays for the current people and particle counts
+ * Only call while the simulation thread is not running.
+ */
+void allocSnapshots() {
+    for (int i = 0; i < 3; i++) {
+        free(snapshots[i].people);
+        free(snapshots[i].particleLines);
+        snapshots[i].people = malloc(numPeople * sizeof(Person));
+        snapshots[i].maxPeople = numPeople;
+        snapshots[i].particleLines = malloc(precipitation.capacity * 6 * sizeof(float));
+        if (!snapshots[i].people || !snapshots[i].particleLines) {
+            fprintf(stderr, "Out of memory allocating simulation snapshots\n");
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Allocate the snapshots, publish the initial state and start the
+ * simulation thread and its helpers
+ * Call after init() has created the people and particles.
+ */
+void initSimulation() {
+    initSystems();
+    allocSnapshots();
+    simClockStart = simClock();
+    snapshots[snapshotBack].prevSunAngle = environment.sunAngle;
+    publishSnapshot();
+    acquireSnapshot();
+
+    // Default: leave one core for rendering (headless steps the simulation
+    // between frames itself, but still uses the helpers)
+    if (simThreads < 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        simThreads = cpus > 2 ? (int)cpus - 1 : 1;
+    }
+    if (simThreads > MAX_WORKERS) simThreads = MAX_WORKERS;
+    initWorkers(&workers, simThreads > 1 ? simThreads - 1 : 0);
+    atexit(stopSimulation);
+    if (simThreads > 0 && !headless) {
+        simThreadRunning = pthread_create(&simThread, NULL, simulationLoop, NULL) == 0;
+        if (!simThreadRunning) fprintf(stderr, "Could not start simulation thread, simulating on the GLUT thread\n");
+    }
+}
+
+/**
+ * Idle callback: keep redrawing as fast as the display allows
+ * (buffer swaps are paced by vsync when the driver enables it); also
+ * steps the simulation when it has no thread of its own
+ */
+void idle() {
+    if (!simThreadRunning) advanceSimulation();
+    glutPostRedisplay();
+}
+
+/**
+ * Create an offscreen OpenGL context with EGL
+ * Prefers Mesa's surfaceless platform (no X server or GPU needed) and
+ * renders into a pbuffer of the requested size.
+ * @param width,height Framebuffer size
+ * @return 1 on success
+ */
+int initHeadlessContext(int width, int height) {
+#ifdef HAVE_EGL
+    EGLDisplay display = EGL_NO_DISPLAY;
+    const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay && clientExtensions && strstr(clientExtensions, "EGL_MESA_platform_surfaceless")) {
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    }
+    if (display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) return 0;
+
+    EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_DEPTH_SIZE, 24,
+        EGL_NONE
+    };
+    EGLint surfaceAttribs[] = {EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE};
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    if (!eglBindAPI(EGL_OPENGL_API) ||
+        !eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs == 0) return 0;
+
+    EGLSurface surface = eglCreatePbufferSurface(display, config, surfaceAttribs);
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+    if (surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT) return 0;
+    return eglMakeCurrent(display, surface, surface, context) == EGL_TRUE;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Open the capture output and start the writer thread
+ * The format follows the target: pipes get Y4M (encoders detect it),
+ * otherwise the name's extension picks PPM or Y4M, and raw RGB is the
+ * fallback.
+ * @param target Pattern with %d (a file per frame), file name, "-" or "|command"
+ * @param width,height Area to capture
+ * @return 1 if capturing
+ */
+int startCapture(const char* target, int width, int height) {
+    Capture* c = &capture;
+    size_t len = strlen(target);
+    c->target = target;
+    c->format = CAPTURE_RAW;
+    if (len > 4 && !strcmp(target + len - 4, ".ppm")) c->format = CAPTURE_PPM;
+    if ((len > 4 && !strcmp(target + len - 4, ".y4m")) || target[0] == '|') c->format = CAPTURE_Y4M;
+
+    // One file (or stdout, or a pipe) for every frame unless the name has a frame number
+    c->stream = NULL;
+    c->piped = target[0] == '|';
+    if (c->piped) {
+        c->stream = popen(target + 1, "w");
+    } else if (!strcmp(target, "-")) {
+        c->stream = fdopen(dup(STDOUT_FILENO), "wb");
+        dup2(STDERR_FILENO, STDOUT_FILENO); // Keep status messages out of the stream
+    } else if (!strchr(target, '%')) {
+        c->stream = fopen(target, "wb");
+    }
+    if ((c->piped || !strchr(target, '%')) && !c->stream) {
+        fprintf(stderr, "Cannot write %s\n", target);
+        return 0;
+    }
+
+    c->width = width;
+    c->height = height;
+    c->frameBytes = (size_t)width * height * 4;
+    c->convert = malloc((size_t)width * height * 3);
+    for (int i = 0; i < CAPTURE_QUEUE; i++) {
+        c->slots[i] = malloc(c->frameBytes);
+        if (!c->slots[i] || !c->convert) {
+            fprintf(stderr, "Out of memory allocating a %dx%d capture queue\n", width, height);
+            exit(1);
+        }
+    }
+
+    // Pixel buffer objects make the readback asynchronous (GL 2.1)
+    memset(c->pbos, 0, sizeof(c->pbos));
+    if (glVersionAtLeast(2, 1) || hasExtension("GL_ARB_pixel_buffer_object")) {
+        glGenBuffers(CAPTURE_PBOS, c->pbos);
+        for (int i = 0; i < CAPTURE_PBOS; i++) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, c->pbos[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, c->frameBytes, NULL, GL_STREAM_READ);
+            c->pboFrame[i] = -1;
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    c->issued = c->head = c->tail = 0;
+    c->stalls = 0;
+    c->readMs = c->copyMs = c->waitMs = c->writeMs = 0.0;
+    c->quit = c->failed = 0;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->ready, NULL);
+    pthread_cond_init(&c->space, NULL);
+    if (pthread_create(&c->writer, NULL, captureWriterMain, NULL) != 0) {
+        fprintf(stderr, "Could not start the capture writer thread\n");
+        return 0;
+    }
+    c->running = 1;
+    return 1;
+}
+
+/**
+ * Convert one captured frame and write it out (writer thread)
+ * @param c Capture state
+ * @param pixels Bottom-up RGBA rows
+ * @param index Frame number, for per-frame file names
+ */
+void writeCaptureFrame(Capture* c, const unsigned char* pixels, long long index) {
+    int w = c->width, h = c->height;
+    FILE* out = c->stream;
+    if (!out) {
+        char path[1024];
+        snprintf(path, sizeof(path), c->target, (int)index);
+        out = fopen(path, "wb");
+        if (!out) {
+            if (!c->failed) fprintf(stderr, "Cannot write %s\n", path);
+            c->failed = 1;
+            return;
+        }
+    }
+
+    if (c->format == CAPTURE_Y4M) {
+        // Stream header before the first frame (or in every per-frame file)
+        if (out != c->stream || index == 0) {
+            fprintf(out, "YUV4MPEG2 W%d H%d F%ld:1000 Ip A1:1 C444\n", w, h, lround(headlessFps * 1000.0));
+        }
+        unsigned char *py = c->convert, *pu = py + (size_t)w * h, *pv = pu + (size_t)w * h;
+        for (int y = 0; y < h; y++) {
+            const unsigned char* src = pixels + (size_t)(h - 1 - y) * w * 4;
+            for (int x = 0; x < w; x++, src += 4) {
+                int r = src[0], g = src[1], b = src[2];
+                *py++ = (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+                *pu++ = (unsigned char)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+                *pv++ = (unsigned char)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+            }
+        }
+        fputs("FRAME\n", out);
+        fwrite(c->convert, 1, (size_t)w * h * 3, out);
+    } else {
+        if (c->format == CAPTURE_PPM) fprintf(out, "P6\n%d %d\n255\n", w, h);
+        for (int y = h - 1; y >= 0; y--) {
+            const unsigned char* src = pixels + (size_t)y * w * 4;
+            unsigned char* dst = c->convert;
+            for (int x = 0; x < w; x++, src += 4, dst += 3) {
+                dst[0] = src[0];
+                dst[1] = src[1];
+                dst[2] = src[2];
+            }
+            fwrite(c->convert, 1, (size_t)w * 3, out);
+        }
+    }
+
+    if (ferror(out) && !c->failed) {
+        fprintf(stderr, "Capture write failed\n");
+        c->failed = 1;
+    }
+    if (out != c->stream) fclose(out);
+}
+
+/**
+ * Writer thread: write queued frames in order until told to quit
+ * @param arg Unused
+ * @return NULL
+ */
+void* captureWriterMain(void* arg) {
+    Capture* c = &capture;
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        while (c->tail == c->head && !c->quit) pthread_cond_wait(&c->ready, &c->lock);
+        if (c->tail == c->head) break; // Quit once the queue has drained
+        int slot = c->tail % CAPTURE_QUEUE;
+        pthread_mutex_unlock(&c->lock);
+
+        double start = nowSeconds();
+        writeCaptureFrame(c, c->slots[slot], c->slotFrame[slot]);
+        double ms = (nowSeconds() - start) * 1000.0;
+
+        pthread_mutex_lock(&c->lock);
+        c->writeMs += ms;
+        c->tail++;
+        pthread_cond_signal(&c->space);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/**
+ * Wait for a free queue slot (render thread)
+ * @param c Capture state
+ * @return Slot to fill before calling queueCaptureSlot()
+ */
+unsigned char* waitCaptureSlot(Capture* c) {
+    double start = nowSeconds();
+    pthread_mutex_lock(&c->lock);
+    if (c->head - c->tail >= CAPTURE_QUEUE) c->stalls++;
+    while (c->head - c->tail >= CAPTURE_QUEUE) pthread_cond_wait(&c->space, &c->lock);
+    pthread_mutex_unlock(&c->lock);
+    c->waitMs += (nowSeconds() - start) * 1000.0;
+    return c->slots[c->head % CAPTURE_QUEUE];
+}
+
+/**
+ * Hand the slot returned by waitCaptureSlot() to the writer
+ * @param c Capture state
+ * @param index Frame number held by the slot
+ */
+void queueCaptureSlot(Capture* c, long long index) {
+    pthread_mutex_lock(&c->lock);
+    c->slotFrame[c->head % CAPTURE_QUEUE] = index;
+    c->head++;
+    pthread_cond_signal(&c->ready);
+    pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * Map a finished readback and queue its pixels for the writer
+ * @param c Capture state
+ * @param i Pixel buffer holding the frame
+ */
+void collectCapture(Capture* c, int i) {
+    unsigned char* slot = waitCaptureSlot(c);
+    double start = nowSeconds();
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, c->pbos[i]);
+    const void* pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if (pixels) {
+        memcpy(slot, pixels, c->frameBytes);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+        memset(slot, 0, c->frameBytes);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    c->copyMs += (nowSeconds() - start) * 1000.0;
+    queueCaptureSlot(c, c->pboFrame[i]);
+    c->pboFrame[i] = -1;
+}
+
+/**
+ * Read back the rendered frame for the capture writer
+ * The readback only starts here; the frame issued CAPTURE_PBOS - 1 frames
+ * ago is the one mapped and queued. Starts the capture on first use.
+ */
+void captureFrame() {
+    Capture* c = &capture;
+    if (!c->running && !startCapture(captureTarget, windowWidth, windowHeight)) {
+        captureTarget = NULL;
+        return;
+    }
+    profileBegin(PASS_CAPTURE);
+    double start = nowSeconds();
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    if (c->pbos[0]) {
+        int i = c->issued % CAPTURE_PBOS;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, c->pbos[i]);
+        glReadPixels(0, 0, c->width, c->height, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        c->pboFrame[i] = c->issued++;
+        c->readMs += (nowSeconds() - start) * 1000.0;
+
+        // The oldest readback in flight has had time to finish
+        int oldest = c->issued % CAPTURE_PBOS;
+        if (c->pboFrame[oldest] >= 0) collectCapture(c, oldest);
+    } else {
+        unsigned char* slot = waitCaptureSlot(c);
+        double read = nowSeconds();
+        glReadPixels(0, 0, c->width, c->height, GL_RGBA, GL_UNSIGNED_BYTE, slot);
+        c->readMs += (nowSeconds() - read) * 1000.0;
+        queueCaptureSlot(c, c->issued++);
+    }
+    profileEnd(PASS_CAPTURE);
+}
+
+/**
+ * Stop the writer once it has written every queued frame, close the
+ * output and report the capture's cost per frame
+ * Needs no GL context, so it also runs at exit.
+ */
+void stopCaptureWriter() {
+    Capture* c = &capture;
+    if (!c->running) return;
+    c->running = 0;
+    pthread_mutex_lock(&c->lock);
+    c->quit = 1;
+    pthread_cond_signal(&c->ready);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(c->writer, NULL);
+    if (c->piped) pclose(c->stream);
+    else if (c->stream) fclose(c->stream);
+    c->stream = NULL;
+
+    long long n = c->head > 0 ? c->head : 1;
+    fprintf(stderr, "Capture: %lld frames at %dx%d (%s), render thread %.3f ms/frame"
+                    " (readback %.3f, copy %.3f, waiting %.3f, %lld stalls), writer %.3f ms/frame\n",
+            c->head, c->width, c->height, c->pbos[0] ? "pixel buffers" : "synchronous",
+            (c->readMs + c->copyMs + c->waitMs) / n, c->readMs / n, c->copyMs / n, c->waitMs / n,
+            c->stalls, c->writeMs / n);
+    for (int i = 0; i < CAPTURE_QUEUE; i++) free(c->slots[i]);
+    free(c->convert);
+}
+
+/**
+ * End the capture: queue the readbacks still in flight, wait for the
+ * writer and close the output
+ */
+void finishCapture() {
+    Capture* c = &capture;
+    if (c->running && c->pbos[0]) {
+        for (long long n = c->issued - CAPTURE_PBOS; n < c->issued; n++) {
+            int i = (int)(n % CAPTURE_PBOS);
+            if (n >= 0 && c->pboFrame[i] == n) collectCapture(c, i);
+        }
+        glDeleteBuffers(CAPTURE_PBOS, c->pbos);
+    }
+    stopCaptureWriter();
+    captureTarget = NULL;
+}
+
+/**
+ * Render --headless frames offscreen and exit
+ * Each frame advances the simulation by 1/fps simulated seconds, so the
+ * output is the same however long the frames take to render.
+ */
+void runHeadless() {
+    if (!initHeadlessContext(headlessWidth, headlessHeight)) {
+        fprintf(stderr, "Could not create an offscreen OpenGL context (EGL)\n");
+        exit(1);
+    }
+    if (!captureTarget) captureTarget = headlessOutput;
+    if (!startCapture(captureTarget, headlessWidth, headlessHeight)) exit(1);
+
+    init();
+    reshape(headlessWidth, headlessHeight);
+    initSimulation();
+
+    double start = nowSeconds();
+    for (int i = 0; i < headlessFrames; i++) {
+        headlessTime = simClockStart + (i + 1) / headlessFps;
+        advanceSimulation();
+        display();
+    }
+    finishCapture();
+
+    double elapsed = nowSeconds() - start;
+    fprintf(stderr, "Headless: %d frames at %dx%d in %.2f s (%.1f fps, %.0f frames/min)\n",
+            headlessFrames, headlessWidth, headlessHeight, elapsed,
+            headlessFrames / elapsed, headlessFrames * 60.0 / elapsed);
+    if (dynamicRes.enabled && dynamicRes.frames > 0) {
+        fprintf(stderr, "Dynamic resolution: %.0f%% average, %.0f%% minimum for a %.1f ms budget (%d drops, %d raises)\n",
+                dynamicRes.scaleSum / dynamicRes.frames * 100.0, dynamicRes.minScale * 100.0f, dynamicRes.targetMs,
+                dynamicRes.drops, dynamicRes.raises);
+    }
+    exit(0);
+}
+
+/**
+ * Set up the scene, camera and simulation state for a benchmark scenario
+ * Counts are applied by regenerating the forest, crowd and particle pool.
+ * @param sc Scenario to load
  */
-void drawSmoke() {
-    glPushMatrix();
-    // Position at chimney with vertical animation
-    glTranslatef(-1.2, 3.5 + fmod(smokeY, 2.0), -0.8);
-    glColor4f(0.8, 0.8, 0.8, 0.5); // Semi-transparent gray
-    glutSolidSphere(0.3, 8, 8);     // Smoke puff
-    glPopMatrix();
+void loadBenchmarkScenario(const BenchmarkScenario* sc) {
+    forestTreeCount = sc->trees;
+    numPeople = sc->people;
+    particleCapacity = sc->particles;
+    cloudCount = sc->clouds;
+    lanternCount = sc->lights;
+    smokePuffs = sc->smoke;
+    stereo.enabled = sc->stereo != 0;
+    stereo.naive = sc->stereo == 2;
+    generateForest(&forest, forestTreeCount, sceneSeed);
+    initCrowdObstacles();
+    initPeople();
+    freeParticles(&precipitation);
+    initParticles(&precipitation, particleCapacity, sceneSeed);
+    initClouds(cloudCount, sceneSeed);
+    initLights(lanternCount, sceneSeed);
+    allocSnapshots();
+
+    environment.weatherMode = sc->weatherMode;
+    environment.isDay = sc->isDay;
+    environment.sunAngle = 1.2; // Well above the horizon, so no day/night switch mid-run
+    zoom = sc->zoom;
+    cameraAngle = 0.0;
+    cameraX = cameraZ = 0.0;
+
+    // Restart the frame clock and publish the new state
+    simClockStart = headlessTime;
+    simTick = 0;
+    snapshots[snapshotBack].prevSunAngle = environment.sunAngle;
+    publishSnapshot();
+    acquireSnapshot();
+    memset(profiler.cpu, 0, sizeof(profiler.cpu));
+    memset(profiler.gpu, 0, sizeof(profiler.gpu));
 }
 
 /**
- * Render a cabin with detailed construction
- * Includes walls, roof, chimney, door, and windows
+ * Write one scenario's results as a JSON object
+ * @param out Report file
+ * @param sc Scenario
+ * @param ms Measured frame times, sorted ascending
+ * @param count Number of frame times
+ * @param visible Objects that passed culling, summed over the measured frames
+ * @param occluded Objects hidden by occlusion culling, summed the same way
+ * @param forestCalls Forest draw calls, summed the same way
+ * @param last Whether this is the final entry (no trailing comma)
  */
-void drawCabin() {
-    glPushMatrix();
-
-    // Cabin dimensions
-    float width = 4.0, height = 2.0, depth = 3.0, roofHeight = 1.5;
-    float halfW = width / 2.0, halfD = depth / 2.0;
-
-    /* WALLS - Wooden plank construction */
-    glBegin(GL_QUADS);
-    for (float y = 0.0; y < height; y += 0.2) {
-        // Varying wood color for planks
-        glColor3f(0.5 + fmod(y * 2, 0.4), 0.25, 0.1);
-
-        // Front wall
-        glVertex3f(-halfW, y, halfD);
-        glVertex3f(halfW, y, halfD);
-        glVertex3f(halfW, y + 0.2, halfD);
-        glVertex3f(-halfW, y + 0.2, halfD);
-
-        // Back wall
-        glVertex3f(-halfW, y, -halfD);
-        glVertex3f(halfW, y, -halfD);
-        glVertex3f(halfW, y + 0.2, -halfD);
-        glVertex3f(-halfW, y + 0.2, -halfD);
-
-        // Left wall
-        glVertex3f(-halfW, y, -halfD);
-        glVertex3f(-halfW, y, halfD);
-        glVertex3f(-halfW, y + 0.2, halfD);
-        glVertex3f(-halfW, y + 0.2, -halfD);
+void writeBenchmarkEntry(FILE* out, const BenchmarkScenario* sc, const float* ms, int count, double visible,
+                         double occluded, double forestCalls, int last) {
+    static const char* stereoNames[] = {"off", "shared", "naive"};
+    double sum = 0.0;
+    for (int i = 0; i < count; i++) sum += ms[i];
+    double mean = sum / count;
 
-        // Right wall
-        glVertex3f(halfW, y, -halfD);
-        glVertex3f(halfW, y, halfD);
-        glVertex3f(halfW, y + 0.2, halfD);
-        glVertex3f(halfW, y + 0.2, -halfD);
+    fprintf(out, "    {\n      \"name\": \"%s\",\n", sc->name);
+    fprintf(out, "      \"weather\": %d, \"day\": %d, \"trees\": %d, \"people\": %d, \"particles\": %d,"
+                 " \"clouds\": %d, \"lights\": %d, \"smoke\": %d, \"orbit_degrees\": %.0f, \"travel\": %.0f,"
+                 " \"stereo\": \"%s\",\n",
+            sc->weatherMode, sc->isDay, forest.numTrees, numPeople, precipitation.capacity, cloudLayer.count,
+            lightField.count - CABIN_LIGHTS, smokePuffs, sc->orbit, sc->travel, stereoNames[sc->stereo]);
+    fprintf(out, "      \"frame_ms\": {\"mean\": %.4f, \"min\": %.4f, \"p50\": %.4f, \"p90\": %.4f,"
+                 " \"p99\": %.4f, \"max\": %.4f},\n",
+            mean, ms[0], ms[count / 2], ms[count * 90 / 100], ms[count * 99 / 100], ms[count - 1]);
+    fprintf(out, "      \"visible_objects\": %.1f, \"occluded_objects\": %.1f, \"total_objects\": %d,\n",
+            visible / count, occluded / count, forest.numTrees + numPeople + 1);
+    fprintf(out, "      \"forest_path\": \"%s\", \"forest_draw_calls\": %.1f,\n",
+            forest.program ? "instanced" : "merged-mesh", forestCalls / count);
+    if (dynamicRes.enabled && dynamicRes.frames > 0) {
+        fprintf(out, "      \"render_scale\": {\"target_ms\": %.2f, \"mean\": %.4f, \"min\": %.4f, \"drops\": %d,"
+                     " \"raises\": %d},\n", dynamicRes.targetMs, dynamicRes.scaleSum / dynamicRes.frames,
+                dynamicRes.minScale, dynamicRes.drops, dynamicRes.raises);
     }
-    glEnd();
+    fprintf(out, "      \"fps\": %.2f,\n      \"passes\": {", 1000.0 / mean);
 
-    /* FLOOR - Wooden planks */
-    glColor3f(0.4, 0.2, 0.1); // Darker wood color
-    glBegin(GL_QUADS);
-    glVertex3f(-halfW, 0.0, -halfD);
-    glVertex3f(halfW, 0.0, -halfD);
-    glVertex3f(halfW, 0.0, halfD);
-    glVertex3f(-halfW, 0.0, halfD);
-    glEnd();
+    // Average time per pass from the profiler
+    int first = 1;
+    for (int pass = 0; pass < PROFILE_PASSES; pass++) {
+        const ProfileSeries *c = &profiler.cpu[pass], *g = &profiler.gpu[pass];
+        if (c->samples == 0) continue;
+        fprintf(out, "%s\n        \"%s\": {\"cpu_ms\": %.4f", first ? "" : ",", profilePassNames[pass], c->sum / c->samples);
+        if (g->samples) fprintf(out, ", \"gpu_ms\": %.4f", g->sum / g->samples);
+        fprintf(out, "}");
+        first = 0;
+    }
+    fprintf(out, "\n      }\n    }%s\n", last ? "" : ",");
+}
 
-    /* DOOR - Centered on front wall */
-    glColor3f(0.3, 0.15, 0.05); // Brown door
-    glBegin(GL_QUADS);
-    glVertex3f(-0.5, 0.0, halfD + 0.01);  // Slightly in front of wall
-    glVertex3f(0.5, 0.0, halfD + 0.01);
-    glVertex3f(0.5, 1.2, halfD + 0.01);
-    glVertex3f(-0.5, 1.2, halfD + 0.01);
-    glEnd();
+/**
+ * Run the scripted benchmark scenarios headless and write a JSON report
+ * Each scenario is warmed up, then every frame (simulation step and
+ * render, finished with glFinish) is timed individually.
+ */
+void runBenchmarkSuite() {
+    headlessOutput = NULL; // Render only, don't save frames
+    if (!initHeadlessContext(headlessWidth, headlessHeight)) {
+        fprintf(stderr, "Could not create an offscreen OpenGL context (EGL)\n");
+        exit(1);
+    }
 
-    /* WINDOWS - On front wall */
-    glColor3f(0.5, 0.8, 1.0); // Glass blue
-    glBegin(GL_QUADS);
-    // Left window
-    glVertex3f(-1.5, 1.0, halfD + 0.01);
-    glVertex3f(-0.9, 1.0, halfD + 0.01);
-    glVertex3f(-0.9, 1.5, halfD + 0.01);
-    glVertex3f(-1.5, 1.5, halfD + 0.01);
-    // Right window
-    glVertex3f(1.5, 1.0, halfD + 0.01);
-    glVertex3f(0.9, 1.0, halfD + 0.01);
-    glVertex3f(0.9, 1.5, halfD + 0.01);
-    glVertex3f(1.5, 1.5, halfD + 0.01);
-    glEnd();
+    // With "-" the report goes to stdout and status messages to stderr
+    FILE* out;
+    if (!strcmp(benchmarkReportPath, "-")) {
+        out = fdopen(dup(STDOUT_FILENO), "w");
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    } else {
+        out = fopen(benchmarkReportPath, "w");
+    }
+    float* ms = malloc(benchmarkSuiteFrames * sizeof(float));
+    if (!out || !ms) {
+        fprintf(stderr, "Cannot write %s\n", benchmarkReportPath);
+        exit(1);
+    }
 
-    /* ROOF - Gabled construction */
-    glColor3f(0.4, 0.0, 0.0); // Dark red roof
-    // Front triangle
-    glBegin(GL_TRIANGLES);
-    glVertex3f(-halfW, height, halfD);
-    glVertex3f(halfW, height, halfD);
-    glVertex3f(0.0, height + roofHeight, halfD);
-    // Back triangle
-    glVertex3f(-halfW, height, -halfD);
-    glVertex3f(halfW, height, -halfD);
-    glVertex3f(0.0, height + roofHeight, -halfD);
-    glEnd();
+    init();
+    reshape(headlessWidth, headlessHeight);
+    initSimulation();
+    setProfiling(1);
 
-    // Roof sides
-    glBegin(GL_QUADS);
-    // Left side
-    glVertex3f(-halfW, height, -halfD);
-    glVertex3f(-halfW, height, halfD);
-    glVertex3f(0.0, height + roofHeight, halfD);
-    glVertex3f(0.0, height + roofHeight, -halfD);
-    // Right side
-    glVertex3f(halfW, height, -halfD);
-    glVertex3f(halfW, height, halfD);
-    glVertex3f(0.0, height + roofHeight, halfD);
-    glVertex3f(0.0, height + roofHeight, -halfD);
-    glEnd();
+    int selected[NUM_BENCHMARK_SCENARIOS], numSelected = 0;
+    for (int i = 0; i < NUM_BENCHMARK_SCENARIOS; i++) {
+        if (!benchmarkFilter || strstr(benchmarkScenarios[i].name, benchmarkFilter)) selected[numSelected++] = i;
+    }
 
-    /* CHIMNEY - Brick structure */
-    glPushMatrix();
-    glTranslatef(-1.2, height + 0.5, -0.8); // Position on roof
-    glColor3f(0.2, 0.2, 0.2); // Dark gray
-    glScalef(0.3, 1.0, 0.3);  // Scale to chimney proportions
-    glutSolidCube(1.0);        // Simple cube chimney
-    glPopMatrix();
+    fprintf(out, "{\n  \"renderer\": \"%s\",\n  \"version\": \"%s\",\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+    fprintf(out, "  \"width\": %d, \"height\": %d, \"fps_step\": %.2f, \"warmup_frames\": %d, \"frames\": %d,"
+                 " \"threads\": %d,\n  \"scenarios\": [\n",
+            headlessWidth, headlessHeight, headlessFps, benchmarkSuiteWarmup, benchmarkSuiteFrames, simThreads);
 
-    glPopMatrix();
+    for (int k = 0; k < numSelected; k++) {
+        const BenchmarkScenario* sc = &benchmarkScenarios[selected[k]];
+        double visible = 0.0, occluded = 0.0, forestCalls = 0.0;
+        loadBenchmarkScenario(sc);
+        for (int i = -benchmarkSuiteWarmup; i < benchmarkSuiteFrames; i++) {
+            if (i == 0) {
+                memset(profiler.cpu, 0, sizeof(profiler.cpu)); // Drop warmup timings
+                memset(profiler.gpu, 0, sizeof(profiler.gpu));
+                resetDynamicResolutionStats();
+            }
+            if (i >= 0) cameraAngle = sc->orbit * i / benchmarkSuiteFrames;
+            if (i >= 0) cameraZ = -sc->travel * i / benchmarkSuiteFrames;
+            double start = nowSeconds();
+            headlessTime += 1.0 / headlessFps;
+            advanceSimulation();
+            display();
+            if (i >= 0) ms[i] = (nowSeconds() - start) * 1000.0;
+            if (i >= 0) visible += forest.visibleTrees + sceneIndex.visiblePeople + sceneIndex.cabinVisible;
+            if (i >= 0) occluded += occlusion.rejected;
+            if (i >= 0) forestCalls += forest.drawCalls;
+        }
+        qsort(ms, benchmarkSuiteFrames, sizeof(float), compareFloats);
+        writeBenchmarkEntry(out, sc, ms, benchmarkSuiteFrames, visible, occluded, forestCalls,
+                            k == numSelected - 1);
+        fprintf(stderr, "%-18s %8.2f ms p50 %8.2f ms p99\n", sc->name,
+                ms[benchmarkSuiteFrames / 2], ms[benchmarkSuiteFrames * 99 / 100]);
+    }
+    fprintf(out, "  ]\n}\n");
+    fclose(out);
+    free(ms);
+    exit(0);
 }
 
 /**
- * Render a tree at specified coordinates
- * @param x X position coordinate
- * @param z Z position coordinate
+ * Append a view key to the recording, stamped with the tick on screen
+ * @param key Key code
+ * @param special 1 for GLUT special keys
  */
-void drawTree(float x, float z) {
-    glPushMatrix();
-    glTranslatef(x, 0.0, z); // Position tree
-    
-    /* TRUNK - Brown cylinder */
-    glColor3f(0.4, 0.2, 0.1); // Brown wood
-    glPushMatrix();
-    glTranslatef(0, 1, 0);    // Raise trunk
-    glScalef(0.2, 2, 0.2);    // Scale to trunk shape
-    glutSolidCube(1.0);        // Simple cube trunk
-    glPopMatrix();
-
-    /* FOLIAGE - Green sphere */
-    glColor3f(0.0, 0.6, 0.0); // Green leaves
-    glTranslatef(0, 2.5, 0);  // Position foliage above trunk
-    glutSolidSphere(0.7, 10, 10); // Spherical foliage
-    
-    glPopMatrix();
+void recordViewInput(int key, int special) {
+    if (recordFile) fprintf(recordFile, "view %lld %d %d\n", frame->tick, key, special);
 }
 
 /**
- * Render the ground plane
- * Large green quad covering the entire scene
+ * Apply recorded view keys whose tick has been reached
+ * @param tick Simulation tick being displayed
  */
-void drawGround() {
-    glColor3f(0.3, 0.6, 0.2); // Grass green
-    glBegin(GL_QUADS);
-    // Cover large area (-50 to 50 in X and Z)
-    glVertex3f(-50, 0, -50);
-    glVertex3f(-50, 0, 50);
-    glVertex3f(50, 0, 50);
-    glVertex3f(50, 0, -50);
-    glEnd();
+void replayViewInput(long long tick) {
+    for (; replayViewCursor < numReplayEvents; replayViewCursor++) {
+        const InputEvent* e = &replayEvents[replayViewCursor];
+        if (!e->view) continue;
+        if (e->tick > tick) break;
+        if (applyViewKey(e->code, e->arg)) recordViewInput(e->code, e->arg);
+    }
 }
 
-/**
- * Render two large background hills
- * Uses cones rotated to point upward
- */
-void drawHills() {
-    glColor3f(0.2, 0.5, 0.2); // Hill green (slightly different from ground)
-    
-    /* LEFT HILL */
-    glPushMatrix();
-    glTranslatef(-15, 0, -30); // Position left and back
-    glRotatef(-90, 1, 0, 0);   // Rotate cone to point up
-    glutSolidCone(15, 10, 30, 30); // Wide base (radius 15), height 10
-    glPopMatrix();
-    
-    /* RIGHT HILL */
-    glPushMatrix();
-    glTranslatef(15, 0, -30);  // Position right and back
-    glRotatef(-90, 1, 0, 0);   // Rotate cone to point up
-    glutSolidCone(15, 10, 30, 30); // Same dimensions as left hill
-    glPopMatrix();
+/* Flush and close the recording (atexit) */
+void closeRecording() {
+    if (recordFile) fclose(recordFile);
+    recordFile = NULL;
 }
 
 /**
- * Render a cloud cluster at specified position
- * @param x X position coordinate
- * @param y Y position (height) coordinate
- * @param z Z position coordinate
+ * Start --record: write the header describing the scene being recorded,
+ * with every option that changes what the scene or simulation does
  */
-void drawCloud(float x, float y, float z) {
-    glColor4f(1.0, 1.0, 1.0, 0.8); // White with transparency
-    glPushMatrix();
-    glTranslatef(x, y, z); // Position cloud
-    
-    // Cloud is made of three overlapping spheres
-    glutSolidSphere(0.8, 10, 10); // Main cloud mass
-    
-    glTranslatef(0.8, 0.1, 0.0); // Offset right
-    glutSolidSphere(0.6, 10, 10); // Right puff
-    
-    glTranslatef(-1.6, 0.1, 0.0); // Offset left from original
-    glutSolidSphere(0.6, 10, 10); // Left puff
-    
-    glPopMatrix();
+void startRecording() {
+    recordFile = fopen(recordPath, "w");
+    if (!recordFile) {
+        fprintf(stderr, "Cannot write %s\n", recordPath);
+        exit(1);
+    }
+    fprintf(recordFile, "%s\nseed %u\ntrees %d\npeople %d\nparticles %d\n",
+            INPUT_RECORDING_MAGIC, sceneSeed, forestTreeCount, numPeople, particleCapacity);
+    fprintf(recordFile, "terrain-size %.9g\nclouds %d\nlights %d\nsmoke %d\n",
+            terrainSize, cloudCount, lanternCount, smokePuffs);
+    if (scenePath) fprintf(recordFile, "scene %s\n", scenePath);
+    atexit(closeRecording);
 }
 
 /**
- * Main display function - renders entire scene
- * Called whenever the display needs updating
+ * Load --replay: the header restores the recorded seed, scene and
+ * simulation options, overriding any the command line set differently,
+ * then every event line is read into memory
+ * @param argc,argv Command line, to name the options overridden
  */
-void display() {
-    // Clear buffers
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    glLoadIdentity();
-    
-    // Set camera position and orientation
-    glTranslatef(0.0, -5.0, zoom);      // Position camera
-    glRotatef(cameraAngle, 0.0, 1.0, 0.0); // Rotate view
-
-    // Update lighting based on time
-    updateLighting();
-    
-    // Enable fog if in fog weather mode
-    if (weatherMode == 3) drawFog();
-
-    /* DRAW SCENE ELEMENTS */
-    drawGround();    // Draw terrain first
-    drawHills();     // Background hills
-    drawCabin();     // Main cabin structure
+void loadReplay(int argc, char** argv) {
+    FILE* f = fopen(replayPath, "r");
+    static char replayScene[256];
+    char line[300], kind[8];
+    int capacity = 0;
+    if (!f || !fgets(line, sizeof(line), f) || strncmp(line, INPUT_RECORDING_MAGIC, strlen(INPUT_RECORDING_MAGIC))) {
+        fprintf(stderr, "%s is not an input recording\n", replayPath);
+        exit(1);
+    }
 
-    // Draw trees at various positions
-    drawTree(5, 3); drawTree(-6, -4); drawTree(8, -5); drawTree(6, 4);
-    drawTree(-5, -6); drawTree(7, -7); drawTree(-9, 5); drawTree(10, 2);
+    // The recording decides; keep the command line's values to report clashes
+    unsigned int seed = sceneSeed;
+    int trees = forestTreeCount, people = numPeople, particles = particleCapacity;
+    int clouds = cloudCount, lights = lanternCount, smoke = smokePuffs;
+    float size = terrainSize;
+    const char* sceneOption = scenePath;
+    scenePath = NULL;
+    while (fgets(line, sizeof(line), f)) {
+        InputEvent e;
+        if (sscanf(line, "seed %u", &sceneSeed) == 1) continue;
+        if (sscanf(line, "trees %d", &forestTreeCount) == 1) continue;
+        if (sscanf(line, "people %d", &numPeople) == 1) continue;
+        if (sscanf(line, "particles %d", &particleCapacity) == 1) continue;
+        if (sscanf(line, "terrain-size %f", &terrainSize) == 1) continue;
+        if (sscanf(line, "clouds %d", &cloudCount) == 1) continue;
+        if (sscanf(line, "lights %d", &lanternCount) == 1) continue;
+        if (sscanf(line, "smoke %d", &smokePuffs) == 1) continue;
+        if (sscanf(line, "scene %255s", replayScene) == 1) {
+            scenePath = replayScene;
+            continue;
+        }
+        if (sscanf(line, "%7s %lld %d %d", kind, &e.tick, &e.code, &e.arg) != 4) continue;
+        e.view = !strcmp(kind, "view");
+        if (numReplayEvents == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            replayEvents = realloc(replayEvents, capacity * sizeof(InputEvent));
+            if (!replayEvents) {
+                fprintf(stderr, "Out of memory loading %s\n", replayPath);
+                exit(1);
+            }
+        }
+        replayEvents[numReplayEvents++] = e;
+    }
+    fclose(f);
 
-    // Draw moving clouds
-    drawCloud(5 + 2 * sin(sunAngle), 15, -5);  // Cloud with slight movement
-    drawCloud(-10 + 2 * cos(sunAngle), 17, 6); // Second moving cloud
-    
-    drawSmoke(); // Chimney smoke
+    // Same limits as the command line, whatever the file says
+    if (forestTreeCount < 0) forestTreeCount = 0;
+    if (numPeople < 1) numPeople = 1;
+    if (particleCapacity < 0) particleCapacity = 0;
+    if (terrainSize < 2.0f * TERRAIN_CHUNK_SIZE) terrainSize = 2.0f * TERRAIN_CHUNK_SIZE;
+    if (cloudCount < 0) cloudCount = 0;
+    if (lanternCount < 0) lanternCount = 0;
+    if (smokePuffs < 0) smokePuffs = 0;
 
-    // Draw all characters
-    for (int i = 0; i < MAX_PEOPLE; i++) {
-        drawPerson(&people[i]);
+    const struct { const char* option; int differs; } recorded[] = {
+        {"--seed", sceneSeed != seed}, {"--trees", forestTreeCount != trees}, {"--people", numPeople != people},
+        {"--particles", particleCapacity != particles}, {"--terrain-size", terrainSize != size},
+        {"--clouds", cloudCount != clouds}, {"--lights", lanternCount != lights}, {"--smoke", smokePuffs != smoke},
+        {"--scene", sceneOption && (!scenePath || strcmp(scenePath, sceneOption))}
+    };
+    for (int i = 1; i + 1 < argc; i++) {
+        for (size_t k = 0; k < sizeof(recorded) / sizeof(recorded[0]); k++) {
+            if (recorded[k].differs && !strcmp(argv[i], recorded[k].option)) {
+                fprintf(stderr, "Ignoring %s %s: %s was recorded with a different value\n", argv[i], argv[i + 1],
+                        replayPath);
+            }
+        }
     }
-    
-    // Draw precipitation if active
-    if (weatherMode == 1 || weatherMode == 2) drawRainOrSnow();
 
-    // Ensure fog is disabled for next frame
-    glDisable(GL_FOG);
-    
-    // Swap buffers to display rendered scene
-    glutSwapBuffers();
+    // Keep replay mode (live input ignored) even for an empty recording
+    if (!replayEvents) replayEvents = malloc(sizeof(InputEvent));
+    printf("Replaying %d input events from %s\n", numReplayEvents, replayPath);
 }
 
 /**
- * Keyboard input handler
- * @param key ASCII key pressed
- * @param x X coordinate of mouse when key pressed
- * @param y Y coordinate of mouse when key pressed
+ * Find the first object of a kind in the loaded scene file
+ * @param kind Object kind
+ * @return Object record, or NULL when no scene (or no such object) is loaded
  */
-void keyboard(unsigned char key, int x, int y) {
-    switch (key) {
-        case 'd': case 'D': 
-            isDay = 1; // Switch to daytime
-            break;
-        case 'n': case 'N': 
-            isDay = 0; // Switch to nighttime
-            break;
-        case '+': 
-            zoom += 1.0; // Zoom in
-            break;
-        case '-': 
-            zoom -= 1.0; // Zoom out
-            break;
-        case 'w': case 'W':
-            // Cycle through weather modes
-            weatherMode = (weatherMode + 1) % 4; 
-            break;
+const SceneObject* sceneObject(SceneObjectKind kind) {
+    if (!scene.header) return NULL;
+    const SceneObject* objects = scene.sections[SCENE_SECTION_OBJECTS];
+    for (unsigned int i = 0; i < scene.header->sections[SCENE_SECTION_OBJECTS].count; i++) {
+        if (objects[i].kind == (int)kind) return &objects[i];
     }
+    return NULL;
 }
 
 /**
- * Special key handler (arrow keys)
- * @param key GLUT key constant
- * @param x X coordinate of mouse
- * @param y Y coordinate of mouse
+ * Check that a range lies within a section of the loaded scene
+ * @return 1 if first and count are non-negative and first + count <= the section's records
  */
-void specialKeys(int key, int x, int y) {
-    switch (key) {
-        case GLUT_KEY_LEFT: 
-            cameraAngle -= 2.0; // Rotate view left
-            break;
-        case GLUT_KEY_RIGHT: 
-            cameraAngle += 2.0; // Rotate view right
-            break;
-    }
+int sceneRangeValid(SceneSectionType type, int first, int count) {
+    return first >= 0 && count >= 0 && (long long)first + count <= scene.header->sections[type].count;
 }
 
 /**
- * Initialize OpenGL settings
- * Sets up lighting, materials, and other rendering parameters
+ * Center the clearing on the cabin and let it reach TERRAIN_CLEARING or
+ * the foot of the nearest hill, whichever is closer
+ * @param s Layout to complete
+ * @return NULL, or why the layout cannot be used
  */
-void init() {
-    srand(time(0)); // Seed random number generator
-    
-    // Enable depth testing for 3D rendering
-    glEnable(GL_DEPTH_TEST);
-    
-    // Enable lighting
-    glEnable(GL_LIGHTING);
-    glEnable(GL_LIGHT0); // Use light source 0
-    
-    // Enable color material for colored objects
-    glEnable(GL_COLOR_MATERIAL);
-    
-    // Use smooth shading
-    glShadeModel(GL_SMOOTH);
-    
-    // Enable blending for transparency
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    
-    // Set up perspective projection
-    glMatrixMode(GL_PROJECTION);
-    gluPerspective(45.0, 1.0, 1.0, 100.0);
-    glMatrixMode(GL_MODELVIEW);
-    
-    // Initialize character positions
-    initPeople();
+const char* layoutClearing(SceneLayout* s) {
+    s->clearingX = s->cabinX;
+    s->clearingZ = s->cabinZ;
+    s->clearingRadius = TERRAIN_CLEARING;
+    for (int i = 0; i < s->numHills; i++) {
+        const Hill* h = &s->hills[i];
+        if (!(h->radius > 0.0f) || !(h->height >= 0.0f)) return "a hill has no size";
+        float dx = h->x - s->cabinX, dz = h->z - s->cabinZ;
+        s->clearingRadius = fminf(s->clearingRadius, sqrtf(dx * dx + dz * dz) - h->radius);
+    }
+    return s->clearingRadius < CLEARING_MIN ? "a hill stands on the clearing" : NULL;
 }
 
 /**
- * Window resize handler
- * @param w New window width
- * @param h New window height
+ * Map a binary scene file and check its layout, then take the seed,
+ * terrain size, crowd and cloud sizes, the cabin and the hills from it.
+ * Nothing is parsed or copied: the sections are used where they lie in
+ * the mapping.
+ * @param path Scene file written by --convert-scene
  */
-void reshape(int w, int h) {
-    // Set viewport to new dimensions
-    glViewport(0, 0, w, h);
-    
-    // Update projection matrix
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    gluPerspective(45.0, (float)w / (float)h, 1.0, 100.0);
-    glMatrixMode(GL_MODELVIEW);
-}
+void loadScene(const char* path) {
+    double start = nowSeconds();
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        exit(1);
+    }
+    void* data = MAP_FAILED;
+    if ((size_t)st.st_size >= sizeof(SceneHeader)) data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    const SceneHeader* h = data;
+    if (data == MAP_FAILED || memcmp(h->magic, SCENE_MAGIC, sizeof(h->magic))) {
+        fprintf(stderr, "%s is not a scene file (convert text scenes with --convert-scene)\n", path);
+        exit(1);
+    }
+    if (h->byteOrder != SCENE_BYTE_ORDER || h->version != SCENE_VERSION) {
+        fprintf(stderr, "%s is scene version %u%s; this build reads version %d\n", path, h->version,
+                h->byteOrder != SCENE_BYTE_ORDER ? " of the other byte order" : "", SCENE_VERSION);
+        exit(1);
+    }
 
-/**
- * Update character positions and states
- * Handles walking animation and movement logic
- */
-void updatePeople() {
-    for (int i = 0; i < MAX_PEOPLE; i++) {
-        Person* p = &people[i];
-        p->timer++; // Increment state timer
-        
-        if (p->state == 0) { // Standing state
-            // After random interval, start walking
-            if (p->timer > 100 + rand() % 100) {
-                p->state = 1; // Change to walking
-                p->angle = rand() % 360; // Random direction
-                p->timer = 0; // Reset timer
-            }
-        } 
-        else { // Walking state
-            /* LEG ANIMATION */
-            p->legAngle += p->legDirection * 2.0; // Swing legs
-            if (fabs(p->legAngle) > 15.0) { // Reverse at max angle
-                p->legDirection *= -1;
-            }
-            
-            /* MOVEMENT */
-            // Move forward in facing direction
-            p->x += sin(p->angle * M_PI / 180.0) * p->speed;
-            p->z += cos(p->angle * M_PI / 180.0) * p->speed;
-            
-            /* RANDOM DIRECTION CHANGE */
-            if (rand() % 100 < 2) { // 2% chance per frame
-                p->angle += (rand() % 60) - 30; // -30 to +30 degree change
-            }
-            
-            /* BOUNDARY CHECK */
-            if (p->x < -20 || p->x > 20 || p->z < -20 || p->z > 20) {
-                p->angle += 180; // Turn around at edge
-            }
-            
-            /* RANDOM STOP */
-            if (p->timer > 200 + rand() % 200) { // After random interval
-                p->state = 0; // Stop walking
-                p->timer = 0;
-                p->legAngle = 0; // Reset legs
-            }
+    scene.data = data;
+    scene.size = st.st_size;
+    scene.header = h;
+    const char* error = NULL;
+    for (int i = 0; i < SCENE_SECTION_COUNT && !error; i++) {
+        const SceneSection* sec = &h->sections[i];
+        if (sec->offset % SCENE_ALIGN || sec->offset > scene.size || sec->bytes > scene.size - sec->offset ||
+            sec->bytes != sec->count * sceneRecordSize[i]) error = "a section lies outside the file";
+        scene.sections[i] = scene.data + sec->offset;
+    }
+
+    // Cross-check the tables, so a damaged file cannot send reads astray
+    const SceneObject* objects = scene.sections[SCENE_SECTION_OBJECTS];
+    const SceneChunk* chunks = scene.sections[SCENE_SECTION_CHUNKS];
+    const SceneMesh* meshes = scene.sections[SCENE_SECTION_MESHES];
+    const GLuint* indices = scene.sections[SCENE_SECTION_INDICES];
+    if (!error && (h->chunksX < 1 || h->chunksZ < 1 ||
+                   (long long)h->chunksX * h->chunksZ != h->sections[SCENE_SECTION_CHUNKS].count)) {
+        error = "the chunk grid does not match the chunk table";
+    }
+    for (unsigned int i = 0; !error && i < h->sections[SCENE_SECTION_OBJECTS].count; i++) {
+        const SceneObject* o = &objects[i];
+        if (!sceneRangeValid(SCENE_SECTION_INSTANCES, o->firstInstance, o->numInstances) ||
+            !sceneRangeValid(SCENE_SECTION_MESHES, o->firstMesh, o->numMeshes)) error = "an object range is out of bounds";
+        else if (o->kind == SCENE_OBJECT_TREE && o->numMeshes != FOREST_LODS) error = "trees need one mesh per detail level";
+    }
+    for (unsigned int i = 0; !error && i < h->sections[SCENE_SECTION_CHUNKS].count; i++) {
+        if (!sceneRangeValid(SCENE_SECTION_INSTANCES, chunks[i].first, chunks[i].count)) error = "a chunk range is out of bounds";
+    }
+    for (unsigned int i = 0; !error && i < h->sections[SCENE_SECTION_MESHES].count; i++) {
+        const SceneMesh* m = &meshes[i];
+        if (!sceneRangeValid(SCENE_SECTION_VERTICES, m->firstVertex, m->numVertices) ||
+            !sceneRangeValid(SCENE_SECTION_INDICES, m->firstIndex, m->numIndices)) {
+            error = "a mesh range is out of bounds";
+            break;
+        }
+        for (int k = 0; k < m->numIndices; k++) {
+            if (indices[m->firstIndex + k] >= (GLuint)m->numVertices) error = "a mesh index is out of bounds";
         }
     }
-}
 
+    // Cabin and hills; the clearing follows from them
+    SceneLayout placed = {0};
+    for (unsigned int i = 0; !error && i < h->sections[SCENE_SECTION_OBJECTS].count; i++) {
+        const float* p = objects[i].place;
+        if (objects[i].kind == SCENE_OBJECT_CABIN) {
+            placed.cabinX = p[0];
+            placed.cabinZ = p[1];
+        } else if (objects[i].kind == SCENE_OBJECT_HILL) {
+            if (placed.numHills == MAX_HILLS) error = "there are too many hills";
+            else placed.hills[placed.numHills++] = (Hill){p[0], p[1], p[2], p[3]};
+        }
+    }
+    if (!error) error = layoutClearing(&placed);
+    if (error) {
+        fprintf(stderr, "%s is damaged: %s\n", path, error);
+        exit(1);
+    }
+
+    sceneSeed = h->seed;
+    terrainSize = fmaxf(h->terrainSize, 2.0f * TERRAIN_CHUNK_SIZE);
+    numPeople = h->people > 0 ? h->people : 1;
+    cloudCount = h->clouds > 0 ? h->clouds : 0;
+    layout = placed;
+    const SceneObject* trees = sceneObject(SCENE_OBJECT_TREE);
+    printf("Scene %s: %d trees and %d hills mapped in %.2f ms\n", path, trees ? trees->numInstances : 0,
+           layout.numHills, (nowSeconds() - start) * 1000.0);
+}
 
 /**
- * Render a person character
- * @param p Pointer to Person struct
+ * Write one section of a scene file, padded to SCENE_ALIGN
+ * @param out Scene file being written
+ * @param h Header whose section entry is filled in
+ * @param type Section type
+ * @param data Records
+ * @param count Number of records
+ * @param offset Running file offset, advanced past the section
+ * @return 1 on success
  */
-void drawPerson(Person* p) {
-    glPushMatrix();
-    glTranslatef(p->x, 0.0, p->z);           // Position the person
-    glRotatef(p->angle, 0.0, 1.0, 0.0);      // Face the direction
+int writeSceneSection(FILE* out, SceneHeader* h, SceneSectionType type, const void* data, int count,
+                      unsigned long long* offset) {
+    static const char zeros[SCENE_ALIGN];
+    SceneSection* sec = &h->sections[type];
+    sec->count = count;
+    sec->offset = *offset;
+    sec->bytes = (unsigned long long)count * sceneRecordSize[type];
+    size_t pad = (SCENE_ALIGN - sec->bytes % SCENE_ALIGN) % SCENE_ALIGN;
+    *offset += sec->bytes + pad;
+    if (out && count && fwrite(data, sceneRecordSize[type], count, out) != (size_t)count) return 0;
+    return !out || fwrite(zeros, 1, pad, out) == pad;
+}
 
-    /* BODY */
-    glColor3f(0.8, 0.6, 0.4);                // Shirt color
-    glPushMatrix();
-    glTranslatef(0.0, 1.0, 0.0);             // Move up to chest height
-    glScalef(0.4, 0.6, 0.2);                 // Scale to torso shape
-    glutSolidCube(1.0);
-    glPopMatrix();
+/**
+ * Convert a text scene description into a binary scene file
+ * One statement per line, # starts a comment:
+ *   seed N            Terrain and simulation seed (default 1)
+ *   terrain-size N    Side length of the world (default 2048)
+ *   people N          Crowd size (default 5)
+ *   clouds N          Cloud layer size (default 300)
+ *   cabin X Z         Where the cabin stands (default 0 0)
+ *   hill X Z R H      A hill of base radius R and height H (the first
+ *                     one replaces the two default hills)
+ *   tree X Z [SCALE]  A tree standing on the ground at (X, Z)
+ *   forest N          N trees scattered like --trees N
+ * Heights, chunk order and the tree meshes are all worked out here, so
+ * loading the result needs no computation beyond the clearing.
+ * @param inPath Text description
+ * @param outPath Binary scene to write
+ * @return 1 on success
+ */
+int convertScene(const char* inPath, const char* outPath) {
+    double start = nowSeconds();
+    FILE* in = fopen(inPath, "r");
+    if (!in) {
+        fprintf(stderr, "Cannot open %s\n", inPath);
+        return 0;
+    }
+    SceneHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SCENE_MAGIC, sizeof(h.magic));
+    h.version = SCENE_VERSION;
+    h.byteOrder = SCENE_BYTE_ORDER;
+    h.seed = 1;
+    h.terrainSize = 2048.0f;
+    h.people = DEFAULT_PEOPLE;
+    h.clouds = DEFAULT_CLOUDS;
 
-    /* HEAD */
-    glColor3f(1.0, 0.8, 0.6);                // Skin color
-    glPushMatrix();
-    glTranslatef(0.0, 1.6, 0.0);             // Head position
-    glutSolidSphere(0.2, 10, 10);            // Spherical head
-    glPopMatrix();
+    // Statements first: tree heights need the final seed and hills
+    typedef struct { float x, z, scale; } PlacedTree;
+    PlacedTree* placed = NULL;
+    SceneLayout s = layout;
+    int numPlaced = 0, maxPlaced = 0, scattered = 0, lineNumber = 0, hillsGiven = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), in)) {
+        char* comment = strchr(line, '#');
+        char word[32];
+        PlacedTree t = {0.0f, 0.0f, 1.0f};
+        Hill hill;
+        lineNumber++;
+        if (comment) *comment = '\0';
+        if (sscanf(line, "%31s", word) != 1) continue;
 
-    /* LEGS (animated swing) */
-    glColor3f(0.2, 0.2, 0.8);                // Pants color
+        int ok;
+        if (!strcmp(word, "seed")) ok = sscanf(line, "%*s %u", &h.seed) == 1;
+        else if (!strcmp(word, "terrain-size")) ok = sscanf(line, "%*s %f", &h.terrainSize) == 1;
+        else if (!strcmp(word, "people")) ok = sscanf(line, "%*s %d", &h.people) == 1;
+        else if (!strcmp(word, "clouds")) ok = sscanf(line, "%*s %d", &h.clouds) == 1;
+        else if (!strcmp(word, "forest")) ok = sscanf(line, "%*s %d", &scattered) == 1 && scattered >= 0;
+        else if (!strcmp(word, "cabin")) ok = sscanf(line, "%*s %f %f", &s.cabinX, &s.cabinZ) == 2;
+        else if (!strcmp(word, "hill")) {
+            ok = sscanf(line, "%*s %f %f %f %f", &hill.x, &hill.z, &hill.radius, &hill.height) == 4 &&
+                 hillsGiven < MAX_HILLS;
+            if (ok) {
+                s.hills[hillsGiven++] = hill;
+                s.numHills = hillsGiven;
+            }
+        } else if (!strcmp(word, "tree")) {
+            ok = sscanf(line, "%*s %f %f %f", &t.x, &t.z, &t.scale) >= 2;
+            if (ok) {
+                growArray((void**)&placed, numPlaced, &maxPlaced, sizeof(PlacedTree));
+                placed[numPlaced++] = t;
+            }
+        } else ok = 0;
+        if (!ok) {
+            fprintf(stderr, "%s:%d: cannot read \"%s\"\n", inPath, lineNumber, word);
+            fclose(in);
+            free(placed);
+            return 0;
+        }
+    }
+    fclose(in);
+    const char* error = layoutClearing(&s);
+    if (error) {
+        fprintf(stderr, "%s: %s\n", inPath, error);
+        free(placed);
+        return 0;
+    }
 
-    // Left leg
-    glPushMatrix();
-    glTranslatef(-0.1, 0.4, 0.0);
-    glRotatef(p->legAngle, 1.0, 0.0, 0.0);   // Swing animation
-    glTranslatef(0.0, -0.4, 0.0);
-    glScalef(0.1, 0.8, 0.1);
-    glutSolidCube(1.0);
-    glPopMatrix();
+    // Place the trees on the terrain of the scene's seed and sort them into chunks
+    Forest f;
+    memset(&f, 0, sizeof(f));
+    terrain.seed = h.seed;
+    layout = s;
+    initTerrainHeights();
+    f.trees = malloc(((size_t)numPlaced + scattered + 1) * sizeof(TreeInstance));
+    if (!f.trees) {
+        fprintf(stderr, "Out of memory placing %d trees\n", numPlaced + scattered);
+        exit(1);
+    }
+    for (int i = 0; i < numPlaced; i++) {
+        TreeInstance t = {placed[i].x, terrainHeight(placed[i].x, placed[i].z), placed[i].z, placed[i].scale};
+        f.trees[f.numTrees++] = t;
+    }
+    free(placed);
+    if (scattered) f.numTrees += scatterTrees(f.trees + f.numTrees, scattered, h.seed);
+    buildForestChunks(&f);
 
-    // Right leg
-    glPushMatrix();
-    glTranslatef(0.1, 0.4, 0.0);
-    glRotatef(-p->legAngle, 1.0, 0.0, 0.0);  // Opposite swing
-    glTranslatef(0.0, -0.4, 0.0);
-    glScalef(0.1, 0.8, 0.1);
-    glutSolidCube(1.0);
-    glPopMatrix();
+    int numChunks = f.chunksX * f.chunksZ;
+    SceneChunk* chunks = malloc(numChunks * sizeof(SceneChunk));
+    if (!chunks) {
+        fprintf(stderr, "Out of memory writing %d chunks\n", numChunks);
+        exit(1);
+    }
+    for (int i = 0; i < numChunks; i++) {
+        chunks[i].first = f.chunks[i].first;
+        chunks[i].count = f.chunks[i].count;
+        memcpy(chunks[i].min, f.chunks[i].min, sizeof(chunks[i].min));
+        memcpy(chunks[i].max, f.chunks[i].max, sizeof(chunks[i].max));
+    }
+    h.chunksX = f.chunksX;
+    h.chunksZ = f.chunksZ;
+    h.originX = f.originX;
+    h.originZ = f.originZ;
 
-    glPopMatrix();
-}
+    // Tree meshes, concatenated
+    MeshBuilder lods[FOREST_LODS];
+    SceneMesh meshes[FOREST_LODS];
+    memset(lods, 0, sizeof(lods));
+    buildTreeMeshes(lods);
+    int numVerts = 0, numIndices = 0;
+    for (int lod = 0; lod < FOREST_LODS; lod++) {
+        SceneMesh m = {numVerts, lods[lod].numVerts, numIndices, lods[lod].numIndices};
+        meshes[lod] = m;
+        numVerts += m.numVertices;
+        numIndices += m.numIndices;
+    }
+    MeshVertex* verts = malloc(numVerts * sizeof(MeshVertex));
+    GLuint* indices = malloc(numIndices * sizeof(GLuint));
+    if (!verts || !indices) {
+        fprintf(stderr, "Out of memory writing tree meshes\n");
+        exit(1);
+    }
+    for (int lod = 0; lod < FOREST_LODS; lod++) {
+        memcpy(verts + meshes[lod].firstVertex, lods[lod].verts, meshes[lod].numVertices * sizeof(MeshVertex));
+        memcpy(indices + meshes[lod].firstIndex, lods[lod].indices, meshes[lod].numIndices * sizeof(GLuint));
+        meshFree(&lods[lod]);
+    }
+    SceneObject objects[2 + MAX_HILLS] = {{SCENE_OBJECT_TREE, 0, f.numTrees, 0, FOREST_LODS, {0}},
+                                          {SCENE_OBJECT_CABIN, 0, 0, 0, 0, {s.cabinX, s.cabinZ}}};
+    for (int i = 0; i < s.numHills; i++) {
+        const Hill* hl = &s.hills[i];
+        SceneObject o = {SCENE_OBJECT_HILL, 0, 0, 0, 0, {hl->x, hl->z, hl->radius, hl->height}};
+        objects[2 + i] = o;
+    }
 
+    // Lay the sections out once to fill in the header, then write everything
+    FILE* out = NULL;
+    int ok = 1;
+    for (int pass = 0; pass < 2 && ok; pass++) {
+        unsigned long long offset = (sizeof(SceneHeader) + SCENE_ALIGN - 1) / SCENE_ALIGN * SCENE_ALIGN;
+        if (pass == 1) {
+            static const char zeros[SCENE_ALIGN];
+            out = fopen(outPath, "wb");
+            ok = out && fwrite(&h, sizeof(h), 1, out) == 1 && fwrite(zeros, 1, offset - sizeof(h), out) == offset - sizeof(h);
+        }
+        ok = ok && writeSceneSection(out, &h, SCENE_SECTION_OBJECTS, objects, 2 + s.numHills, &offset);
+        ok = ok && writeSceneSection(out, &h, SCENE_SECTION_INSTANCES, f.trees, f.numTrees, &offset);
+        ok = ok && writeSceneSection(out, &h, SCENE_SECTION_CHUNKS, chunks, numChunks, &offset);
+        ok = ok && writeSceneSection(out, &h, SCENE_SECTION_MESHES, meshes, FOREST_LODS, &offset);
+        ok = ok && writeSceneSection(out, &h, SCENE_SECTION_VERTICES, verts, numVerts, &offset);
+        ok = ok && writeSceneSection(out, &h, SCENE_SECTION_INDICES, indices, numIndices, &offset);
+    }
+    if (out && fclose(out)) ok = 0;
+    if (ok) {
+        printf("Wrote %s: %d trees in %d chunks, %d tree meshes, %d hills (%.0f ms)\n", outPath, f.numTrees,
+               numChunks, FOREST_LODS, s.numHills, (nowSeconds() - start) * 1000.0);
+    } else {
+        fprintf(stderr, "Cannot write %s\n", outPath);
+    }
 
+    free(chunks);
+    free(verts);
+    free(indices);
+    freeForestTrees(&f);
+    free(terrain.heights);
+    terrain.heights = NULL;
+    return ok;
+}
 
 /**
- * Animation timer callback
- * @param value Timer value (unused)
+ * Parse command-line options (GLUT options are already removed)
+ * @param argc Argument count
+ * @param argv Argument vector
  */
-void timer(int value) {
-    /* DAY/NIGHT CYCLE */
-    if (isDay) {
-        sunAngle += 0.005; // Advance sun
-        if (sunAngle >= 3.14) isDay = 0; // Switch to night at sunset
-    } else {
-        sunAngle -= 0.005; // Advance moon
-        if (sunAngle <= 0.0) isDay = 1; // Switch to day at sunrise
+void parseArguments(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--trees") && i + 1 < argc) {
+            forestTreeCount = atoi(argv[++i]);
+            if (forestTreeCount < 0) forestTreeCount = 0;
+        } else if (!strcmp(argv[i], "--terrain-size") && i + 1 < argc) {
+            terrainSize = atof(argv[++i]);
+            if (terrainSize < 2.0f * TERRAIN_CHUNK_SIZE) terrainSize = 2.0f * TERRAIN_CHUNK_SIZE;
+        } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+            sceneSeed = (unsigned int)strtoul(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--scene") && i + 1 < argc) {
+            scenePath = argv[++i];
+        } else if (!strcmp(argv[i], "--people") && i + 1 < argc) {
+            numPeople = atoi(argv[++i]);
+            if (numPeople < 1) numPeople = 1;
+        } else if (!strcmp(argv[i], "--crowd-stats")) {
+            crowdStats = 1;
+        } else if (!strcmp(argv[i], "--stereo") && i + 1 < argc) {
+            stereo.enabled = 1;
+            i++;
+            if (!strcmp(argv[i], "sbs")) stereo.layout = STEREO_SIDE_BY_SIDE;
+            else if (!strcmp(argv[i], "layers")) stereo.layout = STEREO_LAYERS;
+            else {
+                fprintf(stderr, "Bad --stereo %s (expected sbs or layers)\n", argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--ipd") && i + 1 < argc) {
+            stereo.ipd = atof(argv[++i]);
+            if (stereo.ipd < 0.0f) stereo.ipd = 0.0f;
+        } else if (!strcmp(argv[i], "--convergence") && i + 1 < argc) {
+            stereo.convergence = atof(argv[++i]);
+            if (stereo.convergence < 1.0f) stereo.convergence = 1.0f;
+        } else if (!strcmp(argv[i], "--dynamic-res") && i + 1 < argc) {
+            float ms = atof(argv[++i]);
+            dynamicRes.enabled = ms > 0.0f;
+            if (ms > 0.0f) dynamicRes.targetMs = ms;
+        } else if (!strcmp(argv[i], "--particles") && i + 1 < argc) {
+            particleCapacity = atoi(argv[++i]);
+            if (particleCapacity < 0) particleCapacity = 0;
+        } else if (!strcmp(argv[i], "--clouds") && i + 1 < argc) {
+            cloudCount = atoi(argv[++i]);
+            if (cloudCount < 0) cloudCount = 0;
+        } else if (!strcmp(argv[i], "--lights") && i + 1 < argc) {
+            lanternCount = atoi(argv[++i]);
+            if (lanternCount < 0) lanternCount = 0;
+        } else if (!strcmp(argv[i], "--smoke") && i + 1 < argc) {
+            smokePuffs = atoi(argv[++i]);
+            if (smokePuffs < 0) smokePuffs = 0;
+        } else if (!strcmp(argv[i], "--headless") && i + 1 < argc) {
+            headless = 1;
+            headlessFrames = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &headlessWidth, &headlessHeight) != 2 ||
+                headlessWidth < 1 || headlessHeight < 1) {
+                fprintf(stderr, "Bad --size %s (expected WxH)\n", argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--fps") && i + 1 < argc) {
+            headlessFps = atof(argv[++i]);
+            if (headlessFps <= 0.0f) headlessFps = 30.0f;
+        } else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+            headlessOutput = argv[++i];
+        } else if (!strcmp(argv[i], "--capture") && i + 1 < argc) {
+            captureTarget = argv[++i];
+        } else if (!strcmp(argv[i], "--profile") && i + 1 < argc) {
+            profileCsvPath = argv[++i];
+        } else if (!strcmp(argv[i], "--benchmark") && i + 1 < argc) {
+            headless = 1;
+            benchmarkReportPath = argv[++i];
+        } else if (!strcmp(argv[i], "--bench-only") && i + 1 < argc) {
+            benchmarkFilter = argv[++i];
+        } else if (!strcmp(argv[i], "--bench-frames") && i + 1 < argc) {
+            benchmarkSuiteFrames = atoi(argv[++i]);
+            if (benchmarkSuiteFrames < 1) benchmarkSuiteFrames = 1;
+        } else if (!strcmp(argv[i], "--bench-warmup") && i + 1 < argc) {
+            benchmarkSuiteWarmup = atoi(argv[++i]);
+            if (benchmarkSuiteWarmup < 0) benchmarkSuiteWarmup = 0;
+        } else if (!strcmp(argv[i], "--record") && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            simThreads = atoi(argv[++i]);
+            if (simThreads < 0) simThreads = 0;
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            exit(1);
+        }
     }
-    
-    /* LIGHT FLICKER FOR NIGHT */
-    lightFlicker = 0.7 + 0.3 * ((rand() % 10) / 10.0);
-    
-    /* SMOKE ANIMATION */
-    smokeY += 0.01;
-    
-    /* UPDATE CHARACTERS */
-    updatePeople();
-    
-    /* REDRAW SCENE */
-    glutPostRedisplay();
-    
-    /* RESET TIMER */
-    glutTimerFunc(16, timer, 0); // ~60fps
+
+    if (replayPath) loadReplay(argc, argv);
+    if (scenePath) loadScene(scenePath);
+    if (recordPath) startRecording();
+    exactRuns = recordPath || replayPath;
 }
 
 /**
@@ -652,8 +10561,19 @@ void timer(int value) {
  * @return Program exit status
  */
 int main(int argc, char** argv) {
+    // Headless runs need no display connection, so skip GLUT entirely
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--convert-scene") && i + 2 < argc) exit(convertScene(argv[i + 1], argv[i + 2]) ? 0 : 1);
+        if (!strcmp(argv[i], "--headless") || !strcmp(argv[i], "--benchmark")) {
+            parseArguments(argc, argv);
+            if (benchmarkReportPath) runBenchmarkSuite();
+            runHeadless();
+        }
+    }
+
     // Initialize GLUT
     glutInit(&argc, argv);
+    parseArguments(argc, argv);
     glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH);
     
     // Create window
@@ -662,13 +10582,20 @@ int main(int argc, char** argv) {
     
     // Initialize OpenGL
     init();
+
+    // Start simulating in the background
+    initSimulation();
+
+    // Frames still queued for --capture are written when the window closes
+    if (captureTarget) atexit(stopCaptureWriter);
     
     // Register callbacks
     glutDisplayFunc(display);
     glutReshapeFunc(reshape);
     glutKeyboardFunc(keyboard);
     glutSpecialFunc(specialKeys);
-    glutTimerFunc(0, timer, 0);
+    glutMouseFunc(mouse);
+    glutIdleFunc(idle);
     
     // Start main loop
     glutMainLoop();